@@ -36,6 +36,7 @@
 #include "qemu-common.h"
 #include "sysemu.h"
 #include "gdbstub.h"
+#include "replay.h"
 #endif
 
 #define SYS_OPEN        0x01
@@ -117,6 +118,16 @@ static inline uint32_t set_swi_errno(CPUState *env, uint32_t code)
 #include "softmmu-semi.h"
 #endif
 
+/* Host time seen by the guest is an input of -record/-replay.  */
+static inline uint32_t semi_host_value(uint32_t value)
+{
+#ifndef CONFIG_USER_ONLY
+    if (replay_mode != REPLAY_NONE)
+        value = replay_host_value(value);
+#endif
+    return value;
+}
+
 static target_ulong arm_semi_syscall_len;
 
 #if !defined(CONFIG_USER_ONLY)
@@ -350,9 +361,9 @@ uint32_t do_arm_semihosting(CPUState *env)
             return ret;
         }
     case SYS_CLOCK:
-        return clock() / (CLOCKS_PER_SEC / 100);
+        return semi_host_value(clock() / (CLOCKS_PER_SEC / 100));
     case SYS_TIME:
-        return set_swi_errno(ts, time(NULL));
+        return semi_host_value(set_swi_errno(ts, time(NULL)));
     case SYS_SYSTEM:
         if (use_gdb_syscalls()) {
             gdb_do_syscall(arm_semi_cb, "system,%s", ARG(0), (int)ARG(1)+1);
@@ -30,6 +30,12 @@
 #define AUDIO_CAP "audio"
 #include "audio_int.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#define AUDIO_THREAD
+#endif
+
 /* #define DEBUG_PLIVE */
 /* #define DEBUG_LIVE */
 /* #define DEBUG_OUT */
@@ -59,6 +65,8 @@ static struct {
     } period;
     int plive;
     int log_to_monitor;
+    int thread;
+    int mixeng_simd;
 } conf = {
     {                           /* DAC fixed settings */
         1,                      /* enabled */
@@ -86,11 +94,59 @@ static struct {
 
     { 250 },                    /* period */
     0,                          /* plive */
-    0                           /* log_to_monitor */
+    0,                          /* log_to_monitor */
+    0,                          /* thread */
+    1                           /* mixeng_simd */
 };
 
 static AudioState glob_audio_state;
 
+/* With QEMU_AUDIO_THREAD the host voices are mixed and played by a
+   separate thread, so that playback goes on while the main loop is busy
+   running guest code.  audio_mutex protects the voices; it is taken by
+   the audio thread around each pass and by the AUD_ entry points, and is
+   recursive because voice callbacks call AUD_write/AUD_read.  */
+#ifdef AUDIO_THREAD
+static pthread_mutex_t audio_mutex;
+static pthread_t audio_thread_id;
+static int audio_thread_quit;
+#endif
+
+static void audio_lock (void)
+{
+#ifdef AUDIO_THREAD
+    if (glob_audio_state.threaded) {
+        pthread_mutex_lock (&audio_mutex);
+    }
+#endif
+}
+
+static void audio_unlock (void)
+{
+#ifdef AUDIO_THREAD
+    if (glob_audio_state.threaded) {
+        pthread_mutex_unlock (&audio_mutex);
+    }
+#endif
+}
+
+static inline int audio_on_thread (void)
+{
+#ifdef AUDIO_THREAD
+    return glob_audio_state.threaded
+        && pthread_equal (pthread_self (), audio_thread_id);
+#else
+    return 0;
+#endif
+}
+
+/* Callbacks of cards that did not ask for the audio thread are run from
+   the main loop timer instead, see audio_run_callbacks.  */
+static inline int audio_callback_here (AudioState *s, int threaded)
+{
+    return !s->threaded || threaded;
+}
+
 struct mixeng_volume nominal_volume = {
     0,
 #ifdef FLOAT_MIXENG
@@ -745,6 +801,12 @@ static void audio_capture_maybe_changed (CaptureVoiceOut *cap, int enabled)
     if (cap->hw.enabled != enabled) {
         audcnotification_e cmd;
         cap->hw.enabled = enabled;
+        /* Capture clients (VNC) are not thread safe: the main loop timer
+           passes the change on, see audio_run_capture_notify.  */
+        if (audio_on_thread ()) {
+            cap->notify_pending = 1;
+            return;
+        }
         cmd = enabled ? AUD_CNOTIFY_ENABLE : AUD_CNOTIFY_DISABLE;
         audio_notify_capture (cap, cmd);
     }
@@ -1092,12 +1154,15 @@ int AUD_write (SWVoiceOut *sw, void *buf, int size)
         return size;
     }
 
+    audio_lock ();
     if (!sw->hw->enabled) {
+        audio_unlock ();
         dolog ("Writing to disabled voice %s\n", SW_NAME (sw));
         return 0;
     }
 
     bytes = sw->hw->pcm_ops->write (sw, buf, size);
+    audio_unlock ();
     return bytes;
 }
 
@@ -1110,12 +1175,15 @@ int AUD_read (SWVoiceIn *sw, void *buf, int size)
         return size;
     }
 
+    audio_lock ();
     if (!sw->hw->enabled) {
+        audio_unlock ();
         dolog ("Reading from disabled voice %s\n", SW_NAME (sw));
         return 0;
     }
 
     bytes = sw->hw->pcm_ops->read (sw, buf, size);
+    audio_unlock ();
     return bytes;
 }
 
@@ -1124,14 +1192,10 @@ int AUD_get_buffer_size_out (SWVoiceOut *sw)
     return sw->hw->samples << sw->hw->info.shift;
 }
 
-void AUD_set_active_out (SWVoiceOut *sw, int on)
+static void audio_set_active_out (SWVoiceOut *sw, int on)
 {
     HWVoiceOut *hw;
 
-    if (!sw) {
-        return;
-    }
-
     hw = sw->hw;
     if (sw->active != on) {
         SWVoiceOut *temp_sw;
@@ -1167,13 +1231,18 @@ void AUD_set_active_out (SWVoiceOut *sw, int on)
     }
 }
 
-void AUD_set_active_in (SWVoiceIn *sw, int on)
+void AUD_set_active_out (SWVoiceOut *sw, int on)
 {
-    HWVoiceIn *hw;
-
-    if (!sw) {
-        return;
+    if (sw) {
+        audio_lock ();
+        audio_set_active_out (sw, on);
+        audio_unlock ();
     }
+}
+
+static void audio_set_active_in (SWVoiceIn *sw, int on)
+{
+    HWVoiceIn *hw;
 
     hw = sw->hw;
     if (sw->active != on) {
@@ -1205,6 +1274,15 @@ void AUD_set_active_in (SWVoiceIn *sw, int on)
     }
 }
 
+void AUD_set_active_in (SWVoiceIn *sw, int on)
+{
+    if (sw) {
+        audio_lock ();
+        audio_set_active_in (sw, on);
+        audio_unlock ();
+    }
+}
+
 static int audio_get_avail (SWVoiceIn *sw)
 {
     int live;
@@ -1326,17 +1404,31 @@ static void audio_run_out (AudioState *s)
         }
 
         if (!live) {
+            int nb_active = 0;
+
             for (sw = hw->sw_head.lh_first; sw; sw = sw->entries.le_next) {
                 if (sw->active) {
+                    nb_active++;
                     free = audio_get_free (sw);
-                    if (free > 0) {
+                    if (free > 0 && audio_callback_here (s, sw->threaded)) {
                         sw->callback.fn (sw->callback.opaque, free);
                     }
                 }
             }
+            /* Count each time the mixing buffer runs dry under an
+               active voice, not every pass it stays empty.  */
+            if (nb_active && !hw->starved) {
+                hw->starved = 1;
+                hw->underruns++;
+            }
             continue;
         }
 
+        hw->starved = 0;
+        if (live > hw->max_live) {
+            hw->max_live = live;
+        }
+
         prev_rpos = hw->rpos;
         played = hw->pcm_ops->run_out (hw);
         if (audio_bug (AUDIO_FUNC, hw->rpos >= hw->samples)) {
@@ -1375,7 +1467,7 @@ static void audio_run_out (AudioState *s)
 
             if (sw->active) {
                 free = audio_get_free (sw);
-                if (free > 0) {
+                if (free > 0 && audio_callback_here (s, sw->threaded)) {
                     sw->callback.fn (sw->callback.opaque, free);
                 }
             }
@@ -1420,7 +1512,7 @@ static void audio_run_in (AudioState *s)
                 int avail;
 
                 avail = audio_get_avail (sw);
-                if (avail > 0) {
+                if (avail > 0 && audio_callback_here (s, sw->threaded)) {
                     sw->callback.fn (sw->callback.opaque, avail);
                 }
             }
@@ -1475,17 +1567,173 @@ static void audio_run_capture (AudioState *s)
     }
 }
 
+static void audio_run_capture_notify (AudioState *s)
+{
+    CaptureVoiceOut *cap;
+
+    for (cap = s->cap_head.lh_first; cap; cap = cap->entries.le_next) {
+        if (cap->notify_pending) {
+            cap->notify_pending = 0;
+            audio_notify_capture (cap, cap->hw.enabled ? AUD_CNOTIFY_ENABLE
+                                                       : AUD_CNOTIFY_DISABLE);
+        }
+    }
+}
+
+/* Run the callbacks that must stay on the main thread while the audio
+   thread services the host voices.  */
+static void audio_run_callbacks (AudioState *s)
+{
+    HWVoiceOut *hwo = NULL;
+    HWVoiceIn *hwi = NULL;
+    SWVoiceOut *swo;
+    SWVoiceIn *swi;
+    int n;
+
+    while ((hwo = audio_pcm_hw_find_any_enabled_out (s, hwo))) {
+        for (swo = hwo->sw_head.lh_first; swo; swo = swo->entries.le_next) {
+            if (swo->active && !swo->threaded) {
+                n = audio_get_free (swo);
+                if (n > 0) {
+                    swo->callback.fn (swo->callback.opaque, n);
+                }
+            }
+        }
+    }
+
+    while ((hwi = audio_pcm_hw_find_any_enabled_in (s, hwi))) {
+        for (swi = hwi->sw_head.lh_first; swi; swi = swi->entries.le_next) {
+            if (swi->active && !swi->threaded) {
+                n = audio_get_avail (swi);
+                if (n > 0) {
+                    swi->callback.fn (swi->callback.opaque, n);
+                }
+            }
+        }
+    }
+}
+
 static void audio_timer (void *opaque)
 {
     AudioState *s = opaque;
 
-    audio_run_out (s);
-    audio_run_in (s);
-    audio_run_capture (s);
+    if (s->threaded) {
+        /* The audio thread only fills the capture buffers.  */
+        audio_lock ();
+        audio_run_callbacks (s);
+        audio_run_capture_notify (s);
+        audio_run_capture (s);
+        audio_unlock ();
+    }
+    else {
+        audio_run_out (s);
+        audio_run_in (s);
+        audio_run_capture (s);
+    }
 
     qemu_mod_timer (s->ts, qemu_get_clock (vm_clock) + conf.period.ticks);
 }
 
+#ifdef AUDIO_THREAD
+static void *audio_thread (void *opaque)
+{
+    AudioState *s = opaque;
+    struct timespec ts;
+    int64_t period;
+    sigset_t set;
+
+    /* Leave the signals to the main thread.  */
+    sigfillset (&set);
+    pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+    period = conf.period.hertz > 0 ? 1000000000LL / conf.period.hertz
+                                   : 1000000;
+    ts.tv_sec = period / 1000000000LL;
+    ts.tv_nsec = period % 1000000000LL;
+
+    for (;;) {
+        audio_lock ();
+        if (audio_thread_quit) {
+            audio_unlock ();
+            break;
+        }
+        if (s->vm_running) {
+            audio_run_out (s);
+            audio_run_in (s);
+        }
+        audio_unlock ();
+        nanosleep (&ts, NULL);
+    }
+    return NULL;
+}
+
+static void audio_mutex_init (void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init (&audio_mutex, &attr);
+    pthread_mutexattr_destroy (&attr);
+}
+
+static int audio_thread_create (AudioState *s)
+{
+    audio_thread_quit = 0;
+    if (pthread_create (&audio_thread_id, NULL, audio_thread, s)) {
+        dolog ("Could not create audio thread, using the timer\n");
+        s->threaded = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* fork() (-fork-server) only duplicates the calling thread.  Holding
+   audio_mutex across it leaves the voices, and the rings the callbacks
+   consume, in a consistent state; the child then gets a fresh mutex and
+   its own audio thread.  */
+static void audio_fork_prepare (void)
+{
+    audio_lock ();
+}
+
+static void audio_fork_parent (void)
+{
+    audio_unlock ();
+}
+
+static void audio_fork_child (void)
+{
+    AudioState *s = &glob_audio_state;
+
+    if (s->threaded) {
+        audio_mutex_init ();
+        audio_thread_create (s);
+    }
+}
+
+static void audio_thread_start (AudioState *s)
+{
+    audio_mutex_init ();
+    s->threaded = 1;
+    if (!audio_thread_create (s)) {
+        pthread_atfork (audio_fork_prepare, audio_fork_parent,
+                        audio_fork_child);
+    }
+}
+
+static void audio_thread_stop (AudioState *s)
+{
+    if (s->threaded) {
+        audio_lock ();
+        audio_thread_quit = 1;
+        audio_unlock ();
+        pthread_join (audio_thread_id, NULL);
+        s->threaded = 0;
+    }
+}
+#endif
+
 static struct audio_option audio_options[] = {
     /* DAC */
     {"DAC_FIXED_SETTINGS", AUD_OPT_BOOL, &conf.fixed_out.enabled,
@@ -1529,6 +1777,12 @@ static struct audio_option audio_options[] = {
     {"LOG_TO_MONITOR", AUD_OPT_BOOL, &conf.log_to_monitor,
      "print logging messages to monitor instead of stderr", NULL, 0},
 
+    {"THREAD", AUD_OPT_BOOL, &conf.thread,
+     "Play and mix the host voices from a separate thread", NULL, 0},
+
+    {"MIXENG_SIMD", AUD_OPT_BOOL, &conf.mixeng_simd,
+     "Use SIMD sample conversion and resampling if available", NULL, 0},
+
     {NULL, 0, NULL, NULL, NULL, 0}
 };
 
@@ -1603,6 +1857,63 @@ void AUD_help (void)
         );
 }
 
+static int audio_samples_to_ms (int samples, struct audio_pcm_info *info)
+{
+    return info->freq ? (int64_t) samples * 1000 / info->freq : 0;
+}
+
+void AUD_info (void)
+{
+    AudioState *s = &glob_audio_state;
+    HWVoiceOut *hwo = NULL;
+    HWVoiceIn *hwi = NULL;
+    SWVoiceOut *swo;
+    SWVoiceIn *swi;
+    QEMUSoundCard *card;
+    int live;
+
+    if (!s->drv) {
+        term_printf ("No audio driver\n");
+        return;
+    }
+
+    term_printf ("driver %s, voices run from the %s\n", s->drv->name,
+                 s->threaded ? "audio thread" : "main loop timer");
+
+    audio_lock ();
+    while ((hwo = audio_pcm_hw_find_any_enabled_out (s, hwo))) {
+        live = audio_pcm_hw_get_live_out (hwo);
+        term_printf ("out %d Hz %d ch: buffer %d ms, queued %d ms "
+                     "(max %d ms), underruns %" PRIu64 "\n",
+                     hwo->info.freq, hwo->info.nchannels,
+                     audio_samples_to_ms (hwo->samples, &hwo->info),
+                     audio_samples_to_ms (live, &hwo->info),
+                     audio_samples_to_ms (hwo->max_live, &hwo->info),
+                     hwo->underruns);
+        for (swo = hwo->sw_head.lh_first; swo; swo = swo->entries.le_next) {
+            term_printf ("  %s%s\n", SW_NAME (swo),
+                         swo->active ? "" : " (inactive)");
+        }
+    }
+    while ((hwi = audio_pcm_hw_find_any_enabled_in (s, hwi))) {
+        term_printf ("in %d Hz %d ch: buffer %d ms\n",
+                     hwi->info.freq, hwi->info.nchannels,
+                     audio_samples_to_ms (hwi->samples, &hwi->info));
+        for (swi = hwi->sw_head.lh_first; swi; swi = swi->entries.le_next) {
+            term_printf ("  %s%s\n", SW_NAME (swi),
+                         swi->active ? "" : " (inactive)");
+        }
+    }
+    audio_unlock ();
+
+    for (card = s->card_head.lh_first; card; card = card->entries.le_next) {
+        if (card->info) {
+            term_printf ("%s:\n", card->name);
+            card->info (card);
+        }
+    }
+}
+
 static int audio_driver_init (AudioState *s, struct audio_driver *drv)
 {
     if (drv->options) {
@@ -1629,6 +1940,8 @@ static void audio_vm_change_state_handler (void *opaque, int running)
     HWVoiceIn *hwi = NULL;
     int op = running ? VOICE_ENABLE : VOICE_DISABLE;
 
+    audio_lock ();
+    s->vm_running = running;
     while ((hwo = audio_pcm_hw_find_any_enabled_out (s, hwo))) {
         hwo->pcm_ops->ctl_out (hwo, op);
     }
@@ -1636,6 +1949,7 @@ static void audio_vm_change_state_handler (void *opaque, int running)
     while ((hwi = audio_pcm_hw_find_any_enabled_in (s, hwi))) {
         hwi->pcm_ops->ctl_in (hwi, op);
     }
+    audio_unlock ();
 }
 
 static void audio_atexit (void)
@@ -1644,6 +1958,10 @@ static void audio_atexit (void)
     HWVoiceOut *hwo = NULL;
     HWVoiceIn *hwi = NULL;
 
+#ifdef AUDIO_THREAD
+    audio_thread_stop (s);
+#endif
+
     while ((hwo = audio_pcm_hw_find_any_enabled_out (s, hwo))) {
         SWVoiceCap *sc;
 
@@ -1692,6 +2010,9 @@ void AUD_register_card (AudioState *s, const char *name, QEMUSoundCard *card)
 {
     card->audio = s;
     card->name = qemu_strdup (name);
+    if (!s->threaded) {
+        card->threaded = 0;
+    }
     memset (&card->entries, 0, sizeof (card->entries));
     LIST_INSERT_HEAD (&s->card_head, card, entries);
 }
@@ -1722,6 +2043,7 @@ AudioState *AUD_init (void)
     }
 
     audio_process_options ("AUDIO", audio_options);
+    mixeng_init (conf.mixeng_simd);
 
     s->nb_hw_voices_out = conf.fixed_out.nb_voices;
     s->nb_hw_voices_in = conf.fixed_in.nb_voices;
@@ -1807,10 +2129,18 @@ AudioState *AUD_init (void)
     LIST_INIT (&s->card_head);
     register_savevm ("audio", 0, 1, audio_save, audio_load, s);
     qemu_mod_timer (s->ts, qemu_get_clock (vm_clock) + conf.period.ticks);
+
+    if (conf.thread) {
+#ifdef AUDIO_THREAD
+        audio_thread_start (s);
+#else
+        dolog ("warning: The audio thread is not supported on this host\n");
+#endif
+    }
     return s;
 }
 
-CaptureVoiceOut *AUD_add_capture (
+static CaptureVoiceOut *audio_add_capture (
     AudioState *s,
     struct audsettings *as,
     struct audio_capture_ops *ops,
@@ -1906,7 +2236,22 @@ CaptureVoiceOut *AUD_add_capture (
     }
 }
 
-void AUD_del_capture (CaptureVoiceOut *cap, void *cb_opaque)
+CaptureVoiceOut *AUD_add_capture (
+    AudioState *s,
+    struct audsettings *as,
+    struct audio_capture_ops *ops,
+    void *cb_opaque
+    )
+{
+    CaptureVoiceOut *cap;
+
+    audio_lock ();
+    cap = audio_add_capture (s, as, ops, cb_opaque);
+    audio_unlock ();
+    return cap;
+}
+
+static void audio_del_capture (CaptureVoiceOut *cap, void *cb_opaque)
 {
     struct capture_callback *cb;
 
@@ -1943,6 +2288,13 @@ void AUD_del_capture (CaptureVoiceOut *cap, void *cb_opaque)
     }
 }
 
+void AUD_del_capture (CaptureVoiceOut *cap, void *cb_opaque)
+{
+    audio_lock ();
+    audio_del_capture (cap, cb_opaque);
+    audio_unlock ();
+}
+
 void AUD_set_volume_out (SWVoiceOut *sw, int mute, uint8_t lvol, uint8_t rvol)
 {
     if (sw) {
@@ -77,11 +77,18 @@ typedef struct SWVoiceOut SWVoiceOut;
 typedef struct CaptureVoiceOut CaptureVoiceOut;
 typedef struct SWVoiceIn SWVoiceIn;
 
-typedef struct QEMUSoundCard {
+typedef struct QEMUSoundCard QEMUSoundCard;
+
+struct QEMUSoundCard {
     AudioState *audio;
     char *name;
+    /* Set before AUD_register_card if the voice callbacks may run in the
+       audio thread; cleared when there is no audio thread.  */
+    int threaded;
+    /* Optional, for "info audio".  */
+    void (*info) (QEMUSoundCard *card);
     LIST_ENTRY (QEMUSoundCard) entries;
-} QEMUSoundCard;
+};
 
 typedef struct QEMUAudioTimeStamp {
     uint64_t old_ts;
@@ -96,6 +103,7 @@ void AUD_log (const char *cap, const char *fmt, ...)
 
 AudioState *AUD_init (void);
 void AUD_help (void);
+void AUD_info (void);
 void AUD_register_card (AudioState *s, const char *name, QEMUSoundCard *card);
 void AUD_remove_card (QEMUSoundCard *card);
 CaptureVoiceOut *AUD_add_capture (
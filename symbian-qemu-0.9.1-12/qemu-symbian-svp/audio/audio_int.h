@@ -75,6 +75,9 @@ typedef struct HWVoiceOut {
 
     int rpos;
     uint64_t ts_helper;
+    uint64_t underruns;
+    int starved;
+    int max_live;
 
     struct st_sample *mix_buf;
 
@@ -116,6 +119,7 @@ struct SWVoiceOut {
     char *name;
     struct mixeng_volume vol;
     struct audio_callback callback;
+    int threaded;
     LIST_ENTRY (SWVoiceOut) entries;
 };
 
@@ -131,6 +135,7 @@ struct SWVoiceIn {
     char *name;
     struct mixeng_volume vol;
     struct audio_callback callback;
+    int threaded;
     LIST_ENTRY (SWVoiceIn) entries;
 };
 
@@ -171,6 +176,7 @@ struct capture_callback {
 struct CaptureVoiceOut {
     HWVoiceOut hw;
     void *buf;
+    int notify_pending;         /* changed on the audio thread */
     LIST_HEAD (cb_listhead, capture_callback) cb_head;
     LIST_ENTRY (CaptureVoiceOut) entries;
 };
@@ -192,6 +198,8 @@ struct AudioState {
     LIST_HEAD (cap_listhead, CaptureVoiceOut) cap_head;
     int nb_hw_voices_out;
     int nb_hw_voices_in;
+    int threaded;
+    int vm_running;
 };
 
 extern struct audio_driver no_audio_driver;
@@ -397,11 +397,13 @@ void glue (AUD_close_, TYPE) (QEMUSoundCard *card, SW *sw)
             return;
         }
 
+        audio_lock ();
         glue (audio_close_, TYPE) (card->audio, sw);
+        audio_unlock ();
     }
 }
 
-SW *glue (AUD_open_, TYPE) (
+static SW *glue (audio_open_, TYPE) (
     QEMUSoundCard *card,
     SW *sw,
     const char *name,
@@ -496,6 +498,7 @@ SW *glue (AUD_open_, TYPE) (
         sw->vol = nominal_volume;
         sw->callback.fn = callback_fn;
         sw->callback.opaque = callback_opaque;
+        sw->threaded = card->threaded;
 
 #ifdef DAC
         if (live) {
@@ -525,6 +528,22 @@ SW *glue (AUD_open_, TYPE) (
     return NULL;
 }
 
+SW *glue (AUD_open_, TYPE) (
+    QEMUSoundCard *card,
+    SW *sw,
+    const char *name,
+    void *callback_opaque ,
+    audio_callback_fn_t callback_fn,
+    struct audsettings *as
+    )
+{
+    audio_lock ();
+    sw = glue (audio_open_, TYPE) (card, sw, name, callback_opaque,
+                                   callback_fn, as);
+    audio_unlock ();
+    return sw;
+}
+
 int glue (AUD_is_active_, TYPE) (SW *sw)
 {
     return sw ? sw->active : 0;
@@ -536,7 +555,9 @@ void glue (AUD_init_time_stamp_, TYPE) (SW *sw, QEMUAudioTimeStamp *ts)
         return;
     }
 
+    audio_lock ();
     ts->old_ts = sw->hw->ts_helper;
+    audio_unlock ();
 }
 
 uint64_t glue (AUD_get_elapsed_usec_, TYPE) (SW *sw, QEMUAudioTimeStamp *ts)
@@ -547,7 +568,9 @@ uint64_t glue (AUD_get_elapsed_usec_, TYPE) (SW *sw, QEMUAudioTimeStamp *ts)
         return 0;
     }
 
+    audio_lock ();
     cur_ts = sw->hw->ts_helper;
+    audio_unlock ();
     old_ts = ts->old_ts;
     /* dolog ("cur %lld old %lld\n", cur_ts, old_ts); */
 
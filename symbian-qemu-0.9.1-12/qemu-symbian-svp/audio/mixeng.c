@@ -28,6 +28,11 @@
 #define AUDIO_CAP "mixeng"
 #include "audio_int.h"
 
+#if defined(__SSE2__) && !defined(FLOAT_MIXENG)
+#include <emmintrin.h>
+#define MIXENG_SSE2
+#endif
+
 /* 8 bit */
 #define ENDIAN_CONVERSION natural
 #define ENDIAN_CONVERT(v) (v)
@@ -316,14 +321,184 @@ void *st_rate_start (int inrate, int outrate)
     return rate;
 }
 
-#define NAME st_rate_flow_mix
+#define NAME st_rate_flow_mix_generic
 #define OP(a, b) a += b
 #include "rate_template.h"
 
-#define NAME st_rate_flow
+#define NAME st_rate_flow_generic
 #define OP(a, b) a = b
 #include "rate_template.h"
 
+#ifdef MIXENG_SSE2
+/*
+ * SSE2 versions of the signed 16 bit native endian stereo conversions
+ * and of the resampler.  They give the same results as the generic
+ * code.  SSE2 has no 64 bit compare or arithmetic shift, so clipping
+ * works on the 32 bit halves of the st_sample values.
+ */
+
+static void conv_natural_int16_t_to_stereo_sse2
+    (struct st_sample *dst, const void *src, int samples,
+     struct mixeng_volume *vol)
+{
+    const int16_t *in = src;
+    __m128i zero = _mm_setzero_si128 ();
+    __m128i x, lo, hi, slo, shi;
+
+#ifdef CONFIG_MIXEMU
+    if (vol->mute || vol->l != nominal_volume.l
+        || vol->r != nominal_volume.r) {
+        conv_natural_int16_t_to_stereo (dst, src, samples, vol);
+        return;
+    }
+#endif
+
+    for (; samples >= 4; samples -= 4) {
+        x = _mm_loadu_si128 ((const __m128i *) in);
+        /* v << 16 as 32 bit values, then sign extended to 64 bit */
+        lo = _mm_unpacklo_epi16 (zero, x);
+        hi = _mm_unpackhi_epi16 (zero, x);
+        slo = _mm_srai_epi32 (lo, 31);
+        shi = _mm_srai_epi32 (hi, 31);
+        _mm_storeu_si128 ((__m128i *) dst, _mm_unpacklo_epi32 (lo, slo));
+        _mm_storeu_si128 ((__m128i *) (dst + 1), _mm_unpackhi_epi32 (lo, slo));
+        _mm_storeu_si128 ((__m128i *) (dst + 2), _mm_unpacklo_epi32 (hi, shi));
+        _mm_storeu_si128 ((__m128i *) (dst + 3), _mm_unpackhi_epi32 (hi, shi));
+        in += 8;
+        dst += 4;
+    }
+    if (samples) {
+        conv_natural_int16_t_to_stereo (dst, in, samples, vol);
+    }
+}
+
+/* Clip the four 64 bit values of a and b to 16 bit, as 32 bit values. */
+static inline __m128i clip_int16_sse2 (__m128i a, __m128i b)
+{
+    __m128i lo, hi, fits, big, r, sat;
+
+    a = _mm_shuffle_epi32 (a, _MM_SHUFFLE (3, 1, 2, 0));
+    b = _mm_shuffle_epi32 (b, _MM_SHUFFLE (3, 1, 2, 0));
+    lo = _mm_unpacklo_epi64 (a, b);
+    hi = _mm_unpackhi_epi64 (a, b);
+
+    /* values that fit in 32 bits: v >= 0x7f000000 gives IN_MAX */
+    fits = _mm_cmpeq_epi32 (hi, _mm_srai_epi32 (lo, 31));
+    big = _mm_cmpgt_epi32 (lo, _mm_set1_epi32 (0x7effffff));
+    r = _mm_srai_epi32 (lo, 16);
+    r = _mm_or_si128 (_mm_andnot_si128 (big, r),
+                      _mm_and_si128 (big, _mm_set1_epi32 (SHRT_MAX)));
+
+    /* the others saturate by sign */
+    sat = _mm_xor_si128 (_mm_set1_epi32 (SHRT_MAX), _mm_srai_epi32 (hi, 31));
+
+    return _mm_or_si128 (_mm_and_si128 (fits, r), _mm_andnot_si128 (fits, sat));
+}
+
+static void clip_natural_int16_t_from_stereo_sse2
+    (void *dst, const struct st_sample *src, int samples)
+{
+    int16_t *out = dst;
+    __m128i r0, r1;
+
+    for (; samples >= 4; samples -= 4) {
+        r0 = clip_int16_sse2 (_mm_loadu_si128 ((const __m128i *) src),
+                              _mm_loadu_si128 ((const __m128i *) (src + 1)));
+        r1 = clip_int16_sse2 (_mm_loadu_si128 ((const __m128i *) (src + 2)),
+                              _mm_loadu_si128 ((const __m128i *) (src + 3)));
+        _mm_storeu_si128 ((__m128i *) out, _mm_packs_epi32 (r0, r1));
+        src += 4;
+        out += 8;
+    }
+    if (samples) {
+        clip_natural_int16_t_from_stereo (out, src, samples);
+    }
+}
+
+/*
+ * Only the equal rate case is vectorized: the interpolating loop is
+ * bound by the position bookkeeping and is no faster with SSE2.
+ */
+static void st_rate_flow_mix_sse2 (void *opaque, struct st_sample *ibuf,
+                                   struct st_sample *obuf,
+                                   int *isamp, int *osamp)
+{
+    struct rate *rate = opaque;
+    int i, n = *isamp > *osamp ? *osamp : *isamp;
+
+    if (rate->opos_inc != (1ULL + UINT_MAX)) {
+        st_rate_flow_mix_generic (opaque, ibuf, obuf, isamp, osamp);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        __m128i o = _mm_loadu_si128 ((__m128i *) &obuf[i]);
+        o = _mm_add_epi64 (o, _mm_loadu_si128 ((__m128i *) &ibuf[i]));
+        _mm_storeu_si128 ((__m128i *) &obuf[i], o);
+    }
+    *isamp = n;
+    *osamp = n;
+}
+
+static void st_rate_flow_sse2 (void *opaque, struct st_sample *ibuf,
+                               struct st_sample *obuf, int *isamp, int *osamp)
+{
+    struct rate *rate = opaque;
+    int n = *isamp > *osamp ? *osamp : *isamp;
+
+    if (rate->opos_inc != (1ULL + UINT_MAX)) {
+        st_rate_flow_generic (opaque, ibuf, obuf, isamp, osamp);
+        return;
+    }
+
+    memcpy (obuf, ibuf, n * sizeof (*obuf));
+    *isamp = n;
+    *osamp = n;
+}
+#endif
+
+typedef void (st_rate_fn) (void *opaque, struct st_sample *ibuf,
+                           struct st_sample *obuf, int *isamp, int *osamp);
+
+static st_rate_fn *st_rate_flow_fn = st_rate_flow_generic;
+static st_rate_fn *st_rate_flow_mix_fn = st_rate_flow_mix_generic;
+
+void st_rate_flow (void *opaque, struct st_sample *ibuf,
+                   struct st_sample *obuf, int *isamp, int *osamp)
+{
+    st_rate_flow_fn (opaque, ibuf, obuf, isamp, osamp);
+}
+
+void st_rate_flow_mix (void *opaque, struct st_sample *ibuf,
+                       struct st_sample *obuf, int *isamp, int *osamp)
+{
+    st_rate_flow_mix_fn (opaque, ibuf, obuf, isamp, osamp);
+}
+
+/*
+ * Select the generic or the SIMD conversion and resampling routines.
+ * Voices pick their conversion functions when they are opened, so this
+ * must be called before.  Returns nonzero if SIMD routines are used.
+ */
+int mixeng_init (int simd)
+{
+    mixeng_conv[1][1][0][1] = conv_natural_int16_t_to_stereo;
+    mixeng_clip[1][1][0][1] = clip_natural_int16_t_from_stereo;
+    st_rate_flow_fn = st_rate_flow_generic;
+    st_rate_flow_mix_fn = st_rate_flow_mix_generic;
+
+#ifdef MIXENG_SSE2
+    if (simd) {
+        mixeng_conv[1][1][0][1] = conv_natural_int16_t_to_stereo_sse2;
+        mixeng_clip[1][1][0][1] = clip_natural_int16_t_from_stereo_sse2;
+        st_rate_flow_fn = st_rate_flow_sse2;
+        st_rate_flow_mix_fn = st_rate_flow_mix_sse2;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
 void st_rate_stop (void *opaque)
 {
     qemu_free (opaque);
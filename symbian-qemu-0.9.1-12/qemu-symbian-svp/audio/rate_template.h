@@ -27,8 +27,8 @@
  * Processed signed long samples from ibuf to obuf.
  * Return number of samples processed.
  */
-void NAME (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
-           int *isamp, int *osamp)
+static void NAME (void *opaque, struct st_sample *ibuf,
+                  struct st_sample *obuf, int *isamp, int *osamp)
 {
     struct rate *rate = opaque;
     struct st_sample *istart, *iend;
@@ -810,8 +810,9 @@ static int qcow_make_empty(BlockDriverState *bs)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors)
+static int qcow_write_compressed_cluster(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
@@ -868,6 +869,26 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
+static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                 const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (nb_sectors == 0 || (nb_sectors % s->cluster_sectors) != 0)
+        return qcow_write_compressed_cluster(bs, sector_num, buf, nb_sectors);
+    while (nb_sectors > 0) {
+        ret = qcow_write_compressed_cluster(bs, sector_num, buf,
+                                            s->cluster_sectors);
+        if (ret < 0)
+            return ret;
+        sector_num += s->cluster_sectors;
+        buf += s->cluster_size;
+        nb_sectors -= s->cluster_sectors;
+    }
+    return 0;
+}
+
 static void qcow_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -26,6 +26,10 @@
 #include <zlib.h>
 #include "aes.h"
 #include <assert.h>
+#ifdef CONFIG_AIO
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 /*
   Differences with QCOW:
@@ -97,7 +101,35 @@ typedef struct __attribute__((packed)) QCowSnapshotHeader {
     /* name follows  */
 } QCowSnapshotHeader;
 
-#define L2_CACHE_SIZE 16
+/* L2 tables and refcount blocks are cached.  Unless the drive sets a
+   size, the L2 cache covers the whole image within these bounds, and
+   the refcount cache is a quarter of it.  */
+#define L2_CACHE_MIN            16
+#define L2_CACHE_MAX_BYTES      (4 * 1024 * 1024)
+#define REFCOUNT_CACHE_MIN      4
+
+typedef struct QCowCacheEntry {
+    uint64_t offset;    /* 0 if the entry is free */
+    int dirty_start;    /* bytes to write back, empty if clean */
+    int dirty_end;
+    int lru_prev;       /* LRU list, most recently used first */
+    int lru_next;
+    int hash_next;
+} QCowCacheEntry;
+
+typedef struct QCowCache {
+    int size;
+    int table_size;
+    uint8_t *tables;
+    QCowCacheEntry *entries;
+    int *hash;
+    int hash_bits;
+    int lru_first;
+    int lru_last;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+} QCowCache;
 
 typedef struct QCowSnapshot {
     uint64_t l1_table_offset;
@@ -124,9 +156,7 @@ typedef struct BDRVQcowState {
     uint64_t cluster_offset_mask;
     uint64_t l1_table_offset;
     uint64_t *l1_table;
-    uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    QCowCache l2_cache;
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -134,8 +164,7 @@ typedef struct BDRVQcowState {
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
-    uint64_t refcount_block_cache_offset;
-    uint16_t *refcount_block_cache;
+    QCowCache refcount_cache;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
@@ -154,8 +183,9 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
                      uint8_t *buf, int nb_sectors);
 static int qcow_read_snapshots(BlockDriverState *bs);
 static void qcow_free_snapshots(BlockDriverState *bs);
-static int refcount_init(BlockDriverState *bs);
+static int refcount_init(BlockDriverState *bs, int cache_size);
 static void refcount_close(BlockDriverState *bs);
+static int refcount_flush(BlockDriverState *bs);
 static int get_refcount(BlockDriverState *bs, int64_t cluster_index);
 static int update_cluster_refcount(BlockDriverState *bs,
                                    int64_t cluster_index,
@@ -171,6 +201,211 @@ static void free_clusters(BlockDriverState *bs,
 static void check_refcounts(BlockDriverState *bs);
 #endif
 
+/*********************************************************/
+/* metadata cache */
+
+/* A cache of cluster sized tables read from the image, found by their
+   offset through a hash table and evicted in LRU order.  Changes are
+   only written back when the table is evicted or flushed, and then
+   only the range of bytes that changed.  */
+
+static int qcow_cache_init(QCowCache *c, int size, int table_size)
+{
+    int i;
+
+    c->size = size;
+    c->table_size = table_size;
+    for (c->hash_bits = 1; (1 << c->hash_bits) < size * 2; c->hash_bits++)
+        ;
+    c->tables = qemu_malloc(size * table_size);
+    c->entries = qemu_mallocz(size * sizeof(QCowCacheEntry));
+    c->hash = qemu_malloc((1 << c->hash_bits) * sizeof(int));
+    if (!c->tables || !c->entries || !c->hash)
+        return -ENOMEM;
+    for (i = 0; i < (1 << c->hash_bits); i++)
+        c->hash[i] = -1;
+    for (i = 0; i < size; i++) {
+        c->entries[i].lru_prev = i - 1;
+        c->entries[i].lru_next = i + 1 < size ? i + 1 : -1;
+        c->entries[i].hash_next = -1;
+    }
+    c->lru_first = 0;
+    c->lru_last = size - 1;
+    return 0;
+}
+
+static void qcow_cache_free(QCowCache *c)
+{
+    qemu_free(c->tables);
+    qemu_free(c->entries);
+    qemu_free(c->hash);
+}
+
+static inline void *qcow_cache_table(QCowCache *c, int i)
+{
+    return c->tables + (size_t)i * c->table_size;
+}
+
+static inline int qcow_cache_index(QCowCache *c, void *table)
+{
+    return ((uint8_t *)table - c->tables) / c->table_size;
+}
+
+static inline unsigned int qcow_cache_hash(QCowCache *c, uint64_t offset)
+{
+    return ((uint32_t)(offset >> 9) * 0x9e3779b1) >> (32 - c->hash_bits);
+}
+
+static void qcow_cache_unhash(QCowCache *c, int i)
+{
+    int *p = &c->hash[qcow_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i)
+        p = &c->entries[*p].hash_next;
+    *p = c->entries[i].hash_next;
+    c->entries[i].offset = 0;
+}
+
+/* Move entry I to the front of the LRU list.  */
+static void qcow_cache_touch(QCowCache *c, int i)
+{
+    QCowCacheEntry *e = &c->entries[i];
+
+    if (c->lru_first == i)
+        return;
+    c->entries[e->lru_prev].lru_next = e->lru_next;
+    if (e->lru_next >= 0)
+        c->entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        c->lru_last = e->lru_prev;
+    e->lru_prev = -1;
+    e->lru_next = c->lru_first;
+    c->entries[c->lru_first].lru_prev = i;
+    c->lru_first = i;
+}
+
+static int qcow_cache_write(BDRVQcowState *s, QCowCache *c, int i)
+{
+    QCowCacheEntry *e = &c->entries[i];
+    int len = e->dirty_end - e->dirty_start;
+
+    if (bdrv_pwrite(s->hd, e->offset + e->dirty_start,
+                    (uint8_t *)qcow_cache_table(c, i) + e->dirty_start,
+                    len) != len)
+        return -EIO;
+    e->dirty_start = e->dirty_end = 0;
+    c->writebacks++;
+    return 0;
+}
+
+/* Write back all the dirty tables.  */
+static int qcow_cache_flush(BDRVQcowState *s, QCowCache *c)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty_end && qcow_cache_write(s, c, i) < 0)
+            ret = -EIO;
+    }
+    return ret;
+}
+
+/* Forget all the tables.  Dirty ones are lost.  */
+static void qcow_cache_reset(QCowCache *c)
+{
+    int i;
+
+    for (i = 0; i < (1 << c->hash_bits); i++)
+        c->hash[i] = -1;
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].offset = 0;
+        c->entries[i].dirty_start = c->entries[i].dirty_end = 0;
+        c->entries[i].hash_next = -1;
+    }
+}
+
+static int qcow_cache_lookup(QCowCache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->hash[qcow_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset)
+            return i;
+    }
+    return -1;
+}
+
+static void *qcow_cache_find(QCowCache *c, uint64_t offset)
+{
+    int i = qcow_cache_lookup(c, offset);
+
+    if (i < 0)
+        return NULL;
+    qcow_cache_touch(c, i);
+    c->hits++;
+    return qcow_cache_table(c, i);
+}
+
+/* Return an entry for the table at OFFSET, whose contents are left for
+   the caller to fill.  This is the least recently used entry unless
+   the offset, which was just allocated, still has a stale one.  */
+static void *qcow_cache_new(BDRVQcowState *s, QCowCache *c, uint64_t offset)
+{
+    int i = qcow_cache_lookup(c, offset);
+    unsigned int h;
+
+    if (i >= 0) {
+        qcow_cache_touch(c, i);
+        return qcow_cache_table(c, i);
+    }
+    i = c->lru_last;
+    if (c->entries[i].dirty_end && qcow_cache_write(s, c, i) < 0)
+        return NULL;
+    if (c->entries[i].offset)
+        qcow_cache_unhash(c, i);
+    h = qcow_cache_hash(c, offset);
+    c->entries[i].offset = offset;
+    c->entries[i].hash_next = c->hash[h];
+    c->hash[h] = i;
+    qcow_cache_touch(c, i);
+    c->misses++;
+    return qcow_cache_table(c, i);
+}
+
+/* Return the table at OFFSET, reading it from the image if needed.  */
+static void *qcow_cache_load(BDRVQcowState *s, QCowCache *c, uint64_t offset)
+{
+    void *table;
+
+    table = qcow_cache_find(c, offset);
+    if (table)
+        return table;
+    table = qcow_cache_new(s, c, offset);
+    if (!table)
+        return NULL;
+    if (bdrv_pread(s->hd, offset, table, c->table_size) != c->table_size) {
+        qcow_cache_unhash(c, qcow_cache_index(c, table));
+        return NULL;
+    }
+    return table;
+}
+
+/* Mark LEN bytes at P, inside TABLE, to be written back.  */
+static void qcow_cache_set_dirty(QCowCache *c, void *table, void *p, int len)
+{
+    QCowCacheEntry *e = &c->entries[qcow_cache_index(c, table)];
+    int start = (uint8_t *)p - (uint8_t *)table;
+
+    if (e->dirty_end == 0) {
+        e->dirty_start = start;
+        e->dirty_end = start + len;
+    } else {
+        e->dirty_start = MIN(e->dirty_start, start);
+        e->dirty_end = MAX(e->dirty_end, start + len);
+    }
+}
+
 static int qcow_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const QCowHeader *cow_header = (const void *)buf;
@@ -186,7 +421,7 @@ static int qcow_probe(const uint8_t *buf, int buf_size, const char *filename)
 static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    int len, i, shift, ret;
+    int len, i, shift, ret, l2_cache_size, refcount_cache_size;
     QCowHeader header;
 
     /* Performance is terrible right now with cache=writethrough due mainly
@@ -262,8 +497,16 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
         be64_to_cpus(&s->l1_table[i]);
     }
     /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    if (!s->l2_cache)
+    if (bs->metadata_cache_size > 0) {
+        l2_cache_size = (bs->metadata_cache_size / 5 * 4) >> s->cluster_bits;
+        refcount_cache_size = (bs->metadata_cache_size / 5) >> s->cluster_bits;
+    } else {
+        l2_cache_size = MIN(s->l1_vm_state_index,
+                            L2_CACHE_MAX_BYTES >> s->cluster_bits);
+        refcount_cache_size = l2_cache_size / 4;
+    }
+    if (qcow_cache_init(&s->l2_cache, MAX(l2_cache_size, L2_CACHE_MIN),
+                        s->cluster_size) < 0)
         goto fail;
     s->cluster_cache = qemu_malloc(s->cluster_size);
     if (!s->cluster_cache)
@@ -275,7 +518,7 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
         goto fail;
     s->cluster_cache_offset = -1;
 
-    if (refcount_init(bs) < 0)
+    if (refcount_init(bs, MAX(refcount_cache_size, REFCOUNT_CACHE_MIN)) < 0)
         goto fail;
 
     /* read the backing file name */
@@ -299,7 +542,7 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     qcow_free_snapshots(bs);
     refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    qcow_cache_free(&s->l2_cache);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     bdrv_delete(s->hd);
@@ -402,27 +645,7 @@ static void l2_cache_reset(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
 
-    memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
-}
-
-static inline int l2_cache_new_entry(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-    uint32_t min_count;
-    int min_index, i;
-
-    /* find a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    return min_index;
+    qcow_cache_reset(&s->l2_cache);
 }
 
 static int64_t align_offset(int64_t offset, int n)
@@ -467,6 +690,8 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
         new_l1_table[i] = be64_to_cpu(new_l1_table[i]);
 
     /* set new table */
+    if (refcount_flush(bs) < 0)
+        goto fail;
     cpu_to_be32w((uint32_t*)data, new_l1_size);
     cpu_to_be64w((uint64_t*)(data + 4), new_l1_table_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, l1_size), data,
@@ -483,36 +708,6 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
     return -EIO;
 }
 
-/*
- * seek_l2_table
- *
- * seek l2_offset in the l2_cache table
- * if not found, return NULL,
- * if found,
- *   increments the l2 cache hit count of the entry,
- *   if counter overflow, divide by two all counters
- *   return the pointer to the l2 cache entry
- *
- */
-
-static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
-{
-    int i, j;
-
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
-            }
-            return s->l2_cache + (i << s->l2_bits);
-        }
-    }
-    return NULL;
-}
-
 /*
  * l2_load
  *
@@ -526,26 +721,8 @@ static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
 static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
-    uint64_t *l2_table;
-
-    /* seek if the table for the given offset is in the cache */
 
-    l2_table = seek_l2_table(s, l2_offset);
-    if (l2_table != NULL)
-        return l2_table;
-
-    /* not found: load a new entry in the least used one */
-
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
-    if (bdrv_pread(s->hd, l2_offset, l2_table, s->l2_size * sizeof(uint64_t)) !=
-        s->l2_size * sizeof(uint64_t))
-        return NULL;
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
-
-    return l2_table;
+    return qcow_cache_load(s, &s->l2_cache, l2_offset);
 }
 
 /*
@@ -561,7 +738,6 @@ static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
 static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
     uint64_t old_l2_offset, tmp;
     uint64_t *l2_table, l2_offset;
 
@@ -575,6 +751,8 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
 
+    if (refcount_flush(bs) < 0)
+        return NULL;
     tmp = cpu_to_be64(l2_offset | QCOW_OFLAG_COPIED);
     if (bdrv_pwrite(s->hd, s->l1_table_offset + l1_index * sizeof(tmp),
                     &tmp, sizeof(tmp)) != sizeof(tmp))
@@ -582,8 +760,9 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new entry in the l2 cache */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
+    l2_table = qcow_cache_new(s, &s->l2_cache, l2_offset);
+    if (!l2_table)
+        return NULL;
 
     if (old_l2_offset == 0) {
         /* if there was no old l2 table, clear the new table */
@@ -601,11 +780,6 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
         s->l2_size * sizeof(uint64_t))
         return NULL;
 
-    /* update the l2 cache entry */
-
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
-
     return l2_table;
 }
 
@@ -855,6 +1029,8 @@ static uint64_t alloc_compressed_cluster_offset(BlockDriverState *bs,
     /* compressed clusters never have the copied flag */
 
     l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    if (refcount_flush(bs) < 0)
+        return 0;
     if (bdrv_pwrite(s->hd,
                     l2_offset + l2_index * sizeof(uint64_t),
                     l2_table + l2_index,
@@ -914,6 +1090,8 @@ static int alloc_cluster_link_l2(BlockDriverState *bs, uint64_t cluster_offset,
                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
      }
 
+    if (refcount_flush(bs) < 0)
+        goto err;
     if (bdrv_pwrite(s->hd, l2_offset + l2_index * sizeof(uint64_t),
                 l2_table + l2_index, m->nb_clusters * sizeof(uint64_t)) !=
             m->nb_clusters * sizeof(uint64_t))
@@ -1429,8 +1607,9 @@ static void qcow_aio_cancel(BlockDriverAIOCB *blockacb)
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    refcount_flush(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    qcow_cache_free(&s->l2_cache);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     refcount_close(bs);
@@ -1578,14 +1757,128 @@ static int qcow_make_empty(BlockDriverState *bs)
     return 0;
 }
 
+/* Deflate one cluster into OUT_BUF, which holds at least cluster_size
+   bytes.  Returns the compressed length, or -1 if the cluster does not
+   compress and must be written as a normal one.  */
+static int qcow_compress_cluster(int cluster_size, uint8_t *out_buf,
+                                 const uint8_t *buf)
+{
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0)
+        return -1;
+
+    strm.avail_in = cluster_size;
+    strm.next_in = (uint8_t *)buf;
+    strm.avail_out = cluster_size;
+    strm.next_out = out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - out_buf;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= cluster_size)
+        return -1;
+    return out_len;
+}
+
+#define QCOW_MAX_COMPRESS_THREADS 16
+
+typedef struct QCowCompressBatch {
+    int cluster_size;
+    int nb_clusters;
+    int stride;
+    const uint8_t *buf;
+    uint8_t *out_buf;
+    int *out_len;
+} QCowCompressBatch;
+
+typedef struct QCowCompressWorker {
+    QCowCompressBatch *batch;
+    int first;
+} QCowCompressWorker;
+
+/* Each worker takes every stride'th cluster of the batch, so they never
+   share any state.  */
+static void *qcow_compress_worker(void *opaque)
+{
+    QCowCompressWorker *w = opaque;
+    QCowCompressBatch *b = w->batch;
+    int i;
+
+    for (i = w->first; i < b->nb_clusters; i += b->stride) {
+        b->out_len[i] = qcow_compress_cluster(b->cluster_size,
+                            b->out_buf + (int64_t)i * b->cluster_size,
+                            b->buf + (int64_t)i * b->cluster_size);
+    }
+    return NULL;
+}
+
+/* Compress the clusters of the batch, spread over up to THREADS threads
+   including the calling one.  */
+static void qcow_compress_batch(QCowCompressBatch *b, int threads)
+{
+    QCowCompressWorker workers[QCOW_MAX_COMPRESS_THREADS];
+    int i;
+#ifdef CONFIG_AIO
+    pthread_t tids[QCOW_MAX_COMPRESS_THREADS];
+    sigset_t set, oldset;
+    int started = 1;
+#endif
+
+    if (threads > QCOW_MAX_COMPRESS_THREADS)
+        threads = QCOW_MAX_COMPRESS_THREADS;
+    if (threads > b->nb_clusters)
+        threads = b->nb_clusters;
+    if (threads < 1)
+        threads = 1;
+#ifndef CONFIG_AIO
+    threads = 1;
+#endif
+    b->stride = threads;
+    for (i = 0; i < threads; i++) {
+        workers[i].batch = b;
+        workers[i].first = i;
+    }
+
+#ifdef CONFIG_AIO
+    /* the workers must not take the AIO completion signals */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, qcow_compress_worker,
+                           &workers[i]) != 0)
+            break;
+    }
+    started = i;
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    /* do the share of the workers that could not be created */
+    for (i = started; i < threads; i++)
+        qcow_compress_worker(&workers[i]);
+#endif
+    qcow_compress_worker(&workers[0]);
+#ifdef CONFIG_AIO
+    for (i = 1; i < started; i++)
+        pthread_join(tids[i], NULL);
+#endif
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+/* NB_SECTORS may cover several clusters, which are then compressed in
+   parallel on bs->compress_threads threads and written in order.  */
 static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    QCowCompressBatch batch;
+    int i, ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -1598,60 +1891,56 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return 0;
     }
 
-    if (nb_sectors != s->cluster_sectors)
+    if (nb_sectors < 0 || (nb_sectors % s->cluster_sectors) != 0 ||
+        (sector_num & (s->cluster_sectors - 1)) != 0)
         return -EINVAL;
 
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-    if (!out_buf)
+    batch.cluster_size = s->cluster_size;
+    batch.nb_clusters = nb_sectors / s->cluster_sectors;
+    batch.buf = buf;
+    batch.out_buf = qemu_malloc((int64_t)batch.nb_clusters * s->cluster_size);
+    batch.out_len = qemu_malloc(batch.nb_clusters * sizeof(int));
+    if (!batch.out_buf || !batch.out_len) {
+        qemu_free(batch.out_buf);
+        qemu_free(batch.out_len);
         return -ENOMEM;
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
     }
+    qcow_compress_batch(&batch, bs->compress_threads);
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
-        deflateEnd(&strm);
-        return -1;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        qcow_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = alloc_compressed_cluster_offset(bs, sector_num << 9,
-                                              out_len);
-        if (!cluster_offset)
-            return -1;
-        cluster_offset &= s->cluster_offset_mask;
-        if (bdrv_pwrite(s->hd, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
+    ret = 0;
+    for (i = 0; i < batch.nb_clusters; i++) {
+        out_len = batch.out_len[i];
+        out_buf = batch.out_buf + (int64_t)i * s->cluster_size;
+        if (out_len < 0) {
+            /* could not compress: write normal cluster */
+            qcow_write(bs, sector_num, buf, s->cluster_sectors);
+        } else {
+            cluster_offset = alloc_compressed_cluster_offset(bs,
+                                 sector_num << 9, out_len);
+            if (!cluster_offset) {
+                ret = -1;
+                break;
+            }
+            cluster_offset &= s->cluster_offset_mask;
+            if (bdrv_pwrite(s->hd, cluster_offset, out_buf, out_len) !=
+                out_len) {
+                ret = -1;
+                break;
+            }
         }
+        sector_num += s->cluster_sectors;
+        buf += s->cluster_size;
     }
 
-    qemu_free(out_buf);
-    return 0;
+    qemu_free(batch.out_buf);
+    qemu_free(batch.out_len);
+    return ret;
 }
 
 static void qcow_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    refcount_flush(bs);
     bdrv_flush(s->hd);
 }
 
@@ -1661,6 +1950,12 @@ static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = (int64_t)s->l1_vm_state_index <<
         (s->cluster_bits + s->l2_bits);
+    bdi->metadata_cache_size = (int64_t)(s->l2_cache.size +
+        s->refcount_cache.size) << s->cluster_bits;
+    bdi->metadata_cache_hits = s->l2_cache.hits + s->refcount_cache.hits;
+    bdi->metadata_cache_misses = s->l2_cache.misses +
+        s->refcount_cache.misses;
+    bdi->metadata_cache_writes = s->refcount_cache.writebacks;
     return 0;
 }
 
@@ -1775,7 +2070,7 @@ static int update_snapshot_refcount(BlockDriverState *bs,
     if (l1_allocated)
         qemu_free(l1_table);
     qemu_free(l2_table);
-    return 0;
+    return refcount_flush(bs);
  fail:
     if (l1_allocated)
         qemu_free(l1_table);
@@ -2148,13 +2443,12 @@ static int qcow_snapshot_list(BlockDriverState *bs,
 /*********************************************************/
 /* refcount handling */
 
-static int refcount_init(BlockDriverState *bs)
+static int refcount_init(BlockDriverState *bs, int cache_size)
 {
     BDRVQcowState *s = bs->opaque;
     int ret, refcount_table_size2, i;
 
-    s->refcount_block_cache = qemu_malloc(s->cluster_size);
-    if (!s->refcount_block_cache)
+    if (qcow_cache_init(&s->refcount_cache, cache_size, s->cluster_size) < 0)
         goto fail;
     refcount_table_size2 = s->refcount_table_size * sizeof(uint64_t);
     s->refcount_table = qemu_malloc(refcount_table_size2);
@@ -2176,22 +2470,25 @@ static int refcount_init(BlockDriverState *bs)
 static void refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    qemu_free(s->refcount_block_cache);
+    qcow_cache_free(&s->refcount_cache);
     qemu_free(s->refcount_table);
 }
 
+/* Refcount updates are written back lazily: write them before any
+   metadata that points to the clusters they allocate.  */
+static int refcount_flush(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return qcow_cache_flush(s, &s->refcount_cache);
+}
 
-static int load_refcount_block(BlockDriverState *bs,
-                               int64_t refcount_block_offset)
+static uint16_t *load_refcount_block(BlockDriverState *bs,
+                                     int64_t refcount_block_offset)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret;
-    ret = bdrv_pread(s->hd, refcount_block_offset, s->refcount_block_cache,
-                     s->cluster_size);
-    if (ret != s->cluster_size)
-        return -EIO;
-    s->refcount_block_cache_offset = refcount_block_offset;
-    return 0;
+
+    return qcow_cache_load(s, &s->refcount_cache, refcount_block_offset);
 }
 
 static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
@@ -2199,6 +2496,7 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     BDRVQcowState *s = bs->opaque;
     int refcount_table_index, block_index;
     int64_t refcount_block_offset;
+    uint16_t *refcount_block;
 
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
     if (refcount_table_index >= s->refcount_table_size)
@@ -2206,14 +2504,13 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     refcount_block_offset = s->refcount_table[refcount_table_index];
     if (!refcount_block_offset)
         return 0;
-    if (refcount_block_offset != s->refcount_block_cache_offset) {
-        /* better than nothing: return allocated if read error */
-        if (load_refcount_block(bs, refcount_block_offset) < 0)
-            return 1;
-    }
+    refcount_block = load_refcount_block(bs, refcount_block_offset);
+    /* better than nothing: return allocated if read error */
+    if (!refcount_block)
+        return 1;
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    return be16_to_cpu(s->refcount_block_cache[block_index]);
+    return be16_to_cpu(refcount_block[block_index]);
 }
 
 /* return < 0 if error */
@@ -2359,7 +2656,6 @@ static int grow_refcount_table(BlockDriverState *bs, int min_size)
 }
 
 /* addend must be 1 or -1 */
-/* XXX: cache several refcount block clusters ? */
 static int update_cluster_refcount(BlockDriverState *bs,
                                    int64_t cluster_index,
                                    int addend)
@@ -2368,6 +2664,7 @@ static int update_cluster_refcount(BlockDriverState *bs,
     int64_t offset, refcount_block_offset;
     int ret, refcount_table_index, block_index, refcount;
     uint64_t data64;
+    uint16_t *refcount_block;
 
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
     if (refcount_table_index >= s->refcount_table_size) {
@@ -2384,8 +2681,11 @@ static int update_cluster_refcount(BlockDriverState *bs,
         /* create a new refcount block */
         /* Note: we cannot update the refcount now to avoid recursion */
         offset = alloc_clusters_noref(bs, s->cluster_size);
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        ret = bdrv_pwrite(s->hd, offset, s->refcount_block_cache, s->cluster_size);
+        refcount_block = qcow_cache_new(s, &s->refcount_cache, offset);
+        if (!refcount_block)
+            return -EIO;
+        memset(refcount_block, 0, s->cluster_size);
+        ret = bdrv_pwrite(s->hd, offset, refcount_block, s->cluster_size);
         if (ret != s->cluster_size)
             return -EINVAL;
         s->refcount_table[refcount_table_index] = offset;
@@ -2397,29 +2697,25 @@ static int update_cluster_refcount(BlockDriverState *bs,
             return -EINVAL;
 
         refcount_block_offset = offset;
-        s->refcount_block_cache_offset = offset;
         update_refcount(bs, offset, s->cluster_size, 1);
-    } else {
-        if (refcount_block_offset != s->refcount_block_cache_offset) {
-            if (load_refcount_block(bs, refcount_block_offset) < 0)
-                return -EIO;
-        }
     }
-    /* we can update the count and save it */
+    /* the recursive update above may have evicted the block */
+    refcount_block = load_refcount_block(bs, refcount_block_offset);
+    if (!refcount_block)
+        return -EIO;
+    /* we can update the count, it is written back later */
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    refcount = be16_to_cpu(s->refcount_block_cache[block_index]);
+    refcount = be16_to_cpu(refcount_block[block_index]);
     refcount += addend;
     if (refcount < 0 || refcount > 0xffff)
         return -EINVAL;
     if (refcount == 0 && cluster_index < s->free_cluster_index) {
         s->free_cluster_index = cluster_index;
     }
-    s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
-    if (bdrv_pwrite(s->hd,
-                    refcount_block_offset + (block_index << REFCOUNT_SHIFT),
-                    &s->refcount_block_cache[block_index], 2) != 2)
-        return -EIO;
+    refcount_block[block_index] = cpu_to_be16(refcount);
+    qcow_cache_set_dirty(&s->refcount_cache, refcount_block,
+                         &refcount_block[block_index], 2);
     return refcount;
 }
 
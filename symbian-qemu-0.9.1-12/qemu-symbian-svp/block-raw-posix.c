@@ -29,6 +29,12 @@
 #ifdef CONFIG_AIO
 #include "posix-aio-compat.h"
 #endif
+#ifdef CONFIG_LINUX_AIO
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/aio_abi.h>
+#include <pthread.h>
+#endif
 
 #ifdef CONFIG_COCOA
 #include <paths.h>
@@ -106,9 +112,15 @@ typedef struct BDRVRawState {
     int fd_media_changed;
 #endif
     uint8_t* aligned_buf;
+#ifdef CONFIG_LINUX_AIO
+    int native_aio;
+#endif
 } BDRVRawState;
 
 static int posix_aio_init(void);
+#ifdef CONFIG_LINUX_AIO
+static int laio_init(void);
+#endif
 
 static int fd_open(BlockDriverState *bs);
 
@@ -157,6 +169,9 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
             return ret;
         }
     }
+#ifdef CONFIG_LINUX_AIO
+    s->native_aio = (flags & BDRV_O_NATIVE_AIO) && laio_init() == 0;
+#endif
     return 0;
 }
 
@@ -438,6 +453,9 @@ static int raw_pwrite(BlockDriverState *bs, int64_t offset,
 typedef struct RawAIOCB {
     BlockDriverAIOCB common;
     struct qemu_paiocb aiocb;
+#ifdef CONFIG_LINUX_AIO
+    struct iocb iocb;
+#endif
     struct RawAIOCB *next;
     int ret;
 } RawAIOCB;
@@ -565,6 +583,257 @@ static int posix_aio_init(void)
     return 0;
 }
 
+#ifdef CONFIG_LINUX_AIO
+/***********************************************************/
+/* Linux native AIO */
+
+/* raw_aio_read/write queue the requests of drives opened with
+   BDRV_O_NATIVE_AIO, and a bottom half hands the whole queue to the
+   kernel with one io_submit(), so that the requests a device starts in
+   one main loop iteration cost a single system call.  The kernel
+   signals completions on an eventfd that is polled like any other AIO
+   fd: there is no thread handoff and no signal.  */
+
+#define LAIO_MAX_EVENTS 128
+
+typedef struct LinuxAioState {
+    aio_context_t ctx;
+    int efd;
+    int nb_submitted;           /* requests owned by the kernel */
+    int nb_queued;
+    RawAIOCB *first_queued;
+    RawAIOCB **last_queued;
+    QEMUBH *submit_bh;
+    int cancel_done;
+} LinuxAioState;
+
+static LinuxAioState *linux_aio_state;
+
+static int laio_process_completions(LinuxAioState *s, int min_nr)
+{
+    struct io_event events[LAIO_MAX_EVENTS];
+    struct timespec ts;
+    RawAIOCB *acb;
+    int i, n, done = 0;
+
+    for (;;) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = 0;
+        n = syscall(__NR_io_getevents, s->ctx, min_nr, LAIO_MAX_EVENTS,
+                    events, min_nr ? NULL : &ts);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        s->nb_submitted -= n;
+        for (i = 0; i < n; i++) {
+            acb = (RawAIOCB *)(uintptr_t)events[i].data;
+            if (events[i].res == acb->iocb.aio_nbytes)
+                acb->ret = 0;
+            else if ((int64_t)events[i].res < 0)
+                acb->ret = events[i].res;
+            else
+                acb->ret = -EINVAL;
+            acb->common.cb(acb->common.opaque, acb->ret);
+            qemu_aio_release(acb);
+        }
+        done += n;
+        if (n < LAIO_MAX_EVENTS)
+            break;
+        min_nr = 0;
+    }
+    return done;
+}
+
+static void laio_submit_queued(LinuxAioState *s)
+{
+    struct iocb *iocbs[LAIO_MAX_EVENTS];
+    RawAIOCB *acb;
+    int i, n, ret;
+
+    while (s->nb_queued > 0 && s->nb_submitted < LAIO_MAX_EVENTS) {
+        n = 0;
+        for (acb = s->first_queued;
+             acb && n < LAIO_MAX_EVENTS - s->nb_submitted; acb = acb->next)
+            iocbs[n++] = &acb->iocb;
+        ret = syscall(__NR_io_submit, s->ctx, n, iocbs);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && s->nb_submitted > 0)
+                break; /* retried when requests complete */
+            /* fail the first request, which the kernel refused */
+            ret = -errno;
+            acb = s->first_queued;
+            s->first_queued = acb->next;
+            if (!s->first_queued)
+                s->last_queued = &s->first_queued;
+            s->nb_queued--;
+            acb->common.cb(acb->common.opaque, ret);
+            qemu_aio_release(acb);
+            continue;
+        }
+        for (i = 0; i < ret; i++) {
+            s->first_queued = s->first_queued->next;
+        }
+        if (!s->first_queued)
+            s->last_queued = &s->first_queued;
+        s->nb_queued -= ret;
+        s->nb_submitted += ret;
+    }
+}
+
+static void laio_submit_bh(void *opaque)
+{
+    laio_submit_queued(opaque);
+}
+
+static void laio_completion(void *opaque)
+{
+    LinuxAioState *s = opaque;
+    uint64_t count;
+
+    /* the counter only wakes us up, the events tell what completed */
+    while (read(s->efd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+    laio_process_completions(s, 0);
+    laio_submit_queued(s);
+}
+
+static int laio_flush(void *opaque)
+{
+    LinuxAioState *s = opaque;
+    return s->nb_submitted + s->nb_queued > 0;
+}
+
+/* The AIO context belongs to the address space of the parent, and the
+   eventfd is shared with it: a forked child (-fork-server) needs its own.
+   The new eventfd takes the number of the old one, which keeps the
+   registered handler valid.  Requests owned by the parent's kernel
+   context never complete here.  */
+static void laio_child(void)
+{
+    LinuxAioState *s = linux_aio_state;
+    int efd;
+
+    s->nb_submitted = 0;
+    efd = eventfd(0, 0);
+    if (efd >= 0) {
+        dup2(efd, s->efd);
+        close(efd);
+        fcntl(s->efd, F_SETFL, O_NONBLOCK);
+    }
+    s->ctx = 0;
+    if (efd < 0 || syscall(__NR_io_setup, LAIO_MAX_EVENTS, &s->ctx) < 0)
+        fprintf(stderr, "native AIO setup failed in the child process\n");
+}
+
+static int laio_init(void)
+{
+    LinuxAioState *s;
+
+    if (linux_aio_state)
+        return 0;
+
+    s = qemu_mallocz(sizeof(LinuxAioState));
+    if (s == NULL)
+        return -ENOMEM;
+    s->efd = eventfd(0, 0);
+    if (s->efd < 0) {
+        qemu_free(s);
+        return -errno;
+    }
+    fcntl(s->efd, F_SETFL, O_NONBLOCK);
+    if (syscall(__NR_io_setup, LAIO_MAX_EVENTS, &s->ctx) < 0) {
+        fprintf(stderr, "io_setup failed, using thread based AIO\n");
+        close(s->efd);
+        qemu_free(s);
+        return -errno;
+    }
+    s->last_queued = &s->first_queued;
+    s->submit_bh = qemu_bh_new(laio_submit_bh, s);
+    qemu_aio_set_fd_handler(s->efd, laio_completion, NULL, laio_flush, s);
+
+    linux_aio_state = s;
+    pthread_atfork(NULL, NULL, laio_child);
+    return 0;
+}
+
+static RawAIOCB *laio_submit(BlockDriverState *bs, int64_t sector_num,
+                             uint8_t *buf, int nb_sectors, int opcode,
+                             BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+    LinuxAioState *ls = linux_aio_state;
+    RawAIOCB *acb;
+
+    if (fd_open(bs) < 0)
+        return NULL;
+
+    acb = qemu_aio_get(bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    memset(&acb->iocb, 0, sizeof(acb->iocb));
+    acb->iocb.aio_data = (uintptr_t)acb;
+    acb->iocb.aio_lio_opcode = opcode;
+    acb->iocb.aio_fildes = s->fd;
+    acb->iocb.aio_buf = (uintptr_t)buf;
+    if (nb_sectors < 0)
+        acb->iocb.aio_nbytes = -nb_sectors;
+    else
+        acb->iocb.aio_nbytes = nb_sectors * 512;
+    acb->iocb.aio_offset = sector_num * 512;
+    acb->iocb.aio_flags = IOCB_FLAG_RESFD;
+    acb->iocb.aio_resfd = ls->efd;
+
+    acb->next = NULL;
+    *ls->last_queued = acb;
+    ls->last_queued = &acb->next;
+    ls->nb_queued++;
+    qemu_bh_schedule(ls->submit_bh);
+    return acb;
+}
+
+static void laio_cancel_done(void *opaque, int ret)
+{
+    LinuxAioState *s = opaque;
+    s->cancel_done = 1;
+}
+
+static void laio_cancel(RawAIOCB *acb)
+{
+    LinuxAioState *s = linux_aio_state;
+    struct io_event event;
+    RawAIOCB **pacb;
+
+    /* not submitted yet: just forget it */
+    for (pacb = &s->first_queued; *pacb; pacb = &(*pacb)->next) {
+        if (*pacb == acb) {
+            *pacb = acb->next;
+            if (!acb->next)
+                s->last_queued = pacb;
+            s->nb_queued--;
+            qemu_aio_release(acb);
+            return;
+        }
+    }
+
+    if (syscall(__NR_io_cancel, s->ctx, &acb->iocb, &event) == 0) {
+        s->nb_submitted--;
+        qemu_aio_release(acb);
+        return;
+    }
+
+    /* fail safe: if the aio could not be canceled, we wait for it and
+       drop its completion */
+    s->cancel_done = 0;
+    acb->common.cb = laio_cancel_done;
+    acb->common.opaque = s;
+    while (!s->cancel_done)
+        laio_process_completions(s, 1);
+}
+#endif /* CONFIG_LINUX_AIO */
+
 static RawAIOCB *raw_aio_setup(BlockDriverState *bs,
         int64_t sector_num, uint8_t *buf, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -620,6 +889,13 @@ static BlockDriverAIOCB *raw_aio_read(BlockDriverState *bs,
         return &acb->common;
     }
 
+#ifdef CONFIG_LINUX_AIO
+    if (s->native_aio) {
+        acb = laio_submit(bs, sector_num, buf, nb_sectors, IOCB_CMD_PREAD,
+                          cb, opaque);
+        return acb ? &acb->common : NULL;
+    }
+#endif
     acb = raw_aio_setup(bs, sector_num, buf, nb_sectors, cb, opaque);
     if (!acb)
         return NULL;
@@ -651,6 +927,13 @@ static BlockDriverAIOCB *raw_aio_write(BlockDriverState *bs,
         return &acb->common;
     }
 
+#ifdef CONFIG_LINUX_AIO
+    if (s->native_aio) {
+        acb = laio_submit(bs, sector_num, (uint8_t *)buf, nb_sectors,
+                          IOCB_CMD_PWRITE, cb, opaque);
+        return acb ? &acb->common : NULL;
+    }
+#endif
     acb = raw_aio_setup(bs, sector_num, (uint8_t*)buf, nb_sectors, cb, opaque);
     if (!acb)
         return NULL;
@@ -667,6 +950,12 @@ static void raw_aio_cancel(BlockDriverAIOCB *blockacb)
     RawAIOCB *acb = (RawAIOCB *)blockacb;
     RawAIOCB **pacb;
 
+#ifdef CONFIG_LINUX_AIO
+    if (((BDRVRawState *)acb->common.bs->opaque)->native_aio) {
+        laio_cancel(acb);
+        return;
+    }
+#endif
     ret = qemu_paio_cancel(acb->aiocb.aio_fildes, &acb->aiocb);
     if (ret == QEMU_PAIO_NOTCANCELED) {
         /* fail safe: if the aio could not be canceled, we wait for
@@ -969,6 +1258,10 @@ static int hdev_open(BlockDriverState *bs, const char *filename, int flags)
         s->fd = -1;
         s->fd_media_changed = 1;
     }
+#endif
+#ifdef CONFIG_LINUX_AIO
+    s->native_aio = (flags & BDRV_O_NATIVE_AIO) && s->type == FTYPE_FILE &&
+                    laio_init() == 0;
 #endif
     return 0;
 }
@@ -62,6 +62,7 @@ static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
 BlockDriverState *bdrv_first;
 
 static BlockDriver *first_drv;
+static int bdrv_sync_aio;
 
 int path_is_absolute(const char *path)
 {
@@ -130,7 +131,7 @@ void path_combine(char *dest, int dest_size,
 
 static void bdrv_register(BlockDriver *bdrv)
 {
-    if (!bdrv->bdrv_aio_read) {
+    if (!bdrv->bdrv_aio_read || (bdrv_sync_aio && bdrv->bdrv_pread)) {
         /* add AIO emulation layer */
         bdrv->bdrv_aio_read = bdrv_aio_read_em;
         bdrv->bdrv_aio_write = bdrv_aio_write_em;
@@ -400,7 +401,8 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
     /* Note: for compatibility, we open disk image files as RDWR, and
        RDONLY as fallback */
     if (!(flags & BDRV_O_FILE))
-        open_flags = BDRV_O_RDWR | (flags & BDRV_O_CACHE_MASK);
+        open_flags = BDRV_O_RDWR |
+            (flags & (BDRV_O_CACHE_MASK | BDRV_O_NATIVE_AIO));
     else
         open_flags = flags & ~(BDRV_O_FILE | BDRV_O_SNAPSHOT);
     ret = drv->bdrv_open(bs, filename, open_flags);
@@ -880,6 +882,26 @@ void bdrv_set_translation_hint(BlockDriverState *bs, int translation)
     bs->translation = translation;
 }
 
+/* Number of request queues of devices that can have more than one.  */
+void bdrv_set_queues_hint(BlockDriverState *bs, int queues)
+{
+    bs->queues = queues;
+}
+
+/* Size in bytes of the metadata cache of image formats that have one,
+   such as qcow2, for the next time the image is opened.  */
+void bdrv_set_metadata_cache(BlockDriverState *bs, int64_t size)
+{
+    bs->metadata_cache_size = size;
+}
+
+/* Number of threads that bdrv_write_compressed may use to compress the
+   clusters of a request.  */
+void bdrv_set_compress_threads(BlockDriverState *bs, int threads)
+{
+    bs->compress_threads = threads;
+}
+
 void bdrv_get_geometry_hint(BlockDriverState *bs,
                             int *pcyls, int *pheads, int *psecs)
 {
@@ -898,6 +920,11 @@ int bdrv_get_translation_hint(BlockDriverState *bs)
     return bs->translation;
 }
 
+int bdrv_get_queues_hint(BlockDriverState *bs)
+{
+    return bs->queues > 0 ? bs->queues : 1;
+}
+
 int bdrv_is_removable(BlockDriverState *bs)
 {
     return bs->removable;
@@ -921,6 +948,15 @@ void bdrv_set_change_cb(BlockDriverState *bs,
     bs->change_opaque = opaque;
 }
 
+/* The device model attached to the drive can print its own statistics
+   after those of the block layer.  */
+void bdrv_set_stats_cb(BlockDriverState *bs,
+                       void (*stats_cb)(void *opaque), void *opaque)
+{
+    bs->stats_cb = stats_cb;
+    bs->stats_opaque = opaque;
+}
+
 int bdrv_is_encrypted(BlockDriverState *bs)
 {
     if (bs->backing_hd && bs->backing_hd->encrypted)
@@ -1082,11 +1118,13 @@ void bdrv_info_stats (void)
 		     " rd_bytes=%" PRIu64
 		     " wr_bytes=%" PRIu64
 		     " rd_operations=%" PRIu64
-		     " wr_operations=%" PRIu64
-		     "\n",
+		     " wr_operations=%" PRIu64,
 		     bs->device_name,
 		     bs->rd_bytes, bs->wr_bytes,
 		     bs->rd_ops, bs->wr_ops);
+	if (bs->stats_cb)
+	    bs->stats_cb(bs->stats_opaque);
+	term_printf ("\n");
     }
 }
 
@@ -1392,6 +1430,14 @@ static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
     return async_ret;
 }
 
+/* Emulate AIO on top of synchronous I/O for the drivers that support
+   it, so that requests complete in the order they are submitted, from a
+   bottom half.  Must be called before bdrv_init().  */
+void bdrv_set_sync_aio(void)
+{
+    bdrv_sync_aio = 1;
+}
+
 void bdrv_init(void)
 {
     bdrv_register(&bdrv_raw);
@@ -100,6 +100,9 @@ struct BlockDriverState {
     /* event callback when inserting/removing */
     void (*change_cb)(void *opaque);
     void *change_opaque;
+    /* device statistics, appended to "info blockstats" */
+    void (*stats_cb)(void *opaque);
+    void *stats_opaque;
 
     BlockDriver *drv; /* NULL means no media */
     void *opaque;
@@ -109,6 +112,10 @@ struct BlockDriverState {
                                 this file image */
     int is_temporary;
     int media_changed;
+    /* size of the image format's metadata cache, 0 for its default */
+    int64_t metadata_cache_size;
+    /* threads used to compress clusters in bdrv_write_compressed */
+    int compress_threads;
 
     BlockDriverState *backing_hd;
     /* async read/write emulation */
@@ -125,6 +132,7 @@ struct BlockDriverState {
        drivers. They are not used by the block driver */
     int cyls, heads, secs, translation;
     int type;
+    int queues;
     char device_name[32];
     BlockDriverState *next;
 };
@@ -755,7 +755,11 @@ void cpu_abort(CPUState *env, const char *fmt, ...)
     __attribute__ ((__format__ (__printf__, 2, 3)))
     __attribute__ ((__noreturn__));
 extern CPUState *first_cpu;
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+extern __thread CPUState *cpu_single_env;
+#else
 extern CPUState *cpu_single_env;
+#endif
 extern int64_t qemu_icount;
 extern int use_icount;
 
@@ -857,6 +861,7 @@ extern int phys_ram_fd;
 extern uint8_t *kqemu_phys_ram_base;
 #endif
 extern uint8_t *phys_ram_dirty;
+extern uint8_t *phys_ram_postcopy;
 extern ram_addr_t ram_size;
 
 /* physical memory access */
@@ -910,6 +915,7 @@ ram_addr_t cpu_get_physical_page_desc(target_phys_addr_t addr);
 ram_addr_t get_ram_offset_phys(target_phys_addr_t addr);
 ram_addr_t qemu_ram_alloc(ram_addr_t);
 void qemu_ram_free(ram_addr_t addr);
+int qemu_ram_map_file(int fd, int64_t offset);
 int cpu_register_io_memory(int io_index,
                            CPUReadMemoryFunc **mem_read,
                            CPUWriteMemoryFunc **mem_write,
@@ -949,6 +955,7 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
 #define CODE_DIRTY_FLAG      0x02
 #define KQEMU_DIRTY_FLAG     0x04
 #define MIGRATION_DIRTY_FLAG 0x08
+#define SNAPSHOT_DIRTY_FLAG  0x10
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
@@ -967,8 +974,21 @@ static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
     phys_ram_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
 }
 
+/* During a post-copy migration, fetch a page that has not been received
+   yet before it is accessed.  */
+void ram_postcopy_fetch(ram_addr_t addr);
+
+static inline void cpu_physical_memory_fetch(ram_addr_t addr)
+{
+    if (unlikely(phys_ram_postcopy != NULL)
+        && phys_ram_postcopy[addr >> TARGET_PAGE_BITS])
+        ram_postcopy_fetch(addr & TARGET_PAGE_MASK);
+}
+
+void cpu_physical_memory_written(ram_addr_t addr, ram_addr_t len);
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+void cpu_physical_memory_reset_dirty_all(int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
@@ -205,7 +205,9 @@ typedef struct CPUWatchpoint {
                                                                         \
     void *next_cpu; /* next CPU sharing TB cache */                     \
     int cpu_index; /* CPU index (informative) */                        \
-    int running; /* Nonzero if cpu is currently running(usermode).  */  \
+    int running; /* Nonzero if cpu is currently running.  */            \
+    int stop;    /* Stop request for the CPU thread.  */                \
+    int stopped; /* Nonzero if the CPU thread is parked.  */            \
     /* user data */                                                     \
     void *opaque;                                                       \
     void *qdev;                                                         \
@@ -179,7 +179,9 @@ static inline TranslationBlock *tb_find_fast(void)
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
+        int locked = cpu_threads_lock();
         tb = tb_find_slow(pc, cs_base, flags);
+        cpu_threads_unlock(locked);
     }
     return tb;
 }
@@ -251,6 +253,15 @@ int cpu_exec(CPUState *env1)
 #endif
     env->exception_index = -1;
 
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    /* The CPU thread calls us with the global lock held.  Guest code
+       runs without it.  */
+    if (cpu_threads_enabled) {
+        cpu_exec_start(env);
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+
     /* prepare setjmp context for exception handling */
     for(;;) {
         if (setjmp(env->jmp_env) == 0) {
@@ -278,6 +289,7 @@ int cpu_exec(CPUState *env1)
                     ret = env->exception_index;
                     break;
                 } else {
+                    int locked = cpu_threads_lock();
 #if defined(TARGET_I386)
                     /* simulate a real cpu exception. On i386, it can
                        trigger new exceptions, but we do not handle
@@ -305,6 +317,7 @@ int cpu_exec(CPUState *env1)
 #elif defined(TARGET_M68K)
                     do_interrupt(0);
 #endif
+                    cpu_threads_unlock(locked);
                 }
                 env->exception_index = -1;
             }
@@ -343,6 +356,12 @@ int cpu_exec(CPUState *env1)
             for(;;) {
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+                    if (cpu_threads_enabled) {
+                        qemu_mutex_lock_iothread();
+                        interrupt_request = env->interrupt_request;
+                    }
+#endif
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~(CPU_INTERRUPT_HARD |
@@ -531,6 +550,10 @@ int cpu_exec(CPUState *env1)
                         env->exception_index = EXCP_INTERRUPT;
                         cpu_loop_exit();
                     }
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+                    if (cpu_threads_enabled)
+                        qemu_mutex_unlock_iothread();
+#endif
                 }
 #ifdef DEBUG_EXEC
                 if ((loglevel & CPU_LOG_TB_CPU)) {
@@ -576,6 +599,19 @@ int cpu_exec(CPUState *env1)
                     next_tb = 0;
                     tb_invalidated_flag = 0;
                 }
+                /* Count executions of ordinary TBs.  Cold TBs are not
+                   chained so that every entry comes back here; once hot
+                   the TB is replaced by a trace.  */
+                if (tb_trace_threshold && tb->cflags == 0) {
+                    if (++tb->exec_count >= tb_trace_threshold) {
+                        int locked = cpu_threads_lock();
+                        tb = tb_gen_trace(env, tb);
+                        env->tb_jmp_cache[tb_jmp_cache_hash_func(tb->pc)] = tb;
+                        tb_invalidated_flag = 0;
+                        cpu_threads_unlock(locked);
+                    }
+                    next_tb = 0;
+                }
 #ifdef DEBUG_EXEC
                 if ((loglevel & CPU_LOG_EXEC)) {
                     fprintf(logfile, "Trace 0x%08lx [" TARGET_FMT_lx "] %s\n",
@@ -592,7 +628,9 @@ int cpu_exec(CPUState *env1)
                         (env->kqemu_enabled != 2) &&
 #endif
                         tb->page_addr[1] == -1) {
+                    int locked = cpu_threads_lock();
                     tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                    cpu_threads_unlock(locked);
                 }
                 }
                 spin_unlock(&tb_lock);
@@ -602,6 +640,12 @@ int cpu_exec(CPUState *env1)
                    TB, but before it is linked into a potentially
                    infinite loop and becomes env->current_tb. Avoid
                    starting execution if there is a pending interrupt. */
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+                /* Another thread sets the flag and then reads
+                   current_tb.  */
+                if (cpu_threads_enabled)
+                    __sync_synchronize();
+#endif
                 if (unlikely (env->interrupt_request & CPU_INTERRUPT_EXIT))
                     env->current_tb = NULL;
 
@@ -655,15 +699,33 @@ int cpu_exec(CPUState *env1)
             } /* for(;;) */
         } else {
             env_to_regs();
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+            /* The exception may have been raised with the global lock
+               held.  */
+            if (cpu_threads_iothread_locked)
+                qemu_mutex_unlock_iothread();
+#endif
+#if defined(TARGET_ARM) && !defined(CONFIG_USER_ONLY)
+            /* or in the middle of a store exclusive.  */
+            cpu_arm_exclusive_release(env);
+#endif
         }
     } /* for(;;) */
 
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    if (cpu_threads_enabled) {
+        if (!cpu_threads_iothread_locked)
+            qemu_mutex_lock_iothread();
+        cpu_exec_end(env);
+    }
+#endif
+
 
 #if defined(TARGET_I386)
     /* restore flags in standard format */
     env->eflags = env->eflags | helper_cc_compute_all(CC_OP) | (DF & DF_MASK);
 #elif defined(TARGET_ARM)
-    /* XXX: Save/restore host fpu exception state?.  */
+    vfp_sync_host_flags(env);
 #elif defined(TARGET_SPARC)
 #elif defined(TARGET_PPC)
 #elif defined(TARGET_M68K)
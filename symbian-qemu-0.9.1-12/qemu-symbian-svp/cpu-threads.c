@@ -0,0 +1,316 @@
+/*
+ * One host thread per emulated CPU
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Each CPU thread runs cpu_exec() in a loop.  The main thread becomes
+   the I/O thread: it keeps running timers, bottom halves and I/O
+   handlers and no longer executes guest code.  With -io-thread, a single
+   thread runs all the CPUs in turn, as the main loop does without
+   threads.
+
+   A CPU is "running" from the moment it enters cpu_exec() until it
+   leaves it, whether or not it holds the global lock at the time.  This
+   follows the exclusive section scheme of the NPTL user mode emulation:
+   start_exclusive() kicks every running CPU out of cpu_exec() and waits
+   until none is left, and cpu_exec_start() does not let a CPU back in
+   before end_exclusive().  The flag and pending_cpus are only changed
+   with the global lock held.  */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "sysemu.h"
+#include "cpu-threads.h"
+
+#ifdef CONFIG_VCPU_THREADS
+
+#include <pthread.h>
+#include <signal.h>
+
+int cpu_threads_enabled;
+__thread int cpu_threads_iothread_locked;
+
+static int cpu_threads_started;
+static pthread_mutex_t qemu_global_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* A halted or stopped CPU may be able to run.  */
+static pthread_cond_t qemu_cpu_cond = PTHREAD_COND_INITIALIZER;
+/* A CPU thread acknowledged a stop request.  */
+static pthread_cond_t qemu_pause_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t exclusive_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t exclusive_resume = PTHREAD_COND_INITIALIZER;
+static int pending_cpus;
+/* The CPU that owns the exclusive section was running guest code.  */
+static int exclusive_cpu_running;
+static CPUState *debug_cpu;
+/* CPU executed by the single CPU thread, and kicks it has not seen.  */
+static CPUState *single_cpu;
+static int single_kicked;
+
+void qemu_mutex_lock_iothread(void)
+{
+    pthread_mutex_lock(&qemu_global_mutex);
+    cpu_threads_iothread_locked = 1;
+}
+
+void qemu_mutex_unlock_iothread(void)
+{
+    cpu_threads_iothread_locked = 0;
+    pthread_mutex_unlock(&qemu_global_mutex);
+}
+
+static void qemu_cond_wait(pthread_cond_t *cond)
+{
+    pthread_cond_wait(cond, &qemu_global_mutex);
+}
+
+/* Wait for pending exclusive operations to complete.  */
+static void exclusive_idle(void)
+{
+    while (pending_cpus)
+        qemu_cond_wait(&exclusive_resume);
+}
+
+/* Stop all other CPUs from executing guest code.  Called with the global
+   lock held, from the main thread or from a CPU thread.  A CPU that
+   starts an exclusive operation from within cpu_exec() stops counting
+   as running until end_exclusive().  */
+void start_exclusive(void)
+{
+    CPUState *self = cpu_single_env;
+    CPUState *other;
+    int running = 0;
+
+    if (self && self->running) {
+        cpu_exec_end(self);
+        running = 1;
+    }
+    exclusive_idle();
+    exclusive_cpu_running = running;
+
+    pending_cpus = 1;
+    for (other = first_cpu; other != NULL; other = other->next_cpu) {
+        if (other->running) {
+            pending_cpus++;
+            cpu_interrupt(other, CPU_INTERRUPT_EXIT);
+        }
+    }
+    while (pending_cpus > 1)
+        qemu_cond_wait(&exclusive_cond);
+}
+
+void end_exclusive(void)
+{
+    if (exclusive_cpu_running) {
+        cpu_single_env->running = 1;
+        exclusive_cpu_running = 0;
+    }
+    pending_cpus = 0;
+    pthread_cond_broadcast(&exclusive_resume);
+}
+
+/* Wait for exclusive operations to finish, and mark the CPU as running.
+   The global lock must be held.  */
+void cpu_exec_start(CPUState *env)
+{
+    exclusive_idle();
+    env->running = 1;
+}
+
+/* Mark the CPU as not running, and release pending exclusive operations.
+   The global lock must be held.  */
+void cpu_exec_end(CPUState *env)
+{
+    env->running = 0;
+    if (pending_cpus > 1) {
+        if (--pending_cpus == 1)
+            pthread_cond_signal(&exclusive_cond);
+    }
+}
+
+/* Called by cpu_interrupt, so that a halted CPU notices the request.  */
+void cpu_threads_kick(CPUState *env)
+{
+    single_kicked = 1;
+    pthread_cond_broadcast(&qemu_cpu_cond);
+}
+
+/* Called by the I/O thread after each main loop iteration, so that the
+   single CPU thread moves on to the next CPU.  */
+void cpu_threads_rotate(void)
+{
+    if (single_cpu && first_cpu->next_cpu)
+        cpu_interrupt(single_cpu, CPU_INTERRUPT_EXIT);
+}
+
+/* Stop every CPU thread outside cpu_exec().  Called with the global lock
+   held.  When called from a CPU thread, that CPU stops once it returns
+   from cpu_exec().  */
+void pause_all_vcpus(void)
+{
+    CPUState *self = cpu_single_env;
+    CPUState *env;
+    int done;
+
+    if (!cpu_threads_started)
+        return;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->stopped) {
+            env->stop = 1;
+            cpu_interrupt(env, CPU_INTERRUPT_EXIT);
+        }
+    }
+    for (;;) {
+        done = 1;
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (env != self && !env->stopped)
+                done = 0;
+        }
+        if (done)
+            break;
+        qemu_cond_wait(&qemu_pause_cond);
+    }
+}
+
+void resume_all_vcpus(void)
+{
+    CPUState *env;
+
+    if (!cpu_threads_started)
+        return;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        env->stop = 0;
+        env->stopped = 0;
+    }
+    pthread_cond_broadcast(&qemu_cpu_cond);
+}
+
+/* Return the CPU that hit a breakpoint or watchpoint, if any.  */
+CPUState *cpu_threads_debug_cpu(void)
+{
+    CPUState *env = debug_cpu;
+
+    debug_cpu = NULL;
+    return env;
+}
+
+/* Handle a stop request.  Returns nonzero if ENV must not run.  */
+static int cpu_thread_stopped(CPUState *env)
+{
+    if (env->stop) {
+        env->stop = 0;
+        env->stopped = 1;
+        pthread_cond_broadcast(&qemu_pause_cond);
+    }
+    return env->stopped || !vm_running;
+}
+
+/* Run ENV once.  Returns nonzero if the CPU is idle.  */
+static int cpu_thread_exec(CPUState *env)
+{
+    int ret;
+
+    ret = cpu_exec(env);
+    if (ret == EXCP_DEBUG) {
+        /* The main loop stops the VM and reports to gdb.  */
+        debug_cpu = env;
+        env->stopped = 1;
+        qemu_notify_event();
+        return 1;
+    }
+    return ret == EXCP_HALTED;
+}
+
+static void cpu_thread_block_signals(void)
+{
+    sigset_t set;
+
+    /* Leave the alarm and I/O signals to the main thread.  */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void *cpu_thread(void *opaque)
+{
+    CPUState *env = opaque;
+
+    cpu_thread_block_signals();
+    qemu_mutex_lock_iothread();
+    for (;;) {
+        if (cpu_thread_stopped(env) || cpu_thread_exec(env))
+            qemu_cond_wait(&qemu_cpu_cond);
+    }
+    return NULL;
+}
+
+static void *single_cpu_thread(void *opaque)
+{
+    CPUState *env;
+    int idle;
+
+    cpu_thread_block_signals();
+    qemu_mutex_lock_iothread();
+    for (;;) {
+        single_kicked = 0;
+        idle = 1;
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (cpu_thread_stopped(env))
+                continue;
+            single_cpu = env;
+            if (!cpu_thread_exec(env))
+                idle = 0;
+            single_cpu = NULL;
+        }
+        /* A CPU may have been woken up after it went idle.  */
+        if (idle && !single_kicked)
+            qemu_cond_wait(&qemu_cpu_cond);
+    }
+    return NULL;
+}
+
+/* The main thread owns the global lock from startup.  */
+void cpu_threads_init(int mode)
+{
+    cpu_threads_enabled = mode;
+    qemu_mutex_lock_iothread();
+}
+
+int cpu_threads_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    CPUState *env;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (cpu_threads_enabled == CPU_THREADS_SINGLE) {
+        if (pthread_create(&thread, &attr, single_cpu_thread, NULL) != 0) {
+            fprintf(stderr, "qemu: could not create CPU thread\n");
+            return -1;
+        }
+    } else {
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (pthread_create(&thread, &attr, cpu_thread, env) != 0) {
+                fprintf(stderr, "qemu: could not create CPU thread\n");
+                return -1;
+            }
+        }
+    }
+    pthread_attr_destroy(&attr);
+    cpu_threads_started = 1;
+    return 0;
+}
+
+#endif /* CONFIG_VCPU_THREADS */
@@ -0,0 +1,80 @@
+#ifndef CPU_THREADS_H
+#define CPU_THREADS_H
+
+/* Guest code runs outside the main thread, which becomes the I/O
+   thread: one host thread per emulated CPU (-vcpu-threads), or a single
+   thread for all of them (-io-thread).
+
+   A single global mutex serializes device emulation, the translator
+   and the TB tables.  The main thread holds it except while waiting for
+   I/O.  A CPU thread drops it while it executes translated code and
+   takes it back for MMIO, coprocessor and other helpers that touch
+   shared state, so CPUs only run in parallel inside generated code.
+   Operations that must not race with generated code, such as a TB
+   flush, stop all the other CPUs with start_exclusive().  */
+
+#define CPU_THREADS_PER_CPU     1
+#define CPU_THREADS_SINGLE      2
+
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+
+/* 0, or one of CPU_THREADS_*.  */
+extern int cpu_threads_enabled;
+extern __thread int cpu_threads_iothread_locked;
+
+void cpu_threads_init(int mode);
+int cpu_threads_start(void);
+void cpu_threads_rotate(void);
+void qemu_mutex_lock_iothread(void);
+void qemu_mutex_unlock_iothread(void);
+void cpu_threads_kick(CPUState *env);
+void pause_all_vcpus(void);
+void resume_all_vcpus(void);
+CPUState *cpu_threads_debug_cpu(void);
+
+void start_exclusive(void);
+void end_exclusive(void);
+void cpu_exec_start(CPUState *env);
+void cpu_exec_end(CPUState *env);
+
+/* Take the global lock unless this thread already holds it.  Returns
+   nonzero if the lock must be released with cpu_threads_unlock.  */
+static inline int cpu_threads_lock(void)
+{
+    if (cpu_threads_enabled && !cpu_threads_iothread_locked) {
+        qemu_mutex_lock_iothread();
+        return 1;
+    }
+    return 0;
+}
+
+static inline void cpu_threads_unlock(int locked)
+{
+    if (locked)
+        qemu_mutex_unlock_iothread();
+}
+
+#else
+
+#define cpu_threads_enabled 0
+
+static inline int cpu_threads_lock(void)
+{
+    return 0;
+}
+
+static inline void cpu_threads_unlock(int locked)
+{
+}
+
+static inline void pause_all_vcpus(void)
+{
+}
+
+static inline void resume_all_vcpus(void)
+{
+}
+
+#endif
+
+#endif
@@ -134,7 +134,8 @@ struct TranslationBlock {
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
     uint16_t cflags;    /* compile flags */
-#define CF_COUNT_MASK  0x7fff
+#define CF_COUNT_MASK  0x3fff
+#define CF_TRACE       0x4000 /* Hot trace spanning several blocks.  */
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
@@ -160,6 +161,9 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* number of times this TB was entered from the main loop while
+       counting for hot trace detection */
+    uint32_t exec_count;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -188,10 +192,14 @@ void tb_flush(CPUState *env);
 void tb_link_phys(TranslationBlock *tb,
                   target_ulong phys_pc, target_ulong phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, target_ulong page_addr);
+TranslationBlock *tb_gen_trace(CPUState *env, TranslationBlock *tb);
 
 extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 extern uint8_t *code_gen_ptr;
 extern int code_gen_max_blocks;
+/* Number of executions after which a TB is retranslated as a hot trace.
+   Zero disables trace formation.  */
+extern int tb_trace_threshold;
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -280,6 +288,8 @@ extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
 
+#include "cpu-threads.h"
+
 #if !defined(CONFIG_USER_ONLY)
 
 void tlb_fill(target_ulong addr, int is_write, int mmu_idx,
@@ -24,6 +24,7 @@
 #else
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 #include <stdlib.h>
 #include <stdio.h>
@@ -40,6 +41,9 @@
 #include "hw/hw.h"
 #include "osdep.h"
 #include "kvm.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "tb-cache.h"
+#endif
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #endif
@@ -86,6 +90,7 @@
 
 static TranslationBlock *tbs;
 int code_gen_max_blocks;
+int tb_trace_threshold;
 TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
@@ -114,6 +119,7 @@ uint8_t *code_gen_ptr;
 ram_addr_t phys_ram_size;
 int phys_ram_fd;
 uint8_t *phys_ram_dirty;
+uint8_t *phys_ram_postcopy;
 static int in_migration;
 static ram_addr_t phys_ram_alloc_offset = 0;
 #endif
@@ -121,7 +127,11 @@ static ram_addr_t phys_ram_alloc_offset = 0;
 CPUState *first_cpu;
 /* current CPU in the current thread. It is only valid inside
    cpu_exec() */
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+__thread CPUState *cpu_single_env;
+#else
 CPUState *cpu_single_env;
+#endif
 /* 0 = Do not count executed instructions.
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
@@ -192,6 +202,7 @@ static int log_append = 0;
 static int tlb_flush_count;
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_trace_count;
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
@@ -586,6 +597,10 @@ static void page_flush_tb(void)
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int keep_code = 0;
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    int locked = 0;
+#endif
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(code_gen_ptr - code_gen_buffer),
@@ -595,6 +610,19 @@ void tb_flush(CPUState *env1)
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    if (cpu_threads_enabled) {
+        locked = cpu_threads_lock();
+        /* A helper that flushes returns into the current TB.  Unless
+           the buffer is full, keep the code until the next flush so that
+           the other CPUs do not overwrite it in the meantime.  */
+        if (cpu_single_env && cpu_single_env->running &&
+            code_gen_ptr - code_gen_buffer < code_gen_buffer_max_size)
+            keep_code = 1;
+        start_exclusive();
+    }
+#endif
+
     nb_tbs = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -604,10 +632,18 @@ void tb_flush(CPUState *env1)
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
+    if (!keep_code)
+        code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    if (cpu_threads_enabled) {
+        end_exclusive();
+        cpu_threads_unlock(locked);
+    }
+#endif
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -872,6 +908,14 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+#if !defined(CONFIG_USER_ONLY)
+    if (tb_cache_enabled) {
+        if (!tb_cache_lookup(env, tb, &code_gen_size)) {
+            cpu_gen_code(env, tb, &code_gen_size);
+            tb_cache_insert(env, tb, code_gen_size);
+        }
+    } else
+#endif
     cpu_gen_code(env, tb, &code_gen_size);
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -885,6 +929,24 @@ TranslationBlock *tb_gen_code(CPUState *env,
     return tb;
 }
 
+/* Replace a hot TB by a trace starting at the same PC.  The trace may
+   follow branches into other blocks of the same page (see the target
+   translator), so the original TB is dropped rather than kept alongside
+   it.  */
+TranslationBlock *tb_gen_trace(CPUState *env, TranslationBlock *tb)
+{
+    target_ulong pc, cs_base;
+    uint64_t flags;
+
+    pc = tb->pc;
+    cs_base = tb->cs_base;
+    flags = tb->flags;
+    tb_phys_invalidate(tb, -1);
+    tb = tb_gen_code(env, pc, cs_base, flags, CF_TRACE);
+    tb_trace_count++;
+    return tb;
+}
+
 /* invalidate all TBs which intersect with the target physical page
    starting in range [start;end[. NOTE: start and end must refer to
    the same physical page. 'is_cpu_write_access' should be true if called
@@ -1153,6 +1215,7 @@ TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tbs[nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
     return tb;
 }
 
@@ -1510,10 +1573,20 @@ void cpu_interrupt(CPUState *env, int mask)
 #endif
     int old_mask;
 
-    old_mask = env->interrupt_request;
-    /* FIXME: This is probably not threadsafe.  A different thread could
-       be in the middle of a read-modify-write operation.  */
-    env->interrupt_request |= mask;
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    if (cpu_threads_enabled) {
+        /* The CPU thread may update the mask at the same time.  This
+           is also a barrier against the check of current_tb.  */
+        old_mask = __sync_fetch_and_or(&env->interrupt_request, mask);
+        cpu_threads_kick(env);
+    } else
+#endif
+    {
+        old_mask = env->interrupt_request;
+        /* FIXME: This is probably not threadsafe.  A different thread
+           could be in the middle of a read-modify-write operation.  */
+        env->interrupt_request |= mask;
+    }
 #if defined(USE_NPTL)
     /* FIXME: TB unchaining isn't SMP safe.  For now just ignore the
        problem and hope the cpu will stop of its own accord.  For userspace
@@ -1534,6 +1607,15 @@ void cpu_interrupt(CPUState *env, int mask)
         tb = env->current_tb;
         /* if the cpu is currently executing code, we must unlink it and
            all the potentially executing TB */
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+        if (tb && cpu_threads_enabled) {
+            /* The jump lists are protected by the global lock.  */
+            int locked = cpu_threads_lock();
+            env->current_tb = NULL;
+            tb_reset_jump_recursive(tb);
+            cpu_threads_unlock(locked);
+        } else
+#endif
         if (tb && !testandset(&interrupt_lock)) {
             env->current_tb = NULL;
             tb_reset_jump_recursive(tb);
@@ -1545,6 +1627,12 @@ void cpu_interrupt(CPUState *env, int mask)
 
 void cpu_reset_interrupt(CPUState *env, int mask)
 {
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    if (cpu_threads_enabled) {
+        __sync_fetch_and_and(&env->interrupt_request, ~mask);
+        return;
+    }
+#endif
     env->interrupt_request &= ~mask;
 }
 
@@ -1795,6 +1883,31 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
     }
 }
 
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+/* Return nonzero if a TLB of 'env' lets guest writes to the range skip
+   the dirty tracking.  */
+static int tlb_has_dirty_range(CPUState *env, unsigned long start,
+                               unsigned long length)
+{
+    CPUTLBEntry *tlb_entry;
+    unsigned long addr;
+    int mmu_idx, i;
+
+    for(mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for(i = 0; i < CPU_TLB_SIZE; i++) {
+            tlb_entry = &env->tlb_table[mmu_idx][i];
+            if ((tlb_entry->addr_write & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
+                continue;
+            addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) +
+                   tlb_entry->addend;
+            if ((addr - start) < length)
+                return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
 {
@@ -1802,6 +1915,9 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     unsigned long length, start1;
     int i, mask, len;
     uint8_t *p;
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    int locked = 0, exclusive = 0;
+#endif
 
     start &= TARGET_PAGE_MASK;
     end = TARGET_PAGE_ALIGN(end);
@@ -1831,7 +1947,29 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
        when accessing the range */
     /* FIXME: This is wrong if start1 spans multiple regions.  */
     start1 = (unsigned long)host_ram_addr(start);
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    /* The other CPUs fill and use their TLB without the lock.  Only stop
+       them if one of them has an entry to rewrite: an entry filled from
+       now on sees the cleared dirty bits (see tlb_set_page_exec).  The
+       lock keeps the CPUs that are not running out of cpu_exec().  */
+    if (cpu_threads_enabled) {
+        locked = cpu_threads_lock();
+        __sync_synchronize();
+        for(env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (env != cpu_single_env && env->running &&
+                tlb_has_dirty_range(env, start1, length)) {
+                exclusive = 1;
+                start_exclusive();
+                break;
+            }
+        }
+    }
+#endif
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+        if (!exclusive && env != cpu_single_env && env->running)
+            continue;
+#endif
         for(i = 0; i < CPU_TLB_SIZE; i++)
             tlb_reset_dirty_range(&env->tlb_table[0][i], start1, length);
         for(i = 0; i < CPU_TLB_SIZE; i++)
@@ -1845,6 +1983,11 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
 #endif
 #endif
     }
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    if (exclusive)
+        end_exclusive();
+    cpu_threads_unlock(locked);
+#endif
 }
 
 int cpu_physical_memory_set_dirty_tracking(int enable)
@@ -1954,6 +2097,8 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
     if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM && !(pd & IO_MEM_ROMD)) {
         /* IO memory case (romd handled later) */
         address |= TLB_MMIO;
+    } else {
+        cpu_physical_memory_fetch(pd & TARGET_PAGE_MASK);
     }
     addend = (unsigned long)host_ram_addr(pd & TARGET_PAGE_MASK);
     if ((pd & ~TARGET_PAGE_MASK) <= IO_MEM_ROM) {
@@ -2015,6 +2160,16 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
             te->addr_write = address | TLB_NOTDIRTY;
         } else {
             te->addr_write = address;
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+            /* cpu_physical_memory_reset_dirty does not stop this CPU if
+               it did not see the entry: check the dirty bits again.  */
+            if (cpu_threads_enabled &&
+                (pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+                __sync_synchronize();
+                if (!cpu_physical_memory_is_dirty(pd))
+                    te->addr_write = address | TLB_NOTDIRTY;
+            }
+#endif
         }
     } else {
         te->addr_write = -1;
@@ -2473,6 +2628,70 @@ void qemu_ram_free(ram_addr_t addr)
   /* TODO: Implement this.  */
 }
 
+/* Clear DIRTY_FLAGS for all of guest RAM, one region at a time since
+   cpu_physical_memory_reset_dirty needs contiguous host memory.  Walk
+   by offset because host_ram_addr reorders the region list.  */
+void cpu_physical_memory_reset_dirty_all(int dirty_flags)
+{
+    ram_region *r;
+    ram_addr_t addr, end;
+
+#ifdef USE_KQEMU
+    if (kqemu_allowed) {
+        cpu_physical_memory_reset_dirty(0, phys_ram_alloc_offset, dirty_flags);
+        return;
+    }
+#endif
+    for (addr = 0; addr < phys_ram_alloc_offset; addr = end) {
+        r = ram_regions;
+        while (r && (r->offset > addr || r->offset + r->size <= addr))
+            r = r->next;
+        if (!r)
+            break;
+        end = r->offset + r->size;
+        cpu_physical_memory_reset_dirty(addr, end, dirty_flags);
+    }
+}
+
+/* Replace the contents of guest RAM with the image at OFFSET in file FD.
+   Regions that are host page aligned are mapped copy-on-write, so pages
+   are only read when the guest touches them.  Others are read.  Returns
+   -1 if the image could not be used.  */
+int qemu_ram_map_file(int fd, int64_t offset)
+{
+#ifndef _WIN32
+    ram_region *r;
+    unsigned long pagesize = getpagesize();
+    struct stat st;
+    void *p;
+
+#ifdef USE_KQEMU
+    if (kqemu_allowed)
+        return -1;
+#endif
+    if (phys_ram_alloc_offset > phys_ram_size || fstat(fd, &st) < 0
+        || st.st_size < offset + phys_ram_size)
+        return -1;
+    for (r = ram_regions; r; r = r->next) {
+        if (((unsigned long)r->host | r->offset | r->size) & (pagesize - 1)) {
+            if (pread(fd, r->host, r->size, offset + r->offset) != r->size)
+                return -1;
+        } else {
+            p = mmap(r->host, r->size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, fd, offset + r->offset);
+            if (p == MAP_FAILED)
+                return -1;
+        }
+        memset(phys_ram_dirty + (r->offset >> TARGET_PAGE_BITS), 0xff,
+               r->size >> TARGET_PAGE_BITS);
+    }
+    tb_flush(first_cpu);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 static uint32_t unassigned_mem_readb(void *opaque, target_phys_addr_t addr)
 {
 #ifdef DEBUG_UNASSIGNED
@@ -3043,6 +3262,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 unsigned long addr1;
                 addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
                 /* RAM case */
+                cpu_physical_memory_fetch(addr1);
                 ptr = host_ram_addr(addr1);
                 memcpy(ptr, buf, l);
                 if (!cpu_physical_memory_is_dirty(addr1)) {
@@ -3078,6 +3298,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 }
             } else {
                 /* RAM case */
+                cpu_physical_memory_fetch(pd & TARGET_PAGE_MASK);
                 ptr = host_ram_addr((pd & TARGET_PAGE_MASK)
                                     + (addr & ~TARGET_PAGE_MASK));
                 memcpy(buf, ptr, l);
@@ -3089,6 +3310,28 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
     }
 }
 
+/* A device wrote directly to the host memory of guest RAM: invalidate the
+   code translated from it and mark it dirty, as cpu_physical_memory_write
+   does.  */
+void cpu_physical_memory_written(ram_addr_t addr, ram_addr_t len)
+{
+    ram_addr_t end = addr + len;
+
+    while (addr < end) {
+        ram_addr_t l = MIN((addr & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE,
+                           end) - addr;
+
+        if (!cpu_physical_memory_is_dirty(addr)) {
+            /* invalidate code */
+            tb_invalidate_phys_page_range(addr, addr + l, 0);
+            /* set dirty bit */
+            phys_ram_dirty[addr >> TARGET_PAGE_BITS] |=
+                (0xff & ~CODE_DIRTY_FLAG);
+        }
+        addr += l;
+    }
+}
+
 /* used for ROM loading : can write in RAM and ROM */
 void cpu_physical_memory_write_rom(target_phys_addr_t addr,
                                    const uint8_t *buf, int len)
@@ -3121,6 +3364,7 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
             /* ROM/RAM case */
             ptr = host_ram_addr(addr1);
             memcpy(ptr, buf, l);
+            phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |= SNAPSHOT_DIRTY_FLAG;
         }
         len -= l;
         buf += l;
@@ -3154,6 +3398,7 @@ uint32_t ldl_phys(target_phys_addr_t addr)
         val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
     } else {
         /* RAM case */
+        cpu_physical_memory_fetch(pd & TARGET_PAGE_MASK);
         ptr = host_ram_addr((pd & TARGET_PAGE_MASK) +
                             (addr & ~TARGET_PAGE_MASK));
         val = ldl_p(ptr);
@@ -3192,6 +3437,7 @@ uint64_t ldq_phys(target_phys_addr_t addr)
 #endif
     } else {
         /* RAM case */
+        cpu_physical_memory_fetch(pd & TARGET_PAGE_MASK);
         ptr = host_ram_addr((pd & TARGET_PAGE_MASK) +
                             (addr & ~TARGET_PAGE_MASK));
         val = ldq_p(ptr);
@@ -3239,6 +3485,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
     } else {
         unsigned long addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
+        cpu_physical_memory_fetch(addr1);
         ptr = host_ram_addr(addr1);
         stl_p(ptr, val);
 
@@ -3280,6 +3527,7 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val >> 32);
 #endif
     } else {
+        cpu_physical_memory_fetch(pd & TARGET_PAGE_MASK);
         ptr = host_ram_addr((pd & TARGET_PAGE_MASK) +
                             (addr & ~TARGET_PAGE_MASK));
         stq_p(ptr, val);
@@ -3310,6 +3558,7 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
         unsigned long addr1;
         addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
         /* RAM case */
+        cpu_physical_memory_fetch(addr1);
         ptr = host_ram_addr(addr1);
         stl_p(ptr, val);
         if (!cpu_physical_memory_is_dirty(addr1)) {
@@ -3435,6 +3684,7 @@ void dump_exec_info(FILE *f,
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int trace_tb_count, trace_code_size;
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -3442,9 +3692,15 @@ void dump_exec_info(FILE *f,
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
+    trace_tb_count = 0;
+    trace_code_size = 0;
     for(i = 0; i < nb_tbs; i++) {
         tb = &tbs[i];
         target_code_size += tb->size;
+        if (tb->cflags & CF_TRACE) {
+            trace_tb_count++;
+            trace_code_size += tb->size;
+        }
         if (tb->size > max_target_code_size)
             max_target_code_size = tb->size;
         if (tb->page_addr[1] != -1)
@@ -3476,10 +3732,25 @@ void dump_exec_info(FILE *f,
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    if (tb_trace_threshold) {
+        cpu_fprintf(f, "trace TB count      %d (%d%%) threshold=%d\n",
+                    trace_tb_count,
+                    nb_tbs ? (trace_tb_count * 100) / nb_tbs : 0,
+                    tb_trace_threshold);
+        cpu_fprintf(f, "trace avg size      %d bytes (coverage %d%%)\n",
+                    trace_tb_count ? trace_code_size / trace_tb_count : 0,
+                    target_code_size ?
+                    (int)(((int64_t)trace_code_size * 100) / target_code_size) : 0);
+    }
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    if (tb_trace_threshold)
+        cpu_fprintf(f, "trace gen count     %d\n", tb_trace_count);
+#if !defined(CONFIG_USER_ONLY)
+    tb_cache_dump_info(f, cpu_fprintf);
+#endif
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -43,6 +43,7 @@ typedef struct {
 typedef struct mpcore_priv_state {
     gic_state *gic;
     uint32_t scu_control;
+    int num_cpu;
     mpcore_timer_state timer[8];
 } mpcore_priv_state;
 
@@ -166,7 +167,7 @@ static uint32_t mpcore_priv_read(void *opaque, target_phys_addr_t offset)
         case 0x00: /* Control.  */
             return s->scu_control;
         case 0x04: /* Configuration.  */
-            return 0xf3;
+            return (((1 << s->num_cpu) - 1) << 4) | (s->num_cpu - 1);
         case 0x08: /* CPU status.  */
             return 0;
         case 0x0c: /* Invalidate all.  */
@@ -258,7 +259,8 @@ static CPUWriteMemoryFunc *mpcore_priv_writefn[] = {
 };
 
 
-static qemu_irq *mpcore_priv_init(uint32_t base, qemu_irq *pic_irq)
+static qemu_irq *mpcore_priv_init(uint32_t base, qemu_irq *pic_irq,
+                                   int num_cpu)
 {
     mpcore_priv_state *s;
     int iomemtype;
@@ -267,6 +269,7 @@ static qemu_irq *mpcore_priv_init(uint32_t base, qemu_irq *pic_irq)
     s = (mpcore_priv_state *)qemu_mallocz(sizeof(mpcore_priv_state));
     if (!s)
         return NULL;
+    s->num_cpu = num_cpu;
     s->gic = gic_init(base + 0x1000, pic_irq);
     if (!s->gic)
         return NULL;
@@ -311,14 +314,14 @@ static void mpcore_rirq_set_irq(void *opaque, int irq, int level)
     }
 }
 
-qemu_irq *mpcore_irq_init(qemu_irq *cpu_irq)
+qemu_irq *mpcore_irq_init(qemu_irq *cpu_irq, int num_cpu)
 {
     mpcore_rirq_state *s;
     int n;
 
     /* ??? IRQ routing is hardcoded to "normal" mode.  */
     s = qemu_mallocz(sizeof(mpcore_rirq_state));
-    s->cpuic = mpcore_priv_init(MPCORE_PRIV_BASE, cpu_irq);
+    s->cpuic = mpcore_priv_init(MPCORE_PRIV_BASE, cpu_irq, num_cpu);
     for (n = 0; n < 4; n++) {
         s->rvic[n] = realview_gic_init(0x10040000 + n * 0x10000,
                                        s->cpuic[10 + n]);
@@ -46,7 +46,7 @@ qemu_irq *pl190_init(uint32_t base, qemu_irq irq, qemu_irq fiq);
 qemu_irq *realview_gic_init(uint32_t base, qemu_irq parent_irq);
 
 /* mpcore.c */
-extern qemu_irq *mpcore_irq_init(qemu_irq *cpu_irq);
+extern qemu_irq *mpcore_irq_init(qemu_irq *cpu_irq, int num_cpu);
 
 /* arm-timer.c */
 void sp804_init(uint32_t base, qemu_irq irq);
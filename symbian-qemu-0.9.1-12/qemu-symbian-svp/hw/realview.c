@@ -35,15 +35,17 @@ static void realview_init(ram_addr_t ram_size, int vga_ram_size,
     NICInfo *nd;
     int n;
     int done_smc = 0;
-    qemu_irq cpu_irq[4];
+    qemu_irq cpu_irq[4] = { NULL, NULL, NULL, NULL };
     int ncpu;
+    int is_mpcore;
     int index;
+    ram_addr_t ram_offset;
 
     if (!cpu_model)
         cpu_model = "arm926";
-    /* FIXME: obey smp_cpus.  */
-    if (strcmp(cpu_model, "arm11mpcore") == 0) {
-        ncpu = 4;
+    is_mpcore = (strcmp(cpu_model, "arm11mpcore") == 0);
+    if (is_mpcore) {
+        ncpu = smp_cpus;
     } else {
         ncpu = 1;
     }
@@ -64,19 +66,21 @@ static void realview_init(ram_addr_t ram_size, int vga_ram_size,
         }
     }
 
+    /* The page after the RAM holds the secondary CPU startup code.  */
+    ram_offset = qemu_ram_alloc(ram_size + 0x1000);
     /* ??? RAM should repeat to fill physical memory space.  */
     /* SDRAM at address zero.  */
-    cpu_register_physical_memory(0, ram_size, IO_MEM_RAM);
+    cpu_register_physical_memory(0, ram_size, ram_offset | IO_MEM_RAM);
 
     arm_sysctl_init(0x10000000, 0xc1400400);
 
-    if (ncpu == 1) {
+    if (!is_mpcore) {
         /* ??? The documentation says GIC1 is nFIQ and either GIC2 or GIC3
            is nIRQ (there are inconsistencies).  However Linux 2.6.17 expects
            GIC1 to be nIRQ and ignores all the others, so do that for now.  */
         pic = realview_gic_init(0x10040000, cpu_irq[0]);
     } else {
-        pic = mpcore_irq_init(cpu_irq);
+        pic = mpcore_irq_init(cpu_irq, ncpu);
     }
 
     pl050_init(0x10006000, pic[20], 0);
@@ -193,7 +197,8 @@ static void realview_init(ram_addr_t ram_size, int vga_ram_size,
        startup code.  I guess this works on real hardware because the
        BootROM happens to be in ROM/flash or in memory that isn't clobbered
        until after Linux boots the secondary CPUs.  */
-    cpu_register_physical_memory(0x80000000, 0x1000, IO_MEM_RAM + ram_size);
+    cpu_register_physical_memory(0x80000000, 0x1000,
+                                 (ram_offset + ram_size) | IO_MEM_RAM);
 }
 
 QEMUMachine realview_machine = {
@@ -202,4 +207,5 @@ QEMUMachine realview_machine = {
     .init = realview_init,
     .ram_require = 0x1000,
     .use_scsi = 1,
+    .max_cpus = 4,
 };
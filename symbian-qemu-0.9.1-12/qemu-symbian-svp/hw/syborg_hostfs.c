@@ -27,6 +27,7 @@
 #include "hw.h"
 #include "syborg.h"
 #include "devtree.h"
+#include "replay.h"
 
 //#define DEBUG_SYBORG_HOSTFS
 
@@ -407,6 +408,15 @@ static int hostfs_get_filename(syborg_hostfs_state *s, host_char *buf,
 
 typedef int (*syborg_hostfs_op_fn)(syborg_hostfs_state *);
 
+/* Guest memory written by a command is part of its recorded result.  */
+static void hostfs_memory_write(target_phys_addr_t addr, const uint8_t *buf,
+                                int len)
+{
+    cpu_physical_memory_write(addr, buf, len);
+    if (replay_mode == REPLAY_RECORD)
+        replay_hostfs_write(addr, buf, len);
+}
+
 static int hostfs_unsupported(syborg_hostfs_state *s)
 {
     return HOST_FS_UNSUPPORTED;
@@ -736,7 +746,7 @@ static int hostfs_dir_read(syborg_hostfs_state *s)
     name_len = wcslen(d->info.name);
     if (name_len >= s->arg[2])
         return HOST_FS_TOO_BIG;
-    cpu_physical_memory_write(s->arg[1], (void *)d->info.name,
+    hostfs_memory_write(s->arg[1], (void *)d->info.name,
                               (name_len + 1) * 2);
     s->arg[3] = name_len;
 
@@ -788,7 +798,7 @@ static int hostfs_dir_read(syborg_hostfs_state *s)
     outbytes = HOSTFS_PATH_MAX - outbytes;
     if (outbytes > s->arg[2] * 2)
         return HOST_FS_TOO_BIG;
-    cpu_physical_memory_write(s->arg[1], (void *)unicode_name, outbytes);
+    hostfs_memory_write(s->arg[1], (void *)unicode_name, outbytes);
     s->arg[3] = (outbytes >> 1) - 1;
 
     snprintf(full_name, HOSTFS_PATH_MAX, "%s/%s", d->path, de->d_name);
@@ -835,7 +845,7 @@ static int hostfs_file_read(syborg_hostfs_state *s)
         }
         if (bit == 0)
             break;
-        cpu_physical_memory_write(addr, buf, bit);
+        hostfs_memory_write(addr, buf, bit);
         addr += bit;
         len -= bit;
     }
@@ -989,7 +999,12 @@ static void syborg_hostfs_write(void *opaque, target_phys_addr_t offset,
             DPRINTF("Bad command %d\n", s->command);
             s->result = HOST_FS_UNSUPPORTED;
         } else {
-            s->result = syborg_hostfs_ops[s->command](s);
+            if (replay_mode == REPLAY_PLAY)
+                replay_hostfs_done(&s->result, s->arg);
+            else
+                s->result = syborg_hostfs_ops[s->command](s);
+            if (replay_mode == REPLAY_RECORD)
+                replay_hostfs_done(&s->result, s->arg);
             DPRINTF("Result %d\n", s->result);
         }
         break;
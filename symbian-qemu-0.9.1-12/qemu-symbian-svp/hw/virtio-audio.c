@@ -23,6 +23,8 @@
  */
 
 #include "virtio-audio.h"
+#include "console.h"
+#include "qemu-char.h"
 
 //#define DEBUG_VIRTIO_AUDIO
 
@@ -42,6 +44,27 @@ do { fprintf(stderr, "virtio-audio: error: " fmt , ##args);} while (0)
 #define VIRT_CONTROL_QUEUE_SIZE 0x40
 #define VIRT_DATA_QUEUE_SIZE 0x80
 
+/* Guest buffers are copied through a ring, so that the voice callback
+   never touches the virtqueue and can run in the audio thread while the
+   main thread is busy.  The ring holds about 1/RING_FRACTION s of audio,
+   which is how far the host can play ahead of a stalled main loop.  */
+#define VIRTIO_AUDIO_RING_MAX 0x10000
+#define VIRTIO_AUDIO_RING_MIN 0x1000
+#define VIRTIO_AUDIO_RING_FRACTION 8
+
+/* Single producer, single consumer byte ring.  The main thread fills it
+   from the guest for playback and drains it to the guest for capture;
+   the voice callback does the opposite.  head is only written by the
+   producer and tail by the consumer.  */
+typedef struct {
+    uint8_t *buf;
+    uint32_t size;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} VirtIOAudioRing;
+
+#define ring_barrier() __sync_synchronize()
+
 typedef struct {
     struct VirtIOAudio *dev;
     VirtQueue *data_vq;
@@ -52,6 +75,11 @@ typedef struct {
     int data_left;
     int data_offset;
     int has_buffer;
+    VirtIOAudioRing ring;
+    int starved;
+    uint64_t bytes;
+    uint64_t underruns;
+    uint64_t overruns;
 } VirtIOAudioStream;
 
 typedef struct VirtIOAudio
@@ -60,6 +88,8 @@ typedef struct VirtIOAudio
     QEMUSoundCard card;
     VirtQueue *cmd_vq;
     VirtIOAudioStream stream[NUM_STREAMS];
+    int wakeup_fds[2];
+    volatile int wakeup_pending;
 } VirtIOAudio;
 
 static VirtIOAudio *to_virtio_audio(VirtIODevice *vdev)
@@ -86,111 +116,305 @@ static void virtio_audio_set_features(VirtIODevice *vdev, uint32_t features)
 {
 }
 
-static int virtio_audio_fill(VirtIOAudioStream *stream,
-                             int offset, int total_len)
+/* Contiguous free space for the producer.  */
+static uint8_t *ring_write_ptr(VirtIOAudioRing *r, int *len)
+{
+    uint32_t head = r->head;
+    uint32_t off = head & (r->size - 1);
+    uint32_t n = r->size - (head - r->tail);
+
+    ring_barrier();
+    if (n > r->size - off)
+        n = r->size - off;
+    *len = n;
+    return r->buf + off;
+}
+
+static void ring_produce(VirtIOAudioRing *r, int len)
+{
+    ring_barrier();
+    r->head += len;
+}
+
+/* Contiguous data for the consumer.  */
+static uint8_t *ring_read_ptr(VirtIOAudioRing *r, int *len)
+{
+    uint32_t tail = r->tail;
+    uint32_t off = tail & (r->size - 1);
+    uint32_t n = r->head - tail;
+
+    ring_barrier();
+    if (n > r->size - off)
+        n = r->size - off;
+    *len = n;
+    return r->buf + off;
+}
+
+static void ring_consume(VirtIOAudioRing *r, int len)
+{
+    ring_barrier();
+    r->tail += len;
+}
+
+static int virtio_audio_bytes_per_second(struct audsettings *fmt)
+{
+    int bytes;
+
+    switch (fmt->fmt) {
+    case AUD_FMT_U16:
+    case AUD_FMT_S16:
+        bytes = 2;
+        break;
+    case AUD_FMT_U32:
+    case AUD_FMT_S32:
+        bytes = 4;
+        break;
+    default:
+        bytes = 1;
+        break;
+    }
+    return fmt->freq * fmt->nchannels * bytes;
+}
+
+/* Give back the buffer in progress and empty the ring.  The voice must
+   be inactive or closed, so that the callback does not run.  */
+static void virtio_audio_stream_reset(VirtIOAudioStream *stream)
+{
+    uint32_t size;
+
+    if (stream->has_buffer) {
+        virtqueue_push(stream->data_vq, &stream->elem, 0);
+        virtio_notify(&stream->dev->vdev, stream->data_vq);
+        stream->has_buffer = 0;
+    }
+    stream->data_left = 0;
+    stream->data_offset = 0;
+    stream->starved = 0;
+
+    size = VIRTIO_AUDIO_RING_MIN;
+    while (size < VIRTIO_AUDIO_RING_MAX &&
+           size < virtio_audio_bytes_per_second(&stream->fmt)
+                  / VIRTIO_AUDIO_RING_FRACTION)
+        size <<= 1;
+    stream->ring.size = size;
+    stream->ring.head = 0;
+    stream->ring.tail = 0;
+}
+
+/* Copy LEN bytes between the current guest buffer and BUF.  */
+static void virtio_audio_copy(VirtIOAudioStream *stream, uint8_t *buf,
+                              int len)
 {
-    uint8_t *p;
-    int to_write;
-    int written;
-    int size;
-    int n;
     struct iovec *iov;
     int iov_len;
+    int offset;
+    int n;
+    int to_copy;
 
     if (stream->in_voice) {
         iov_len = stream->elem.in_num;
         iov = stream->elem.in_sg;
-    } else if (stream->out_voice) {
+    } else {
         iov_len = stream->elem.out_num;
         iov = stream->elem.out_sg;
-    } else
-    {
-        DPRINTF("No voice selected skipping block\n");
-        return 0;
     }
-    written = 0;
-    for (n = 0; total_len > 0 && n < iov_len; n++) {
-        p = iov[n].iov_base;
-        to_write = iov[n].iov_len;
-        if (offset) {
-            if (offset >= to_write) {
-                offset -= to_write;
-                continue;
-            }
-            p += offset;
-            to_write -= offset;
-            offset = 0;
+    offset = stream->data_offset;
+    for (n = 0; len > 0 && n < iov_len; n++) {
+        if (offset >= iov[n].iov_len) {
+            offset -= iov[n].iov_len;
+            continue;
         }
-        if (to_write > total_len)
-            to_write = total_len;
-        while (to_write) {
+        to_copy = iov[n].iov_len - offset;
+        if (to_copy > len)
+            to_copy = len;
+        if (stream->in_voice)
+            memcpy((uint8_t *)iov[n].iov_base + offset, buf, to_copy);
+        else
+            memcpy(buf, (uint8_t *)iov[n].iov_base + offset, to_copy);
+        buf += to_copy;
+        len -= to_copy;
+        offset = 0;
+    }
+}
+
+/* Move data between the virtqueue and the ring.  Main thread only.  */
+static void virtio_audio_service(VirtIOAudioStream *stream)
+{
+    VirtIOAudioRing *r = &stream->ring;
+    uint8_t *p;
+    int notify = 0;
+    int len;
+    int n;
+
+    if (!stream->in_voice && !stream->out_voice)
+        return;
+
+    for (;;) {
+        if (!stream->has_buffer) {
+            if (!virtqueue_pop(stream->data_vq, &stream->elem))
+                break;
+            stream->has_buffer = 1;
+            stream->data_offset = 0;
+            stream->data_left = 0;
             if (stream->in_voice) {
-                size = AUD_read(stream->in_voice, p, to_write);
-            } else if (stream->out_voice) {
-                size = AUD_write(stream->out_voice, p, to_write);
+                for (n = 0; n < stream->elem.in_num; n++)
+                    stream->data_left += stream->elem.in_sg[n].iov_len;
             } else {
-                size = 0;
-            }
-            DPRINTF("Copied %d/%d\n", size, to_write);
-            if (size == 0) {
-                total_len = 0;
-                break;
+                for (n = 0; n < stream->elem.out_num; n++)
+                    stream->data_left += stream->elem.out_sg[n].iov_len;
             }
-            to_write -= size;
-            total_len -= size;
-            written += size;
         }
+        if (stream->in_voice)
+            p = ring_read_ptr(r, &len);
+        else
+            p = ring_write_ptr(r, &len);
+        if (len > stream->data_left)
+            len = stream->data_left;
+        if (len == 0 && stream->data_left)
+            break;
+
+        virtio_audio_copy(stream, p, len);
+        if (stream->in_voice)
+            ring_consume(r, len);
+        else
+            ring_produce(r, len);
+        stream->data_offset += len;
+        stream->data_left -= len;
+
+        if (stream->data_left == 0) {
+            virtqueue_push(stream->data_vq, &stream->elem, stream->data_offset);
+            stream->has_buffer = 0;
+            notify = 1;
+        }
+    }
+    if (notify)
+        virtio_notify(&stream->dev->vdev, stream->data_vq);
+}
+
+static void virtio_audio_service_all(VirtIOAudio *s)
+{
+    int i;
+
+    for (i = 0; i < NUM_STREAMS; i++)
+        virtio_audio_service(&s->stream[i]);
+}
+
+#ifndef _WIN32
+static void virtio_audio_wakeup_read(void *opaque)
+{
+    VirtIOAudio *s = opaque;
+    char buf[16];
+
+    while (read(s->wakeup_fds[0], buf, sizeof(buf)) > 0)
+        ;
+    s->wakeup_pending = 0;
+    ring_barrier();
+    virtio_audio_service_all(s);
+}
+#endif
+
+/* Ask the main thread to refill or drain the ring.  Wakeups are
+   coalesced until the main thread has run.  */
+static void virtio_audio_wakeup(VirtIOAudioStream *stream)
+{
+    VirtIOAudio *s = stream->dev;
+#ifndef _WIN32
+    char byte = 0;
+
+    if (s->card.threaded) {
+        if (!s->wakeup_pending) {
+            s->wakeup_pending = 1;
+            if (write(s->wakeup_fds[1], &byte, 1) != 1)
+                s->wakeup_pending = 0;
+        }
+        return;
     }
-    return written;
+#endif
+    virtio_audio_service(stream);
 }
 
+/* Voice callback, from the audio thread if there is one.  */
 static void virtio_audio_callback(void *opaque, int avail)
 {
     VirtIOAudioStream *stream = opaque;
+    VirtIOAudioRing *r = &stream->ring;
+    uint8_t *p;
+    int len;
     int n;
 
     DPRINTF("Callback (%d)\n", avail);
-    if ((!stream->in_voice)&&(!stream->out_voice))
-    {
-        DPRINTF("Skipping callback as no voice is selected!\n");
-    }
-    while (avail) {
-        while (stream->data_left == 0) {
-            if (stream->has_buffer) {
-                virtqueue_push(stream->data_vq, &stream->elem, stream->data_offset);
-                virtio_notify(&stream->dev->vdev, stream->data_vq);
-                stream->has_buffer = 0;
+    while (avail > 0) {
+        if (stream->in_voice) {
+            p = ring_write_ptr(r, &len);
+            if (len == 0) {
+                /* The guest is not taking the captured data.  */
+                if (!stream->starved) {
+                    stream->starved = 1;
+                    stream->overruns++;
+                }
+                break;
             }
-            if (!virtqueue_pop(stream->data_vq, &stream->elem)) {
-                /* Buffer underrun.  */
-                stream->has_buffer = 0;
+            if (len > avail)
+                len = avail;
+            n = AUD_read(stream->in_voice, p, len);
+            ring_produce(r, n);
+        } else if (stream->out_voice) {
+            p = ring_read_ptr(r, &len);
+            if (len == 0) {
                 DPRINTF("Underrun\n");
+                if (!stream->starved) {
+                    stream->starved = 1;
+                    stream->underruns++;
+                }
                 break;
             }
-            stream->data_offset = 0;
-            stream->data_left = 0;
-            stream->has_buffer = 1;
-            if (stream->in_voice) {
-                for (n = 0; n < stream->elem.in_num; n++)
-                    stream->data_left += stream->elem.in_sg[n].iov_len;
-            } else if (stream->out_voice) {
-                for (n = 0; n < stream->elem.out_num; n++)
-                    stream->data_left += stream->elem.out_sg[n].iov_len;
-            }
+            if (len > avail)
+                len = avail;
+            n = AUD_write(stream->out_voice, p, len);
+            ring_consume(r, n);
+        } else {
+            DPRINTF("Skipping callback as no voice is selected!\n");
+            return;
         }
-        if (stream->data_left == 0)
-            break;
-        n = virtio_audio_fill(stream, stream->data_offset, avail);
-        stream->data_left -= n;
-        stream->data_offset += n;
+        DPRINTF("Copied %d/%d\n", n, len);
+        stream->starved = 0;
+        stream->bytes += n;
         avail -= n;
-        if (!n)
+        if (n == 0)
             break;
     }
-    if (stream->data_left == 0 && stream->has_buffer) {
-        virtqueue_push(stream->data_vq, &stream->elem, stream->data_offset);
-        virtio_notify(&stream->dev->vdev, stream->data_vq);
-        stream->has_buffer = 0;
+
+    if (stream->in_voice) {
+        if (r->head != r->tail)
+            virtio_audio_wakeup(stream);
+    } else {
+        if (r->size - (r->head - r->tail) >= r->size / 2)
+            virtio_audio_wakeup(stream);
+    }
+}
+
+static void virtio_audio_info(QEMUSoundCard *card)
+{
+    VirtIOAudio *s = container_of(card, VirtIOAudio, card);
+    VirtIOAudioStream *stream;
+    uint32_t used;
+    int rate;
+    int i;
+
+    for (i = 0; i < NUM_STREAMS; i++) {
+        stream = &s->stream[i];
+        if (!stream->in_voice && !stream->out_voice)
+            continue;
+        used = stream->ring.head - stream->ring.tail;
+        rate = virtio_audio_bytes_per_second(&stream->fmt);
+        term_printf("  stream %d %s: ring %u/%u bytes (%d ms), "
+                    "%" PRIu64 " bytes, %s %" PRIu64 "\n",
+                    i, stream->in_voice ? "in" : "out",
+                    used, stream->ring.size,
+                    rate ? (int)((uint64_t)used * 1000 / rate) : 0,
+                    stream->bytes,
+                    stream->in_voice ? "overruns" : "underruns",
+                    stream->in_voice ? stream->overruns : stream->underruns);
     }
 }
 
@@ -264,6 +488,9 @@ static void virtio_audio_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
                     break;
                 case VIRTIO_AUDIO_CMD_INIT:
                     out_bytes = 0;
+                    AUD_set_active_in(stream->in_voice, 0);
+                    AUD_set_active_out(stream->out_voice, 0);
+                    virtio_audio_stream_reset(stream);
                     if (value == 1) {
                         if (stream->out_voice) {
                             AUD_close_out(&s->card, stream->out_voice);
@@ -310,6 +537,7 @@ static void virtio_audio_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
                     {
                         DPRINTF("Cannot execute CMD_RUN as no voice is active\n");
                     }
+                    virtio_audio_service(stream);
                     break;
                 }
                 p += 3;
@@ -324,6 +552,13 @@ static void virtio_audio_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 
 static void virtio_audio_handle_data(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIOAudio *s = to_virtio_audio(vdev);
+    int i;
+
+    for (i = 0; i < NUM_STREAMS; i++) {
+        if (s->stream[i].data_vq == vq)
+            virtio_audio_service(&s->stream[i]);
+    }
 }
 
 
@@ -376,7 +611,6 @@ static int virtio_audio_load(QEMUFile *f, void *opaque, int version_id)
         stream = &s->stream[i];
 
         stream->has_buffer = 0;
-        stream->data_left = 0;
         if (stream->in_voice) {
             AUD_close_in(&s->card, stream->in_voice);
             stream->in_voice = NULL;
@@ -390,6 +624,7 @@ static int virtio_audio_load(QEMUFile *f, void *opaque, int version_id)
         stream->fmt.nchannels = qemu_get_be16(f);
         stream->fmt.fmt = qemu_get_be32(f);
         stream->fmt.freq = qemu_get_be32(f);
+        virtio_audio_stream_reset(stream);
         if (mode & 2) {
             stream->in_voice = AUD_open_in(&s->card, stream->in_voice,
                                            "virtio-audio.in",
@@ -429,9 +664,26 @@ void virtio_audio_init(VirtIOBindFn bind, void *bind_arg, AudioState *audio)
         s->stream[i].data_vq = virtio_add_queue(&s->vdev, VIRT_DATA_QUEUE_SIZE,
                                                 virtio_audio_handle_data);
         s->stream[i].dev = s;
+        s->stream[i].ring.buf = qemu_malloc(VIRTIO_AUDIO_RING_MAX);
+        virtio_audio_stream_reset(&s->stream[i]);
     }
 
+    s->card.threaded = 1;
+    s->card.info = virtio_audio_info;
     AUD_register_card(audio, "virtio-audio", &s->card);
+#ifndef _WIN32
+    if (s->card.threaded) {
+        if (pipe(s->wakeup_fds) < 0) {
+            fprintf(stderr, "virtio-audio: failed to create pipe\n");
+            s->card.threaded = 0;
+        } else {
+            fcntl(s->wakeup_fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(s->wakeup_fds[1], F_SETFL, O_NONBLOCK);
+            qemu_set_fd_handler(s->wakeup_fds[0], virtio_audio_wakeup_read,
+                                NULL, s);
+        }
+    }
+#endif
 
     register_savevm("virtio-audio", -1, 1,
                     virtio_audio_save, virtio_audio_load, s);
@@ -13,12 +13,36 @@
 
 #include "virtio-blk.h"
 #include "block_int.h"
+#include "qemu-timer.h"
+#include "console.h"
+
+/* Requests for contiguous sectors that are popped from the queue in the
+   same pass are merged into a single block layer request, up to these
+   limits.  */
+#define VIRTIO_BLK_MERGE_MAX_REQS       32
+#define VIRTIO_BLK_MERGE_MAX_SECTORS    2048
+
+/* Request latency histogram: bucket 0 counts requests that completed in
+   less than 16us, and each following bucket doubles the limit.  The last
+   one counts all the slower requests.  */
+#define VIRTIO_BLK_LAT_BUCKETS          12
+#define VIRTIO_BLK_LAT_MIN_US           16
 
 typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
     BlockDriverState *bs;
-    VirtQueue *vq;
+    int num_queues;
+    VirtQueue *vq[VIRTIO_PCI_QUEUE_MAX];
+    /* Guest requests submitted to the block layer and not completed. */
+    int in_flight;
+
+    /* Statistics (display with "info blockstats"). */
+    uint64_t requests;
+    uint64_t merged;
+    uint64_t submitted;
+    uint64_t depth_sum;
+    uint64_t latency[VIRTIO_BLK_LAT_BUCKETS];
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -29,46 +53,89 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     size_t size;
-    uint8_t *buffer;
+    int64_t start_time;
+    struct VirtIOBlockReq *next;
 } VirtIOBlockReq;
 
+/* One block layer request, covering one or more guest requests for
+   contiguous sectors in the same direction.  */
+typedef struct VirtIOBlockIO
+{
+    VirtIOBlock *dev;
+    VirtQueue *vq;
+    VirtIOBlockReq *first;
+    VirtIOBlockReq *last;
+    int nb_reqs;
+    int is_write;
+    int64_t sector;
+    size_t size;
+    uint8_t *buffer;
+} VirtIOBlockIO;
+
+static void virtio_blk_account_latency(VirtIOBlock *s, VirtIOBlockReq *req)
+{
+    int64_t us;
+    int i;
+
+    us = (qemu_get_host_clock() - req->start_time) / 1000;
+    for (i = 0; i < VIRTIO_BLK_LAT_BUCKETS - 1; i++) {
+        if (us < ((int64_t)VIRTIO_BLK_LAT_MIN_US << i))
+            break;
+    }
+    s->latency[i]++;
+}
+
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
-    VirtIOBlockReq *req = opaque;
-    VirtIOBlock *s = req->dev;
+    VirtIOBlockIO *io = opaque;
+    VirtIOBlock *s = io->dev;
+    VirtIOBlockReq *req, *next;
+    size_t buf_offset = 0;
 
-    /* Copy read data to the guest */
-    if (!ret && !(req->out->type & VIRTIO_BLK_T_OUT)) {
-        size_t offset = 0;
-        int i;
+    for (req = io->first; req != NULL; req = next) {
+        next = req->next;
 
-        for (i = 0; i < req->elem.in_num - 1; i++) {
-            size_t len;
+        /* Copy read data to the guest */
+        if (!ret && !io->is_write) {
+            size_t offset = 0;
+            int i;
 
-            /* Be pretty defensive wrt malicious guests */
-            len = MIN(req->elem.in_sg[i].iov_len,
-                      req->size - offset);
+            for (i = 0; i < req->elem.in_num - 1; i++) {
+                size_t len;
 
-            memcpy(req->elem.in_sg[i].iov_base,
-                   req->buffer + offset,
-                   len);
-            offset += len;
+                /* Be pretty defensive wrt malicious guests */
+                len = MIN(req->elem.in_sg[i].iov_len,
+                          req->size - offset);
+
+                memcpy(req->elem.in_sg[i].iov_base,
+                       io->buffer + buf_offset + offset,
+                       len);
+                offset += len;
+            }
         }
+        buf_offset += req->size;
+
+        req->in->status = ret ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+        virtqueue_push(req->vq, &req->elem, req->size + sizeof(*req->in));
+        virtio_blk_account_latency(s, req);
+        qemu_free(req);
     }
+    s->in_flight -= io->nb_reqs;
 
-    req->in->status = ret ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
-    virtqueue_push(s->vq, &req->elem, req->size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
+    /* All the requests of a merged I/O come from the same queue, so the
+       guest only needs to be notified once.  */
+    virtio_notify(&s->vdev, io->vq);
 
-    qemu_free(req->buffer);
-    qemu_free(req);
+    qemu_free(io->buffer);
+    qemu_free(io);
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req;
 
@@ -77,7 +144,8 @@ static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
         return NULL;
 
     req->dev = s;
-    if (!virtqueue_pop(s->vq, &req->elem)) {
+    req->vq = vq;
+    if (!virtqueue_pop(vq, &req->elem)) {
         qemu_free(req);
         return NULL;
     }
@@ -85,12 +153,135 @@ static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
     return req;
 }
 
+static VirtIOBlockIO *virtio_blk_new_io(VirtIOBlock *s, VirtIOBlockReq *req,
+                                        int is_write)
+{
+    VirtIOBlockIO *io;
+
+    io = qemu_mallocz(sizeof(*io));
+    if (io == NULL)
+        return NULL;
+    io->dev = s;
+    io->vq = req->vq;
+    io->first = io->last = req;
+    io->nb_reqs = 1;
+    io->is_write = is_write;
+    io->sector = req->out->sector;
+    io->size = req->size;
+    return io;
+}
+
+static void virtio_blk_fail_request(VirtIOBlock *s, VirtIOBlockReq *req)
+{
+    req->in->status = VIRTIO_BLK_S_IOERR;
+    virtqueue_push(req->vq, &req->elem, sizeof(*req->in));
+    virtio_notify(&s->vdev, req->vq);
+    qemu_free(req);
+}
+
+static void virtio_blk_submit(VirtIOBlock *s, VirtIOBlockIO *io)
+{
+    BlockDriverAIOCB *acb;
+    VirtIOBlockReq *req;
+
+    io->buffer = qemu_memalign(512, io->size);
+    if (io->buffer == NULL && io->nb_reqs > 1) {
+        VirtIOBlockReq *next;
+
+        /* No memory for the merged bounce buffer: submit the requests
+           one by one, with smaller buffers.  */
+        s->merged -= io->nb_reqs - 1;
+        for (req = io->first; req != NULL; req = next) {
+            VirtIOBlockIO *single;
+
+            next = req->next;
+            req->next = NULL;
+            single = virtio_blk_new_io(s, req, io->is_write);
+            if (single)
+                virtio_blk_submit(s, single);
+            else
+                virtio_blk_fail_request(s, req);
+        }
+        qemu_free(io);
+        return;
+    }
+
+    s->in_flight += io->nb_reqs;
+    s->submitted++;
+    s->depth_sum += s->in_flight;
+
+    if (io->buffer == NULL) {
+        virtio_blk_rw_complete(io, -ENOMEM);
+        return;
+    }
+
+    if (io->is_write) {
+        size_t buf_offset = 0;
+
+        /* We copy the data from the SG lists to avoid splitting up the
+           request.  This helps performance a lot until we can pass full
+           sg lists as AIO operations */
+        for (req = io->first; req != NULL; req = req->next) {
+            size_t offset = 0;
+            int i;
+
+            for (i = 1; i < req->elem.out_num; i++) {
+                size_t len;
+
+                len = MIN(req->elem.out_sg[i].iov_len,
+                          req->size - offset);
+                memcpy(io->buffer + buf_offset + offset,
+                       req->elem.out_sg[i].iov_base,
+                       len);
+                offset += len;
+            }
+            buf_offset += req->size;
+        }
+
+        acb = bdrv_aio_write(s->bs, io->sector, io->buffer, io->size / 512,
+                             virtio_blk_rw_complete, io);
+    } else {
+        acb = bdrv_aio_read(s->bs, io->sector, io->buffer, io->size / 512,
+                            virtio_blk_rw_complete, io);
+    }
+    if (acb == NULL)
+        virtio_blk_rw_complete(io, -EIO);
+}
+
+/* Add a request to the pending I/O if it continues it, otherwise submit
+   the pending I/O and start a new one.  Returns the pending I/O.  */
+static VirtIOBlockIO *virtio_blk_merge(VirtIOBlock *s, VirtIOBlockIO *io,
+                                       VirtIOBlockReq *req, int is_write)
+{
+    if (io && io->is_write == is_write &&
+        io->nb_reqs < VIRTIO_BLK_MERGE_MAX_REQS &&
+        (io->size % 512) == 0 &&
+        io->sector + io->size / 512 == req->out->sector &&
+        (io->size + req->size) / 512 <= VIRTIO_BLK_MERGE_MAX_SECTORS) {
+        io->last->next = req;
+        io->last = req;
+        io->nb_reqs++;
+        io->size += req->size;
+        s->merged++;
+        return io;
+    }
+
+    if (io)
+        virtio_blk_submit(s, io);
+
+    io = virtio_blk_new_io(s, req, is_write);
+    if (io == NULL)
+        virtio_blk_fail_request(s, req);
+    return io;
+}
+
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
     VirtIOBlockReq *req;
+    VirtIOBlockIO *io = NULL;
 
-    while ((req = virtio_blk_get_request(s))) {
+    while ((req = virtio_blk_get_request(s, vq))) {
         int i;
 
         if (req->elem.out_num < 1 || req->elem.in_num < 1) {
@@ -106,6 +297,8 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 
         req->out = (void *)req->elem.out_sg[0].iov_base;
         req->in = (void *)req->elem.in_sg[req->elem.in_num - 1].iov_base;
+        req->start_time = qemu_get_host_clock();
+        s->requests++;
 
         if (req->out->type & VIRTIO_BLK_T_SCSI_CMD) {
             unsigned int len = sizeof(*req->in);
@@ -115,53 +308,19 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             virtio_notify(vdev, vq);
             qemu_free(req);
         } else if (req->out->type & VIRTIO_BLK_T_OUT) {
-            size_t offset;
-
             for (i = 1; i < req->elem.out_num; i++)
                 req->size += req->elem.out_sg[i].iov_len;
 
-            req->buffer = qemu_memalign(512, req->size);
-            if (req->buffer == NULL) {
-                qemu_free(req);
-                break;
-            }
-
-            /* We copy the data from the SG list to avoid splitting up the request.  This helps
-               performance a lot until we can pass full sg lists as AIO operations */
-            offset = 0;
-            for (i = 1; i < req->elem.out_num; i++) {
-                size_t len;
-
-                len = MIN(req->elem.out_sg[i].iov_len,
-                          req->size - offset);
-                memcpy(req->buffer + offset,
-                       req->elem.out_sg[i].iov_base,
-                       len);
-                offset += len;
-            }
-
-            bdrv_aio_write(s->bs, req->out->sector,
-                           req->buffer,
-                           req->size / 512,
-                           virtio_blk_rw_complete,
-                           req);
+            io = virtio_blk_merge(s, io, req, 1);
         } else {
             for (i = 0; i < req->elem.in_num - 1; i++)
                 req->size += req->elem.in_sg[i].iov_len;
 
-            req->buffer = qemu_memalign(512, req->size);
-            if (req->buffer == NULL) {
-                qemu_free(req);
-                break;
-            }
-
-            bdrv_aio_read(s->bs, req->out->sector,
-                          req->buffer,
-                          req->size / 512,
-                          virtio_blk_rw_complete,
-                          req);
+            io = virtio_blk_merge(s, io, req, 0);
         }
     }
+    if (io)
+        virtio_blk_submit(s, io);
     /*
      * FIXME: Want to check for completions before returning to guest mode,
      * so cached reads and writes are reported as quickly as possible. But
@@ -169,6 +328,24 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
      */
 }
 
+static void virtio_blk_info_stats(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+    uint64_t depth;
+    int i;
+
+    depth = s->submitted ? s->depth_sum * 10 / s->submitted : 0;
+    term_printf(" requests=%" PRIu64 " merged=%" PRIu64
+                " avg_queue_depth=%" PRIu64 ".%" PRIu64 " latency_us=",
+                s->requests, s->merged, depth / 10, depth % 10);
+    for (i = 0; i < VIRTIO_BLK_LAT_BUCKETS - 1; i++)
+        term_printf("<%d:%" PRIu64 ",",
+                    VIRTIO_BLK_LAT_MIN_US << i, s->latency[i]);
+    term_printf(">=%d:%" PRIu64,
+                VIRTIO_BLK_LAT_MIN_US << (VIRTIO_BLK_LAT_BUCKETS - 2),
+                s->latency[VIRTIO_BLK_LAT_BUCKETS - 1]);
+}
+
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
     /*
@@ -185,6 +362,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     uint64_t capacity;
     int cylinders, heads, secs;
 
+    memset(&blkcfg, 0, sizeof(blkcfg));
     bdrv_get_geometry(s->bs, &capacity);
     bdrv_get_geometry_hint(s->bs, &cylinders, &heads, &secs);
     stq_raw(&blkcfg.capacity, capacity);
@@ -192,12 +370,19 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     stw_raw(&blkcfg.cylinders, cylinders);
     blkcfg.heads = heads;
     blkcfg.sectors = secs;
+    stw_raw(&blkcfg.num_queues, s->num_queues);
     memcpy(config, &blkcfg, sizeof(blkcfg));
 }
 
 static uint32_t virtio_blk_get_features(VirtIODevice *vdev)
 {
-    return (1 << VIRTIO_BLK_F_SEG_MAX | 1 << VIRTIO_BLK_F_GEOMETRY);
+    VirtIOBlock *s = to_virtio_blk(vdev);
+    uint32_t features;
+
+    features = (1 << VIRTIO_BLK_F_SEG_MAX | 1 << VIRTIO_BLK_F_GEOMETRY);
+    if (s->num_queues > 1)
+        features |= 1 << VIRTIO_BLK_F_MQ;
+    return features;
 }
 
 static void virtio_blk_save(QEMUFile *f, void *opaque)
@@ -222,6 +407,7 @@ void virtio_blk_init(VirtIOBindFn bind, void *bind_arg, BlockDriverState *bs)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
+    int i;
     static int virtio_blk_id;
 
     s = (VirtIOBlock *)bind(bind_arg, "virtio-blk", 0, VIRTIO_ID_BLOCK,
@@ -237,7 +423,15 @@ void virtio_blk_init(VirtIOBindFn bind, void *bind_arg, BlockDriverState *bs)
     bdrv_guess_geometry(s->bs, &cylinders, &heads, &secs);
     bdrv_set_geometry_hint(s->bs, cylinders, heads, secs);
 
-    s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    s->num_queues = bdrv_get_queues_hint(bs);
+    if (s->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        fprintf(stderr, "virtio-blk: only %d queues supported\n",
+                VIRTIO_PCI_QUEUE_MAX);
+        s->num_queues = VIRTIO_PCI_QUEUE_MAX;
+    }
+    for (i = 0; i < s->num_queues; i++)
+        s->vq[i] = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    bdrv_set_stats_cb(bs, virtio_blk_info_stats, s);
 
     register_savevm("virtio-blk", virtio_blk_id++, 1,
                     virtio_blk_save, virtio_blk_load, s);
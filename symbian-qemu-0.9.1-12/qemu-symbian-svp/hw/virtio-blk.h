@@ -27,6 +27,7 @@
 #define VIRTIO_BLK_F_SIZE_MAX   1       /* Indicates maximum segment size */
 #define VIRTIO_BLK_F_SEG_MAX    2       /* Indicates maximum # of segments */
 #define VIRTIO_BLK_F_GEOMETRY   4       /* Indicates support of legacy geometry */
+#define VIRTIO_BLK_F_MQ         12      /* Support more than one vq */
 
 struct virtio_blk_config
 {
@@ -36,6 +37,16 @@ struct virtio_blk_config
     uint16_t cylinders;
     uint8_t heads;
     uint8_t sectors;
+    /* The fields below are only valid with the matching feature bits;
+       they are here to give num_queues its place in the layout.  */
+    uint32_t blk_size;
+    uint8_t physical_block_exp;
+    uint8_t alignment_offset;
+    uint16_t min_io_size;
+    uint32_t opt_io_size;
+    uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;
 } __attribute__((packed));
 
 /* These two define direction. */
@@ -14,8 +14,33 @@
 #include "virtio.h"
 #include "net.h"
 #include "qemu-timer.h"
+#include "console.h"
 #include "virtio-net.h"
 
+/* Maximum number of packets sent per TX queue flush, so that a guest
+   that keeps the queue full cannot starve the main loop.  */
+#define VIRTIO_NET_TX_BURST     256
+
+/* Maximum number of merged RX buffers a packet received in place can
+   use.  */
+#define VIRTIO_NET_RX_MAX_ELEMS 8
+
+/* Room for the Ethernet, 802.1Q, IP and TCP headers of a TSO frame. */
+#define VIRTIO_NET_MAX_HDRS     (14 + 4 + 60 + 60)
+
+/* Largest frame handed over for offload: 64K of IP payload behind an
+   IPv6 header and a tagged Ethernet header.  */
+#define VIRTIO_NET_MAX_FRAME    (14 + 4 + 40 + 65535)
+
+#define ETH_P_IP                0x0800
+#define ETH_P_IPV6              0x86dd
+#define ETH_P_8021Q             0x8100
+#define IP_PROTO_TCP            6
+
+#define TCP_FLAG_FIN            0x01
+#define TCP_FLAG_PSH            0x08
+#define TCP_FLAG_CWR            0x80
+
 typedef struct VirtIONet
 {
     VirtIODevice vdev;
@@ -26,6 +51,25 @@ typedef struct VirtIONet
     QEMUTimer *tx_timer;
     int tx_timer_active;
     int mergeable_rx_bufs;
+    /* Linear copy of a TX packet that needs checksum or TSO offload. */
+    uint8_t tx_buf[VIRTIO_NET_MAX_FRAME];
+    /* RX buffers handed out by virtio_net_rx_buf, and the number of
+       packets completed in place and not flushed to the guest yet.  */
+    VirtQueueElement rx_elem[VIRTIO_NET_RX_MAX_ELEMS];
+    int rx_num;
+    int rx_pending;
+
+    /* Statistics (display with "info network"). */
+    uint64_t tx_kicks;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_segments;
+    uint64_t tx_tso_errors;
+    uint64_t tx_oversize;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_buffers;
+    uint64_t rx_in_place;
 } VirtIONet;
 
 /* TODO
@@ -50,6 +94,14 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev)
 {
     uint32_t features = (1 << VIRTIO_NET_F_MAC);
 
+    /* Checksums and TCP segmentation are done in software by
+       virtio_net_send_offload, so they work with any VLAN client.  */
+    features |= (1 << VIRTIO_NET_F_MRG_RXBUF);
+    features |= (1 << VIRTIO_NET_F_CSUM);
+    features |= (1 << VIRTIO_NET_F_HOST_TSO4);
+    features |= (1 << VIRTIO_NET_F_HOST_TSO6);
+    features |= (1 << VIRTIO_NET_F_HOST_ECN);
+
     return features;
 }
 
@@ -123,12 +175,27 @@ static int receive_header(VirtIONet *n, struct iovec *iov, int iovcnt,
     return offset;
 }
 
+static void virtio_net_rx_flush(void *opaque)
+{
+    VirtIONet *n = opaque;
+
+    if (!n->rx_pending)
+        return;
+
+    virtqueue_flush(n->rx_vq, n->rx_pending);
+    n->rx_pending = 0;
+    virtio_notify(&n->vdev, n->rx_vq);
+}
+
 static void virtio_net_receive(void *opaque, const uint8_t *buf, int size)
 {
     VirtIONet *n = opaque;
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t hdr_len, offset, i;
 
+    /* Packets received in place come first.  */
+    virtio_net_rx_flush(n);
+
     if (!do_virtio_net_can_receive(n, size))
         return;
 
@@ -190,21 +257,281 @@ static void virtio_net_receive(void *opaque, const uint8_t *buf, int size)
 
     virtqueue_flush(n->rx_vq, i);
     virtio_notify(&n->vdev, n->rx_vq);
+
+    n->rx_packets++;
+    n->rx_bytes += size;
+    n->rx_buffers += i;
+}
+
+/* Receive in place: pop the RX buffers for a packet of up to size
+   bytes and return their data part, after the header, in iov.  */
+static int virtio_net_rx_buf(void *opaque, struct iovec *iov, int iovcnt,
+                             int size)
+{
+    VirtIONet *n = opaque;
+    size_t hdr_len;
+    int total = 0, cnt = 0;
+
+    hdr_len = n->mergeable_rx_bufs ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
+
+    if (!do_virtio_net_can_receive(n, size + hdr_len))
+        return 0;
+
+    n->rx_num = 0;
+    while (total < size) {
+        VirtQueueElement *elem = &n->rx_elem[n->rx_num];
+        size_t skip;
+        int i;
+
+        if ((n->rx_num != 0 && !n->mergeable_rx_bufs) ||
+            n->rx_num == VIRTIO_NET_RX_MAX_ELEMS ||
+            !virtqueue_pop(n->rx_vq, elem))
+            goto fail;
+        n->rx_num++;
+
+        if (elem->in_num < 1 || elem->in_sg[0].iov_len < hdr_len ||
+            (!n->mergeable_rx_bufs && elem->in_sg[0].iov_len != hdr_len))
+            goto fail;
+
+        skip = n->rx_num == 1 ? hdr_len : 0;
+        for (i = 0; i < elem->in_num; i++) {
+            size_t len = elem->in_sg[i].iov_len - skip;
+
+            if (len > 0) {
+                if (cnt == iovcnt)
+                    goto fail;
+                iov[cnt].iov_base = (uint8_t *)elem->in_sg[i].iov_base + skip;
+                iov[cnt].iov_len = len;
+                cnt++;
+                total += len;
+            }
+            skip = 0;
+        }
+    }
+    return cnt;
+
+fail:
+    /* Let the packet go through virtio_net_receive, which copes with any
+       buffer layout.  */
+    while (n->rx_num > 0)
+        virtqueue_discard(n->rx_vq, &n->rx_elem[--n->rx_num]);
+    return -1;
+}
+
+static void virtio_net_rx_done(void *opaque, int len)
+{
+    VirtIONet *n = opaque;
+    struct virtio_net_hdr *hdr;
+    size_t hdr_len;
+    int i, used, offset;
+
+    hdr_len = n->mergeable_rx_bufs ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
+
+    /* Count the buffers the packet was written to, give back the others. */
+    used = 0;
+    for (offset = -(int)hdr_len; offset < len && used < n->rx_num; used++) {
+        VirtQueueElement *elem = &n->rx_elem[used];
+
+        for (i = 0; i < elem->in_num; i++)
+            offset += elem->in_sg[i].iov_len;
+    }
+    if (len <= 0)
+        used = 0;
+    while (n->rx_num > used)
+        virtqueue_discard(n->rx_vq, &n->rx_elem[--n->rx_num]);
+    if (!used)
+        return;
+
+    hdr = n->rx_elem[0].in_sg[0].iov_base;
+    memset(hdr, 0, hdr_len);
+    hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    if (n->mergeable_rx_bufs)
+        ((struct virtio_net_hdr_mrg_rxbuf *)hdr)->num_buffers = used;
+
+    offset = -(int)hdr_len;
+    for (i = 0; i < used; i++) {
+        VirtQueueElement *elem = &n->rx_elem[i];
+        int j, elem_len = 0;
+
+        for (j = 0; j < elem->in_num; j++)
+            elem_len += elem->in_sg[j].iov_len;
+        elem_len = MIN(elem_len, len - offset);
+        virtqueue_fill(n->rx_vq, elem, elem_len, n->rx_pending + i);
+        offset += elem_len;
+    }
+    n->rx_pending += used;
+    n->rx_num = 0;
+
+    n->rx_packets++;
+    n->rx_bytes += len;
+    n->rx_buffers += used;
+    n->rx_in_place++;
 }
 
 /* TX */
-static void virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+
+/* Sum of the IPv4 or IPv6 pseudo header of a TCP segment.  */
+static uint32_t tcp_pseudo_sum(const uint8_t *ip, int is_ipv6, int tcp_len)
+{
+    uint32_t sum;
+
+    if (is_ipv6)
+        sum = net_checksum_add(32, (uint8_t *)ip + 8);
+    else
+        sum = net_checksum_add(8, (uint8_t *)ip + 12);
+    return sum + IP_PROTO_TCP + tcp_len;
+}
+
+/* Send a frame larger than the MTU as TCP segments of gso_size bytes of
+   payload.  The headers are rebuilt for each segment, the payload is
+   sent from the frame without copying.  Returns the number of bytes of
+   the frame that were sent.  */
+static int virtio_net_send_tso(VirtIONet *n, struct virtio_net_hdr *hdr,
+                               uint8_t *buf, int size)
+{
+    uint8_t seg_hdr[VIRTIO_NET_MAX_HDRS];
+    struct iovec iov[2];
+    int ip_off, tcp_off, hdrs_len, is_ipv6, mss, offset, id;
+    uint32_t seq;
+
+    ip_off = 14;
+    if (size >= 18 && (buf[12] << 8 | buf[13]) == ETH_P_8021Q)
+        ip_off = 18;
+    if (size < ip_off + 40)
+        return -1;
+
+    is_ipv6 = (buf[ip_off - 2] << 8 | buf[ip_off - 1]) == ETH_P_IPV6;
+    if (is_ipv6) {
+        if (buf[ip_off + 6] != IP_PROTO_TCP)
+            return -1;
+        tcp_off = ip_off + 40;
+    } else {
+        if (buf[ip_off + 9] != IP_PROTO_TCP)
+            return -1;
+        tcp_off = ip_off + (buf[ip_off] & 0x0f) * 4;
+    }
+    if (size < tcp_off + 20)
+        return -1;
+    hdrs_len = tcp_off + (buf[tcp_off + 12] >> 4) * 4;
+    mss = hdr->gso_size;
+    if (hdrs_len > VIRTIO_NET_MAX_HDRS || hdrs_len > size || mss == 0)
+        return -1;
+
+    id = buf[ip_off + 4] << 8 | buf[ip_off + 5];
+    seq = be32_to_cpupu((uint32_t *)(buf + tcp_off + 4));
+
+    for (offset = hdrs_len; offset < size; offset += mss) {
+        int len = MIN(mss, size - offset);
+        int seg_len = hdrs_len + len;
+        uint8_t *ip = seg_hdr + ip_off;
+        uint8_t *tcp = seg_hdr + tcp_off;
+        uint32_t sum;
+        uint16_t csum;
+
+        memcpy(seg_hdr, buf, hdrs_len);
+        if (is_ipv6) {
+            cpu_to_be16wu((uint16_t *)(ip + 4), seg_len - ip_off - 40);
+        } else {
+            cpu_to_be16wu((uint16_t *)(ip + 2), seg_len - ip_off);
+            cpu_to_be16wu((uint16_t *)(ip + 4), id++);
+            ip[10] = ip[11] = 0;
+            csum = net_checksum_finish(net_checksum_add(tcp_off - ip_off, ip));
+            cpu_to_be16wu((uint16_t *)(ip + 10), csum);
+        }
+
+        cpu_to_be32wu((uint32_t *)(tcp + 4), seq + (offset - hdrs_len));
+        if (offset + len < size)
+            tcp[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        if (offset != hdrs_len)
+            tcp[13] &= ~TCP_FLAG_CWR;
+
+        /* The TCP header has an even length, so the payload can be
+           summed separately.  */
+        tcp[16] = tcp[17] = 0;
+        sum = tcp_pseudo_sum(ip, is_ipv6, seg_len - tcp_off);
+        sum += net_checksum_add(hdrs_len - tcp_off, tcp);
+        sum += net_checksum_add(len, buf + offset);
+        cpu_to_be16wu((uint16_t *)(tcp + 16), net_checksum_finish(sum));
+
+        iov[0].iov_base = seg_hdr;
+        iov[0].iov_len = hdrs_len;
+        iov[1].iov_base = buf + offset;
+        iov[1].iov_len = len;
+        qemu_sendv_packet(n->vc, iov, 2);
+        n->tx_segments++;
+    }
+
+    return size;
+}
+
+/* Do the offloads that the guest asked for in the header of a packet,
+   then send it.  */
+static int virtio_net_send_offload(VirtIONet *n, struct virtio_net_hdr *hdr,
+                                   const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    int size;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    /* Never send a truncated frame.  */
+    if (total > sizeof(n->tx_buf)) {
+        n->tx_oversize++;
+        return total;
+    }
+
+    size = 0;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(n->tx_buf + size, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+
+    if ((hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV4 ||
+        (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV6) {
+        /* A frame that cannot be segmented is dropped.  */
+        if (virtio_net_send_tso(n, hdr, n->tx_buf, size) != size)
+            n->tx_tso_errors++;
+        return size;
+    }
+
+    if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        /* The guest stored the sum of the pseudo header in the checksum
+           field, so summing from csum_start gives the final checksum. */
+        int start = hdr->csum_start;
+        int offset = start + hdr->csum_offset;
+
+        if (offset + 2 <= size) {
+            uint16_t csum;
+
+            csum = net_checksum_finish(net_checksum_add(size - start,
+                                                        n->tx_buf + start));
+            cpu_to_be16wu((uint16_t *)(n->tx_buf + offset), csum);
+        }
+    }
+
+    qemu_send_packet(n->vc, n->tx_buf, size);
+    return size;
+}
+
+/* Send the packets in the TX queue, up to VIRTIO_NET_TX_BURST of them.
+   The guest is notified once for the whole batch.  Returns the number of
+   packets sent.  */
+static int virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 {
     VirtQueueElement elem;
-    int has_vnet_hdr = 0;
+    int num_packets = 0;
 
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
-        return;
+        return 0;
 
-    while (virtqueue_pop(vq, &elem)) {
+    while (num_packets < VIRTIO_NET_TX_BURST && virtqueue_pop(vq, &elem)) {
         ssize_t len = 0;
         unsigned int out_num = elem.out_num;
         struct iovec *out_sg = &elem.out_sg[0];
+        struct virtio_net_hdr *hdr;
         unsigned hdr_len;
 
         /* hdr_len refers to the header received from the guest */
@@ -217,23 +544,27 @@ static void virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             exit(1);
         }
 
-        /* ignore the header if GSO is not supported */
-        if (!has_vnet_hdr) {
-            out_num--;
-            out_sg++;
-            len += hdr_len;
-        } else if (n->mergeable_rx_bufs) {
-            /* tapfd expects a struct virtio_net_hdr */
-            hdr_len -= sizeof(struct virtio_net_hdr);
-            out_sg->iov_len -= hdr_len;
-            len += hdr_len;
-        }
+        hdr = out_sg->iov_base;
+        out_num--;
+        out_sg++;
+
+        if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) ||
+            hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE)
+            len = virtio_net_send_offload(n, hdr, out_sg, out_num);
+        else
+            len = qemu_sendv_packet(n->vc, out_sg, out_num);
 
-        len += qemu_sendv_packet(n->vc, out_sg, out_num);
+        n->tx_bytes += len;
+        virtqueue_push(vq, &elem, len + hdr_len);
+        num_packets++;
+    }
 
-        virtqueue_push(vq, &elem, len);
+    if (num_packets) {
+        n->tx_kicks++;
+        n->tx_packets += num_packets;
         virtio_notify(&n->vdev, vq);
     }
+    return num_packets;
 }
 
 static void virtio_net_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
@@ -244,7 +575,12 @@ static void virtio_net_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
         virtio_queue_set_notification(vq, 1);
         qemu_del_timer(n->tx_timer);
         n->tx_timer_active = 0;
-        virtio_net_flush_tx(n, vq);
+        if (virtio_net_flush_tx(n, vq) == VIRTIO_NET_TX_BURST) {
+            /* Come back for the rest of the queue soon.  */
+            qemu_mod_timer(n->tx_timer, qemu_get_clock(vm_clock));
+            n->tx_timer_active = 1;
+            virtio_queue_set_notification(vq, 0);
+        }
     } else {
         qemu_mod_timer(n->tx_timer,
                        qemu_get_clock(vm_clock) + TX_TIMER_INTERVAL);
@@ -264,7 +600,28 @@ static void virtio_net_tx_timer(void *opaque)
         return;
 
     virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    if (virtio_net_flush_tx(n, n->tx_vq) == VIRTIO_NET_TX_BURST) {
+        qemu_mod_timer(n->tx_timer, qemu_get_clock(vm_clock));
+        n->tx_timer_active = 1;
+        virtio_queue_set_notification(n->tx_vq, 0);
+    }
+}
+
+static void virtio_net_info_stats(void *opaque)
+{
+    VirtIONet *n = opaque;
+    uint64_t kicks = n->tx_kicks ? n->tx_kicks : 1;
+
+    term_printf("    tx: kicks=%" PRIu64 " packets=%" PRIu64
+                " bytes=%" PRIu64 " tso_segments=%" PRIu64
+                " tso_errors=%" PRIu64 " oversize=%" PRIu64
+                " packets/kick=%" PRIu64 " bytes/kick=%" PRIu64 "\n",
+                n->tx_kicks, n->tx_packets, n->tx_bytes, n->tx_segments,
+                n->tx_tso_errors, n->tx_oversize,
+                n->tx_packets / kicks, n->tx_bytes / kicks);
+    term_printf("    rx: packets=%" PRIu64 " bytes=%" PRIu64
+                " buffers=%" PRIu64 " in_place=%" PRIu64 "\n",
+                n->rx_packets, n->rx_bytes, n->rx_buffers, n->rx_in_place);
 }
 
 static void virtio_net_save(QEMUFile *f, void *opaque)
@@ -285,6 +642,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         return -EINVAL;
 
     virtio_load(&n->vdev, f);
+    virtio_net_set_features(&n->vdev, n->vdev.features);
 
     qemu_get_buffer(f, n->mac, 6);
     n->tx_timer_active = qemu_get_be32(f);
@@ -315,6 +673,15 @@ void virtio_net_init(VirtIOBindFn bind, void *bind_arg, NICInfo *nd)
     memcpy(n->mac, nd->macaddr, 6);
     n->vc = qemu_new_vlan_client(nd->vlan, virtio_net_receive,
                                  virtio_net_can_receive, n);
+    n->vc->info_stats = virtio_net_info_stats;
+    n->vc->rx_buf = virtio_net_rx_buf;
+    n->vc->rx_done = virtio_net_rx_done;
+    n->vc->rx_flush = virtio_net_rx_flush;
+    virtio_queue_set_map_in(n->rx_vq, 1);
+    snprintf(n->vc->info_str, sizeof(n->vc->info_str),
+             "virtio-net macaddr=%02x:%02x:%02x:%02x:%02x:%02x",
+             n->mac[0], n->mac[1], n->mac[2],
+             n->mac[3], n->mac[4], n->mac[5]);
 
     n->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, n);
     n->tx_timer_active = 0;
@@ -16,8 +16,6 @@
 #include "virtio.h"
 #include "sysemu.h"
 
-//#define VIRTIO_ZERO_COPY
-
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize for historical reasons. */
 #define VIRTIO_VRING_ALIGN         4096
@@ -70,48 +68,50 @@ struct VirtQueue
     target_phys_addr_t pa;
     uint16_t last_avail_idx;
     int inuse;
+    int map_in;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
 };
 
 #define VIRTIO_PCI_QUEUE_MAX        16
 
 /* virt queue functions */
-#ifdef VIRTIO_ZERO_COPY
+
+/* Return a host pointer to a guest buffer, or NULL if it is not in
+   contiguous RAM.  */
 static void *virtio_map_gpa(target_phys_addr_t addr, size_t size)
 {
     ram_addr_t off;
     target_phys_addr_t addr1;
+    uint8_t *ptr;
 
     off = cpu_get_physical_page_desc(addr);
-    if ((off & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
-        fprintf(stderr, "virtio DMA to IO ram\n");
-        exit(1);
-    }
+    if ((off & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
+        return NULL;
 
     off = (off & TARGET_PAGE_MASK) | (addr & ~TARGET_PAGE_MASK);
 
-    for (addr1 = addr + TARGET_PAGE_SIZE;
-         addr1 < TARGET_PAGE_ALIGN(addr + size);
+    for (addr1 = addr & TARGET_PAGE_MASK;
+         addr1 < addr + size;
          addr1 += TARGET_PAGE_SIZE) {
         ram_addr_t off1;
 
         off1 = cpu_get_physical_page_desc(addr1);
-        if ((off1 & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
-            fprintf(stderr, "virtio DMA to IO ram\n");
-            exit(1);
-        }
-
-        off1 = (off1 & TARGET_PAGE_MASK) | (addr1 & ~TARGET_PAGE_MASK);
+        if ((off1 & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
+            return NULL;
 
-        if (off1 != (off + (addr1 - addr))) {
-            fprintf(stderr, "discontigous virtio memory\n");
-            exit(1);
-        }
+        off1 &= TARGET_PAGE_MASK;
+        if (off1 != (off & TARGET_PAGE_MASK) + (addr1 - (addr & TARGET_PAGE_MASK)))
+            return NULL;
+        cpu_physical_memory_fetch(off1);
     }
 
-    return phys_ram_base + off;
+    /* The RAM offsets are contiguous, check that the host memory is too. */
+    ptr = host_ram_addr(off);
+    if (size > 1 && host_ram_addr(off + size - 1) != ptr + size - 1)
+        return NULL;
+
+    return ptr;
 }
-#endif
 
 static void virtqueue_init(VirtQueue *vq, target_phys_addr_t pa)
 {
@@ -213,6 +213,15 @@ static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
     stw_phys(pa, lduw_phys(pa) & ~mask);
 }
 
+/* Let the device write to the in buffers of the elements popped from
+   the queue in place, rather than through a bounce buffer that is copied
+   to the guest when the element is filled.  Elements whose buffers are
+   not all in RAM still use bounce buffers.  */
+void virtio_queue_set_map_in(VirtQueue *vq, int enable)
+{
+    vq->map_in = enable;
+}
+
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     if (enable)
@@ -237,31 +246,25 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     unsigned int offset;
     int i;
 
-#ifndef VIRTIO_ZERO_COPY
     for (i = 0; i < elem->out_num; i++)
         qemu_free(elem->out_sg[i].iov_base);
-#endif
 
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
 
-#ifdef VIRTIO_ZERO_COPY
-        if (size) {
-            ram_addr_t addr = (uint8_t *)elem->in_sg[i].iov_base - phys_ram_base;
-            ram_addr_t off;
-
-            for (off = 0; off < size; off += TARGET_PAGE_SIZE)
-                cpu_physical_memory_set_dirty(addr + off);
+        if (elem->in_mapped) {
+            if (size)
+                cpu_physical_memory_written(
+                    ram_offset_from_host(elem->in_sg[i].iov_base), size);
+        } else {
+            if (size)
+                cpu_physical_memory_write(elem->in_addr[i],
+                                          elem->in_sg[i].iov_base,
+                                          size);
+
+            qemu_free(elem->in_sg[i].iov_base);
         }
-#else
-        if (size)
-            cpu_physical_memory_write(elem->in_addr[i],
-                                      elem->in_sg[i].iov_base,
-                                      size);
-
-        qemu_free(elem->in_sg[i].iov_base);
-#endif
         
         offset += size;
     }
@@ -281,6 +284,22 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     vq->inuse -= count;
 }
 
+/* Give back the last element popped from the queue, unused.  */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    int i;
+
+    for (i = 0; i < elem->out_num; i++)
+        qemu_free(elem->out_sg[i].iov_base);
+    if (!elem->in_mapped) {
+        for (i = 0; i < elem->in_num; i++)
+            qemu_free(elem->in_sg[i].iov_base);
+    }
+
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
@@ -374,6 +393,22 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
     return 0;
 }
 
+/* Switch the in buffers mapped so far to bounce buffers, when one of the
+   buffers of the element cannot be mapped.  */
+static void virtqueue_unmap_in(VirtQueueElement *elem)
+{
+    int i;
+
+    for (i = 0; i < elem->in_num - 1; i++) {
+        struct iovec *sg = &elem->in_sg[i];
+
+        if (sg->iov_len > (2 << 20))
+            sg->iov_len = 2 << 20;
+        sg->iov_base = qemu_malloc(sg->iov_len);
+    }
+    elem->in_mapped = 0;
+}
+
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head;
@@ -383,6 +418,7 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 
     /* When we start there are none of either input nor output. */
     elem->out_num = elem->in_num = 0;
+    elem->in_mapped = vq->map_in;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
     do {
@@ -397,26 +433,31 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         /* Grab the first descriptor, and check it's OK. */
         sg->iov_len = vring_desc_len(vq, i);
 
-#ifdef VIRTIO_ZERO_COPY
-        sg->iov_base = virtio_map_gpa(vring_desc_addr(vq, i), sg->iov_len);
-#else
-        /* cap individual scatter element size to prevent unbounded allocations
-           of memory from the guest.  Practically speaking, no virtio driver
-           will ever pass more than a page in each element.  We set the cap to
-           be 2MB in case for some reason a large page makes it way into the
-           sg list.  When we implement a zero copy API, this limitation will
-           disappear */
-        if (sg->iov_len > (2 << 20))
-            sg->iov_len = 2 << 20;
+        sg->iov_base = NULL;
+        if (elem->in_mapped && (vring_desc_flags(vq, i) & VRING_DESC_F_WRITE)) {
+            sg->iov_base = virtio_map_gpa(vring_desc_addr(vq, i), sg->iov_len);
+            if (sg->iov_base == NULL)
+                virtqueue_unmap_in(elem);
+        }
 
-        sg->iov_base = qemu_malloc(sg->iov_len);
-        if (sg->iov_base && 
-            !(vring_desc_flags(vq, i) & VRING_DESC_F_WRITE)) {
-            cpu_physical_memory_read(vring_desc_addr(vq, i),
-                                     sg->iov_base,
-                                     sg->iov_len);
+        if (sg->iov_base == NULL) {
+            /* cap individual scatter element size to prevent unbounded
+               allocations of memory from the guest.  Practically speaking,
+               no virtio driver will ever pass more than a page in each
+               element.  We set the cap to be 2MB in case for some reason
+               a large page makes it way into the sg list.  Queues that
+               map their in buffers in place do not have this limit. */
+            if (sg->iov_len > (2 << 20))
+                sg->iov_len = 2 << 20;
+
+            sg->iov_base = qemu_malloc(sg->iov_len);
+            if (sg->iov_base &&
+                !(vring_desc_flags(vq, i) & VRING_DESC_F_WRITE)) {
+                cpu_physical_memory_read(vring_desc_addr(vq, i),
+                                         sg->iov_base,
+                                         sg->iov_len);
+            }
         }
-#endif
         if (sg->iov_base == NULL) {
             fprintf(stderr, "Invalid mapping\n");
             exit(1);
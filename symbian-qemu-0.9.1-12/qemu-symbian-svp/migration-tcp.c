@@ -40,6 +40,11 @@ static int socket_write(FdMigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+static int socket_read(FdMigrationState *s, void *buf, size_t size)
+{
+    return recv(s->fd, buf, size, 0);
+}
+
 static int tcp_close(FdMigrationState *s)
 {
     dprintf("tcp_close\n");
@@ -79,7 +84,7 @@ static void tcp_wait_for_connect(void *opaque)
 
 MigrationState *tcp_start_outgoing_migration(const char *host_port,
                                              int64_t bandwidth_limit,
-                                             int async)
+                                             int async, int postcopy)
 {
     struct sockaddr_in addr;
     FdMigrationState *s;
@@ -94,12 +99,14 @@ MigrationState *tcp_start_outgoing_migration(const char *host_port,
 
     s->get_error = socket_errno;
     s->write = socket_write;
+    s->read = socket_read;
     s->close = tcp_close;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
     s->mig_state.release = migrate_fd_release;
 
     s->state = MIG_STATE_ACTIVE;
+    s->postcopy = postcopy;
     s->detach = !async;
     s->bandwidth_limit = bandwidth_limit;
     s->fd = socket(PF_INET, SOCK_STREAM, 0);
@@ -174,6 +181,13 @@ static void tcp_accept_incoming_migration(void *opaque)
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
     close(s);
 
+    /* With post-copy, the connection stays open to receive the pages.
+       Set up the fault path before anything can touch guest RAM.  */
+    if (ram_postcopy_incoming_start(f, c)) {
+        vm_start();
+        return;
+    }
+
     vm_start();
 
 out_fopen:
@@ -18,6 +18,7 @@
 #include "sysemu.h"
 #include "block.h"
 #include "qemu_socket.h"
+#include "qemu-timer.h"
 
 //#define DEBUG_MIGRATION
 
@@ -48,16 +49,21 @@ void qemu_start_incoming_migration(const char *uri)
         fprintf(stderr, "unknown migration protocol: %s\n", uri);
 }
 
-void do_migrate(int detach, const char *uri)
+void do_migrate(int detach, int postcopy, const char *uri)
 {
     MigrationState *s = NULL;
     const char *p;
 
     if (strstart(uri, "tcp:", &p))
-        s = tcp_start_outgoing_migration(p, max_throttle, detach);
+        s = tcp_start_outgoing_migration(p, max_throttle, detach, postcopy);
 #if !defined(WIN32)
-    else if (strstart(uri, "exec:", &p))
+    else if (strstart(uri, "exec:", &p)) {
+        /* Pages are requested over the migration connection, which a
+           pipe cannot do.  */
+        if (postcopy)
+            term_printf("post-copy needs a tcp: migration, using pre-copy\n");
         s = exec_start_outgoing_migration(p, max_throttle, detach);
+    }
 #endif
     else
         term_printf("unknown migration protocol: %s\n", uri);
@@ -103,10 +109,12 @@ void do_migrate_set_speed(const char *value)
 void do_info_migrate(void)
 {
     MigrationState *s = current_migration;
+    int status;
     
     if (s) {
         term_printf("Migration status: ");
-        switch (s->get_status(s)) {
+        status = s->get_status(s);
+        switch (status) {
         case MIG_STATE_ACTIVE:
             term_printf("active\n");
             break;
@@ -120,7 +128,16 @@ void do_info_migrate(void)
             term_printf("cancelled\n");
             break;
         }
+        term_printf("Mode: %s\n", s->postcopy ? "post-copy" : "pre-copy");
+        if (status == MIG_STATE_ACTIVE)
+            term_printf("Elapsed: %" PRId64 " ms\n",
+                        qemu_get_clock(rt_clock) - s->start_time);
+        else if (status == MIG_STATE_COMPLETED)
+            term_printf("Total time: %" PRId64 " ms\n", s->total_time);
+        if (s->downtime >= 0)
+            term_printf("Downtime: %" PRId64 " ms\n", s->downtime);
     }
+    ram_postcopy_info();
 }
 
 /* shared migration helpers */
@@ -132,10 +149,57 @@ void migrate_fd_error(FdMigrationState *s)
     migrate_fd_cleanup(s);
 }
 
+/* While pages are sent after the guest state, the destination of a
+   post-copy migration asks for the pages it is waiting for.  */
+static void migrate_fd_get_request(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    int ret;
+
+    for (;;) {
+        ret = s->read(s, s->request + s->request_len,
+                      sizeof(s->request) - s->request_len);
+        if (ret == -1 && s->get_error(s) == EINTR)
+            continue;
+        if (ret == -1 && (s->get_error(s) == EAGAIN ||
+                          s->get_error(s) == EWOULDBLOCK))
+            break;
+        if (ret <= 0) {
+            dprintf("destination closed the connection\n");
+            migrate_fd_error(s);
+            break;
+        }
+        s->request_len += ret;
+        if (s->request_len == sizeof(s->request)) {
+            ram_postcopy_request(s->file, be64_to_cpup((uint64_t *)s->request));
+            s->request_len = 0;
+        }
+    }
+}
+
+static void migrate_fd_set_handlers(FdMigrationState *s)
+{
+    qemu_set_fd_handler2(s->fd, NULL,
+                         s->postcopy == 2 ? migrate_fd_get_request : NULL,
+                         s->write_blocked ? migrate_fd_put_notify : NULL, s);
+}
+
+static void migrate_fd_complete(FdMigrationState *s)
+{
+    s->state = MIG_STATE_COMPLETED;
+    migrate_fd_cleanup(s);
+    s->mig_state.total_time = qemu_get_clock(rt_clock) - s->mig_state.start_time;
+}
+
 void migrate_fd_cleanup(FdMigrationState *s)
 {
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
+    if (s->postcopy) {
+        ram_postcopy_set_outgoing(0);
+        s->postcopy = 1;
+    }
+
     if (s->file) {
         dprintf("closing file\n");
         qemu_fclose(s->file);
@@ -157,7 +221,8 @@ void migrate_fd_put_notify(void *opaque)
 {
     FdMigrationState *s = opaque;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    s->write_blocked = 0;
+    migrate_fd_set_handlers(s);
     qemu_file_put_notify(s->file);
 }
 
@@ -173,8 +238,10 @@ ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
     if (ret == -1)
         ret = -(s->get_error(s));
 
-    if (ret == -EAGAIN)
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+    if (ret == -EAGAIN) {
+        s->write_blocked = 1;
+        migrate_fd_set_handlers(s);
+    }
 
     return ret;
 }
@@ -183,6 +250,10 @@ void migrate_fd_connect(FdMigrationState *s)
 {
     int ret;
 
+    s->mig_state.postcopy = s->postcopy;
+    s->mig_state.start_time = qemu_get_clock(rt_clock);
+    s->mig_state.downtime = -1;
+    ram_postcopy_set_outgoing(s->postcopy);
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
@@ -204,21 +275,39 @@ void migrate_fd_connect(FdMigrationState *s)
 void migrate_fd_put_ready(void *opaque)
 {
     FdMigrationState *s = opaque;
+    int64_t stop_time;
 
     if (s->state != MIG_STATE_ACTIVE) {
         dprintf("put_ready returning because of non-active state\n");
         return;
     }
 
+    if (s->postcopy == 2) {
+        if (ram_postcopy_save(s->file) == 1) {
+            dprintf("all pages sent\n");
+            migrate_fd_complete(s);
+        }
+        return;
+    }
+
     dprintf("iterate\n");
     if (qemu_savevm_state_iterate(s->file) == 1) {
         dprintf("done iterating\n");
         vm_stop(0);
+        stop_time = qemu_get_clock(rt_clock);
 
         bdrv_flush_all();
         qemu_savevm_state_complete(s->file);
-        s->state = MIG_STATE_COMPLETED;
-        migrate_fd_cleanup(s);
+        if (s->postcopy) {
+            /* The destination runs from here on and fetches the pages.  */
+            qemu_fflush(s->file);
+            s->mig_state.downtime = qemu_get_clock(rt_clock) - stop_time;
+            s->postcopy = 2;
+            migrate_fd_set_handlers(s);
+            return;
+        }
+        migrate_fd_complete(s);
+        s->mig_state.downtime = qemu_get_clock(rt_clock) - stop_time;
     }
 }
 
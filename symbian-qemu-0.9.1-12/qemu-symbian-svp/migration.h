@@ -27,6 +27,12 @@ struct MigrationState
     void (*cancel)(MigrationState *s);
     int (*get_status)(MigrationState *s);
     void (*release)(MigrationState *s);
+    int postcopy;
+    /* In ms.  Downtime is the time from stopping the guest until its
+       state has been sent, after which the destination can run.  */
+    int64_t start_time;
+    int64_t total_time;
+    int64_t downtime;
 };
 
 typedef struct FdMigrationState FdMigrationState;
@@ -39,15 +45,22 @@ struct FdMigrationState
     int fd;
     int detach;
     int state;
+    /* 1 when asked for, 2 once the guest state is sent and pages are
+       being sent.  */
+    int postcopy;
+    int write_blocked;
+    uint8_t request[8];
+    int request_len;
     int (*get_error)(struct FdMigrationState*);
     int (*close)(struct FdMigrationState*);
     int (*write)(struct FdMigrationState*, const void *, size_t);
+    int (*read)(struct FdMigrationState*, void *, size_t);
     void *opaque;
 };
 
 void qemu_start_incoming_migration(const char *uri);
 
-void do_migrate(int detach, const char *uri);
+void do_migrate(int detach, int postcopy, const char *uri);
 
 void do_migrate_cancel(void);
 
@@ -65,7 +78,7 @@ int tcp_start_incoming_migration(const char *host_port);
 
 MigrationState *tcp_start_outgoing_migration(const char *host_port,
 					     int64_t bandwidth_limit,
-					     int detach);
+					     int detach, int postcopy);
 
 void migrate_fd_error(FdMigrationState *s);
 
@@ -89,6 +102,16 @@ void migrate_fd_wait_for_unfreeze(void *opaque);
 
 int migrate_fd_close(void *opaque);
 
+void ram_postcopy_set_outgoing(int enable);
+
+void ram_postcopy_request(QEMUFile *f, uint64_t addr);
+
+int ram_postcopy_save(QEMUFile *f);
+
+int ram_postcopy_incoming_start(QEMUFile *f, int fd);
+
+void ram_postcopy_info(void);
+
 static inline FdMigrationState *migrate_to_fms(MigrationState *mig_state)
 {
     return container_of(mig_state, FdMigrationState, mig_state);
@@ -41,6 +41,7 @@
 #include "qemu-timer.h"
 #include "migration.h"
 #include "kvm.h"
+#include "replay.h"
 
 //#define DEBUG
 //#define DEBUG_COMPLETION
@@ -1456,6 +1457,8 @@ static const term_cmd_t term_cmds[] = {
       "tag|id", "restore a VM snapshot from its tag or id" },
     { "delvm", "s", do_delvm,
       "tag|id", "delete a VM snapshot from its tag or id" },
+    { "replay_seek", "s", do_replay_seek,
+      "icount", "replay up to instruction 'icount', restarting from the closest snapshot of the log if needed" },
     { "stop", "", do_stop,
       "", "stop emulation", },
     { "c|cont", "", do_cont,
@@ -1510,8 +1513,8 @@ static const term_cmd_t term_cmds[] = {
     { "nmi", "i", do_inject_nmi,
       "cpu", "inject an NMI on the given CPU", },
 #endif
-    { "migrate", "-ds", do_migrate,
-      "[-d] uri", "migrate to URI (using -d to not wait for completion)" },
+    { "migrate", "-d-ps", do_migrate,
+      "[-d] [-p] uri", "migrate to URI (using -d to not wait for completion, -p for post-copy)" },
     { "migrate_cancel", "", do_migrate_cancel,
       "", "cancel the current VM migration" },
     { "migrate_set_speed", "s", do_migrate_set_speed,
@@ -1527,7 +1530,7 @@ static const term_cmd_t info_cmds[] = {
     { "network", "", do_info_network,
       "", "show the network state" },
     { "chardev", "", qemu_chr_info,
-      "", "show the character devices" },
+      "", "show the character devices and their I/O statistics" },
     { "block", "", do_info_block,
       "", "show the block devices" },
     { "blockstats", "", do_info_blockstats,
@@ -1566,8 +1569,26 @@ static const term_cmd_t info_cmds[] = {
       "", "show profiling information", },
     { "capture", "", do_info_capture,
       "", "show capture information" },
+#ifdef HAS_AUDIO
+    { "audio", "", AUD_info,
+      "", "show the host audio voices, latency and underruns" },
+#endif
     { "snapshots", "", do_info_snapshots,
       "", "show the currently saved VM snapshots" },
+    { "snapstore", "", do_info_snapstore,
+      "", "show incremental snapshot store statistics" },
+    { "compression", "", do_info_compression,
+      "", "show RAM compression statistics of the last snapshot save and load" },
+#ifndef _WIN32
+    { "forkserver", "", do_info_forkserver,
+      "", "show the state of the fork server" },
+#endif
+    { "iohandlers", "", do_info_iohandlers,
+      "", "show the time spent in I/O handlers and bottom halves" },
+    { "alarm", "", do_info_alarm,
+      "", "show the host alarm timer and how often it wakes up" },
+    { "replay", "", do_info_replay,
+      "", "show the record/replay state" },
     { "status", "", do_info_status,
       "", "show the current VM status (running|paused)" },
     { "pcmcia", "", pcmcia_info,
@@ -2489,14 +2510,21 @@ static void monitor_handle_command(const char *cmdline)
                     p++;
                 has_option = 0;
                 if (*p == '-') {
-                    p++;
-                    if (*p != c) {
-                        term_printf("%s: unsupported option -%c\n",
-                                    cmdname, *p);
-                        goto fail;
+                    if (p[1] == c) {
+                        p += 2;
+                        has_option = 1;
+                    } else {
+                        /* Options may be omitted: leave it to one of the
+                           options that follow.  */
+                        const char *t = typestr;
+                        while (t[0] == '-' && t[1] != '\0' && t[1] != p[1])
+                            t += 2;
+                        if (t[0] != '-' || t[1] == '\0') {
+                            term_printf("%s: unsupported option -%c\n",
+                                        cmdname, p[1]);
+                            goto fail;
+                        }
                     }
-                    p++;
-                    has_option = 1;
                 }
                 if (nb_args >= MAX_ARGS)
                     goto error_args;
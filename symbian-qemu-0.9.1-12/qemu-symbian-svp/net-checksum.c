@@ -27,12 +27,11 @@ uint32_t net_checksum_add(int len, uint8_t *buf)
     uint32_t sum = 0;
     int i;
 
-    for (i = 0; i < len; i++) {
-	if (i & 1)
-	    sum += (uint32_t)buf[i];
-	else
-	    sum += (uint32_t)buf[i] << 8;
-    }
+    /* Two bytes at a time; a 64k packet cannot overflow the sum.  */
+    for (i = 0; i + 1 < len; i += 2)
+	sum += (uint32_t)buf[i] << 8 | buf[i + 1];
+    if (i < len)
+	sum += (uint32_t)buf[i] << 8;
     return sum;
 }
 
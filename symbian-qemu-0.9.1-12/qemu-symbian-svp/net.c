@@ -28,6 +28,7 @@
 #include "qemu-timer.h"
 #include "qemu-char.h"
 #include "audio/audio.h"
+#include "replay.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -354,13 +355,38 @@ void qemu_send_packet(VLANClientState *vc1, const uint8_t *buf, int size)
     printf("vlan %d send:\n", vlan->id);
     hex_dump(stdout, buf, size);
 #endif
+    vlan->packets++;
+    vlan->bytes += size;
+    if (replay_mode != REPLAY_NONE) {
+        if (vc1->host) {
+            /* On replay, packets from the host come from the log.  */
+            if (replay_mode == REPLAY_PLAY)
+                return;
+            replay_net_packet(vlan->id, buf, size);
+        }
+    }
     for(vc = vlan->first_client; vc != NULL; vc = vc->next) {
         if (vc != vc1) {
+            if (vc->host && replay_mode == REPLAY_PLAY)
+                continue;
             vc->fd_read(vc->opaque, buf, size);
         }
     }
 }
 
+void qemu_replay_packet(int vlan_id, const uint8_t *buf, int size)
+{
+    VLANState *vlan = qemu_find_vlan(vlan_id);
+    VLANClientState *vc;
+
+    vlan->packets++;
+    vlan->bytes += size;
+    for (vc = vlan->first_client; vc != NULL; vc = vc->next) {
+        if (!vc->host)
+            vc->fd_read(vc->opaque, buf, size);
+    }
+}
+
 static ssize_t vc_sendv_compat(VLANClientState *vc, const struct iovec *iov,
                                int iovcnt)
 {
@@ -387,12 +413,19 @@ ssize_t qemu_sendv_packet(VLANClientState *vc1, const struct iovec *iov,
     VLANState *vlan = vc1->vlan;
     VLANClientState *vc;
     ssize_t max_len = 0;
+    int i;
+
+    vlan->packets++;
+    for (i = 0; i < iovcnt; i++)
+        vlan->bytes += iov[i].iov_len;
 
     for (vc = vlan->first_client; vc != NULL; vc = vc->next) {
         ssize_t len = 0;
 
         if (vc == vc1)
             continue;
+        if (vc->host && replay_mode == REPLAY_PLAY)
+            continue;
 
         if (vc->fd_readv)
             len = vc->fd_readv(vc->opaque, iov, iovcnt);
@@ -450,6 +483,7 @@ static int net_slirp_init(VLANState *vlan)
     }
     slirp_vc = qemu_new_vlan_client(vlan,
                                     slirp_receive, NULL, NULL);
+    slirp_vc->host = 1;
     snprintf(slirp_vc->info_str, sizeof(slirp_vc->info_str), "user redirector");
     return 0;
 }
@@ -640,24 +674,107 @@ static void tap_receive(void *opaque, const uint8_t *buf, int size)
     }
 }
 
+/* Maximum number of frames read from the tap device per wakeup.  */
+#define TAP_BURST       64
+/* Frames are truncated to this size.  */
+#define TAP_BUFSIZE     4096
+#define TAP_MAX_IOV     64
+
+/* The client that frames from the tap device can be read into in place:
+   the only other client of the VLAN, if it supports it.  Frames always
+   go through the VLAN when they are recorded or replayed.  */
+static VLANClientState *tap_rx_peer(TAPState *s)
+{
+    VLANClientState *vc, *peer = NULL;
+
+    if (replay_mode != REPLAY_NONE)
+        return NULL;
+
+    for (vc = s->vc->vlan->first_client; vc != NULL; vc = vc->next) {
+        if (vc == s->vc)
+            continue;
+        if (peer || !vc->rx_buf)
+            return NULL;
+        peer = vc;
+    }
+    return peer;
+}
+
+static int tap_can_send(void *opaque)
+{
+    TAPState *s = opaque;
+    VLANClientState *peer = tap_rx_peer(s);
+
+    /* Leave the frames in the tap queue until the guest has buffers for
+       them.  Other VLANs read and drop them, as they always did.  */
+    if (peer && peer->fd_can_read)
+        return peer->fd_can_read(peer->opaque);
+    return 1;
+}
+
+static int tap_read_in_place(TAPState *s, VLANClientState *peer)
+{
+    struct iovec iov[TAP_MAX_IOV];
+    int iovcnt, size;
+
+    iovcnt = peer->rx_buf(peer->opaque, iov, TAP_MAX_IOV, TAP_BUFSIZE);
+    if (iovcnt <= 0)
+        return iovcnt;
+
+    do {
+        size = readv(s->fd, iov, iovcnt);
+    } while (size < 0 && errno == EINTR);
+
+    if (size <= 0) {
+        peer->rx_done(peer->opaque, 0);
+        return 0;
+    }
+    peer->rx_done(peer->opaque, size);
+
+    s->vc->vlan->packets++;
+    s->vc->vlan->bytes += size;
+    s->vc->vlan->packets_in_place++;
+    return size;
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    uint8_t buf[4096];
-    int size;
+    VLANClientState *peer = tap_rx_peer(s);
+    uint8_t buf[TAP_BUFSIZE];
+    int size, n;
+
+    for (n = 0; n < TAP_BURST; n++) {
+#ifdef HAVE_IOVEC
+        if (peer) {
+            size = tap_read_in_place(s, peer);
+            if (size > 0)
+                continue;
+            if (size == 0)
+                break;
+        }
+#endif
+        if (n > 0 && !peer && !qemu_can_send_packet(s->vc))
+            break;
 
 #ifdef __sun__
-    struct strbuf sbuf;
-    int f = 0;
-    sbuf.maxlen = sizeof(buf);
-    sbuf.buf = buf;
-    size = getmsg(s->fd, NULL, &sbuf, &f) >=0 ? sbuf.len : -1;
+        {
+            struct strbuf sbuf;
+            int f = 0;
+            sbuf.maxlen = sizeof(buf);
+            sbuf.buf = buf;
+            size = getmsg(s->fd, NULL, &sbuf, &f) >=0 ? sbuf.len : -1;
+        }
 #else
-    size = read(s->fd, buf, sizeof(buf));
+        size = read(s->fd, buf, sizeof(buf));
 #endif
-    if (size > 0) {
+        if (size <= 0)
+            break;
         qemu_send_packet(s->vc, buf, size);
     }
+
+    if (peer)
+        peer->rx_flush(peer->opaque);
 }
 
 /* fd support */
@@ -671,10 +788,11 @@ static TAPState *net_tap_fd_init(VLANState *vlan, int fd)
         return NULL;
     s->fd = fd;
     s->vc = qemu_new_vlan_client(vlan, tap_receive, NULL, s);
+    s->vc->host = 1;
 #ifdef HAVE_IOVEC
     s->vc->fd_readv = tap_receive_iov;
 #endif
-    qemu_set_fd_handler(s->fd, tap_send, NULL, s);
+    qemu_set_fd_handler2(s->fd, tap_can_send, tap_send, NULL, s);
     snprintf(s->vc->info_str, sizeof(s->vc->info_str), "tap: fd=%d", fd);
     return s;
 }
@@ -991,6 +1109,7 @@ static int net_vde_init(VLANState *vlan, const char *sock, int port,
         return -1;
     }
     s->vc = qemu_new_vlan_client(vlan, vde_from_qemu, NULL, s);
+    s->vc->host = 1;
     qemu_set_fd_handler(vde_datafd(s->vde), vde_to_qemu, NULL, s);
     snprintf(s->vc->info_str, sizeof(s->vc->info_str), "vde: sock=%s fd=%d",
              sock, vde_datafd(s->vde));
@@ -1209,6 +1328,7 @@ static NetSocketState *net_socket_fd_init_dgram(VLANState *vlan, int fd,
     s->fd = fd;
 
     s->vc = qemu_new_vlan_client(vlan, net_socket_receive_dgram, NULL, s);
+    s->vc->host = 1;
     qemu_set_fd_handler(s->fd, net_socket_send_dgram, NULL, s);
 
     /* mcast: save bound address as dst */
@@ -1237,6 +1357,7 @@ static NetSocketState *net_socket_fd_init_stream(VLANState *vlan, int fd,
     s->fd = fd;
     s->vc = qemu_new_vlan_client(vlan,
                                  net_socket_receive, NULL, s);
+    s->vc->host = 1;
     snprintf(s->vc->info_str, sizeof(s->vc->info_str),
              "socket: fd=%d", fd);
     if (is_connected) {
@@ -1609,8 +1730,14 @@ void do_info_network(void)
 
     for(vlan = first_vlan; vlan != NULL; vlan = vlan->next) {
         term_printf("VLAN %d devices:\n", vlan->id);
-        for(vc = vlan->first_client; vc != NULL; vc = vc->next)
+        for(vc = vlan->first_client; vc != NULL; vc = vc->next) {
             term_printf("  %s\n", vc->info_str);
+            if (vc->info_stats)
+                vc->info_stats(vc->opaque);
+        }
+        term_printf("  packets=%" PRIu64 " bytes=%" PRIu64
+                    " in_place=%" PRIu64 "\n",
+                    vlan->packets, vlan->bytes, vlan->packets_in_place);
     }
 }
 
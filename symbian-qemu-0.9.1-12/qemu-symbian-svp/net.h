@@ -18,6 +18,19 @@ struct VLANClientState {
     void *opaque;
     struct VLANClientState *next;
     struct VLANState *vlan;
+    int host;  /* host backend, whose input is recorded on -record */
+    /* prints the statistics of the client for "info network" */
+    void (*info_stats)(void *opaque);
+    /* Receive in place, used by host backends when this client is the
+       only other one on the VLAN.  rx_buf returns the guest buffers that
+       the next packet, of up to size bytes, can be written to as at most
+       iovcnt elements of iov; 0 if there are none, -1 if the packet must
+       go through fd_read instead.  rx_done completes them with the
+       length of the packet, or gives them back if it is 0.  rx_flush
+       tells the guest about the packets completed so far.  */
+    int (*rx_buf)(void *opaque, struct iovec *iov, int iovcnt, int size);
+    void (*rx_done)(void *opaque, int len);
+    void (*rx_flush)(void *opaque);
     char info_str[256];
 };
 
@@ -26,6 +39,10 @@ struct VLANState {
     VLANClientState *first_client;
     struct VLANState *next;
     unsigned int nb_guest_devs, nb_host_devs;
+    /* Packets sent on the VLAN (display with "info network"). */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t packets_in_place;
 };
 
 VLANState *qemu_find_vlan(int id);
@@ -24,31 +24,28 @@ class syborg_serial(qemu.devclass):
     return self.fifo_size - len(self.fifo)
 
   def receive(self, buf):
-    for x in buf:
-      ch = ord(x)
-      if self.dma_rx_count > 0:
-        self.dma_writeb(self.dma_rx_addr, ch)
-        self.dma_rx_addr += 1
-        self.dma_rx_count -= 1
-      else:
-        self.fifo.append(ch)
+    buf = str(buf)
+    n = min(len(buf), self.dma_rx_count)
+    if n > 0:
+      self.dma_write(self.dma_rx_addr, buf[:n])
+      self.dma_rx_addr += n
+      self.dma_rx_count -= n
+    self.fifo.extend([ord(x) for x in buf[n:]])
     self.update_irq()
 
   def do_dma_tx(self, count):
-    # TODO: Optimize block transmits.
-    while count > 0:
-      ch = self.dma_readb(self.dma_tx_addr)
-      self.chardev.write(ch)
-      self.dma_tx_addr += 1
-      count -= 1
+    if count > 0:
+      self.chardev.write(self.dma_read(self.dma_tx_addr, count))
+      self.dma_tx_addr += count
     self.update_irq()
 
   def dma_rx_start(self, count):
-    while (count > 0) and (len(self.fifo) > 0):
-      ch = self.fifo.pop(0)
-      self.dma_writeb(self.dma_rx_addr, ch)
-      self.dma_rx_addr += 1
-      count -= 1
+    n = min(count, len(self.fifo))
+    if n > 0:
+      self.dma_write(self.dma_rx_addr, "".join(map(chr, self.fifo[:n])))
+      del self.fifo[:n]
+      self.dma_rx_addr += n
+      count -= n
     self.dma_rx_count = count
     self.update_irq()
 
@@ -127,9 +127,20 @@ static int spawn_thread(void)
     return ret;
 }
 
+/* The worker threads do not exist in a forked child, which starts its
+   own on demand.  */
+static void paio_child(void)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    cur_threads = 0;
+    idle_threads = 0;
+}
+
 int qemu_paio_init(struct qemu_paioinit *aioinit)
 {
     TAILQ_INIT(&request_list);
+    pthread_atfork(NULL, NULL, paio_child);
 
     return 0;
 }
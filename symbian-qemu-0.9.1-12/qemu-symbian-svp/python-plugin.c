@@ -1552,6 +1552,58 @@ static PyMemberDef qemu_py_devclass_members[] = {
     {NULL}  /* Sentinel */
 };
 
+static PyObject *qemu_py_dma_read(qemu_py_devclass *self, PyObject *args,
+                                  PyObject *kwds)
+{
+    static char *kwlist[] = {"addr", "size", NULL};
+    PyObject *obaddr;
+    PyObject *obdata;
+    target_phys_addr_t addr;
+    int size;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oi", kwlist,
+                                     &obaddr, &size))
+        return NULL;
+
+    addr = qemu_py_physaddr_from_pynum(obaddr);
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "negative size");
+        return NULL;
+    }
+
+    obdata = PyString_FromStringAndSize(NULL, size);
+    if (!obdata)
+        return NULL;
+    cpu_physical_memory_read(addr, (uint8_t *)PyString_AS_STRING(obdata),
+                             size);
+    return obdata;
+}
+
+static PyObject *qemu_py_dma_write(qemu_py_devclass *self, PyObject *args,
+                                   PyObject *kwds)
+{
+    static char *kwlist[] = {"addr", "data", NULL};
+    PyObject *obaddr;
+    target_phys_addr_t addr;
+    const char *data;
+    int len;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os#", kwlist,
+                                     &obaddr, &data, &len))
+        return NULL;
+
+    addr = qemu_py_physaddr_from_pynum(obaddr);
+    if (PyErr_Occurred())
+        return NULL;
+
+    cpu_physical_memory_write(addr, (const uint8_t *)data, len);
+
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef qemu_py_devclass_methods[] = {
     {"set_irq_level", (PyCFunction)qemu_py_set_irq_level, METH_VARARGS,
      "Set IRQ state"},
@@ -1566,6 +1618,10 @@ static PyMethodDef qemu_py_devclass_methods[] = {
      "Read a 32-bit word from system memory"},
     {"dma_writel", (PyCFunction)qemu_py_dma_writel, METH_VARARGS|METH_KEYWORDS,
      "Write a 32-bit word to system memory"},
+    {"dma_read", (PyCFunction)qemu_py_dma_read, METH_VARARGS|METH_KEYWORDS,
+     "Read a string of bytes from system memory"},
+    {"dma_write", (PyCFunction)qemu_py_dma_write, METH_VARARGS|METH_KEYWORDS,
+     "Write a string of bytes to system memory"},
     {"load", (PyCFunction)qemu_py_dummy_loadsave, METH_VARARGS,
      "load snapshot state"},
     {"save", (PyCFunction)qemu_py_dummy_loadsave, METH_VARARGS,
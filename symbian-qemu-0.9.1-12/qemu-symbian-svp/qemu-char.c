@@ -30,6 +30,7 @@
 #include "block.h"
 #include "hw/usb.h"
 #include "hw/baum.h"
+#include "replay.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -100,10 +101,69 @@
 /***********************************************************/
 /* character device */
 
+/* Ring buffer of a buffered character device.  head and tail run
+   freely, head - tail bytes are queued.  */
+#define CHR_RING_SIZE 16384
+
+struct CharRing {
+    uint8_t buf[CHR_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+};
+
+static inline int chr_ring_count(CharRing *r)
+{
+    return r->head - r->tail;
+}
+
+static inline int chr_ring_space(CharRing *r)
+{
+    return CHR_RING_SIZE - chr_ring_count(r);
+}
+
+static int chr_ring_put(CharRing *r, const uint8_t *buf, int len)
+{
+    int n, pos;
+
+    if (len > chr_ring_space(r))
+        len = chr_ring_space(r);
+    pos = r->head % CHR_RING_SIZE;
+    n = CHR_RING_SIZE - pos;
+    if (n > len)
+        n = len;
+    memcpy(r->buf + pos, buf, n);
+    memcpy(r->buf, buf + n, len - n);
+    r->head += len;
+    return len;
+}
+
+/* Describe the queued bytes, which wrap at most once.  */
+static int chr_ring_iov(CharRing *r, struct iovec *iov)
+{
+    int pos = r->tail % CHR_RING_SIZE;
+    int len = chr_ring_count(r);
+
+    iov[0].iov_base = r->buf + pos;
+    if (pos + len <= CHR_RING_SIZE) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+    iov[0].iov_len = CHR_RING_SIZE - pos;
+    iov[1].iov_base = r->buf;
+    iov[1].iov_len = len - iov[0].iov_len;
+    return 2;
+}
+
 static void qemu_chr_event(CharDriverState *s, int event)
 {
     if (!s->chr_event)
         return;
+    if (s->replay_id && replay_mode != REPLAY_NONE) {
+        /* On replay, events come from the log.  */
+        if (replay_mode == REPLAY_PLAY)
+            return;
+        replay_chr_event(s->replay_id, event);
+    }
     s->chr_event(s->handler_opaque, event);
 }
 
@@ -129,9 +189,53 @@ void qemu_chr_connect(CharDriverState *s)
         s->chr_connect(s);
 }
 
+/* Write out the queued output with a single backend call.  */
+void qemu_chr_flush(CharDriverState *s)
+{
+    struct iovec iov[2];
+    int i, n, len;
+
+    if (!s->tx_ring || !chr_ring_count(s->tx_ring))
+        return;
+    len = chr_ring_count(s->tx_ring);
+    n = chr_ring_iov(s->tx_ring, iov);
+    if (s->chr_writev) {
+        s->chr_writev(s, iov, n);
+    } else {
+        for (i = 0; i < n; i++)
+            s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+    }
+    /* Backends write everything or fail, in which case the output is
+       lost as it would have been unbuffered.  */
+    s->tx_ring->tail += len;
+    s->tx_bytes += len;
+}
+
+static void qemu_chr_tx_bh(void *opaque)
+{
+    qemu_chr_flush(opaque);
+}
+
 int qemu_chr_write(CharDriverState *s, const uint8_t *buf, int len)
 {
-    return s->chr_write(s, buf, len);
+    CharRing *r = s->tx_ring;
+
+    if (!r)
+        return s->chr_write(s, buf, len);
+
+    if (len > chr_ring_space(r)) {
+        s->tx_stalls++;
+        qemu_chr_flush(s);
+        if (len > CHR_RING_SIZE) {
+            s->tx_bytes += len;
+            return s->chr_write(s, buf, len);
+        }
+    }
+    /* Only the first byte queued wakes up the main loop, and only once
+       it gets to it: it does not stop the CPU.  */
+    if (!chr_ring_count(r))
+        qemu_bh_schedule_idle(s->tx_bh);
+    return chr_ring_put(r, buf, len);
 }
 
 int qemu_chr_ioctl(CharDriverState *s, int cmd, void *arg)
@@ -141,8 +245,53 @@ int qemu_chr_ioctl(CharDriverState *s, int cmd, void *arg)
     return s->chr_ioctl(s, cmd, arg);
 }
 
+static void qemu_chr_deliver(CharDriverState *s, uint8_t *buf, int len)
+{
+    if (s->replay_id && replay_mode != REPLAY_NONE) {
+        /* On replay, input comes from the log.  */
+        if (replay_mode == REPLAY_PLAY)
+            return;
+        replay_chr_read(s->replay_id, buf, len);
+    }
+    s->chr_read(s->handler_opaque, buf, len);
+}
+
+/* Hand the queued input to the device model, as much as it takes.  */
+static void qemu_chr_rx_drain(CharDriverState *s)
+{
+    CharRing *r = s->rx_ring;
+    struct iovec iov[2];
+    int len;
+
+    if (s->rx_draining || !s->chr_can_read)
+        return;
+    s->rx_draining = 1;
+    while (chr_ring_count(r)) {
+        len = s->chr_can_read(s->handler_opaque);
+        if (len <= 0)
+            break;
+        chr_ring_iov(r, iov);
+        if (len > (int)iov[0].iov_len)
+            len = iov[0].iov_len;
+        qemu_chr_deliver(s, iov[0].iov_base, len);
+        r->tail += len;
+    }
+    s->rx_draining = 0;
+}
+
 int qemu_chr_can_read(CharDriverState *s)
 {
+    if (s->rx_ring) {
+        qemu_chr_rx_drain(s);
+        if (!chr_ring_space(s->rx_ring)) {
+            if (!s->rx_full)
+                s->rx_stalls++;
+            s->rx_full = 1;
+            return 0;
+        }
+        s->rx_full = 0;
+        return chr_ring_space(s->rx_ring);
+    }
     if (!s->chr_can_read)
         return 0;
     return s->chr_can_read(s->handler_opaque);
@@ -150,11 +299,28 @@ int qemu_chr_can_read(CharDriverState *s)
 
 void qemu_chr_read(CharDriverState *s, uint8_t *buf, int len)
 {
-    s->chr_read(s->handler_opaque, buf, len);
+    if (!s->rx_ring) {
+        qemu_chr_deliver(s, buf, len);
+        return;
+    }
+    /* Backends do not read more than qemu_chr_can_read() allowed.  */
+    s->rx_bytes += chr_ring_put(s->rx_ring, buf, len);
+    qemu_chr_rx_drain(s);
+}
+
+static void qemu_chr_rx_bh(void *opaque)
+{
+    qemu_chr_rx_drain(opaque);
 }
 
 void qemu_chr_accept_input(CharDriverState *s)
 {
+    /* Devices call this while the CPU runs: deliver from the main loop,
+       where replay can log the input, but right away.  The CPU is
+       stopped whether input is queued or not, so that replay, which
+       does not queue it, runs the same slices.  */
+    if (s->rx_ring)
+        qemu_bh_schedule(s->rx_bh);
     if (s->chr_accept_input)
         s->chr_accept_input(s);
 }
@@ -498,6 +664,33 @@ int send_all(int fd, const void *buf, int len1)
 {
     return unix_write(fd, buf, len1);
 }
+
+static int unix_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    int ret, len = 0;
+
+    while (iovcnt > 0) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                return -1;
+            continue;
+        } else if (ret == 0) {
+            break;
+        }
+        len += ret;
+        while (iovcnt > 0 && ret >= (int)iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return len;
+}
 #endif /* !_WIN32 */
 
 #ifndef _WIN32
@@ -516,6 +709,12 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return send_all(s->fd_out, buf, len);
 }
 
+static int fd_chr_writev(CharDriverState *chr, struct iovec *iov, int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+    return unix_writev(s->fd_out, iov, iovcnt);
+}
+
 static int fd_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -530,7 +729,7 @@ static void fd_chr_read(void *opaque)
     CharDriverState *chr = opaque;
     FDCharDriver *s = chr->opaque;
     int size, len;
-    uint8_t buf[1024];
+    uint8_t buf[4096];
 
     len = sizeof(buf);
     if (len > s->max_size)
@@ -593,6 +792,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     s->fd_out = fd_out;
     chr->opaque = s;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -1987,6 +2187,20 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+#ifndef _WIN32
+static int tcp_chr_writev(CharDriverState *chr, struct iovec *iov, int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    int i, len;
+
+    if (s->connected)
+        return unix_writev(s->fd, iov, iovcnt);
+    for (i = 0, len = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+#endif
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2051,7 +2265,7 @@ static void tcp_chr_read(void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
-    uint8_t buf[1024];
+    uint8_t buf[4096];
     int len, size;
 
     if (!s->connected || s->max_size <= 0)
@@ -2262,6 +2476,9 @@ static CharDriverState *qemu_chr_open_tcp(const char *host_str,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+#ifndef _WIN32
+    chr->chr_writev = tcp_chr_writev;
+#endif
     chr->chr_close = tcp_chr_close;
     chr->chr_connect = tcp_chr_do_connect;
 
@@ -2299,6 +2516,31 @@ static CharDriverState *qemu_chr_open_tcp(const char *host_str,
 
 static TAILQ_HEAD(CharDriverStateHead, CharDriverState) chardevs
 = TAILQ_HEAD_INITIALIZER(chardevs);
+static int chr_replay_ids;
+
+void qemu_chr_flush_all(void)
+{
+    CharDriverState *chr;
+
+    TAILQ_FOREACH(chr, &chardevs, next) {
+        qemu_chr_flush(chr);
+    }
+}
+
+static void qemu_chr_init_buffers(CharDriverState *chr)
+{
+    static int flush_at_exit;
+
+    chr->rx_ring = qemu_mallocz(sizeof(CharRing));
+    chr->tx_ring = qemu_mallocz(sizeof(CharRing));
+    chr->rx_bh = qemu_bh_new(qemu_chr_rx_bh, chr);
+    chr->tx_bh = qemu_bh_new(qemu_chr_tx_bh, chr);
+    chr->stats_time = qemu_get_clock(rt_clock);
+    if (!flush_at_exit) {
+        atexit(qemu_chr_flush_all);
+        flush_at_exit = 1;
+    }
+}
 
 CharDriverState *qemu_chr_open(const char *label, const char *filename)
 {
@@ -2391,14 +2633,58 @@ CharDriverState *qemu_chr_open(const char *label, const char *filename)
         if (!chr->filename)
             chr->filename = qemu_strdup(filename);
         chr->label = qemu_strdup(label);
+        /* Record the input of the devices the guest sees.  The monitor
+           and gdb stay live on replay; a mux gets its input from the
+           device under it.  */
+        if (strcmp(label, "monitor") && strcmp(label, "gdb") &&
+            !strstart(filename, "mon:", NULL)) {
+            chr->replay_id = ++chr_replay_ids;
+            /* Buffer the same devices, the interactive ones are not
+               worth the latency.  */
+            qemu_chr_init_buffers(chr);
+        }
         TAILQ_INSERT_TAIL(&chardevs, chr, next);
     }
     return chr;
 }
 
+static CharDriverState *qemu_chr_find_replay(int id)
+{
+    CharDriverState *chr;
+
+    TAILQ_FOREACH(chr, &chardevs, next) {
+        if (chr->replay_id == id)
+            return chr;
+    }
+    return NULL;
+}
+
+void qemu_chr_replay_read(int id, uint8_t *buf, int len)
+{
+    CharDriverState *chr = qemu_chr_find_replay(id);
+
+    if (chr && chr->chr_read)
+        chr->chr_read(chr->handler_opaque, buf, len);
+}
+
+void qemu_chr_replay_event(int id, int event)
+{
+    CharDriverState *chr = qemu_chr_find_replay(id);
+
+    if (chr && chr->chr_event)
+        chr->chr_event(chr->handler_opaque, event);
+}
+
 void qemu_chr_close(CharDriverState *chr)
 {
     TAILQ_REMOVE(&chardevs, chr, next);
+    qemu_chr_flush(chr);
+    if (chr->rx_bh)
+        qemu_bh_delete(chr->rx_bh);
+    if (chr->tx_bh)
+        qemu_bh_delete(chr->tx_bh);
+    qemu_free(chr->rx_ring);
+    qemu_free(chr->tx_ring);
     if (chr->chr_close)
         chr->chr_close(chr);
     qemu_free(chr->filename);
@@ -2409,8 +2695,29 @@ void qemu_chr_close(CharDriverState *chr)
 void qemu_chr_info(void)
 {
     CharDriverState *chr;
+    int64_t now, ms;
 
+    now = qemu_get_clock(rt_clock);
     TAILQ_FOREACH(chr, &chardevs, next) {
         term_printf("%s: filename=%s\n", chr->label, chr->filename);
+        if (!chr->rx_ring)
+            continue;
+        /* Rates are since the previous "info chardev".  */
+        ms = now - chr->stats_time;
+        if (ms <= 0)
+            ms = 1;
+        term_printf("    rx %" PRIu64 " bytes, %" PRIu64 " bytes/s, "
+                    "%d queued, ring full %" PRIu64 " times\n",
+                    chr->rx_bytes,
+                    (chr->rx_bytes - chr->stats_rx_bytes) * 1000 / ms,
+                    chr_ring_count(chr->rx_ring), chr->rx_stalls);
+        term_printf("    tx %" PRIu64 " bytes, %" PRIu64 " bytes/s, "
+                    "%d queued, ring full %" PRIu64 " times\n",
+                    chr->tx_bytes,
+                    (chr->tx_bytes - chr->stats_tx_bytes) * 1000 / ms,
+                    chr_ring_count(chr->tx_ring), chr->tx_stalls);
+        chr->stats_time = now;
+        chr->stats_rx_bytes = chr->rx_bytes;
+        chr->stats_tx_bytes = chr->tx_bytes;
     }
 }
@@ -42,8 +42,13 @@ typedef struct {
 
 typedef void IOEventHandler(void *opaque, int event);
 
+typedef struct CharRing CharRing;
+
 struct CharDriverState {
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    /* optional, may modify iov */
+    int (*chr_writev)(struct CharDriverState *s, struct iovec *iov,
+                      int iovcnt);
     void (*chr_update_read_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
     void (*chr_connect)(struct CharDriverState *s);
@@ -59,6 +64,19 @@ struct CharDriverState {
     QEMUBH *bh;
     char *label;
     char *filename;
+    int replay_id;  /* 0 if the input is not recorded */
+    /* Buffered devices queue their input until the device model can
+       take it, and their output until the next main loop iteration.  */
+    CharRing *rx_ring;
+    CharRing *tx_ring;
+    QEMUBH *rx_bh;
+    QEMUBH *tx_bh;
+    int rx_draining;
+    int rx_full;
+    uint64_t rx_bytes, tx_bytes;
+    uint64_t rx_stalls, tx_stalls;
+    int64_t stats_time;
+    uint64_t stats_rx_bytes, stats_tx_bytes;
     TAILQ_ENTRY(CharDriverState) next;
 };
 
@@ -78,6 +96,8 @@ void qemu_chr_reset(CharDriverState *s);
 int qemu_chr_can_read(CharDriverState *s);
 void qemu_chr_read(CharDriverState *s, uint8_t *buf, int len);
 void qemu_chr_accept_input(CharDriverState *s);
+void qemu_chr_flush(CharDriverState *s);
+void qemu_chr_flush_all(void);
 void qemu_chr_info(void);
 
 extern int term_escape_char;
@@ -24,15 +24,24 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <sys/time.h>
 #endif
 
 /* Default to cache=writeback as data integrity is not important for qemu-tcg. */
 #define BRDV_O_FLAGS BDRV_O_CACHE_WB
 
+/* Image format metadata cache size, 0 for the default.  */
+static int64_t metadata_cache_size;
+static int open_flags = BRDV_O_FLAGS;
+
 static void __attribute__((noreturn)) error(const char *fmt, ...)
 {
     va_list ap;
@@ -58,8 +67,9 @@ static void help(void)
            "Command syntax:\n"
            "  create [-e] [-6] [-b base_image] [-f fmt] filename [size]\n"
            "  commit [-f fmt] filename\n"
-           "  convert [-c] [-e] [-6] [-f fmt] [-O output_fmt] [-B output_base_image] filename [filename2 [...]] output_filename\n"
+           "  convert [-c] [-e] [-6] [-p] [-m num] [-f fmt] [-O output_fmt] [-B output_base_image] filename [filename2 [...]] output_filename\n"
            "  info [-f fmt] filename\n"
+           "  bench [-w] [-f fmt] [-n count] [-C size] [-t cache] [-a aio] [-d depth] filename\n"
            "\n"
            "Command parameters:\n"
            "  'filename' is a disk image filename\n"
@@ -77,6 +87,16 @@ static void help(void)
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
            "  '-e' indicates that the target image must be encrypted (qcow format only)\n"
            "  '-6' indicates that the target image must use compatibility level 6 (vmdk format only)\n"
+           "  '-p' reports the progress and throughput of the conversion\n"
+           "  '-m' sets the number of requests in flight (default 8), or the number of\n"
+           "    compression threads with '-c' (default one per CPU)\n"
+           "  '-w' benchmarks random 4K writes rather than reads; the image data is overwritten\n"
+           "  'count' is the number of requests of the benchmark (default 10000)\n"
+           "  '-C' sets the size of the metadata cache of the image format (qcow2 only)\n"
+           "  'cache' is the host cache mode used by the benchmark: none, writethrough or\n"
+           "    writeback (default)\n"
+           "  'aio' is the AIO engine of raw files: threads (default) or native (Linux)\n"
+           "  'depth' makes the benchmark asynchronous, with 'depth' requests in flight\n"
            );
     printf("\nSupported format:");
     bdrv_iterate_format(format_print, NULL);
@@ -182,6 +202,8 @@ static BlockDriverState *bdrv_new_open(const char *filename,
     bs = bdrv_new("");
     if (!bs)
         error("Not enough memory");
+    if (metadata_cache_size)
+        bdrv_set_metadata_cache(bs, metadata_cache_size);
     if (fmt) {
         drv = bdrv_find_format(fmt);
         if (!drv)
@@ -189,7 +211,7 @@ static BlockDriverState *bdrv_new_open(const char *filename,
     } else {
         drv = NULL;
     }
-    if (bdrv_open2(bs, filename, BRDV_O_FLAGS, drv) < 0) {
+    if (bdrv_open2(bs, filename, open_flags, drv) < 0) {
         error("Could not open '%s'", filename);
     }
     if (bdrv_is_encrypted(bs)) {
@@ -346,12 +368,40 @@ static int img_commit(int argc, char **argv)
     return 0;
 }
 
+static int64_t bench_time_us(void)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
 static int is_not_zero(const uint8_t *sector, int len)
 {
-    int i;
-    len >>= 2;
-    for(i = 0;i < len; i++) {
-        if (((uint32_t *)sector)[i] != 0)
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+
+    for(; i + 64 <= len; i += 64) {
+        const __m128i *p = (const __m128i *)(sector + i);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p),
+                                              _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2),
+                                              _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            return 1;
+    }
+#else
+    const unsigned long *p = (const unsigned long *)sector;
+    const int words = 4 * sizeof(unsigned long);
+
+    for(; i + words <= len; i += words, p += 4) {
+        if (p[0] | p[1] | p[2] | p[3])
+            return 1;
+    }
+#endif
+    for(; i < len; i++) {
+        if (sector[i] != 0)
             return 1;
     }
     return 0;
@@ -384,24 +434,335 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
 
 #define IO_BUF_SIZE 65536
 
+/* Requests in flight during a conversion.  */
+#define CONVERT_DEFAULT_REQS    8
+#define CONVERT_MAX_REQS        64
+
+/* Clusters handed to the image format at once by a compressed
+   conversion, so that it can compress them in parallel.  */
+#define CONVERT_COMPRESS_BATCH  (1024 * 1024)
+
+#define CONVERT_FREE            0
+#define CONVERT_READING         1
+#define CONVERT_READ_DONE       2
+#define CONVERT_WRITING         3
+#define CONVERT_WRITE_DONE      4
+
+typedef struct ConvertReq {
+    int state;
+    int ret;
+    int64_t sector_num;         /* first output sector of the buffer */
+    int nb_sectors;
+    int pos;                    /* sectors of the buffer already handled */
+    /* output clusters covered by the write in flight */
+    int64_t lock_start, lock_end;
+    uint8_t *buf;
+} ConvertReq;
+
+static int convert_progress;
+static int64_t convert_start, convert_last_report;
+static int64_t convert_total, convert_done, convert_written;
+
+static void convert_report(int64_t done, int64_t written, int final)
+{
+    int64_t now, elapsed;
+    double mb;
+
+    convert_done += done;
+    convert_written += written;
+    if (!convert_progress)
+        return;
+    now = bench_time_us();
+    if (!final && now - convert_last_report < 250000)
+        return;
+    convert_last_report = now;
+    elapsed = now - convert_start;
+    mb = convert_done / 2048.0;
+    fprintf(stderr, "\r    %5.1f%%  %10.1f MB  %8.1f MB/s",
+            convert_total ? convert_done * 100.0 / convert_total : 100.0,
+            mb, elapsed > 0 ? mb * 1000000.0 / elapsed : 0.0);
+    if (final) {
+        fprintf(stderr, "\n%.1f MB converted in %.2f s, %.1f MB written, "
+                "%.1f MB skipped\n", mb, elapsed / 1000000.0,
+                convert_written / 2048.0,
+                (convert_done - convert_written) / 2048.0);
+    }
+}
+
+static void convert_aio_cb(void *opaque, int ret)
+{
+    ConvertReq *req = opaque;
+
+    req->ret = ret;
+    if (req->state == CONVERT_READING)
+        req->state = CONVERT_READ_DONE;
+    else
+        req->state = CONVERT_WRITE_DONE;
+}
+
+/* Start writing the next run of non-zero sectors of REQ, or release it
+   if there is none left.  Returns 0 if the run must wait for another
+   request writing to the same output clusters: image formats such as
+   qcow2 would allocate a cluster twice for concurrent writes to it.  */
+static int convert_next_write(ConvertReq *reqs, int nb_reqs, ConvertReq *req,
+                              BlockDriverState *out_bs, int cluster_sectors,
+                              int cow)
+{
+    uint8_t *buf;
+    int64_t sector_num;
+    int i, n, n1;
+
+    n = req->nb_sectors - req->pos;
+    buf = req->buf + req->pos * 512;
+    /* NOTE: at the same time we convert, we do not write zero
+       sectors to have a chance to compress the image.  If the output
+       image is being created as a copy on write image, copy all
+       sectors even the ones containing only NUL bytes, because they
+       may differ from the sectors in the base image.  */
+    n1 = n;
+    while (n > 0 && !cow && !is_allocated_sectors(buf, n, &n1)) {
+        req->pos += n1;
+        buf += n1 * 512;
+        n -= n1;
+    }
+    if (n == 0) {
+        req->state = CONVERT_FREE;
+        return 1;
+    }
+
+    sector_num = req->sector_num + req->pos;
+    req->lock_start = sector_num / cluster_sectors;
+    req->lock_end = (sector_num + n1 + cluster_sectors - 1) / cluster_sectors;
+    for (i = 0; i < nb_reqs; i++) {
+        if (reqs[i].state == CONVERT_WRITING &&
+            reqs[i].lock_start < req->lock_end &&
+            req->lock_start < reqs[i].lock_end)
+            return 0;
+    }
+
+    req->pos += n1;
+    req->state = CONVERT_WRITING;
+    convert_report(0, n1, 0);
+    if (!bdrv_aio_write(out_bs, sector_num, buf, n1, convert_aio_cb, req))
+        error("error while writing");
+    return 1;
+}
+
+/* Copy the input images to OUT_BS with NB_REQS reads and writes in
+   flight.  Reads are issued in order; the writes of a request may
+   complete in any order with respect to other requests.  */
+static void convert_copy(BlockDriverState **bs, int bs_n,
+                         BlockDriverState *out_bs, int64_t total_sectors,
+                         int nb_reqs, int cow)
+{
+    ConvertReq reqs[CONVERT_MAX_REQS];
+    BlockDriverInfo bdi;
+    int64_t sector_num, bs_offset;
+    uint64_t bs_sectors;
+    int i, n, n1, bs_i, busy, progress, cluster_sectors;
+
+    cluster_sectors = 1;
+    if (bdrv_get_info(out_bs, &bdi) >= 0 && bdi.cluster_size > 512)
+        cluster_sectors = bdi.cluster_size >> 9;
+
+    memset(reqs, 0, sizeof(reqs));
+    for (i = 0; i < nb_reqs; i++) {
+        reqs[i].buf = qemu_malloc(IO_BUF_SIZE);
+        if (!reqs[i].buf)
+            error("Out of memory");
+    }
+
+    bs_i = 0;
+    bs_offset = 0;
+    bdrv_get_geometry(bs[0], &bs_sectors);
+    sector_num = 0; // total number of sectors converted so far
+    for(;;) {
+        busy = 0;
+        progress = 0;
+        for (i = 0; i < nb_reqs; i++) {
+            ConvertReq *req = &reqs[i];
+
+            if (req->state == CONVERT_FREE && sector_num < total_sectors) {
+                n = IO_BUF_SIZE / 512;
+                if (n > total_sectors - sector_num)
+                    n = total_sectors - sector_num;
+
+                while (sector_num - bs_offset >= bs_sectors) {
+                    bs_i ++;
+                    assert (bs_i < bs_n);
+                    bs_offset += bs_sectors;
+                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
+                }
+
+                if (n > bs_offset + bs_sectors - sector_num)
+                    n = bs_offset + bs_sectors - sector_num;
+
+                /* If the output image is being created as a copy on write
+                   image, assume that sectors which are unallocated in the
+                   input image are present in both the output's and input's
+                   base images (no need to copy them). */
+                if (cow) {
+                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
+                                           n, &n1)) {
+                        sector_num += n1;
+                        convert_report(n1, 0, 0);
+                        progress = 1;
+                        continue;
+                    }
+                    /* The next 'n1' sectors are allocated in the input
+                       image. Copy only those as they may be followed by
+                       unallocated sectors. */
+                    n = n1;
+                }
+
+                req->sector_num = sector_num;
+                req->nb_sectors = n;
+                req->pos = 0;
+                req->state = CONVERT_READING;
+                if (!bdrv_aio_read(bs[bs_i], sector_num - bs_offset,
+                                   req->buf, n, convert_aio_cb, req))
+                    error("error while reading");
+                sector_num += n;
+                progress = 1;
+            }
+
+            if (req->state == CONVERT_READ_DONE ||
+                req->state == CONVERT_WRITE_DONE) {
+                if (req->ret < 0) {
+                    error(req->state == CONVERT_READ_DONE ?
+                          "error while reading" : "error while writing");
+                }
+                if (convert_next_write(reqs, nb_reqs, req, out_bs,
+                                       cluster_sectors, cow)) {
+                    if (req->state == CONVERT_FREE)
+                        convert_report(req->nb_sectors, 0, 0);
+                    progress = 1;
+                }
+            }
+
+            if (req->state != CONVERT_FREE)
+                busy = 1;
+        }
+        if (!busy && sector_num >= total_sectors)
+            break;
+        if (!progress)
+            qemu_aio_wait();
+    }
+
+    for (i = 0; i < nb_reqs; i++)
+        qemu_free(reqs[i].buf);
+}
+
+/* Compress the input images into OUT_BS, a batch of clusters at a
+   time.  The image format compresses the clusters of a batch on
+   THREADS threads.  */
+static void convert_compress(BlockDriverState **bs, int bs_n,
+                             BlockDriverState *out_bs, int64_t total_sectors,
+                             int threads)
+{
+    int n, i, j, bs_i, cluster_size, cluster_sectors, batch_clusters;
+    int64_t sector_num, bs_offset, bs_num;
+    uint64_t bs_sectors;
+    BlockDriverInfo bdi;
+    uint8_t *buf, *buf2;
+
+    if (bdrv_get_info(out_bs, &bdi) < 0)
+        error("could not get block driver info");
+    cluster_size = bdi.cluster_size;
+    if (cluster_size <= 0 || cluster_size > CONVERT_COMPRESS_BATCH)
+        error("invalid cluster size");
+    cluster_sectors = cluster_size >> 9;
+    batch_clusters = CONVERT_COMPRESS_BATCH / cluster_size;
+    buf = qemu_malloc(batch_clusters * cluster_size);
+    if (!buf)
+        error("Out of memory");
+    bdrv_set_compress_threads(out_bs, threads);
+
+    bs_i = 0;
+    bs_offset = 0;
+    bdrv_get_geometry(bs[0], &bs_sectors);
+    sector_num = 0;
+    while (sector_num < total_sectors) {
+        int remainder, nb_clusters;
+
+        if (total_sectors - sector_num >= batch_clusters * cluster_sectors)
+            n = batch_clusters * cluster_sectors;
+        else
+            n = total_sectors - sector_num;
+
+        bs_num = sector_num - bs_offset;
+        assert (bs_num >= 0);
+        remainder = n;
+        buf2 = buf;
+        while (remainder > 0) {
+            int nlow;
+            while (bs_num == bs_sectors) {
+                bs_i++;
+                assert (bs_i < bs_n);
+                bs_offset += bs_sectors;
+                bdrv_get_geometry(bs[bs_i], &bs_sectors);
+                bs_num = 0;
+            }
+            assert (bs_num < bs_sectors);
+
+            nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
+
+            if (bdrv_read(bs[bs_i], bs_num, buf2, nlow) < 0)
+                error("error while reading");
+
+            buf2 += nlow * 512;
+            bs_num += nlow;
+
+            remainder -= nlow;
+        }
+        assert (remainder == 0);
+
+        nb_clusters = (n + cluster_sectors - 1) / cluster_sectors;
+        if (n < nb_clusters * cluster_sectors)
+            memset(buf + n * 512, 0, nb_clusters * cluster_size - n * 512);
+
+        /* hand over each run of non-zero clusters at once */
+        for (i = 0; i < nb_clusters; i = j) {
+            if (!is_not_zero(buf + i * cluster_size, cluster_size)) {
+                j = i + 1;
+                continue;
+            }
+            for (j = i + 1; j < nb_clusters; j++) {
+                if (!is_not_zero(buf + j * cluster_size, cluster_size))
+                    break;
+            }
+            if (bdrv_write_compressed(out_bs,
+                                      sector_num + i * cluster_sectors,
+                                      buf + i * cluster_size,
+                                      (j - i) * cluster_sectors) != 0)
+                error("error while compressing sector %" PRId64,
+                      sector_num + i * cluster_sectors);
+            convert_report(0, (j - i) * cluster_sectors, 0);
+        }
+        sector_num += n;
+        convert_report(n, 0, 0);
+    }
+    /* signal EOF to align */
+    bdrv_write_compressed(out_bs, 0, NULL, 0);
+    qemu_free(buf);
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret, n, n1, bs_n, bs_i, flags, cluster_size, cluster_sectors;
+    int c, ret, bs_n, bs_i, flags, nb_reqs;
     const char *fmt, *out_fmt, *out_baseimg, *out_filename;
     BlockDriver *drv;
     BlockDriverState **bs, *out_bs;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
     uint64_t bs_sectors;
-    uint8_t buf[IO_BUF_SIZE];
-    const uint8_t *buf1;
-    BlockDriverInfo bdi;
 
     fmt = NULL;
     out_fmt = "raw";
     out_baseimg = NULL;
     flags = 0;
+    nb_reqs = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:hce6");
+        c = getopt(argc, argv, "f:O:B:hce6pm:");
         if (c == -1)
             break;
         switch(c) {
@@ -426,6 +787,15 @@ static int img_convert(int argc, char **argv)
         case '6':
             flags |= BLOCK_FLAG_COMPAT6;
             break;
+        case 'p':
+            convert_progress = 1;
+            break;
+        case 'm':
+            nb_reqs = atoi(optarg);
+            if (nb_reqs < 1 || nb_reqs > CONVERT_MAX_REQS)
+                error("The number of requests must be between 1 and %d",
+                      CONVERT_MAX_REQS);
+            break;
         }
     }
 
@@ -473,131 +843,23 @@ static int img_convert(int argc, char **argv)
 
     out_bs = bdrv_new_open(out_filename, out_fmt);
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-
+    convert_total = total_sectors;
+    convert_start = bench_time_us();
     if (flags & BLOCK_FLAG_COMPRESS) {
-        if (bdrv_get_info(out_bs, &bdi) < 0)
-            error("could not get block driver info");
-        cluster_size = bdi.cluster_size;
-        if (cluster_size <= 0 || cluster_size > IO_BUF_SIZE)
-            error("invalid cluster size");
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%lld, "
-                       "bs_i=%d, bs_offset=%lld, bs_sectors=%lld\n",
-                       sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                if (bdrv_read(bs[bs_i], bs_num, buf2, nlow) < 0) 
-                    error("error while reading");
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors)
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            if (is_not_zero(buf, cluster_size)) {
-                if (bdrv_write_compressed(out_bs, sector_num, buf,
-                                          cluster_sectors) != 0)
-                    error("error while compressing sector %" PRId64,
-                          sector_num);
-            }
-            sector_num += n;
+        if (!nb_reqs) {
+            nb_reqs = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+            nb_reqs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
         }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
+        convert_compress(bs, bs_n, out_bs, total_sectors, nb_reqs);
     } else {
-        sector_num = 0; // total number of sectors converted so far
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= (IO_BUF_SIZE / 512))
-                n = (IO_BUF_SIZE / 512);
-            else
-                n = nb_sectors;
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%lld, bs_i=%d, "
-                  "bs_offset=%lld, bs_sectors=%lld\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num)
-                n = bs_offset + bs_sectors - sector_num;
-
-            /* If the output image is being created as a copy on write image,
-               assume that sectors which are unallocated in the input image
-               are present in both the output's and input's base images (no
-               need to copy them). */
-            if (out_baseimg) {
-               if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset, n, &n1)) {
-                  sector_num += n1;
-                  continue;
-               }
-               /* The next 'n1' sectors are allocated in the input image. Copy
-                  only those as they may be followed by unallocated sectors. */
-               n = n1;
-            }
-
-            if (bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n) < 0) 
-                error("error while reading");
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image. */
-                if (out_baseimg || is_allocated_sectors(buf1, n, &n1)) {
-                    if (bdrv_write(out_bs, sector_num, buf1, n1) < 0)
-                        error("error while writing");
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-        }
+        if (!nb_reqs)
+            nb_reqs = CONVERT_DEFAULT_REQS;
+        convert_copy(bs, bs_n, out_bs, total_sectors, nb_reqs,
+                     out_baseimg != NULL);
     }
+    convert_report(0, 0, 1);
     bdrv_delete(out_bs);
     for (bs_i = 0; bs_i < bs_n; bs_i++)
         bdrv_delete(bs[bs_i]);
@@ -732,6 +994,172 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+#define BENCH_MAX_DEPTH 256
+
+typedef struct BenchReq {
+    int busy;
+    int64_t start;
+    uint8_t *buf;
+} BenchReq;
+
+static int bench_in_flight;
+static int64_t bench_latency;
+
+static void bench_aio_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+
+    if (ret < 0)
+        error("I/O error %d", ret);
+    bench_latency += bench_time_us() - req->start;
+    bench_in_flight--;
+    req->busy = 0;
+}
+
+/* Random 4K reads or writes over the whole image, to measure the cost
+   of the image format for a guest doing random I/O.  With a depth, the
+   requests are asynchronous and that many are kept in flight, which
+   compares the host AIO engines.  */
+static int img_bench(int argc, char **argv)
+{
+    int c, i, j, write = 0, count = 10000, depth = 0;
+    const char *filename, *fmt = NULL, *p;
+    BlockDriverState *bs;
+    BlockDriverInfo bdi;
+    uint64_t total_sectors, nb_blocks, rand = 0x2545f4914f6cdd1dULL;
+    BenchReq reqs[BENCH_MAX_DEPTH];
+    int64_t start, elapsed;
+
+    for(;;) {
+        c = getopt(argc, argv, "f:n:C:t:a:d:wh");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'n':
+            count = strtol(optarg, NULL, 0);
+            break;
+        case 'C':
+            p = optarg;
+            metadata_cache_size = strtoll(p, (char **)&p, 0);
+            if (*p == 'M')
+                metadata_cache_size *= 1024 * 1024;
+            else if (*p == 'k' || *p == 'K')
+                metadata_cache_size *= 1024;
+            break;
+        case 't':
+            if (!strcmp(optarg, "none"))
+                open_flags = BDRV_O_NOCACHE;
+            else if (!strcmp(optarg, "writethrough"))
+                open_flags = 0;
+            else if (!strcmp(optarg, "writeback"))
+                open_flags = BDRV_O_CACHE_WB;
+            else
+                error("Invalid cache mode '%s'", optarg);
+            break;
+        case 'a':
+            if (!strcmp(optarg, "native"))
+                open_flags |= BDRV_O_NATIVE_AIO;
+            else if (!strcmp(optarg, "threads"))
+                open_flags &= ~BDRV_O_NATIVE_AIO;
+            else
+                error("Invalid AIO engine '%s'", optarg);
+            break;
+        case 'd':
+            depth = strtol(optarg, NULL, 0);
+            if (depth < 1 || depth > BENCH_MAX_DEPTH)
+                error("The depth must be between 1 and %d", BENCH_MAX_DEPTH);
+            break;
+        case 'w':
+            write = 1;
+            break;
+        }
+    }
+    if (optind >= argc || count <= 0)
+        help();
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt);
+    bdrv_get_geometry(bs, &total_sectors);
+    nb_blocks = total_sectors / 8;
+    if (nb_blocks == 0)
+        error("Image too small");
+    memset(reqs, 0, sizeof(reqs));
+    for (j = 0; j < (depth ? depth : 1); j++) {
+        /* aligned for cache=none */
+        reqs[j].buf = qemu_memalign(512, 4096);
+        memset(reqs[j].buf, 0xa5, 4096);
+    }
+
+    start = bench_time_us();
+    for (i = 0; i < count; i++) {
+        int64_t sector_num;
+        BenchReq *req = &reqs[0];
+
+        /* xorshift: the same offsets on every run */
+        rand ^= rand << 13;
+        rand ^= rand >> 7;
+        rand ^= rand << 17;
+        sector_num = (rand % nb_blocks) * 8;
+        if (depth) {
+            while (bench_in_flight == depth)
+                qemu_aio_wait();
+            for (j = 0; reqs[j].busy; j++)
+                ;
+            req = &reqs[j];
+            req->busy = 1;
+            req->start = bench_time_us();
+            bench_in_flight++;
+            if (write) {
+                if (!bdrv_aio_write(bs, sector_num, req->buf, 8,
+                                    bench_aio_cb, req))
+                    error("error while writing sector %" PRId64, sector_num);
+            } else {
+                if (!bdrv_aio_read(bs, sector_num, req->buf, 8,
+                                   bench_aio_cb, req))
+                    error("error while reading sector %" PRId64, sector_num);
+            }
+        } else if (write) {
+            if (bdrv_write(bs, sector_num, req->buf, 8) < 0)
+                error("error while writing sector %" PRId64, sector_num);
+        } else {
+            if (bdrv_read(bs, sector_num, req->buf, 8) < 0)
+                error("error while reading sector %" PRId64, sector_num);
+        }
+    }
+    while (bench_in_flight > 0)
+        qemu_aio_wait();
+    if (write)
+        bdrv_flush(bs);
+    elapsed = bench_time_us() - start;
+    if (elapsed <= 0)
+        elapsed = 1;
+
+    printf("%d random 4K %s in %.3f s: %.0f IOPS, %.1f MB/s\n",
+           count, write ? "writes" : "reads", elapsed / 1e6,
+           count * 1e6 / elapsed, count * 4096.0 / elapsed);
+    if (depth) {
+        printf("depth %d, %s AIO: %.1f us average latency\n", depth,
+               (open_flags & BDRV_O_NATIVE_AIO) ? "native" : "threads",
+               (double)bench_latency / count);
+    }
+    if (bdrv_get_info(bs, &bdi) >= 0 && bdi.metadata_cache_size) {
+        printf("metadata cache: %" PRId64 " KB, %" PRIu64 " hits, %" PRIu64
+               " misses, %" PRIu64 " writebacks\n",
+               bdi.metadata_cache_size / 1024, bdi.metadata_cache_hits,
+               bdi.metadata_cache_misses, bdi.metadata_cache_writes);
+    }
+    for (j = 0; j < (depth ? depth : 1); j++)
+        qemu_free(reqs[j].buf);
+    bdrv_delete(bs);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     const char *cmd;
@@ -749,6 +1177,8 @@ int main(int argc, char **argv)
         img_convert(argc, argv);
     } else if (!strcmp(cmd, "info")) {
         img_info(argc, argv);
+    } else if (!strcmp(cmd, "bench")) {
+        img_bench(argc, argv);
     } else {
         help();
     }
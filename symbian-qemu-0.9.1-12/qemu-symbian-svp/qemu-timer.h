@@ -18,6 +18,9 @@ extern QEMUClock *rt_clock;
 extern QEMUClock *vm_clock;
 
 int64_t qemu_get_clock(QEMUClock *clock);
+/* Host time in ns, for statistics that need a finer resolution than
+   rt_clock.  It does not stop with the virtual machine.  */
+int64_t qemu_get_host_clock(void);
 
 QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque);
 void qemu_free_timer(QEMUTimer *ts);
@@ -20,12 +20,20 @@
 
 QEMUClock *rt_clock;
 
+/* Bottom halves run from qemu_aio_wait(), as they would from the main
+   loop, so that requests started together are also submitted
+   together.  */
 struct QEMUBH
 {
     QEMUBHFunc *cb;
     void *opaque;
+    int scheduled;
+    int deleted;
+    QEMUBH *next;
 };
 
+static QEMUBH *first_bh;
+
 void qemu_service_io(void)
 {
 }
@@ -42,10 +50,12 @@ QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
 
-    bh = qemu_malloc(sizeof(*bh));
+    bh = qemu_mallocz(sizeof(*bh));
     if (bh) {
         bh->cb = cb;
         bh->opaque = opaque;
+        bh->next = first_bh;
+        first_bh = bh;
     }
 
     return bh;
@@ -53,21 +63,45 @@ QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
 
 int qemu_bh_poll(void)
 {
-    return 0;
+    QEMUBH *bh, **bhp;
+    int ret = 0;
+
+    for (bh = first_bh; bh; bh = bh->next) {
+        if (!bh->deleted && bh->scheduled) {
+            bh->scheduled = 0;
+            ret = 1;
+            bh->cb(bh->opaque);
+        }
+    }
+
+    /* remove deleted bhs */
+    bhp = &first_bh;
+    while (*bhp) {
+        bh = *bhp;
+        if (bh->deleted) {
+            *bhp = bh->next;
+            qemu_free(bh);
+        } else
+            bhp = &bh->next;
+    }
+
+    return ret;
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    bh->cb(bh->opaque);
+    bh->scheduled = 1;
 }
 
 void qemu_bh_cancel(QEMUBH *bh)
 {
+    bh->scheduled = 0;
 }
 
 void qemu_bh_delete(QEMUBH *bh)
 {
-    qemu_free(bh);
+    bh->scheduled = 0;
+    bh->deleted = 1;
 }
 
 int qemu_set_fd_handler2(int fd,
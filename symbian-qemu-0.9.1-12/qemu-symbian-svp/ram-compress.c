@@ -0,0 +1,534 @@
+/*
+ * Parallel page compression for savevm and migration
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The RAM stream hands over batches of pages, which are spread over a
+   pool of worker threads.  The calling thread works on the batch as
+   well and returns once every page is done, so the stream itself stays
+   strictly ordered.
+
+   Two codecs are available: raw deflate from zlib, and "fast", a
+   byte-aligned LZ77 coder using the LZ4 block format that trades ratio
+   for speed.  Each page is compressed on its own so that pages can be
+   decompressed independently and in any order.  */
+
+#include "qemu-common.h"
+#include "ram-compress.h"
+#include <zlib.h>
+#ifdef CONFIG_AIO
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+//#define DEBUG_RAM_COMPRESS
+
+#define RAM_COMPRESS_MAX_THREADS 8
+
+typedef struct CompressSlot {
+    z_stream deflate;
+    z_stream inflate;
+    int deflate_ready;
+    int inflate_ready;
+} CompressSlot;
+
+static CompressSlot compress_slots[RAM_COMPRESS_MAX_THREADS];
+static int compress_threads;
+
+/* The batch being processed.  */
+static RamCompressJob *batch_jobs;
+static int batch_size;
+static int batch_next;
+static int batch_done;
+static int batch_method;
+static int batch_decompress;
+static int batch_errors;
+
+#ifdef CONFIG_AIO
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done_cond = PTHREAD_COND_INITIALIZER;
+static int nb_workers;
+#endif
+
+const char *ram_compress_name(int method)
+{
+    switch (method) {
+    case RAM_COMPRESS_NONE:
+        return "none";
+    case RAM_COMPRESS_ZLIB:
+        return "zlib";
+    case RAM_COMPRESS_FAST:
+        return "fast";
+    default:
+        return "unknown";
+    }
+}
+
+int ram_compress_find(const char *name)
+{
+    if (!strcmp(name, "none"))
+        return RAM_COMPRESS_NONE;
+    if (!strcmp(name, "zlib"))
+        return RAM_COMPRESS_ZLIB;
+    if (!strcmp(name, "fast"))
+        return RAM_COMPRESS_FAST;
+    return -1;
+}
+
+/***********************************************************/
+/* fast codec: LZ4 block format */
+
+#define FAST_HASH_LOG           10
+#define FAST_MIN_MATCH          4
+/* The last match must start this far from the end of the input, and
+   the last bytes are always literals.  */
+#define FAST_MFLIMIT            12
+#define FAST_LAST_LITERALS      5
+/* Offsets are 16 bits.  */
+#define FAST_MAX_INPUT          65535
+
+static inline uint32_t fast_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline int fast_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - FAST_HASH_LOG);
+}
+
+static uint8_t *fast_put_length(uint8_t *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Space needed for a sequence with LIT literals and a match of extra
+   length MLEN.  */
+static inline int fast_seq_size(int lit, int mlen)
+{
+    return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+/* Return the compressed size, or 0 if it does not fit in dst_len.  */
+static int fast_compress(const uint8_t *src, int src_len,
+                         uint8_t *dst, int dst_len)
+{
+    uint16_t table[1 << FAST_HASH_LOG];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend = src + src_len;
+    const uint8_t *mflimit = iend - FAST_MFLIMIT;
+    const uint8_t *mlimit = iend - FAST_LAST_LITERALS;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_len;
+    int lit;
+
+    if (src_len > FAST_MAX_INPUT)
+        return 0;
+    if (src_len > FAST_MFLIMIT) {
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < mflimit) {
+            const uint8_t *ref, *mp, *mr;
+            uint32_t v;
+            uint8_t *token;
+            int h, mlen, off;
+
+            v = fast_read32(ip);
+            h = fast_hash(v);
+            ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || fast_read32(ref) != v) {
+                /* Step faster through data that does not compress.  */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            mp = ip + FAST_MIN_MATCH;
+            mr = ref + FAST_MIN_MATCH;
+            while (mp < mlimit && *mp == *mr) {
+                mp++;
+                mr++;
+            }
+            lit = ip - anchor;
+            mlen = mp - ip - FAST_MIN_MATCH;
+            if (fast_seq_size(lit, mlen) > oend - op)
+                return 0;
+
+            token = op++;
+            if (lit >= 15) {
+                *token = 15 << 4;
+                op = fast_put_length(op, lit - 15);
+            } else {
+                *token = lit << 4;
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+            off = ip - ref;
+            *op++ = off;
+            *op++ = off >> 8;
+            if (mlen >= 15) {
+                *token |= 15;
+                op = fast_put_length(op, mlen - 15);
+            } else {
+                *token |= mlen;
+            }
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    lit = iend - anchor;
+    if (1 + lit / 255 + 1 + lit > oend - op)
+        return 0;
+    if (lit >= 15) {
+        *op++ = 15 << 4;
+        op = fast_put_length(op, lit - 15);
+    } else {
+        *op++ = lit << 4;
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+static int fast_get_length(const uint8_t **pip, const uint8_t *iend, int *len)
+{
+    const uint8_t *ip = *pip;
+    int b;
+
+    do {
+        if (ip >= iend)
+            return -1;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    *pip = ip;
+    return 0;
+}
+
+/* Return the decompressed size, or -1 if the input is corrupt.  */
+static int fast_decompress(const uint8_t *src, int src_len,
+                           uint8_t *dst, int dst_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_len;
+
+    for (;;) {
+        const uint8_t *ref;
+        int token, lit, mlen, off;
+
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15 && fast_get_length(&ip, iend, &lit) < 0)
+            return -1;
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > op - dst)
+            return -1;
+        mlen = token & 15;
+        if (mlen == 15 && fast_get_length(&ip, iend, &mlen) < 0)
+            return -1;
+        mlen += FAST_MIN_MATCH;
+        if (mlen > oend - op)
+            return -1;
+        ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            /* The match overlaps its own output, copy bytewise.  */
+            while (mlen--)
+                *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
+
+/***********************************************************/
+/* zlib codec */
+
+static int zlib_compress(CompressSlot *s, const uint8_t *src, int src_len,
+                         uint8_t *dst, int dst_len)
+{
+    z_stream *zs = &s->deflate;
+
+    if (!s->deflate_ready) {
+        if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return 0;
+        s->deflate_ready = 1;
+    } else {
+        deflateReset(zs);
+    }
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = src_len;
+    zs->next_out = dst;
+    zs->avail_out = dst_len;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    return dst_len - zs->avail_out;
+}
+
+static int zlib_decompress(CompressSlot *s, const uint8_t *src, int src_len,
+                           uint8_t *dst, int dst_len)
+{
+    z_stream *zs = &s->inflate;
+
+    if (!s->inflate_ready) {
+        if (inflateInit2(zs, -MAX_WBITS) != Z_OK)
+            return -1;
+        s->inflate_ready = 1;
+    } else {
+        inflateReset(zs);
+    }
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = src_len;
+    zs->next_out = dst;
+    zs->avail_out = dst_len;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END)
+        return -1;
+    return dst_len - zs->avail_out;
+}
+
+/***********************************************************/
+/* worker pool */
+
+/* Return 0 on success, -1 if the input of a decompression is corrupt.  */
+static int ram_compress_job(CompressSlot *s, RamCompressJob *job,
+                            int method, int decompress)
+{
+    int len;
+
+    if (decompress) {
+        if (job->src_len == job->dst_len) {
+            memcpy(job->dst, job->src, job->src_len);
+            return 0;
+        }
+        switch (method) {
+        case RAM_COMPRESS_ZLIB:
+            len = zlib_decompress(s, job->src, job->src_len,
+                                  job->dst, job->dst_len);
+            break;
+        case RAM_COMPRESS_FAST:
+            len = fast_decompress(job->src, job->src_len,
+                                  job->dst, job->dst_len);
+            break;
+        default:
+            len = -1;
+            break;
+        }
+        return len == job->dst_len ? 0 : -1;
+    }
+
+    /* Keep one byte of margin so that compressed data is always shorter
+       than the page and can be told apart from a raw copy.  */
+    switch (method) {
+    case RAM_COMPRESS_ZLIB:
+        len = zlib_compress(s, job->src, job->src_len,
+                            job->dst, job->src_len - 1);
+        break;
+    case RAM_COMPRESS_FAST:
+        len = fast_compress(job->src, job->src_len,
+                            job->dst, job->src_len - 1);
+        break;
+    default:
+        len = 0;
+        break;
+    }
+    if (len <= 0) {
+        memcpy(job->dst, job->src, job->src_len);
+        len = job->src_len;
+    }
+    job->dst_len = len;
+    return 0;
+}
+
+/* Run the jobs of the current batch until there are none left.  Called
+   and returns with batch_lock held.  */
+static void ram_compress_work(CompressSlot *s)
+{
+    while (batch_next < batch_size) {
+        RamCompressJob *job = &batch_jobs[batch_next++];
+        int ret;
+
+#ifdef CONFIG_AIO
+        pthread_mutex_unlock(&batch_lock);
+#endif
+        ret = ram_compress_job(s, job, batch_method, batch_decompress);
+#ifdef CONFIG_AIO
+        pthread_mutex_lock(&batch_lock);
+#endif
+        if (ret < 0)
+            batch_errors++;
+        if (++batch_done == batch_size) {
+#ifdef CONFIG_AIO
+            pthread_cond_signal(&batch_done_cond);
+#endif
+        }
+    }
+}
+
+#ifdef CONFIG_AIO
+static void *ram_compress_thread(void *opaque)
+{
+    CompressSlot *s = opaque;
+    sigset_t set;
+
+    /* block all signals */
+    sigfillset(&set);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&batch_lock);
+    for (;;) {
+        while (batch_next >= batch_size)
+            pthread_cond_wait(&batch_work_cond, &batch_lock);
+        ram_compress_work(s);
+    }
+    return NULL;
+}
+
+/* The workers do not exist in a forked child.  */
+static void ram_compress_child(void)
+{
+    pthread_mutex_init(&batch_lock, NULL);
+    pthread_cond_init(&batch_work_cond, NULL);
+    pthread_cond_init(&batch_done_cond, NULL);
+    nb_workers = 0;
+}
+
+static void ram_compress_start_workers(void)
+{
+    static int atfork_done;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (!atfork_done) {
+        pthread_atfork(NULL, NULL, ram_compress_child);
+        atfork_done = 1;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (nb_workers < compress_threads - 1) {
+        if (pthread_create(&thread, &attr, ram_compress_thread,
+                           &compress_slots[nb_workers + 1]) != 0) {
+            fprintf(stderr, "ram compression: could not create thread, "
+                    "using %d\n", nb_workers + 1);
+            compress_threads = nb_workers + 1;
+            break;
+        }
+        nb_workers++;
+    }
+    pthread_attr_destroy(&attr);
+}
+#endif
+
+void ram_compress_set_threads(int threads)
+{
+    if (threads < 1)
+        threads = 1;
+    if (threads > RAM_COMPRESS_MAX_THREADS)
+        threads = RAM_COMPRESS_MAX_THREADS;
+#ifndef CONFIG_AIO
+    threads = 1;
+#endif
+    compress_threads = threads;
+}
+
+int ram_compress_get_threads(void)
+{
+    if (!compress_threads) {
+        int n = 1;
+#if defined(CONFIG_AIO) && defined(_SC_NPROCESSORS_ONLN)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        ram_compress_set_threads(n);
+    }
+    return compress_threads;
+}
+
+/* Compress or decompress NB_JOBS pages with METHOD.  Returns once all of
+   them are done, -1 if any of them could not be decompressed.  */
+int ram_compress_run(RamCompressJob *jobs, int nb_jobs, int method,
+                     int decompress)
+{
+    int threaded = 0;
+
+#ifdef CONFIG_AIO
+    if (ram_compress_get_threads() > 1 && nb_jobs > 1) {
+        if (nb_workers < compress_threads - 1)
+            ram_compress_start_workers();
+        threaded = 1;
+    }
+    /* Even when the workers are left out of a batch, they may exist and
+       ram_compress_work() drops the lock around each job.  */
+    pthread_mutex_lock(&batch_lock);
+#endif
+    batch_jobs = jobs;
+    batch_size = nb_jobs;
+    batch_next = 0;
+    batch_done = 0;
+    batch_method = method;
+    batch_decompress = decompress;
+    batch_errors = 0;
+#ifdef CONFIG_AIO
+    if (threaded)
+        pthread_cond_broadcast(&batch_work_cond);
+#endif
+    ram_compress_work(&compress_slots[0]);
+#ifdef CONFIG_AIO
+    if (threaded) {
+        while (batch_done < batch_size)
+            pthread_cond_wait(&batch_done_cond, &batch_lock);
+    }
+#endif
+    batch_jobs = NULL;
+    batch_size = 0;
+    batch_next = 0;
+#ifdef CONFIG_AIO
+    pthread_mutex_unlock(&batch_lock);
+#endif
+#ifdef DEBUG_RAM_COMPRESS
+    if (batch_errors)
+        fprintf(stderr, "ram compression: %d corrupt pages\n", batch_errors);
+#endif
+    return batch_errors ? -1 : 0;
+}
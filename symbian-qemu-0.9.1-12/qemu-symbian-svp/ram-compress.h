@@ -0,0 +1,26 @@
+#ifndef RAM_COMPRESS_H
+#define RAM_COMPRESS_H
+
+/* Parallel compression of guest pages for savevm and migration.  */
+
+#define RAM_COMPRESS_NONE       0
+#define RAM_COMPRESS_ZLIB       1
+#define RAM_COMPRESS_FAST       2
+
+typedef struct RamCompressJob {
+    const uint8_t *src;
+    int src_len;
+    uint8_t *dst;
+    /* Size of dst.  On compression, set to the compressed size, which
+       is src_len if the data did not compress and was copied.  */
+    int dst_len;
+} RamCompressJob;
+
+const char *ram_compress_name(int method);
+int ram_compress_find(const char *name);
+void ram_compress_set_threads(int threads);
+int ram_compress_get_threads(void);
+int ram_compress_run(RamCompressJob *jobs, int nb_jobs, int method,
+                     int decompress);
+
+#endif
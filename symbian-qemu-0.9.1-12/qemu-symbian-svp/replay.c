@@ -0,0 +1,745 @@
+/*
+ * Deterministic record/replay
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* With a fixed -icount shift, virtual time only advances with the guest
+   instructions, and the host alarm no longer interrupts the CPU while
+   recording or replaying: it only leaves cpu_exec() when its instruction
+   budget runs out, when it halts or when the guest itself asks for it.
+   Every main loop iteration then starts at the same instruction on each
+   run, and so do the points in main_loop_wait() where handlers run
+   (REPLAY_PHASE_*).  An input is identified by the iteration and phase
+   it was delivered in, which the replay reproduces by delivering it at
+   the end of the same phase.
+
+   Inputs that the guest reads while it runs (host time, hostfs) are
+   simply returned from the log in order.
+
+   The log starts with a header:
+
+     "QRPL", version, icount shift             (unsigned varints)
+
+   followed by records:
+
+     kind | phase << 4                         (byte)
+     iteration delta                           (unsigned varint)
+     icount delta                              (signed varint)
+     payload length                            (unsigned varint)
+     payload
+
+   Varints are LEB128, with signed ones zigzag encoded first.  The
+   icount of each record is only used to detect that a replay diverged.
+   Snapshot records hold a savevm image of the machine; a replay can
+   start from one instead of from the beginning of the log to reach a
+   given instruction quickly.  */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "exec-all.h"
+#include "hw/hw.h"
+#include "console.h"
+#include "sysemu.h"
+#include "qemu-timer.h"
+#include "replay.h"
+
+#define REPLAY_MAGIC            "QRPL"
+#define REPLAY_VERSION          1
+
+#define REPLAY_EVENT_END        0
+#define REPLAY_EVENT_CHR_READ   1   /* chardev id, data */
+#define REPLAY_EVENT_CHR_EVENT  2   /* chardev id, event */
+#define REPLAY_EVENT_PACKET     3   /* vlan id, data */
+#define REPLAY_EVENT_VALUE      4   /* value */
+#define REPLAY_EVENT_HOSTFS     5   /* result, 4 args, (addr, len, data)* */
+#define REPLAY_EVENT_SNAPSHOT   6   /* savevm image */
+#define REPLAY_EVENT_MAX        7
+
+/* Longest run of guest code between two main loop iterations, in ns of
+   virtual time.  The host alarm does not interrupt the CPU any more, so
+   a guest with no timer armed would otherwise starve the I/O handlers.  */
+#define REPLAY_MAX_SLICE        10000000
+
+static const char * const replay_event_names[REPLAY_EVENT_MAX] = {
+    "end", "chardev input", "chardev event", "packet", "host value",
+    "hostfs", "snapshot",
+};
+
+typedef struct ReplayEvent {
+    int kind;
+    int phase;
+    uint64_t iteration;
+    int64_t icount;
+    int len;
+    off_t offset;
+} ReplayEvent;
+
+typedef struct ReplaySnapshot {
+    off_t offset;
+    int len;
+    uint64_t iteration;
+    int64_t icount;
+} ReplaySnapshot;
+
+int replay_mode;
+
+static FILE *replay_file;
+static char replay_filename[1024];
+static int replay_icount_shift;
+
+/* Main loop iteration and phase the next input belongs to.  */
+static uint64_t replay_iteration;
+static int replay_phase = REPLAY_PHASE_BH;
+
+/* Values the deltas of the next record are relative to.  */
+static uint64_t replay_last_iteration;
+static int64_t replay_last_icount;
+
+/* Payload being built, or read back.  */
+static uint8_t *replay_buf;
+static int replay_buf_len;
+static int replay_buf_size;
+static int replay_buf_pos;
+
+/* Recording.  */
+static int64_t replay_snapshot_interval;
+static int64_t replay_next_snapshot;
+static int replay_hostfs_writes;
+
+/* Replaying.  */
+static ReplayEvent replay_next;
+static int replay_finished;
+static int64_t replay_stop_icount = -1;
+static int64_t replay_seek_icount = -1;
+/* End of the slice that stopping at replay_stop_icount cut short.  */
+static int64_t replay_slice_end = -1;
+static ReplaySnapshot *replay_snapshots;
+static int replay_nb_snapshots;
+
+static uint64_t replay_event_count[REPLAY_EVENT_MAX];
+static uint64_t replay_divergences;
+
+static int64_t replay_get_icount(void)
+{
+    CPUState *env = cpu_single_env;
+    int64_t icount = qemu_icount;
+
+    if (env)
+        icount -= env->icount_decr.u16.low + env->icount_extra;
+    return icount;
+}
+
+static void replay_buf_reserve(int len)
+{
+    if (replay_buf_len + len > replay_buf_size) {
+        replay_buf_size = (replay_buf_len + len) * 2;
+        replay_buf = qemu_realloc(replay_buf, replay_buf_size);
+    }
+}
+
+static void replay_buf_put(const void *data, int len)
+{
+    replay_buf_reserve(len);
+    memcpy(replay_buf + replay_buf_len, data, len);
+    replay_buf_len += len;
+}
+
+static void replay_buf_put_uint(uint64_t v)
+{
+    uint8_t b[10];
+    int n = 0;
+
+    while (v >= 0x80) {
+        b[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    b[n++] = v;
+    replay_buf_put(b, n);
+}
+
+static uint64_t replay_buf_get_uint(void)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    uint8_t b;
+
+    do {
+        if (replay_buf_pos >= replay_buf_len)
+            return 0;
+        b = replay_buf[replay_buf_pos++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+static void replay_put_uint(uint64_t v)
+{
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, replay_file);
+        v >>= 7;
+    }
+    putc(v, replay_file);
+}
+
+static int replay_get_uint(uint64_t *v)
+{
+    int shift = 0;
+    int b;
+
+    *v = 0;
+    do {
+        b = getc(replay_file);
+        if (b == EOF)
+            return -1;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return 0;
+}
+
+static uint64_t zigzag_encode(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (v >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t v)
+{
+    return (v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Append a record with the payload in replay_buf.  */
+static void replay_write_event(int kind)
+{
+    int64_t icount = replay_get_icount();
+
+    putc(kind | (replay_phase << 4), replay_file);
+    replay_put_uint(replay_iteration - replay_last_iteration);
+    replay_put_uint(zigzag_encode(icount - replay_last_icount));
+    replay_put_uint(replay_buf_len);
+    fwrite(replay_buf, 1, replay_buf_len, replay_file);
+    replay_last_iteration = replay_iteration;
+    replay_last_icount = icount;
+    replay_event_count[kind]++;
+    replay_buf_len = 0;
+}
+
+/* Read the header of the next record.  Returns -1 at the end of the
+   log.  */
+static int replay_read_header(ReplayEvent *ev)
+{
+    uint64_t iteration, icount, len;
+    int b;
+
+    b = getc(replay_file);
+    if (b == EOF || replay_get_uint(&iteration) < 0 ||
+        replay_get_uint(&icount) < 0 || replay_get_uint(&len) < 0)
+        return -1;
+    ev->kind = b & 0xf;
+    ev->phase = b >> 4;
+    ev->iteration = replay_last_iteration + iteration;
+    ev->icount = replay_last_icount + zigzag_decode(icount);
+    ev->len = len;
+    ev->offset = ftello(replay_file);
+    replay_last_iteration = ev->iteration;
+    replay_last_icount = ev->icount;
+    return 0;
+}
+
+static int replay_read_payload(ReplayEvent *ev)
+{
+    replay_buf_len = 0;
+    replay_buf_pos = 0;
+    replay_buf_reserve(ev->len);
+    fseeko(replay_file, ev->offset, SEEK_SET);
+    if (fread(replay_buf, 1, ev->len, replay_file) != (size_t)ev->len)
+        return -1;
+    replay_buf_len = ev->len;
+    return 0;
+}
+
+/* Move on to the next input, skipping snapshots.  */
+static void replay_fetch(void)
+{
+    for (;;) {
+        if (replay_read_header(&replay_next) < 0 ||
+            replay_next.kind >= REPLAY_EVENT_MAX) {
+            fprintf(stderr, "replay: %s is truncated\n", replay_filename);
+            replay_next.kind = REPLAY_EVENT_END;
+            replay_next.iteration = 0;
+            replay_next.len = 0;
+            return;
+        }
+        if (replay_next.kind != REPLAY_EVENT_SNAPSHOT)
+            return;
+        fseeko(replay_file, replay_next.offset + replay_next.len, SEEK_SET);
+    }
+}
+
+static void replay_diverged(const char *what)
+{
+    if (!replay_divergences)
+        fprintf(stderr, "replay: diverged from the log at iteration %"
+                PRIu64 ", icount %" PRId64 ": %s\n",
+                replay_iteration, replay_get_icount(), what);
+    replay_divergences++;
+}
+
+static void replay_consumed(void)
+{
+    if (replay_next.icount != replay_get_icount())
+        replay_diverged("instruction count differs");
+    replay_event_count[replay_next.kind]++;
+    fseeko(replay_file, replay_next.offset + replay_next.len, SEEK_SET);
+    replay_fetch();
+}
+
+static int replay_event_due(void)
+{
+    if (replay_finished)
+        return 0;
+    return replay_next.iteration < replay_iteration ||
+           (replay_next.iteration == replay_iteration &&
+            replay_next.phase <= replay_phase);
+}
+
+/* Deliver the asynchronous inputs of the phase that just ended.  */
+static void replay_run_events(void)
+{
+    int id;
+
+    while (replay_event_due()) {
+        if (replay_read_payload(&replay_next) < 0) {
+            replay_next.kind = REPLAY_EVENT_END;
+            continue;
+        }
+        switch (replay_next.kind) {
+        case REPLAY_EVENT_END:
+            fprintf(stderr, "replay: end of %s at icount %" PRId64 "\n",
+                    replay_filename, replay_get_icount());
+            replay_event_count[REPLAY_EVENT_END]++;
+            replay_finished = 1;
+            qemu_system_shutdown_request();
+            return;
+        case REPLAY_EVENT_CHR_READ:
+            id = replay_buf_get_uint();
+            qemu_chr_replay_read(id, replay_buf + replay_buf_pos,
+                                 replay_buf_len - replay_buf_pos);
+            break;
+        case REPLAY_EVENT_CHR_EVENT:
+            id = replay_buf_get_uint();
+            qemu_chr_replay_event(id, replay_buf_get_uint());
+            break;
+        case REPLAY_EVENT_PACKET:
+            id = replay_buf_get_uint();
+            qemu_replay_packet(id, replay_buf + replay_buf_pos,
+                               replay_buf_len - replay_buf_pos);
+            break;
+        default:
+            /* Read by the guest in the phase that ended, or not at all.  */
+            replay_diverged("guest did not read a logged input");
+            break;
+        }
+        replay_consumed();
+    }
+}
+
+/* Return the payload of the next record if it is a KIND input read by
+   the guest, or NULL.  */
+static const uint8_t *replay_sync_event(int kind)
+{
+    ReplayEvent ev;
+
+    if (replay_mode != REPLAY_PLAY || replay_finished)
+        return NULL;
+    /* Asynchronous inputs logged earlier in the same phase came first.  */
+    if (replay_next.kind != kind)
+        replay_run_events();
+    ev = replay_next;
+    if (ev.kind != kind || replay_read_payload(&ev) < 0) {
+        replay_diverged("guest read an input that is not in the log");
+        return NULL;
+    }
+    return replay_buf;
+}
+
+void replay_chr_read(int id, const uint8_t *buf, int len)
+{
+    replay_buf_put_uint(id);
+    replay_buf_put(buf, len);
+    replay_write_event(REPLAY_EVENT_CHR_READ);
+}
+
+void replay_chr_event(int id, int event)
+{
+    replay_buf_put_uint(id);
+    replay_buf_put_uint(event);
+    replay_write_event(REPLAY_EVENT_CHR_EVENT);
+}
+
+void replay_net_packet(int vlan_id, const uint8_t *buf, int size)
+{
+    replay_buf_put_uint(vlan_id);
+    replay_buf_put(buf, size);
+    replay_write_event(REPLAY_EVENT_PACKET);
+}
+
+/* Return VALUE, read from the host, or the value logged in its place.  */
+int64_t replay_host_value(int64_t value)
+{
+    if (replay_mode == REPLAY_RECORD) {
+        replay_buf_put_uint(zigzag_encode(value));
+        replay_write_event(REPLAY_EVENT_VALUE);
+    } else if (replay_sync_event(REPLAY_EVENT_VALUE)) {
+        value = zigzag_decode(replay_buf_get_uint());
+        replay_consumed();
+    }
+    return value;
+}
+
+/* Guest memory written by the hostfs command being recorded.  */
+void replay_hostfs_write(uint64_t addr, const uint8_t *buf, int len)
+{
+    replay_hostfs_writes++;
+    replay_buf_put_uint(addr);
+    replay_buf_put_uint(len);
+    replay_buf_put(buf, len);
+}
+
+/* Record the result of a hostfs command, or replay it in place of
+   running the command.  */
+void replay_hostfs_done(uint32_t *result, uint32_t *args)
+{
+    uint8_t *writes;
+    int writes_len, i;
+    uint64_t addr, len;
+
+    if (replay_mode == REPLAY_RECORD) {
+        writes_len = replay_hostfs_writes ? replay_buf_len : 0;
+        writes = qemu_malloc(writes_len + 1);
+        memcpy(writes, replay_buf, writes_len);
+        replay_buf_len = 0;
+        replay_buf_put_uint(*result);
+        for (i = 0; i < 4; i++)
+            replay_buf_put_uint(args[i]);
+        replay_buf_put(writes, writes_len);
+        qemu_free(writes);
+        replay_hostfs_writes = 0;
+        replay_write_event(REPLAY_EVENT_HOSTFS);
+        return;
+    }
+
+    if (!replay_sync_event(REPLAY_EVENT_HOSTFS)) {
+        *result = -1;
+        return;
+    }
+    *result = replay_buf_get_uint();
+    for (i = 0; i < 4; i++)
+        args[i] = replay_buf_get_uint();
+    while (replay_buf_pos < replay_buf_len) {
+        addr = replay_buf_get_uint();
+        len = replay_buf_get_uint();
+        if (len > replay_buf_len - replay_buf_pos)
+            break;
+        cpu_physical_memory_write(addr, replay_buf + replay_buf_pos, len);
+        replay_buf_pos += len;
+    }
+    replay_consumed();
+}
+
+static int replay_snapshot_put(void *opaque, const uint8_t *buf,
+                               int64_t pos, int size)
+{
+    replay_buf_put(buf, size);
+    return size;
+}
+
+static int replay_snapshot_get(void *opaque, uint8_t *buf,
+                               int64_t pos, int size)
+{
+    if (pos >= replay_buf_len)
+        return 0;
+    if (size > replay_buf_len - pos)
+        size = replay_buf_len - pos;
+    memcpy(buf, replay_buf + pos, size);
+    return size;
+}
+
+static void replay_save_snapshot(void)
+{
+    QEMUFile *f;
+    int ret;
+
+    replay_buf_len = 0;
+    f = qemu_fopen_ops(NULL, replay_snapshot_put, NULL, NULL, NULL);
+    ret = qemu_savevm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        fprintf(stderr, "replay: could not save a snapshot, error %d\n", ret);
+        replay_buf_len = 0;
+        replay_snapshot_interval = 0;
+        return;
+    }
+    replay_write_event(REPLAY_EVENT_SNAPSHOT);
+    replay_next_snapshot = qemu_get_clock(vm_clock) + replay_snapshot_interval;
+}
+
+static int replay_load_snapshot(ReplaySnapshot *sn)
+{
+    ReplayEvent ev;
+    QEMUFile *f;
+    int ret;
+
+    ev.offset = sn->offset;
+    ev.len = sn->len;
+    if (replay_read_payload(&ev) < 0)
+        return -EIO;
+    f = qemu_fopen_ops(NULL, NULL, replay_snapshot_get, NULL, NULL);
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0)
+        return ret;
+    /* Guest code may have changed under the translated blocks.  */
+    tb_flush(first_cpu);
+
+    replay_iteration = replay_last_iteration = sn->iteration;
+    replay_last_icount = sn->icount;
+    replay_phase = REPLAY_PHASE_BH;
+    replay_slice_end = -1;
+    replay_finished = 0;
+    fseeko(replay_file, sn->offset + sn->len, SEEK_SET);
+    replay_fetch();
+    return 0;
+}
+
+/* Find the snapshots, so that seeking does not need to read the log.  */
+static void replay_scan(void)
+{
+    ReplayEvent ev;
+    off_t start = ftello(replay_file);
+
+    while (replay_read_header(&ev) == 0) {
+        if (ev.kind == REPLAY_EVENT_SNAPSHOT) {
+            replay_snapshots = qemu_realloc(replay_snapshots,
+                (replay_nb_snapshots + 1) * sizeof(ReplaySnapshot));
+            replay_snapshots[replay_nb_snapshots].offset = ev.offset;
+            replay_snapshots[replay_nb_snapshots].len = ev.len;
+            replay_snapshots[replay_nb_snapshots].iteration = ev.iteration;
+            replay_snapshots[replay_nb_snapshots].icount = ev.icount;
+            replay_nb_snapshots++;
+        }
+        if (fseeko(replay_file, ev.offset + ev.len, SEEK_SET) < 0)
+            break;
+    }
+    clearerr(replay_file);
+    fseeko(replay_file, start, SEEK_SET);
+    replay_last_iteration = 0;
+    replay_last_icount = 0;
+}
+
+/* Run to instruction ICOUNT, from the closest snapshot before it unless
+   the replay is already on the way there, and stop the VM.  */
+static void replay_do_seek(int64_t icount)
+{
+    ReplaySnapshot *sn = NULL;
+    int64_t now = replay_get_icount();
+    int i, ret;
+
+    for (i = 0; i < replay_nb_snapshots; i++) {
+        if (replay_snapshots[i].icount <= icount)
+            sn = &replay_snapshots[i];
+    }
+    if (icount < now || (sn && sn->icount > now)) {
+        if (!sn) {
+            fprintf(stderr, "replay: no snapshot before icount %" PRId64
+                    "\n", icount);
+            return;
+        }
+        vm_stop(0);
+        ret = replay_load_snapshot(sn);
+        if (ret < 0) {
+            fprintf(stderr, "replay: could not load the snapshot at icount %"
+                    PRId64 ", error %d\n", sn->icount, ret);
+            return;
+        }
+    }
+    replay_stop_icount = icount;
+    vm_start();
+}
+
+void replay_checkpoint(int phase)
+{
+    if (replay_mode == REPLAY_NONE)
+        return;
+    if (replay_mode == REPLAY_PLAY) {
+        replay_run_events();
+        /* Snapshots are taken at the end of the main loop iteration:
+           load them at the same point, so that the CPU runs next.  */
+        if (phase == REPLAY_PHASE_BH && replay_seek_icount >= 0) {
+            replay_do_seek(replay_seek_icount);
+            replay_seek_icount = -1;
+        }
+    }
+    if (phase == REPLAY_PHASE_ENTER && vm_running) {
+        int64_t now = replay_get_icount();
+        int iteration = 1;
+
+        if (replay_stop_icount >= 0 && now >= replay_stop_icount) {
+            fprintf(stderr, "replay: stopped at icount %" PRId64 "\n", now);
+            replay_stop_icount = -1;
+            vm_stop(0);
+            /* The recording did not come back to the main loop in the
+               middle of a slice.  */
+            if (replay_slice_end > now)
+                iteration = 0;
+        }
+        replay_iteration += iteration;
+    }
+    replay_phase = phase;
+
+    if (replay_mode == REPLAY_RECORD && phase == REPLAY_PHASE_BH &&
+        replay_snapshot_interval && vm_running &&
+        qemu_get_clock(vm_clock) >= replay_next_snapshot)
+        replay_save_snapshot();
+}
+
+/* Limit the instruction budget of the CPU to COUNT, so that it comes
+   back to the main loop in time, and stops at the seek target.  */
+int64_t replay_icount_budget(int64_t count)
+{
+    int64_t max = REPLAY_MAX_SLICE >> replay_icount_shift;
+    int64_t now = replay_get_icount();
+
+    if (count > max)
+        count = max;
+    /* After a stop, finish the slice that was recorded so that the
+       main loop iterations stay in step with the log.  */
+    if (replay_slice_end > now && count > replay_slice_end - now)
+        count = replay_slice_end - now;
+    replay_slice_end = -1;
+    if (replay_stop_icount >= 0) {
+        max = replay_stop_icount - now;
+        if (count > max) {
+            replay_slice_end = now + count;
+            count = max > 0 ? max : 0;
+        }
+    }
+    return count;
+}
+
+static void replay_close(void)
+{
+    if (!replay_file)
+        return;
+    if (replay_mode == REPLAY_RECORD) {
+        replay_buf_len = 0;
+        replay_write_event(REPLAY_EVENT_END);
+    }
+    fclose(replay_file);
+    replay_file = NULL;
+}
+
+/* Open the log given to -record or -replay.  ICOUNT_SHIFT is the -icount
+   value to record, and is replaced with the recorded one on replay.  */
+int replay_start(int mode, const char *optarg, int *icount_shift)
+{
+    char buf[32];
+    uint64_t version, shift;
+    const char *p;
+
+    p = get_opt_value(replay_filename, sizeof(replay_filename), optarg);
+    if (*p == ',')
+        p++;
+    if (mode == REPLAY_RECORD) {
+        if (get_param_value(buf, sizeof(buf), "snapshot", p))
+            replay_snapshot_interval = strtoll(buf, NULL, 0) * 1000000000LL;
+        replay_file = fopen(replay_filename, "wb");
+        if (!replay_file)
+            goto fail;
+        setvbuf(replay_file, NULL, _IOFBF, 65536);
+        fwrite(REPLAY_MAGIC, 1, 4, replay_file);
+        replay_put_uint(REPLAY_VERSION);
+        replay_put_uint(*icount_shift);
+    } else {
+        if (get_param_value(buf, sizeof(buf), "seek", p))
+            replay_seek_icount = strtoll(buf, NULL, 0);
+        replay_file = fopen(replay_filename, "rb");
+        if (!replay_file)
+            goto fail;
+        if (fread(buf, 1, 4, replay_file) != 4 ||
+            memcmp(buf, REPLAY_MAGIC, 4) ||
+            replay_get_uint(&version) < 0 || version != REPLAY_VERSION ||
+            replay_get_uint(&shift) < 0) {
+            fprintf(stderr, "qemu: %s is not a replay log\n",
+                    replay_filename);
+            fclose(replay_file);
+            return -1;
+        }
+        *icount_shift = shift;
+        replay_scan();
+        replay_fetch();
+    }
+    replay_icount_shift = *icount_shift;
+    replay_mode = mode;
+    atexit(replay_close);
+    return 0;
+
+fail:
+    fprintf(stderr, "qemu: could not open replay log '%s'\n",
+            replay_filename);
+    return -1;
+}
+
+void do_info_replay(void)
+{
+    int i;
+
+    if (replay_mode == REPLAY_NONE) {
+        term_printf("replay: off\n");
+        return;
+    }
+    term_printf("%s %s, icount shift %d\n",
+                replay_mode == REPLAY_RECORD ? "recording" : "replaying",
+                replay_filename, replay_icount_shift);
+    term_printf("iteration %" PRIu64 ", icount %" PRId64 ", log offset %"
+                PRId64 "\n", replay_iteration, replay_get_icount(),
+                (int64_t)ftello(replay_file));
+    if (replay_mode == REPLAY_PLAY) {
+        term_printf("snapshots: %d", replay_nb_snapshots);
+        for (i = 0; i < replay_nb_snapshots; i++)
+            term_printf(" %" PRId64, replay_snapshots[i].icount);
+        term_printf("\ndivergences: %" PRIu64 "\n", replay_divergences);
+    }
+    term_printf("%-16s %10s\n", "input", "count");
+    for (i = 0; i < REPLAY_EVENT_MAX; i++) {
+        if (replay_event_count[i])
+            term_printf("%-16s %10" PRIu64 "\n", replay_event_names[i],
+                        replay_event_count[i]);
+    }
+}
+
+void do_replay_seek(const char *icount)
+{
+    if (replay_mode != REPLAY_PLAY) {
+        term_printf("Not replaying\n");
+        return;
+    }
+    /* Seek from the main loop, between two iterations.  */
+    replay_seek_icount = strtoll(icount, NULL, 0);
+}
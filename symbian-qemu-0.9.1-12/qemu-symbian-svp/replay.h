@@ -0,0 +1,46 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/* Deterministic record/replay.  With -icount, guest execution only
+   depends on the inputs that come from the host: character device and
+   network backend input, host time and hostfs results.  -record logs
+   each of them together with the point of the main loop where it was
+   delivered, and -replay feeds them back from the log instead of the
+   host, so that the guest runs instruction for instruction the same.  */
+
+#define REPLAY_NONE             0
+#define REPLAY_RECORD           1
+#define REPLAY_PLAY             2
+
+/* Points of main_loop_wait() where asynchronous input is delivered.  */
+#define REPLAY_PHASE_ENTER      0   /* before polling the handlers */
+#define REPLAY_PHASE_POLLED     1   /* before waiting for I/O */
+#define REPLAY_PHASE_IO         2   /* after the I/O handlers */
+#define REPLAY_PHASE_TIMERS     3   /* after the timers */
+#define REPLAY_PHASE_BH         4   /* after the bottom halves */
+
+extern int replay_mode;
+
+int replay_start(int mode, const char *optarg, int *icount_shift);
+void replay_checkpoint(int phase);
+int64_t replay_icount_budget(int64_t count);
+void do_info_replay(void);
+void do_replay_seek(const char *icount);
+
+/* Asynchronous input.  */
+void replay_chr_read(int id, const uint8_t *buf, int len);
+void replay_chr_event(int id, int event);
+void replay_net_packet(int vlan_id, const uint8_t *buf, int size);
+
+/* Synchronous input, read by the guest while it runs.  */
+int64_t replay_host_value(int64_t value);
+void replay_hostfs_write(uint64_t addr, const uint8_t *buf, int len);
+void replay_hostfs_done(uint32_t *result, uint32_t *args);
+
+/* Implemented by the character device and network layers, to deliver
+   input read from the log.  */
+void qemu_chr_replay_read(int id, uint8_t *buf, int len);
+void qemu_chr_replay_event(int id, int event);
+void qemu_replay_packet(int vlan_id, const uint8_t *buf, int size);
+
+#endif
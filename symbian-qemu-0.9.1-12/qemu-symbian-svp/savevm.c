@@ -32,6 +32,7 @@
 #include "audio/audio.h"
 #include "migration.h"
 #include "qemu_socket.h"
+#include "snapshot-store.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -307,6 +308,18 @@ fail:
     return NULL;
 }
 
+/* Return the host file descriptor of a plain file opened with
+   qemu_fopen, or -1 for other kinds of QEMUFile.  */
+int qemu_file_fd(QEMUFile *f)
+{
+    QEMUFileStdio *s = f->opaque;
+
+    if (f->put_buffer != file_put_buffer && f->get_buffer != file_get_buffer)
+        return -1;
+    fflush(s->outfile);
+    return fileno(s->outfile);
+}
+
 typedef struct QEMUFileBdrv
 {
     BlockDriverState *bs;
@@ -377,6 +390,17 @@ int qemu_file_has_error(QEMUFile *f)
     return f->has_error;
 }
 
+void qemu_file_set_error(QEMUFile *f)
+{
+    f->has_error = 1;
+}
+
+/* Number of bytes read ahead and not consumed yet.  */
+int qemu_file_pending(QEMUFile *f)
+{
+    return f->buf_size - f->buf_index;
+}
+
 void qemu_fflush(QEMUFile *f)
 {
     if (!f->put_buffer)
@@ -1016,20 +1040,38 @@ static void do_savevm_file(const char *name)
 {
     QEMUFile *f;
     int saved_vm_running;
+    int ret;
+    char tmp_name[1024];
 
     qemu_aio_flush();
     saved_vm_running = vm_running;
     vm_stop(0);
 
-    f = qemu_fopen(name, "wb");
+    /* Guest RAM may be mapped from the file we are replacing, so write
+       a new file and rename it over the old one.  */
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+    f = qemu_fopen(tmp_name, "wb");
     if (!f) {
         term_printf("Unable to create snapshot\n");
-        return;
+        goto the_end;
     }
 
-    qemu_savevm_state(f);
+    ret = qemu_savevm_state(f);
     qemu_fclose(f);
+    if (ret < 0) {
+        term_printf("Error %d while writing VM\n", ret);
+        unlink(tmp_name);
+        goto the_end;
+    }
+#ifdef _WIN32
+    unlink(name);
+#endif
+    if (rename(tmp_name, name) < 0) {
+        term_printf("Unable to create snapshot\n");
+        unlink(tmp_name);
+    }
 
+ the_end:
     if (saved_vm_running)
         vm_start();
 }
@@ -1053,6 +1095,14 @@ void do_savevm(const char *name)
         do_savevm_file(name + 5);
         return;
     }
+    if (strncmp(name, "store:", 6) == 0) {
+        if (snapshot_store_open(name + 6) == 0) {
+            snapshot_store_saving = 1;
+            do_savevm_file(name + 6);
+            snapshot_store_saving = 0;
+        }
+        return;
+    }
 
     bs = get_bs_snapshots();
     if (!bs) {
@@ -1146,24 +1196,30 @@ static void do_loadvm_file(const char *name)
     QEMUFile *f;
     int saved_vm_running;
     int ret;
+    int64_t start;
 
     qemu_aio_flush();
 
     saved_vm_running = vm_running;
     vm_stop(0);
 
+    start = qemu_get_clock(rt_clock);
     f = qemu_fopen(name, "rb");
     if (!f) {
         term_printf("Unable to open snapshot\n");
-        return;
+        goto the_end;
     }
 
     ret = qemu_loadvm_state(f);
     qemu_fclose(f);
     if (ret < 0) {
         term_printf("Error %d while loading VM state\n", ret);
+    } else {
+        term_printf("Snapshot restored in %" PRId64 " ms\n",
+                    qemu_get_clock(rt_clock) - start);
     }
 
+ the_end:
     if (saved_vm_running)
         vm_start();
 }
@@ -1181,6 +1237,11 @@ void do_loadvm(const char *name)
         do_loadvm_file(name + 5);
         return;
     }
+    if (strncmp(name, "store:", 6) == 0) {
+        if (snapshot_store_open(name + 6) == 0)
+            do_loadvm_file(name + 6);
+        return;
+    }
     bs = get_bs_snapshots();
     if (!bs) {
         term_printf("No block device supports snapshots\n");
@@ -19,7 +19,12 @@
 
 int mbuf_alloced = 0;
 struct mbuf m_freelist, m_usedlist;
-#define MBUF_THRESH 30
+/*
+ * Mbufs beyond this many are freed rather than kept on the free list.
+ * Many parallel connections keep a few hundred in flight, and going
+ * through malloc for each of them shows up in profiles.
+ */
+#define MBUF_THRESH 256
 int mbuf_max = 0;
 
 /*
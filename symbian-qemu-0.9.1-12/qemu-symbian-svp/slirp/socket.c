@@ -24,6 +24,69 @@ so_init()
 }
 #endif
 
+/*
+ * Hash tables of the sockets in tcb and udb, so that the socket of a
+ * packet from the guest is found without walking the whole list.
+ * TCP sockets are hashed on both ends of the connection, UDP sockets
+ * only on the local end, which is all udp_input matches.
+ * sohash() must be called whenever the addresses of a socket are set.
+ */
+#define SO_HASH_SIZE 512
+
+static struct socket *tcb_hash[SO_HASH_SIZE];
+static struct socket *udb_hash[SO_HASH_SIZE];
+
+static inline u_int
+so_hashfn(u_int32_t laddr, u_int lport, u_int32_t faddr, u_int fport)
+{
+	u_int32_t h;
+
+	h = laddr ^ faddr ^ (lport << 16) ^ fport;
+	h ^= h >> 16;
+	h ^= h >> 8;
+	return h & (SO_HASH_SIZE - 1);
+}
+
+void
+sounhash(so)
+	struct socket *so;
+{
+	struct socket **p;
+
+	if (!so->so_hchain)
+	   return;
+	for (p = so->so_hchain; *p; p = &(*p)->so_hnext) {
+		if (*p == so) {
+			*p = so->so_hnext;
+			break;
+		}
+	}
+	so->so_hchain = NULL;
+	so->so_hnext = NULL;
+}
+
+void
+sohash(so)
+	struct socket *so;
+{
+	struct socket **chain;
+
+	sounhash(so);
+	if (so->so_tcpcb)
+	   chain = &tcb_hash[so_hashfn(so->so_laddr.s_addr, so->so_lport,
+				       so->so_faddr.s_addr, so->so_fport)];
+	else
+	   chain = &udb_hash[so_hashfn(so->so_laddr.s_addr, so->so_lport,
+				       0, 0)];
+	so->so_hnext = *chain;
+	*chain = so;
+	so->so_hchain = chain;
+}
+
+/*
+ * Find the socket of a packet from the guest.  For UDP (head == &udb)
+ * only the local address and port are compared.
+ */
 struct socket *
 solookup(head, laddr, lport, faddr, fport)
 	struct socket *head;
@@ -34,18 +97,25 @@ solookup(head, laddr, lport, faddr, fport)
 {
 	struct socket *so;
 
-	for (so = head->so_next; so != head; so = so->so_next) {
+	if (head == &udb) {
+		so = udb_hash[so_hashfn(laddr.s_addr, lport, 0, 0)];
+		for (; so; so = so->so_hnext) {
+			if (so->so_lport == lport &&
+			    so->so_laddr.s_addr == laddr.s_addr)
+			   break;
+		}
+		return so;
+	}
+
+	so = tcb_hash[so_hashfn(laddr.s_addr, lport, faddr.s_addr, fport)];
+	for (; so; so = so->so_hnext) {
 		if (so->so_lport == lport &&
 		    so->so_laddr.s_addr == laddr.s_addr &&
 		    so->so_faddr.s_addr == faddr.s_addr &&
 		    so->so_fport == fport)
 		   break;
 	}
-
-	if (so == head)
-	   return (struct socket *)NULL;
 	return so;
-
 }
 
 /*
@@ -85,6 +155,7 @@ sofree(so)
 
   m_free(so->so_m);
 
+  sounhash(so);
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
@@ -608,6 +679,7 @@ solisten(port, laddr, lport, flags)
 	   so->so_faddr = alias_addr;
 	else
 	   so->so_faddr = addr.sin_addr;
+	sohash(so);
 
 	so->s = s;
 	return so;
@@ -19,6 +19,8 @@
 
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  struct socket *so_hnext;		/* Next socket in the hash chain */
+  struct socket **so_hchain;		/* Hash chain the socket is in */
 
   int s;                           /* The actual socket */
 
@@ -74,6 +76,8 @@ struct socket {
 extern struct socket tcb;
 
 struct socket * solookup _P((struct socket *, struct in_addr, u_int, struct in_addr, u_int));
+void sohash _P((struct socket *));
+void sounhash _P((struct socket *));
 struct socket * socreate _P((void));
 void sofree _P((struct socket *));
 int soread _P((struct socket *));
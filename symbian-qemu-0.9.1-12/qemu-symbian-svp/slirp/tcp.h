@@ -44,8 +44,12 @@ typedef	u_int32_t	tcp_seq;
 
 extern struct socket *tcp_last_so;
 
-#define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+/*
+ * Socket buffer sizes.  Large enough for a full window without scaling,
+ * so that soread/sowrite move a lot of data per system call.
+ */
+#define TCP_SNDSPACE 65536
+#define TCP_RCVSPACE 65536
 
 /*
  * TCP header.
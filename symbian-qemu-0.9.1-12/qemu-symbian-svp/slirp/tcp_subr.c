@@ -494,6 +494,7 @@ tcp_connect(inso)
 	/* Translate connections from localhost to the real hostname */
 	if (so->so_faddr.s_addr == 0 || so->so_faddr.s_addr == loopback_addr.s_addr)
 	   so->so_faddr = alias_addr;
+	sohash(so);
 
 	/* Close the accept() socket, set right state */
 	if (inso->so_state & SS_FACCEPTONCE) {
@@ -837,6 +838,7 @@ tcp_emu(so, m)
 				if (ns->so_faddr.s_addr == 0 ||
 					ns->so_faddr.s_addr == loopback_addr.s_addr)
                   ns->so_faddr = alias_addr;
+				sohash(ns);
 
 				ns->so_iptos = tcp_tos(ns);
 				tp = sototcpcb(ns);
@@ -0,0 +1,684 @@
+/*
+ *  Incremental, deduplicated snapshot store
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A store is a directory holding three files:
+
+     store.pages   guest pages, each stored once whatever the number of
+                   snapshots or addresses it appears at
+     store.hashes  content hash of each page of store.pages
+     store.maps    log of page maps, one per snapshot
+
+   A map lists (guest page, pool page) pairs for the pages that changed
+   since its parent map, or for all of RAM when it has no parent.  Maps
+   are only ever appended and are identified by their offset in the log,
+   so overwriting a snapshot file never breaks the snapshots saved after
+   it.  The snapshot file itself is a normal savevm file whose RAM
+   section only holds the map offset.
+
+   Pages written since the last store snapshot are found with the
+   SNAPSHOT_DIRTY_FLAG bit of the dirty bitmap.  Restoring only copies
+   the pages that differ from what guest RAM currently holds.  */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "exec-all.h"
+#include "hw/hw.h"
+#include "console.h"
+#include "sysemu.h"
+#include "qemu-timer.h"
+#include "snapshot-store.h"
+
+//#define DEBUG_SNAPSHOT_STORE
+
+#define STORE_MAGIC             0x53535351 /* "QSSS" */
+#define STORE_MAP_MAGIC         0x4d535351 /* "QSSM" */
+#define STORE_VERSION           1
+
+/* Write a full map rather than a delta once the chain gets this long,
+   so that restoring never has to walk more than this many maps.  */
+#define STORE_MAX_DEPTH         32
+
+/* New pages are buffered and appended to the pool in batches.  */
+#define STORE_WRITE_BATCH       256
+
+/* Maximum number of pages read with a single request on restore.  */
+#define STORE_READ_BATCH        64
+
+#define STORE_NO_PAGE           0xffffffffu
+
+#define STORE_HASH_MUL          0x9e3779b97f4a7c15ULL
+
+typedef struct StoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t reserved;
+} StoreHeader;
+
+/* Followed by 'nb_entries' StoreMapEntry.  */
+typedef struct StoreMapHeader {
+    uint32_t magic;
+    uint32_t nb_entries;
+    uint32_t depth;
+    uint32_t reserved;
+    int64_t parent;
+    uint64_t ram_size;
+} StoreMapHeader;
+
+typedef struct StoreMapEntry {
+    uint32_t page;
+    uint32_t index;
+} StoreMapEntry;
+
+int snapshot_store_saving;
+
+static char *store_dir;
+static int store_pages_fd = -1;
+static int store_hashes_fd = -1;
+static int store_maps_fd = -1;
+static int64_t store_maps_size;
+static int store_error;
+
+static uint64_t *store_hashes;
+static uint32_t store_hashes_size;
+static uint32_t store_nb_pages;
+static uint32_t store_nb_flushed;
+static uint8_t *store_pending;
+static uint32_t *store_table;
+static uint32_t store_table_mask;
+static uint32_t store_zero_page = STORE_NO_PAGE;
+
+/* Pool page held by each guest page.  Only valid for pages that were
+   not written since store_head was saved or restored.  */
+static uint32_t *store_ram_map;
+static int64_t store_head = -1;
+static uint32_t store_head_depth;
+
+static int64_t store_saves;
+static int64_t store_save_time;
+static int64_t store_last_save_time;
+static int64_t store_last_dirty;
+static int64_t store_last_entries;
+static int64_t store_last_new;
+static int64_t store_dedup_hits;
+static int64_t store_bytes_written;
+static int64_t store_logical_bytes;
+static int64_t store_restores;
+static int64_t store_restore_time;
+static int64_t store_last_restore_time;
+static int64_t store_last_copied;
+static int64_t store_last_skipped;
+
+#ifdef _WIN32
+static ssize_t store_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    if (lseek(fd, offset, SEEK_SET) != offset)
+        return -1;
+    return read(fd, buf, len);
+}
+
+static ssize_t store_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    if (lseek(fd, offset, SEEK_SET) != offset)
+        return -1;
+    return write(fd, buf, len);
+}
+#else
+#define store_pread pread
+#define store_pwrite pwrite
+#endif
+
+static inline uint32_t store_ram_pages(void)
+{
+    return phys_ram_size >> TARGET_PAGE_BITS;
+}
+
+static uint64_t store_hash_page(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = 0;
+    int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / 8; i++) {
+        h = (h ^ w[i]) * STORE_HASH_MUL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static int store_is_zero_page(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / 8; i++) {
+        if (w[i])
+            return 0;
+    }
+    return 1;
+}
+
+static void store_table_insert(uint32_t index)
+{
+    uint32_t slot = store_hashes[index] & store_table_mask;
+
+    while (store_table[slot] != STORE_NO_PAGE)
+        slot = (slot + 1) & store_table_mask;
+    store_table[slot] = index;
+}
+
+/* Keep the table at most half full.  */
+static void store_table_resize(void)
+{
+    uint32_t size, i;
+
+    size = 4096;
+    while (size < store_nb_pages * 2 + 2)
+        size <<= 1;
+    if (store_table && size == store_table_mask + 1)
+        return;
+    qemu_free(store_table);
+    store_table = qemu_malloc(size * sizeof(uint32_t));
+    memset(store_table, 0xff, size * sizeof(uint32_t));
+    store_table_mask = size - 1;
+    for (i = 0; i < store_nb_pages; i++)
+        store_table_insert(i);
+}
+
+static int store_read_page(uint32_t index, uint8_t *buf)
+{
+    if (index >= store_nb_flushed) {
+        memcpy(buf, store_pending + (index - store_nb_flushed) *
+               TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+        return 0;
+    }
+    if (store_pread(store_pages_fd, buf, TARGET_PAGE_SIZE,
+                    (off_t)index * TARGET_PAGE_SIZE) != TARGET_PAGE_SIZE)
+        return -1;
+    return 0;
+}
+
+/* Hashes only select candidates, a match is always checked against the
+   stored data.  */
+static uint32_t store_find_page(const uint8_t *p, uint64_t hash)
+{
+    uint8_t buf[TARGET_PAGE_SIZE];
+    uint32_t slot, index;
+
+    slot = hash & store_table_mask;
+    while ((index = store_table[slot]) != STORE_NO_PAGE) {
+        if (store_hashes[index] == hash && store_read_page(index, buf) == 0
+            && memcmp(buf, p, TARGET_PAGE_SIZE) == 0)
+            return index;
+        slot = (slot + 1) & store_table_mask;
+    }
+    return STORE_NO_PAGE;
+}
+
+static void store_flush(void)
+{
+    uint32_t n = store_nb_pages - store_nb_flushed;
+    size_t len;
+
+    if (n == 0)
+        return;
+    len = (size_t)n * TARGET_PAGE_SIZE;
+    if (store_pwrite(store_pages_fd, store_pending, len,
+                     (off_t)store_nb_flushed * TARGET_PAGE_SIZE) != len)
+        store_error = 1;
+    len = n * sizeof(uint64_t);
+    if (store_pwrite(store_hashes_fd, store_hashes + store_nb_flushed, len,
+                     sizeof(StoreHeader)
+                     + (off_t)store_nb_flushed * sizeof(uint64_t)) != len)
+        store_error = 1;
+    store_bytes_written += (int64_t)n * (TARGET_PAGE_SIZE + sizeof(uint64_t));
+    store_nb_flushed = store_nb_pages;
+}
+
+/* Return the pool page holding the contents of P, adding it if needed.  */
+static uint32_t store_add_page(const uint8_t *p)
+{
+    uint64_t hash;
+    uint32_t index;
+    int zero;
+
+    zero = store_is_zero_page(p);
+    if (zero && store_zero_page != STORE_NO_PAGE) {
+        store_dedup_hits++;
+        return store_zero_page;
+    }
+    hash = store_hash_page(p);
+    index = store_find_page(p, hash);
+    if (index != STORE_NO_PAGE) {
+        store_dedup_hits++;
+        return index;
+    }
+
+    if (store_nb_pages - store_nb_flushed == STORE_WRITE_BATCH)
+        store_flush();
+    if (store_nb_pages == store_hashes_size) {
+        store_hashes_size = store_hashes_size ? store_hashes_size * 2 : 4096;
+        store_hashes = qemu_realloc(store_hashes,
+                                    store_hashes_size * sizeof(uint64_t));
+    }
+    index = store_nb_pages++;
+    store_hashes[index] = hash;
+    memcpy(store_pending + (index - store_nb_flushed) * TARGET_PAGE_SIZE, p,
+           TARGET_PAGE_SIZE);
+    if (store_nb_pages * 2 + 2 > store_table_mask + 1)
+        store_table_resize();
+    else
+        store_table_insert(index);
+    if (zero)
+        store_zero_page = index;
+    return index;
+}
+
+static void store_close(void)
+{
+    if (store_pages_fd >= 0)
+        close(store_pages_fd);
+    if (store_hashes_fd >= 0)
+        close(store_hashes_fd);
+    if (store_maps_fd >= 0)
+        close(store_maps_fd);
+    store_pages_fd = store_hashes_fd = store_maps_fd = -1;
+    qemu_free(store_dir);
+    qemu_free(store_hashes);
+    qemu_free(store_pending);
+    qemu_free(store_table);
+    qemu_free(store_ram_map);
+    store_dir = NULL;
+    store_hashes = NULL;
+    store_pending = NULL;
+    store_table = NULL;
+    store_ram_map = NULL;
+    store_hashes_size = store_nb_pages = store_nb_flushed = 0;
+    store_zero_page = STORE_NO_PAGE;
+    store_head = -1;
+}
+
+/* Open FILE in the store directory and check or write its header if
+   it has one.  Returns the file size.  */
+static int64_t store_open_file(const char *file, int has_header, int *pfd)
+{
+    char name[1024];
+    StoreHeader hdr;
+    struct stat st;
+    int fd;
+
+    snprintf(name, sizeof(name), "%s/%s", store_dir, file);
+    fd = open(name, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        term_printf("Could not open %s: %s\n", name, strerror(errno));
+        goto fail;
+    }
+    *pfd = fd;
+    if (!has_header)
+        return st.st_size;
+    if (st.st_size == 0) {
+        hdr.magic = STORE_MAGIC;
+        hdr.version = STORE_VERSION;
+        hdr.page_size = TARGET_PAGE_SIZE;
+        hdr.reserved = 0;
+        if (store_pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            goto fail;
+        return sizeof(hdr);
+    }
+    if (store_pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+        || hdr.magic != STORE_MAGIC || hdr.version != STORE_VERSION
+        || hdr.page_size != TARGET_PAGE_SIZE) {
+        term_printf("%s is not a snapshot store for this target\n", name);
+        goto fail;
+    }
+    return st.st_size;
+ fail:
+    if (fd >= 0)
+        close(fd);
+    *pfd = -1;
+    return -1;
+}
+
+static char *store_dirname(const char *path)
+{
+    const char *p;
+    char *dir;
+
+    p = strrchr(path, '/');
+#ifdef _WIN32
+    if (strrchr(path, '\\') > p)
+        p = strrchr(path, '\\');
+#endif
+    if (!p)
+        return qemu_strdup(".");
+    if (p == path)
+        return qemu_strdup("/");
+    dir = qemu_malloc(p - path + 1);
+    memcpy(dir, path, p - path);
+    dir[p - path] = '\0';
+    return dir;
+}
+
+/* Use the store in the directory of snapshot file PATH.  */
+int snapshot_store_open(const char *path)
+{
+    int64_t pages_size, hashes_size;
+    uint8_t zero[TARGET_PAGE_SIZE];
+    char *dir;
+    size_t len;
+
+    dir = store_dirname(path);
+    if (store_dir && strcmp(dir, store_dir) == 0) {
+        qemu_free(dir);
+        return 0;
+    }
+    store_close();
+    store_dir = dir;
+
+    pages_size = store_open_file("store.pages", 0, &store_pages_fd);
+    hashes_size = store_open_file("store.hashes", 1, &store_hashes_fd);
+    store_maps_size = store_open_file("store.maps", 1, &store_maps_fd);
+    if (pages_size < 0 || hashes_size < 0 || store_maps_size < 0) {
+        store_close();
+        return -1;
+    }
+
+    /* Pages are written before their hashes, ignore anything left over
+       by an interrupted save.  */
+    store_nb_pages = (hashes_size - sizeof(StoreHeader)) / sizeof(uint64_t);
+    if (store_nb_pages > pages_size / TARGET_PAGE_SIZE)
+        store_nb_pages = pages_size / TARGET_PAGE_SIZE;
+    store_nb_flushed = store_nb_pages;
+    store_hashes_size = store_nb_pages + 4096;
+    store_hashes = qemu_malloc(store_hashes_size * sizeof(uint64_t));
+    len = store_nb_pages * sizeof(uint64_t);
+    if (store_pread(store_hashes_fd, store_hashes, len, sizeof(StoreHeader))
+        != len) {
+        term_printf("Could not read the snapshot store index\n");
+        store_close();
+        return -1;
+    }
+    store_table_resize();
+    memset(zero, 0, sizeof(zero));
+    store_zero_page = store_find_page(zero, store_hash_page(zero));
+
+    store_pending = qemu_malloc(STORE_WRITE_BATCH * TARGET_PAGE_SIZE);
+    store_ram_map = qemu_malloc(store_ram_pages() * sizeof(uint32_t));
+    store_error = 0;
+
+    store_saves = store_save_time = store_last_save_time = 0;
+    store_last_dirty = store_last_entries = store_last_new = 0;
+    store_dedup_hits = store_bytes_written = store_logical_bytes = 0;
+    store_restores = store_restore_time = store_last_restore_time = 0;
+    store_last_copied = store_last_skipped = 0;
+#ifdef DEBUG_SNAPSHOT_STORE
+    fprintf(stderr, "snapshot store: %s: %u pages, %" PRId64 " bytes of maps\n",
+            store_dir, store_nb_pages, store_maps_size);
+#endif
+    return 0;
+}
+
+/* Guest RAM was replaced by something that is not a store snapshot.  */
+void snapshot_store_forget(void)
+{
+    store_head = -1;
+}
+
+/* Save the guest RAM of a "store:" snapshot.  The VM is stopped.  */
+int snapshot_store_save_ram(QEMUFile *f)
+{
+    StoreMapHeader hdr;
+    StoreMapEntry *entries;
+    uint32_t nb_pages, page, index, new_pages;
+    ram_addr_t addr;
+    int64_t start, id, dirty;
+    size_t len;
+    int clean;
+
+    if (!store_dir)
+        return -1;
+    start = qemu_get_clock(rt_clock);
+    nb_pages = store_ram_pages();
+    entries = qemu_malloc(nb_pages * sizeof(StoreMapEntry));
+
+    hdr.magic = STORE_MAP_MAGIC;
+    hdr.nb_entries = 0;
+    hdr.depth = store_head_depth + 1;
+    hdr.reserved = 0;
+    hdr.parent = store_head;
+    hdr.ram_size = phys_ram_size;
+    if (store_head < 0 || hdr.depth > STORE_MAX_DEPTH) {
+        hdr.parent = -1;
+        hdr.depth = 0;
+    }
+
+    new_pages = store_nb_pages;
+    dirty = 0;
+    for (page = 0; page < nb_pages; page++) {
+        addr = (ram_addr_t)page << TARGET_PAGE_BITS;
+        clean = store_head >= 0
+            && !cpu_physical_memory_get_dirty(addr, SNAPSHOT_DIRTY_FLAG);
+        if (clean) {
+            if (hdr.parent >= 0)
+                continue;
+            index = store_ram_map[page];
+        } else {
+            dirty++;
+            index = store_add_page(host_ram_addr(addr));
+            /* Rewritten with the same contents.  */
+            if (hdr.parent >= 0 && index == store_ram_map[page])
+                continue;
+            store_ram_map[page] = index;
+        }
+        entries[hdr.nb_entries].page = page;
+        entries[hdr.nb_entries].index = index;
+        hdr.nb_entries++;
+    }
+    new_pages = store_nb_pages - new_pages;
+    store_flush();
+
+    id = store_maps_size;
+    len = hdr.nb_entries * sizeof(StoreMapEntry);
+    if (store_pwrite(store_maps_fd, &hdr, sizeof(hdr), id) != sizeof(hdr)
+        || store_pwrite(store_maps_fd, entries, len, id + sizeof(hdr)) != len)
+        store_error = 1;
+    qemu_free(entries);
+    if (store_error) {
+        term_printf("Error while writing to the snapshot store\n");
+        store_error = 0;
+        store_head = -1;
+        return -1;
+    }
+    store_maps_size += sizeof(hdr) + len;
+    store_bytes_written += sizeof(hdr) + len;
+
+    cpu_physical_memory_reset_dirty_all(SNAPSHOT_DIRTY_FLAG);
+    store_head = id;
+    store_head_depth = hdr.depth;
+    qemu_put_be64(f, id);
+
+    store_saves++;
+    store_last_dirty = dirty;
+    store_last_entries = hdr.nb_entries;
+    store_last_new = new_pages;
+    store_logical_bytes += phys_ram_size;
+    store_last_save_time = qemu_get_clock(rt_clock) - start;
+    store_save_time += store_last_save_time;
+    return 0;
+}
+
+/* Resolve map ID and its parents into a pool page for every guest page.  */
+static int store_resolve_map(int64_t id, uint32_t *map, uint32_t *depth)
+{
+    StoreMapHeader hdr;
+    StoreMapEntry *entries, *e;
+    uint32_t nb_pages, filled, i;
+    size_t len;
+
+    nb_pages = store_ram_pages();
+    memset(map, 0xff, nb_pages * sizeof(uint32_t));
+    filled = 0;
+    *depth = STORE_NO_PAGE;
+    while (id >= 0 && filled < nb_pages) {
+        if (store_pread(store_maps_fd, &hdr, sizeof(hdr), id) != sizeof(hdr)
+            || hdr.magic != STORE_MAP_MAGIC || hdr.ram_size != phys_ram_size
+            || hdr.nb_entries > nb_pages)
+            return -1;
+        if (*depth == STORE_NO_PAGE)
+            *depth = hdr.depth;
+        len = hdr.nb_entries * sizeof(StoreMapEntry);
+        entries = qemu_malloc(len + 1);
+        if (store_pread(store_maps_fd, entries, len, id + sizeof(hdr)) != len) {
+            qemu_free(entries);
+            return -1;
+        }
+        /* Newer maps take precedence.  */
+        for (i = 0; i < hdr.nb_entries; i++) {
+            e = &entries[i];
+            if (e->page < nb_pages && map[e->page] == STORE_NO_PAGE
+                && e->index < store_nb_pages) {
+                map[e->page] = e->index;
+                filled++;
+            }
+        }
+        qemu_free(entries);
+        id = hdr.parent;
+    }
+    return filled == nb_pages ? 0 : -1;
+}
+
+/* Restore the guest RAM of a "store:" snapshot.  */
+int snapshot_store_load_ram(QEMUFile *f)
+{
+    uint32_t *map;
+    uint32_t nb_pages, page, n, i, depth;
+    ram_addr_t addr;
+    uint8_t *host;
+    int64_t start, id, copied, skipped;
+    size_t len;
+
+    id = qemu_get_be64(f);
+    if (!store_dir) {
+        term_printf("Snapshot belongs to a store, use loadvm store:\n");
+        return -EINVAL;
+    }
+    start = qemu_get_clock(rt_clock);
+    nb_pages = store_ram_pages();
+    map = qemu_malloc(nb_pages * sizeof(uint32_t));
+    if (store_resolve_map(id, map, &depth) < 0) {
+        term_printf("Snapshot store map at %" PRId64 " is damaged\n", id);
+        qemu_free(map);
+        store_head = -1;
+        return -EINVAL;
+    }
+
+    copied = skipped = 0;
+    for (page = 0; page < nb_pages; page += n) {
+        addr = (ram_addr_t)page << TARGET_PAGE_BITS;
+        if (store_head >= 0 && store_ram_map[page] == map[page]
+            && !cpu_physical_memory_get_dirty(addr, SNAPSHOT_DIRTY_FLAG)) {
+            skipped++;
+            n = 1;
+            continue;
+        }
+        host = host_ram_addr(addr);
+        n = 1;
+        if (map[page] == store_zero_page) {
+            /* Avoid faulting in host pages that were never used.  */
+            if (!store_is_zero_page(host))
+                memset(host, 0, TARGET_PAGE_SIZE);
+        } else if (map[page] >= store_nb_flushed) {
+            store_read_page(map[page], host);
+        } else {
+            /* Read runs of pages that are consecutive in the pool and in
+               host memory with one request.  */
+            while (n < STORE_READ_BATCH && page + n < nb_pages
+                   && map[page + n] == map[page] + n
+                   && map[page + n] < store_nb_flushed
+                   && host_ram_addr(addr + (n << TARGET_PAGE_BITS))
+                      == host + (n << TARGET_PAGE_BITS))
+                n++;
+            len = (size_t)n << TARGET_PAGE_BITS;
+            if (store_pread(store_pages_fd, host, len,
+                            (off_t)map[page] * TARGET_PAGE_SIZE) != len) {
+                term_printf("Error while reading the snapshot store\n");
+                qemu_free(map);
+                store_head = -1;
+                return -EIO;
+            }
+        }
+        copied += n;
+        for (i = 0; i < n; i++)
+            cpu_physical_memory_set_dirty(addr + (i << TARGET_PAGE_BITS));
+    }
+    if (copied)
+        tb_flush(first_cpu);
+
+    memcpy(store_ram_map, map, nb_pages * sizeof(uint32_t));
+    qemu_free(map);
+    cpu_physical_memory_reset_dirty_all(SNAPSHOT_DIRTY_FLAG);
+    store_head = id;
+    store_head_depth = depth;
+
+    store_restores++;
+    store_last_copied = copied;
+    store_last_skipped = skipped;
+    store_last_restore_time = qemu_get_clock(rt_clock) - start;
+    store_restore_time += store_last_restore_time;
+    return 0;
+}
+
+void do_info_snapstore(void)
+{
+    int64_t size;
+
+    if (!store_dir) {
+        term_printf("No snapshot store in use\n");
+        return;
+    }
+    size = (int64_t)store_nb_flushed * (TARGET_PAGE_SIZE + sizeof(uint64_t))
+        + store_maps_size;
+    term_printf("Snapshot store %s:\n", store_dir);
+    term_printf("stored pages        %u (%" PRId64 " KB)\n", store_nb_pages,
+                ((int64_t)store_nb_pages * TARGET_PAGE_SIZE) >> 10);
+    term_printf("store size          %" PRId64 " KB\n", size >> 10);
+    term_printf("saves               %" PRId64 " (%" PRId64 " KB of RAM, "
+                "%" PRId64 " KB written)\n", store_saves,
+                store_logical_bytes >> 10, store_bytes_written >> 10);
+    term_printf("deduplicated pages  %" PRId64 "\n", store_dedup_hits);
+    term_printf("save time           %" PRId64 " ms (last %" PRId64 " ms)\n",
+                store_save_time, store_last_save_time);
+    term_printf("last save           %" PRId64 " dirty, %" PRId64 " recorded, "
+                "%" PRId64 " new pages\n", store_last_dirty,
+                store_last_entries, store_last_new);
+    term_printf("restores            %" PRId64 "\n", store_restores);
+    term_printf("restore time        %" PRId64 " ms (last %" PRId64 " ms)\n",
+                store_restore_time, store_last_restore_time);
+    term_printf("last restore        %" PRId64 " copied, %" PRId64
+                " unchanged pages\n", store_last_copied, store_last_skipped);
+    term_printf("chain depth         %u\n",
+                store_head >= 0 ? store_head_depth : 0);
+}
@@ -0,0 +1,16 @@
+#ifndef SNAPSHOT_STORE_H
+#define SNAPSHOT_STORE_H
+
+/* Incremental snapshot store: guest RAM pages of "store:" snapshots are
+   kept once per content in a pool shared by all snapshots of a
+   directory, and each snapshot only records the pages that changed
+   since its parent.  */
+
+extern int snapshot_store_saving;
+
+int snapshot_store_open(const char *path);
+int snapshot_store_save_ram(QEMUFile *f);
+int snapshot_store_load_ram(QEMUFile *f);
+void snapshot_store_forget(void);
+
+#endif
@@ -51,10 +51,18 @@ void do_savevm(const char *name);
 void do_loadvm(const char *name);
 void do_delvm(const char *name);
 void do_info_snapshots(void);
+void do_info_snapstore(void);
+void do_info_compression(void);
+#ifndef _WIN32
+void do_info_forkserver(void);
+#endif
 
 void qemu_announce_self(void);
 
 void main_loop_wait(int timeout);
+void qemu_notify_event(void);
+void do_info_iohandlers(void);
+void do_info_alarm(void);
 
 int qemu_savevm_state_begin(QEMUFile *f);
 int qemu_savevm_state_iterate(QEMUFile *f);
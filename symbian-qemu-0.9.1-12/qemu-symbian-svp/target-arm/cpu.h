@@ -179,11 +179,16 @@ typedef struct CPUARMState {
         uint32_t scratch[8];
 
         float_status fp_status;
+        /* Nonzero if the host FPU holds exception flags raised by the
+           VFP fast path that are not yet in fp_status.  */
+        int host_flags;
     } vfp;
 #if defined(CONFIG_USER_ONLY)
     struct mmon_state *mmon_entry;
 #else
     uint32_t mmon_addr;
+    /* Nonzero while a store exclusive holds the exclusive lock.  */
+    int mmon_locked;
 #endif
 
     /* iwMMXt coprocessor state.  */
@@ -216,6 +221,8 @@ void cpu_arm_close(CPUARMState *s);
 void do_interrupt(CPUARMState *);
 void switch_mode(CPUARMState *, int);
 uint32_t do_arm_semihosting(CPUARMState *env);
+void vfp_sync_host_flags(CPUARMState *env);
+void cpu_arm_exclusive_release(CPUARMState *env);
 
 /* you can call this signal handler from your SIGBUS and SIGSEGV
    signal handlers to inform the virtual CPU of exceptions. non zero
@@ -351,6 +358,15 @@ static inline int arm_feature(CPUARMState *env, int feature)
     return (env->features & (1u << feature)) != 0;
 }
 
+/* Nonzero when unaligned word and halfword accesses are permitted:
+   ARMv6 unaligned support (U bit) enabled and alignment faults (A bit)
+   disabled.  */
+static inline int arm_unaligned_enabled(CPUARMState *env)
+{
+    return arm_feature(env, ARM_FEATURE_V6)
+           && (env->cp15.c1_sys & ((1 << 22) | (1 << 1))) == (1 << 22);
+}
+
 void arm_cpu_list(FILE *f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
 
 /* Interface between CPU and Interrupt controller.  */
@@ -448,6 +464,8 @@ static inline void cpu_get_tb_cpu_state(CPUState *env, target_ulong *pc,
         *flags |= (1 << 6);
     if (env->vfp.xregs[ARM_VFP_FPEXC] & (1 << 30))
         *flags |= (1 << 7);
+    if (arm_unaligned_enabled(env))
+        *flags |= (1 << 16);
 }
 
 #endif
@@ -7,6 +7,10 @@
 #include "gdbstub.h"
 #include "helpers.h"
 #include "qemu-common.h"
+#include "vfp_fast.h"
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+#include <pthread.h>
+#endif
 
 static uint32_t cortexa8_cp15_c0_c1[8] =
 { 0x1031, 0x11, 0x400, 0, 0x31100003, 0x20000000, 0x01202000, 0x11 };
@@ -521,6 +525,15 @@ void HELPER(clrex)(CPUState *env)
     flush_mmon(env->mmon_entry->addr);
 }
 
+/* Only used by the system emulator with -vcpu-threads.  */
+void HELPER(exclusive_begin)(CPUState *env)
+{
+}
+
+void HELPER(exclusive_end)(CPUState *env)
+{
+}
+
 target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr)
 {
     return addr;
@@ -1248,16 +1261,71 @@ target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr)
 }
 
 /* Not really implemented.  Need to figure out a sane way of doing this.
-   Maybe add generic watchpoint support and use that.  */
+   Maybe add generic watchpoint support and use that.
+
+   With -vcpu-threads, a successful store exclusive and SWP run under
+   the exclusive lock, from the test to the end of the store, so that
+   they cannot interleave with the exclusive accesses of other CPUs.
+   Plain stores do not clear the reservations.  */
+
+#ifdef CONFIG_VCPU_THREADS
+static pthread_mutex_t exclusive_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void arm_exclusive_lock(CPUState *env)
+{
+#ifdef CONFIG_VCPU_THREADS
+    if (cpu_threads_enabled) {
+        pthread_mutex_lock(&exclusive_lock);
+        env->mmon_locked = 1;
+    }
+#endif
+}
+
+void cpu_arm_exclusive_release(CPUState *env)
+{
+#ifdef CONFIG_VCPU_THREADS
+    if (env->mmon_locked) {
+        env->mmon_locked = 0;
+        pthread_mutex_unlock(&exclusive_lock);
+    }
+#endif
+}
 
 void HELPER(mark_exclusive)(CPUState *env, uint32_t addr)
 {
+    /* Wait for a store exclusive in progress on another CPU, so that
+       the load that follows sees its result.  */
+    arm_exclusive_lock(env);
     env->mmon_addr = addr;
+    cpu_arm_exclusive_release(env);
 }
 
 uint32_t HELPER(test_exclusive)(CPUState *env, uint32_t addr)
 {
-    return (env->mmon_addr != addr);
+    CPUState *other;
+
+    arm_exclusive_lock(env);
+    if (env->mmon_addr != addr) {
+        cpu_arm_exclusive_release(env);
+        return 1;
+    }
+    /* The store clears the reservation of every CPU on this address.  */
+    for (other = first_cpu; other != NULL; other = other->next_cpu) {
+        if (other->mmon_addr == addr)
+            other->mmon_addr = -1;
+    }
+    return 0;
+}
+
+void HELPER(exclusive_begin)(CPUState *env)
+{
+    arm_exclusive_lock(env);
+}
+
+void HELPER(exclusive_end)(CPUState *env)
+{
+    cpu_arm_exclusive_release(env);
 }
 
 void HELPER(clrex)(CPUState *env)
@@ -1271,10 +1339,15 @@ void HELPER(set_cp)(CPUState *env, uint32_t insn, uint32_t val)
     int cp_info = (insn >> 5) & 7;
     int src = (insn >> 16) & 0xf;
     int operand = insn & 0xf;
+    int locked;
 
-    if (env->cp[cp_num].cp_write)
+    if (env->cp[cp_num].cp_write) {
+        /* Coprocessors are implemented by devices.  */
+        locked = cpu_threads_lock();
         env->cp[cp_num].cp_write(env->cp[cp_num].opaque,
                                  cp_info, src, operand, val);
+        cpu_threads_unlock(locked);
+    }
 }
 
 uint32_t HELPER(get_cp)(CPUState *env, uint32_t insn)
@@ -1283,10 +1356,16 @@ uint32_t HELPER(get_cp)(CPUState *env, uint32_t insn)
     int cp_info = (insn >> 5) & 7;
     int dest = (insn >> 16) & 0xf;
     int operand = insn & 0xf;
-
-    if (env->cp[cp_num].cp_read)
-        return env->cp[cp_num].cp_read(env->cp[cp_num].opaque,
-                                       cp_info, dest, operand);
+    uint32_t val;
+    int locked;
+
+    if (env->cp[cp_num].cp_read) {
+        locked = cpu_threads_lock();
+        val = env->cp[cp_num].cp_read(env->cp[cp_num].opaque,
+                                      cp_info, dest, operand);
+        cpu_threads_unlock(locked);
+        return val;
+    }
     return 0;
 }
 
@@ -2294,11 +2373,47 @@ static inline int vfp_exceptbits_from_host(int host_bits)
     return target_bits;
 }
 
+/* Fold the exception flags raised by the host FPU fast path into the
+   softfloat state.  */
+void vfp_sync_host_flags(CPUState *env)
+{
+#ifdef VFP_FAST_PATH
+    int i;
+
+    if (env->vfp.host_flags) {
+        i = get_float_exception_flags(&env->vfp.fp_status);
+        set_float_exception_flags(i | vfp_fast_read_flags(),
+                                  &env->vfp.fp_status);
+        env->vfp.host_flags = 0;
+    }
+#endif
+}
+
+/* Return nonzero if the host FPU can be used in the current FP mode.  */
+static inline int vfp_fast_enabled(CPUState *env)
+{
+#ifdef VFP_FAST_PATH
+    if ((env->vfp.xregs[ARM_VFP_FPSCR] & VFP_FPSCR_TRAPS)
+        || env->vfp.fp_status.float_rounding_mode != float_round_nearest_even
+        || env->vfp.fp_status.flush_to_zero
+        || env->vfp.fp_status.default_nan_mode)
+        return 0;
+    if (unlikely(!env->vfp.host_flags)) {
+        vfp_fast_clear_flags();
+        env->vfp.host_flags = 1;
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 uint32_t HELPER(vfp_get_fpscr)(CPUState *env)
 {
     int i;
     uint32_t fpscr;
 
+    vfp_sync_host_flags(env);
     fpscr = (env->vfp.xregs[ARM_VFP_FPSCR] & 0xffc8ffff)
             | (env->vfp.vec_len << 16)
             | (env->vfp.vec_stride << 20);
@@ -2330,6 +2445,8 @@ void HELPER(vfp_set_fpscr)(CPUState *env, uint32_t val)
     int i;
     uint32_t changed;
 
+    /* The new flags replace any still held by the host FPU.  */
+    env->vfp.host_flags = 0;
     changed = env->vfp.xregs[ARM_VFP_FPSCR];
     env->vfp.xregs[ARM_VFP_FPSCR] = (val & 0xffc8ffff);
     env->vfp.vec_len = (val >> 16) & 7;
@@ -2365,13 +2482,25 @@ void HELPER(vfp_set_fpscr)(CPUState *env, uint32_t val)
 
 #define VFP_HELPER(name, p) HELPER(glue(glue(vfp_,name),p))
 
+/* Return the result of OP, a host FPU fast path routine that leaves
+   its result in r, when it can be used.  */
+#ifdef VFP_FAST_PATH
+#define VFP_FAST(op) if (vfp_fast_enabled(env) && op) return r
+#else
+#define VFP_FAST(op) (void)r
+#endif
+
 #define VFP_BINOP(name) \
 float32 VFP_HELPER(name, s)(float32 a, float32 b, CPUState *env) \
 { \
+    float32 r; \
+    VFP_FAST(vfp_fast_ ## name ## s(a, b, &r)); \
     return float32_ ## name (a, b, &env->vfp.fp_status); \
 } \
 float64 VFP_HELPER(name, d)(float64 a, float64 b, CPUState *env) \
 { \
+    float64 r; \
+    VFP_FAST(vfp_fast_ ## name ## d(a, b, &r)); \
     return float64_ ## name (a, b, &env->vfp.fp_status); \
 }
 VFP_BINOP(add)
@@ -2402,11 +2531,15 @@ float64 VFP_HELPER(abs, d)(float64 a)
 
 float32 VFP_HELPER(sqrt, s)(float32 a, CPUState *env)
 {
+    float32 r;
+    VFP_FAST(vfp_fast_sqrts(a, &r));
     return float32_sqrt(a, &env->vfp.fp_status);
 }
 
 float64 VFP_HELPER(sqrt, d)(float64 a, CPUState *env)
 {
+    float64 r;
+    VFP_FAST(vfp_fast_sqrtd(a, &r));
     return float64_sqrt(a, &env->vfp.fp_status);
 }
 
@@ -71,6 +71,8 @@ DEF_HELPER_3(set_r13_banked, void, env, i32, i32)
 DEF_HELPER_2(mark_exclusive, void, env, i32)
 DEF_HELPER_2(test_exclusive, i32, env, i32)
 DEF_HELPER_1(clrex, void, env)
+DEF_HELPER_1(exclusive_begin, void, env)
+DEF_HELPER_1(exclusive_end, void, env)
 
 DEF_HELPER_1(get_user_reg, i32, i32)
 DEF_HELPER_2(set_user_reg, void, i32, i32)
@@ -458,4 +460,44 @@ DEF_HELPER_3(iwmmxt_muladdswl, i64, i64, i32, i32)
 
 DEF_HELPER_2(set_teecr, void, env, i32)
 
+/* Whole register NEON operations: dest, src1, src2, size in bytes.  */
+DEF_HELPER_4(neon_vand, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vbic, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vorr, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vorn, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_veor, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vbsl, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vbit, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vbif, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vadd_u8, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vadd_u16, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vadd_u32, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vsub_u8, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vsub_u16, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vsub_u32, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vmul_u8, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vmul_u16, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vmul_u32, void, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vqadd_u8, i32, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vqadd_s8, i32, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vqadd_u16, i32, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vqadd_s16, i32, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vqsub_u8, i32, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vqsub_s8, i32, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vqsub_u16, i32, ptr, ptr, ptr, i32)
+DEF_HELPER_4(neon_vqsub_s16, i32, ptr, ptr, ptr, i32)
+/* dest, src, shift count, size in bytes.  */
+DEF_HELPER_4(neon_vshl_u8, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshl_u16, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshl_u32, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshl_u64, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshr_u8, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshr_u16, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshr_u32, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshr_u64, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshr_s8, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshr_s16, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshr_s32, void, ptr, ptr, i32, i32)
+DEF_HELPER_4(neon_vshr_s64, void, ptr, ptr, i32, i32)
+
 #include "def-helper.h"
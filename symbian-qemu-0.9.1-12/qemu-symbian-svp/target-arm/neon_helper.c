@@ -8,6 +8,9 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "cpu.h"
 #include "exec-all.h"
@@ -16,7 +19,7 @@
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
 
-#define SET_QC() env->vfp.xregs[ARM_VFP_FPSCR] = CPSR_Q
+#define SET_QC() env->vfp.xregs[ARM_VFP_FPSCR] |= CPSR_Q
 
 static float_status neon_float_status;
 #define NFS &neon_float_status
@@ -420,7 +423,7 @@ uint64_t HELPER(neon_shl_u64)(uint64_t val, uint64_t shiftop)
 #define NEON_FN(dest, src1, src2) do { \
     int8_t tmp; \
     tmp = (int8_t)src2; \
-    if (tmp >= sizeof(src1) * 8) { \
+    if (tmp >= (int) (sizeof(src1) * 8)) { \
         dest = 0; \
     } else if (tmp <= -(int) (sizeof(src1) * 8)) { \
         dest = src1 >> (sizeof(src1) * 8 - 1); \
@@ -453,7 +456,7 @@ uint64_t HELPER(neon_shl_s64)(uint64_t valop, uint64_t shiftop)
 #define NEON_FN(dest, src1, src2) do { \
     int8_t tmp; \
     tmp = (int8_t)src2; \
-    if (tmp >= sizeof(src1) * 8) { \
+    if (tmp >= (int) (sizeof(src1) * 8)) { \
         dest = 0; \
     } else if (tmp < -(int) (sizeof(src1) * 8)) { \
         dest = src1 >> (sizeof(src1) * 8 - 1); \
@@ -528,7 +531,7 @@ uint64_t HELPER(neon_rshl_u64)(uint64_t val, uint64_t shiftop)
 #define NEON_FN(dest, src1, src2) do { \
     int8_t tmp; \
     tmp = (int8_t)src2; \
-    if (tmp >= sizeof(src1) * 8) { \
+    if (tmp >= (int) (sizeof(src1) * 8)) { \
         if (src1) { \
             SET_QC(); \
             dest = ~0; \
@@ -579,7 +582,7 @@ uint64_t HELPER(neon_qshl_u64)(CPUState *env, uint64_t val, uint64_t shiftop)
 #define NEON_FN(dest, src1, src2) do { \
     int8_t tmp; \
     tmp = (int8_t)src2; \
-    if (tmp >= sizeof(src1) * 8) { \
+    if (tmp >= (int) (sizeof(src1) * 8)) { \
         if (src1) \
             SET_QC(); \
         dest = src1 >> 31; \
@@ -1455,3 +1458,277 @@ uint32_t HELPER(neon_acgt_f32)(uint32_t a, uint32_t b)
     float32 f1 = float32_abs(vfp_itos(b));
     return (float32_compare_quiet(f0, f1, NFS) > 0) ? ~0 : 0;
 }
+
+/* Whole register operations.  These process OPRSZ bytes (8 for a D
+   register, 16 for a Q register) of the register file in one call
+   instead of one 32-bit pass at a time.  Elementwise operations do not
+   care about the order of the lanes, so the generic versions simply
+   walk the register as an array of elements.  The saturating operations
+   return nonzero if any element saturated; the caller sets QC.  */
+
+#define NEON_VEC_GEN(name, type, expr) \
+static inline void neon_vec_gen_##name(void *vd, void *vn, void *vm, \
+                                       uint32_t oprsz) \
+{ \
+    type *d = vd, *n = vn, *m = vm; \
+    int i; \
+    for (i = 0; i < oprsz / sizeof(type); i++) { \
+        type a = n[i], b = m[i], c = d[i]; \
+        (void)c; \
+        d[i] = (expr); \
+    } \
+}
+
+#define NEON_VEC_GEN_SAT(name, type, wtype, min, max, op) \
+static inline uint32_t neon_vec_gen_##name(void *vd, void *vn, void *vm, \
+                                           uint32_t oprsz) \
+{ \
+    type *d = vd, *n = vn, *m = vm; \
+    uint32_t sat = 0; \
+    int i; \
+    for (i = 0; i < oprsz / sizeof(type); i++) { \
+        wtype tmp = (wtype)n[i] op (wtype)m[i]; \
+        if (tmp > max) { \
+            tmp = max; \
+            sat = 1; \
+        } else if (tmp < min) { \
+            tmp = min; \
+            sat = 1; \
+        } \
+        d[i] = tmp; \
+    } \
+    return sat; \
+}
+
+#define NEON_VEC_GEN_SHIFT(name, type, expr) \
+static inline void neon_vec_gen_##name(void *vd, void *vm, int shift, \
+                                       uint32_t oprsz) \
+{ \
+    type *d = vd, *m = vm; \
+    int i; \
+    for (i = 0; i < oprsz / sizeof(type); i++) { \
+        type a = m[i]; \
+        d[i] = (expr); \
+    } \
+}
+
+NEON_VEC_GEN(and, uint32_t, a & b)
+NEON_VEC_GEN(bic, uint32_t, a & ~b)
+NEON_VEC_GEN(orr, uint32_t, a | b)
+NEON_VEC_GEN(orn, uint32_t, a | ~b)
+NEON_VEC_GEN(eor, uint32_t, a ^ b)
+NEON_VEC_GEN(bsl, uint32_t, (a & c) | (b & ~c))
+NEON_VEC_GEN(bit, uint32_t, (a & b) | (c & ~b))
+NEON_VEC_GEN(bif, uint32_t, (c & b) | (a & ~b))
+NEON_VEC_GEN(add_u8, uint8_t, a + b)
+NEON_VEC_GEN(add_u16, uint16_t, a + b)
+NEON_VEC_GEN(add_u32, uint32_t, a + b)
+NEON_VEC_GEN(sub_u8, uint8_t, a - b)
+NEON_VEC_GEN(sub_u16, uint16_t, a - b)
+NEON_VEC_GEN(sub_u32, uint32_t, a - b)
+NEON_VEC_GEN(mul_u8, uint8_t, a * b)
+NEON_VEC_GEN(mul_u16, uint16_t, (uint32_t)a * b)
+NEON_VEC_GEN(mul_u32, uint32_t, a * b)
+NEON_VEC_GEN_SAT(qadd_u8, uint8_t, int32_t, 0, 0xff, +)
+NEON_VEC_GEN_SAT(qadd_s8, int8_t, int32_t, -0x80, 0x7f, +)
+NEON_VEC_GEN_SAT(qadd_u16, uint16_t, int32_t, 0, 0xffff, +)
+NEON_VEC_GEN_SAT(qadd_s16, int16_t, int32_t, -0x8000, 0x7fff, +)
+NEON_VEC_GEN_SAT(qsub_u8, uint8_t, int32_t, 0, 0xff, -)
+NEON_VEC_GEN_SAT(qsub_s8, int8_t, int32_t, -0x80, 0x7f, -)
+NEON_VEC_GEN_SAT(qsub_u16, uint16_t, int32_t, 0, 0xffff, -)
+NEON_VEC_GEN_SAT(qsub_s16, int16_t, int32_t, -0x8000, 0x7fff, -)
+/* Right shifts take a count between 1 and the element size.  */
+NEON_VEC_GEN_SHIFT(shl_u8, uint8_t, a << shift)
+NEON_VEC_GEN_SHIFT(shl_u16, uint16_t, a << shift)
+NEON_VEC_GEN_SHIFT(shl_u32, uint32_t, a << shift)
+NEON_VEC_GEN_SHIFT(shl_u64, uint64_t, a << shift)
+NEON_VEC_GEN_SHIFT(shr_u8, uint8_t, shift < 8 ? a >> shift : 0)
+NEON_VEC_GEN_SHIFT(shr_u16, uint16_t, shift < 16 ? a >> shift : 0)
+NEON_VEC_GEN_SHIFT(shr_u32, uint32_t, shift < 32 ? a >> shift : 0)
+NEON_VEC_GEN_SHIFT(shr_u64, uint64_t, shift < 64 ? a >> shift : 0)
+NEON_VEC_GEN_SHIFT(shr_s8, int8_t, a >> (shift < 8 ? shift : 7))
+NEON_VEC_GEN_SHIFT(shr_s16, int16_t, a >> (shift < 16 ? shift : 15))
+NEON_VEC_GEN_SHIFT(shr_s32, int32_t, a >> (shift < 32 ? shift : 31))
+NEON_VEC_GEN_SHIFT(shr_s64, int64_t, a >> (shift < 64 ? shift : 63))
+
+#ifdef __SSE2__
+/* Only the low half of the vector is used for D registers.  */
+static inline __m128i neon_vec_load(void *p, uint32_t oprsz)
+{
+    if (oprsz == 16)
+        return _mm_loadu_si128((__m128i *)p);
+    return _mm_loadl_epi64((__m128i *)p);
+}
+
+static inline void neon_vec_store(void *p, __m128i v, uint32_t oprsz)
+{
+    if (oprsz == 16)
+        _mm_storeu_si128((__m128i *)p, v);
+    else
+        _mm_storel_epi64((__m128i *)p, v);
+}
+
+static inline __m128i neon_vec_mul_u8(__m128i a, __m128i b)
+{
+    __m128i even, odd;
+
+    even = _mm_and_si128(_mm_mullo_epi16(a, b), _mm_set1_epi16(0xff));
+    odd = _mm_mullo_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    return _mm_or_si128(even, _mm_slli_epi16(odd, 8));
+}
+
+static inline __m128i neon_vec_mul_u32(__m128i a, __m128i b)
+{
+    __m128i even, odd;
+
+    even = _mm_mul_epu32(a, b);
+    odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+#define NEON_VEC_OP(name, expr) \
+void HELPER(glue(neon_v,name))(void *vd, void *vn, void *vm, uint32_t oprsz) \
+{ \
+    __m128i a = neon_vec_load(vn, oprsz); \
+    __m128i b = neon_vec_load(vm, oprsz); \
+    __m128i c = neon_vec_load(vd, oprsz); \
+    (void)c; \
+    neon_vec_store(vd, (expr), oprsz); \
+}
+
+/* The saturating forms compare against the wrapping result to detect
+   saturation.  */
+#define NEON_VEC_OP_SAT(name, expr, wrap, cmp) \
+uint32_t HELPER(glue(neon_v,name))(void *vd, void *vn, void *vm, \
+                                   uint32_t oprsz) \
+{ \
+    __m128i a = neon_vec_load(vn, oprsz); \
+    __m128i b = neon_vec_load(vm, oprsz); \
+    __m128i res = (expr); \
+    neon_vec_store(vd, res, oprsz); \
+    return _mm_movemask_epi8(cmp(res, (wrap))) != 0xffff; \
+}
+
+#define NEON_VEC_OP_SHIFT(name, expr) \
+void HELPER(glue(neon_v,name))(void *vd, void *vm, uint32_t shift, \
+                               uint32_t oprsz) \
+{ \
+    __m128i a = neon_vec_load(vm, oprsz); \
+    __m128i cnt = _mm_cvtsi32_si128(shift); \
+    (void)cnt; \
+    neon_vec_store(vd, (expr), oprsz); \
+}
+
+#define NEON_VEC_OP_SHIFT_GEN(name) \
+void HELPER(glue(neon_v,name))(void *vd, void *vm, uint32_t shift, \
+                               uint32_t oprsz) \
+{ \
+    neon_vec_gen_##name(vd, vm, shift, oprsz); \
+}
+
+NEON_VEC_OP(and, _mm_and_si128(a, b))
+NEON_VEC_OP(bic, _mm_andnot_si128(b, a))
+NEON_VEC_OP(orr, _mm_or_si128(a, b))
+NEON_VEC_OP(orn, _mm_or_si128(a, _mm_xor_si128(b, _mm_set1_epi32(-1))))
+NEON_VEC_OP(eor, _mm_xor_si128(a, b))
+NEON_VEC_OP(bsl, _mm_or_si128(_mm_and_si128(a, c), _mm_andnot_si128(c, b)))
+NEON_VEC_OP(bit, _mm_or_si128(_mm_and_si128(a, b), _mm_andnot_si128(b, c)))
+NEON_VEC_OP(bif, _mm_or_si128(_mm_and_si128(c, b), _mm_andnot_si128(b, a)))
+NEON_VEC_OP(add_u8, _mm_add_epi8(a, b))
+NEON_VEC_OP(add_u16, _mm_add_epi16(a, b))
+NEON_VEC_OP(add_u32, _mm_add_epi32(a, b))
+NEON_VEC_OP(sub_u8, _mm_sub_epi8(a, b))
+NEON_VEC_OP(sub_u16, _mm_sub_epi16(a, b))
+NEON_VEC_OP(sub_u32, _mm_sub_epi32(a, b))
+NEON_VEC_OP(mul_u8, neon_vec_mul_u8(a, b))
+NEON_VEC_OP(mul_u16, _mm_mullo_epi16(a, b))
+NEON_VEC_OP(mul_u32, neon_vec_mul_u32(a, b))
+NEON_VEC_OP_SAT(qadd_u8, _mm_adds_epu8(a, b), _mm_add_epi8(a, b), _mm_cmpeq_epi8)
+NEON_VEC_OP_SAT(qadd_s8, _mm_adds_epi8(a, b), _mm_add_epi8(a, b), _mm_cmpeq_epi8)
+NEON_VEC_OP_SAT(qadd_u16, _mm_adds_epu16(a, b), _mm_add_epi16(a, b), _mm_cmpeq_epi16)
+NEON_VEC_OP_SAT(qadd_s16, _mm_adds_epi16(a, b), _mm_add_epi16(a, b), _mm_cmpeq_epi16)
+NEON_VEC_OP_SAT(qsub_u8, _mm_subs_epu8(a, b), _mm_sub_epi8(a, b), _mm_cmpeq_epi8)
+NEON_VEC_OP_SAT(qsub_s8, _mm_subs_epi8(a, b), _mm_sub_epi8(a, b), _mm_cmpeq_epi8)
+NEON_VEC_OP_SAT(qsub_u16, _mm_subs_epu16(a, b), _mm_sub_epi16(a, b), _mm_cmpeq_epi16)
+NEON_VEC_OP_SAT(qsub_s16, _mm_subs_epi16(a, b), _mm_sub_epi16(a, b), _mm_cmpeq_epi16)
+/* SSE2 has no byte shifts: shift 16-bit lanes and mask off the bits
+   that crossed into the neighbouring byte.  Counts of the element size
+   or more give zero (logical) or sign copies (arithmetic), which is
+   what NEON wants.  */
+NEON_VEC_OP_SHIFT(shl_u8, _mm_and_si128(_mm_sll_epi16(a, cnt),
+                                        _mm_set1_epi8((uint8_t)(0xff << shift))))
+NEON_VEC_OP_SHIFT(shl_u16, _mm_sll_epi16(a, cnt))
+NEON_VEC_OP_SHIFT(shl_u32, _mm_sll_epi32(a, cnt))
+NEON_VEC_OP_SHIFT(shl_u64, _mm_sll_epi64(a, cnt))
+NEON_VEC_OP_SHIFT(shr_u8, _mm_and_si128(_mm_srl_epi16(a, cnt),
+                                        _mm_set1_epi8((uint8_t)(0xff >> shift))))
+NEON_VEC_OP_SHIFT(shr_u16, _mm_srl_epi16(a, cnt))
+NEON_VEC_OP_SHIFT(shr_u32, _mm_srl_epi32(a, cnt))
+NEON_VEC_OP_SHIFT(shr_u64, _mm_srl_epi64(a, cnt))
+NEON_VEC_OP_SHIFT_GEN(shr_s8)
+NEON_VEC_OP_SHIFT(shr_s16, _mm_sra_epi16(a, cnt))
+NEON_VEC_OP_SHIFT(shr_s32, _mm_sra_epi32(a, cnt))
+NEON_VEC_OP_SHIFT_GEN(shr_s64)
+
+#else /* !__SSE2__ */
+
+#define NEON_VEC_OP(name, expr) \
+void HELPER(glue(neon_v,name))(void *vd, void *vn, void *vm, uint32_t oprsz) \
+{ \
+    neon_vec_gen_##name(vd, vn, vm, oprsz); \
+}
+
+#define NEON_VEC_OP_SAT(name, expr, wrap, cmp) \
+uint32_t HELPER(glue(neon_v,name))(void *vd, void *vn, void *vm, \
+                                   uint32_t oprsz) \
+{ \
+    return neon_vec_gen_##name(vd, vn, vm, oprsz); \
+}
+
+#define NEON_VEC_OP_SHIFT(name, expr) \
+void HELPER(glue(neon_v,name))(void *vd, void *vm, uint32_t shift, \
+                               uint32_t oprsz) \
+{ \
+    neon_vec_gen_##name(vd, vm, shift, oprsz); \
+}
+
+NEON_VEC_OP(and, 0)
+NEON_VEC_OP(bic, 0)
+NEON_VEC_OP(orr, 0)
+NEON_VEC_OP(orn, 0)
+NEON_VEC_OP(eor, 0)
+NEON_VEC_OP(bsl, 0)
+NEON_VEC_OP(bit, 0)
+NEON_VEC_OP(bif, 0)
+NEON_VEC_OP(add_u8, 0)
+NEON_VEC_OP(add_u16, 0)
+NEON_VEC_OP(add_u32, 0)
+NEON_VEC_OP(sub_u8, 0)
+NEON_VEC_OP(sub_u16, 0)
+NEON_VEC_OP(sub_u32, 0)
+NEON_VEC_OP(mul_u8, 0)
+NEON_VEC_OP(mul_u16, 0)
+NEON_VEC_OP(mul_u32, 0)
+NEON_VEC_OP_SAT(qadd_u8, 0, 0, 0)
+NEON_VEC_OP_SAT(qadd_s8, 0, 0, 0)
+NEON_VEC_OP_SAT(qadd_u16, 0, 0, 0)
+NEON_VEC_OP_SAT(qadd_s16, 0, 0, 0)
+NEON_VEC_OP_SAT(qsub_u8, 0, 0, 0)
+NEON_VEC_OP_SAT(qsub_s8, 0, 0, 0)
+NEON_VEC_OP_SAT(qsub_u16, 0, 0, 0)
+NEON_VEC_OP_SAT(qsub_s16, 0, 0, 0)
+NEON_VEC_OP_SHIFT(shl_u8, 0)
+NEON_VEC_OP_SHIFT(shl_u16, 0)
+NEON_VEC_OP_SHIFT(shl_u32, 0)
+NEON_VEC_OP_SHIFT(shl_u64, 0)
+NEON_VEC_OP_SHIFT(shr_u8, 0)
+NEON_VEC_OP_SHIFT(shr_u16, 0)
+NEON_VEC_OP_SHIFT(shr_u32, 0)
+NEON_VEC_OP_SHIFT(shr_u64, 0)
+NEON_VEC_OP_SHIFT(shr_s8, 0)
+NEON_VEC_OP_SHIFT(shr_s16, 0)
+NEON_VEC_OP_SHIFT(shr_s32, 0)
+NEON_VEC_OP_SHIFT(shr_s64, 0)
+
+#endif /* !__SSE2__ */
@@ -67,10 +67,14 @@ uint32_t HELPER(neon_tbl)(uint32_t ireg, uint32_t def,
 
 #if !defined(CONFIG_USER_ONLY)
 
-static void do_unaligned_access (target_ulong addr, int is_write, int is_user, void *retaddr);
+static void arm_unaligned_access (target_ulong addr, int is_write,
+                                  int is_user, void *retaddr, int size);
 
 #define MMUSUFFIX _mmu
 #define ALIGNED_ONLY
+/* Whether a misaligned access faults depends on its size.  */
+#define do_unaligned_access(addr, is_write, is_user, retaddr) \
+    arm_unaligned_access(addr, is_write, is_user, retaddr, DATA_SIZE)
 
 #define SHIFT 0
 #include "softmmu_template.h"
@@ -84,6 +88,8 @@ static void do_unaligned_access (target_ulong addr, int is_write, int is_user, v
 #define SHIFT 3
 #include "softmmu_template.h"
 
+#undef do_unaligned_access
+
 void do_restore_state (void *pc_ptr)
 {
     TranslationBlock *tb;
@@ -95,15 +101,21 @@ void do_restore_state (void *pc_ptr)
     }
 }
 
-static void do_unaligned_access (target_ulong addr, int is_write, int is_user, void *retaddr)
+static void arm_unaligned_access (target_ulong addr, int is_write,
+                                  int is_user, void *retaddr, int size)
 {
-    /* TODO: Legacy alignment behavior and v6 unaligned accesses.  */
+    /* TODO: Legacy alignment behavior.  */
     if (is_write == 2) {
         env->cp15.c5_insn = 1;
         env->cp15.c6_insn = addr;
 	do_restore_state (retaddr);
 	raise_exception (EXCP_PREFETCH_ABORT);
     } else {
+        /* Doubleword accesses (LDRD/STRD) only need word alignment.
+           With ARMv6 unaligned support enabled, word and halfword
+           accesses do not need any.  */
+        if (size == 8 ? (addr & 3) == 0 : arm_unaligned_enabled(env))
+            return;
         env->cp15.c5_data = 1;
         env->cp15.c6_data = addr;
 	do_restore_state (retaddr);
@@ -60,6 +60,14 @@ typedef struct DisasContext {
 #if !defined(CONFIG_USER_ONLY)
     int user;
 #endif
+    /* Nonzero when translating a hot trace (CF_TRACE).  */
+    int trace;
+    /* Number of branches followed so far by the current trace.  */
+    int trace_blocks;
+    /* Mask of the goto_tb slots already used by this TB.  */
+    int jmp_slots;
+    /* Nonzero when unaligned word and halfword accesses are permitted.  */
+    int unaligned;
 } DisasContext;
 
 #if defined(CONFIG_USER_ONLY)
@@ -857,6 +865,54 @@ static inline void gen_st32(TCGv val, TCGv addr, int index)
     dead_tmp(val);
 }
 
+/* Memory index for a single word or halfword load/store.  Lets the
+   backend keep accesses the guest allows to be unaligned inline.  */
+static inline int ldst_index(DisasContext *s, int index)
+{
+#ifdef TCG_TARGET_HAS_qemu_unaligned
+    if (s->unaligned)
+        index |= TCG_MEM_UNALIGNED(0);
+#endif
+    return index;
+}
+
+/* LDRD/STRD as a single 64-bit access.  These only require word
+   alignment.  */
+static inline void gen_ldrd(TCGv lo, TCGv hi, TCGv addr, int index)
+{
+    TCGv_i64 tmp = tcg_temp_new_i64();
+#ifdef TCG_TARGET_HAS_qemu_unaligned
+    index |= TCG_MEM_UNALIGNED(2);
+#endif
+    tcg_gen_qemu_ld64(tmp, addr, index);
+#ifdef TARGET_WORDS_BIGENDIAN
+    tcg_gen_trunc_i64_i32(hi, tmp);
+    tcg_gen_shri_i64(tmp, tmp, 32);
+    tcg_gen_trunc_i64_i32(lo, tmp);
+#else
+    tcg_gen_trunc_i64_i32(lo, tmp);
+    tcg_gen_shri_i64(tmp, tmp, 32);
+    tcg_gen_trunc_i64_i32(hi, tmp);
+#endif
+    tcg_temp_free_i64(tmp);
+}
+static inline void gen_strd(TCGv lo, TCGv hi, TCGv addr, int index)
+{
+    TCGv_i64 tmp = tcg_temp_new_i64();
+#ifdef TCG_TARGET_HAS_qemu_unaligned
+    index |= TCG_MEM_UNALIGNED(2);
+#endif
+#ifdef TARGET_WORDS_BIGENDIAN
+    tcg_gen_concat_i32_i64(tmp, hi, lo);
+#else
+    tcg_gen_concat_i32_i64(tmp, lo, hi);
+#endif
+    tcg_gen_qemu_st64(tmp, addr, index);
+    tcg_temp_free_i64(tmp);
+    dead_tmp(lo);
+    dead_tmp(hi);
+}
+
 static inline void gen_movl_T0_reg(DisasContext *s, int reg)
 {
     load_reg_var(s, cpu_T[0], reg);
@@ -3416,7 +3472,11 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
     TranslationBlock *tb;
 
     tb = s->tb;
-    if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
+    /* A trace can have more than two exits.  Only the first use of each
+       slot can be chained, the others go through the hash table.  */
+    if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)
+        && !(s->jmp_slots & (1 << n))) {
+        s->jmp_slots |= 1 << n;
         tcg_gen_goto_tb(n);
         gen_set_pc_im(dest);
         tcg_gen_exit_tb((long)tb + n);
@@ -3426,15 +3486,46 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
     }
 }
 
+/* Maximum number of branches a trace will follow.  */
+#define TRACE_MAX_BLOCKS 8
+
+/* Try to continue a hot trace across the branch to DEST instead of
+   ending the TB.  Forward conditional branches are predicted not taken:
+   the taken path becomes a side exit and translation continues with the
+   next instruction.  Unconditional forward branches are followed
+   directly.  Backward branches (loops) still end the TB so the loop body
+   is not translated several times.  Returns nonzero if the branch was
+   handled.  */
+static int gen_trace_follow(DisasContext *s, uint32_t dest)
+{
+    if (s->trace_blocks >= TRACE_MAX_BLOCKS || s->condexec_mask
+        || dest <= s->pc
+        || (dest & TARGET_PAGE_MASK) != (s->tb->pc & TARGET_PAGE_MASK))
+        return 0;
+    if (s->condjmp) {
+        /* Only one side exit per trace so that the end of the trace
+           still has a chainable slot.  */
+        if (s->jmp_slots)
+            return 0;
+        gen_goto_tb(s, 0, dest);
+    } else {
+        s->pc = dest;
+    }
+    s->trace_blocks++;
+    return 1;
+}
+
 static inline void gen_jmp (DisasContext *s, uint32_t dest)
 {
+    if (s->trace && gen_trace_follow(s, dest))
+        return;
     if (unlikely(s->singlestep_enabled)) {
         /* An indirect jump so that we still trigger the debug exception.  */
         if (s->thumb)
             dest |= 1;
         gen_bx_im(s, dest);
     } else {
-        gen_goto_tb(s, 0, dest);
+        gen_goto_tb(s, (s->jmp_slots & 1) ? 1 : 0, dest);
         s->is_jmp = DISAS_TB_JUMP;
     }
 }
@@ -3951,6 +4042,140 @@ static void gen_neon_bsl(TCGv dest, TCGv t, TCGv f, TCGv c)
     tcg_gen_or_i32(dest, t, f);
 }
 
+typedef void NeonGenVecFn(TCGv_ptr, TCGv_ptr, TCGv_ptr, TCGv_i32);
+typedef void NeonGenVecSatFn(TCGv_i32, TCGv_ptr, TCGv_ptr, TCGv_ptr,
+                             TCGv_i32);
+typedef void NeonGenVecShiftFn(TCGv_ptr, TCGv_ptr, TCGv_i32, TCGv_i32);
+
+/* Indexed by (u << 2) | size, as in the instruction encoding.  */
+static NeonGenVecFn * const gen_neon_vec_logic[8] = {
+    gen_helper_neon_vand, gen_helper_neon_vbic,
+    gen_helper_neon_vorr, gen_helper_neon_vorn,
+    gen_helper_neon_veor, gen_helper_neon_vbsl,
+    gen_helper_neon_vbit, gen_helper_neon_vbif
+};
+static NeonGenVecFn * const gen_neon_vec_add[3] = {
+    gen_helper_neon_vadd_u8, gen_helper_neon_vadd_u16, gen_helper_neon_vadd_u32
+};
+static NeonGenVecFn * const gen_neon_vec_sub[3] = {
+    gen_helper_neon_vsub_u8, gen_helper_neon_vsub_u16, gen_helper_neon_vsub_u32
+};
+static NeonGenVecFn * const gen_neon_vec_mul[3] = {
+    gen_helper_neon_vmul_u8, gen_helper_neon_vmul_u16, gen_helper_neon_vmul_u32
+};
+/* Indexed by (size << 1) | u.  */
+static NeonGenVecSatFn * const gen_neon_vec_qadd[4] = {
+    gen_helper_neon_vqadd_s8, gen_helper_neon_vqadd_u8,
+    gen_helper_neon_vqadd_s16, gen_helper_neon_vqadd_u16
+};
+static NeonGenVecSatFn * const gen_neon_vec_qsub[4] = {
+    gen_helper_neon_vqsub_s8, gen_helper_neon_vqsub_u8,
+    gen_helper_neon_vqsub_s16, gen_helper_neon_vqsub_u16
+};
+static NeonGenVecShiftFn * const gen_neon_vec_shl[4] = {
+    gen_helper_neon_vshl_u8, gen_helper_neon_vshl_u16,
+    gen_helper_neon_vshl_u32, gen_helper_neon_vshl_u64
+};
+/* Indexed by (size << 1) | u.  */
+static NeonGenVecShiftFn * const gen_neon_vec_shr[8] = {
+    gen_helper_neon_vshr_s8, gen_helper_neon_vshr_u8,
+    gen_helper_neon_vshr_s16, gen_helper_neon_vshr_u16,
+    gen_helper_neon_vshr_s32, gen_helper_neon_vshr_u32,
+    gen_helper_neon_vshr_s64, gen_helper_neon_vshr_u64
+};
+
+static inline TCGv_ptr neon_vec_ptr(int reg)
+{
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+    tcg_gen_addi_ptr(ptr, cpu_env, vfp_reg_offset(1, reg));
+    return ptr;
+}
+
+/* Three register same length operations that have a whole register
+   helper.  These replace the per-pass helper calls for the common
+   integer operations.  Returns nonzero if the operation must be done one
+   pass at a time.  */
+static int gen_neon_vec_3same(int op, int u, int size, int q,
+                              int rd, int rn, int rm)
+{
+    NeonGenVecFn *fn = NULL;
+    NeonGenVecSatFn *satfn = NULL;
+    TCGv_ptr pd, pn, pm;
+    TCGv oprsz;
+    TCGv tmp;
+    int label;
+
+    switch (op) {
+    case 1: /* VQADD */
+        if (size < 2)
+            satfn = gen_neon_vec_qadd[(size << 1) | u];
+        break;
+    case 3: /* Logic ops.  */
+        fn = gen_neon_vec_logic[(u << 2) | size];
+        break;
+    case 5: /* VQSUB */
+        if (size < 2)
+            satfn = gen_neon_vec_qsub[(size << 1) | u];
+        break;
+    case 16: /* VADD, VSUB */
+        if (size < 3)
+            fn = u ? gen_neon_vec_sub[size] : gen_neon_vec_add[size];
+        break;
+    case 19: /* VMUL */
+        if (!u && size < 3)
+            fn = gen_neon_vec_mul[size];
+        break;
+    }
+    if (!fn && !satfn)
+        return 1;
+
+    pd = neon_vec_ptr(rd);
+    pn = neon_vec_ptr(rn);
+    pm = neon_vec_ptr(rm);
+    oprsz = tcg_const_i32(q ? 16 : 8);
+    if (fn) {
+        fn(pd, pn, pm, oprsz);
+    } else {
+        tmp = new_tmp();
+        satfn(tmp, pd, pn, pm, oprsz);
+        label = gen_new_label();
+        tcg_gen_brcondi_i32(TCG_COND_EQ, tmp, 0, label);
+        dead_tmp(tmp);
+        /* QC is sticky and shares FPSCR with the FP mode bits.  */
+        tmp = load_cpu_field(vfp.xregs[ARM_VFP_FPSCR]);
+        tcg_gen_ori_i32(tmp, tmp, CPSR_Q);
+        store_cpu_field(tmp, vfp.xregs[ARM_VFP_FPSCR]);
+        gen_set_label(label);
+    }
+    tcg_temp_free_i32(oprsz);
+    tcg_temp_free_ptr(pm);
+    tcg_temp_free_ptr(pn);
+    tcg_temp_free_ptr(pd);
+    return 0;
+}
+
+/* VSHL and VSHR by immediate on the whole register.  SHIFT is the
+   signed shift count, negative for right shifts.  */
+static void gen_neon_vec_shift(int u, int size, int q, int rd, int rm,
+                               int shift)
+{
+    TCGv_ptr pd, pm;
+    TCGv count, oprsz;
+
+    pd = neon_vec_ptr(rd);
+    pm = neon_vec_ptr(rm);
+    count = tcg_const_i32(shift < 0 ? -shift : shift);
+    oprsz = tcg_const_i32(q ? 16 : 8);
+    if (shift < 0)
+        gen_neon_vec_shr[(size << 1) | u](pd, pm, count, oprsz);
+    else
+        gen_neon_vec_shl[size](pd, pm, count, oprsz);
+    tcg_temp_free_i32(oprsz);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(pm);
+    tcg_temp_free_ptr(pd);
+}
+
 static inline void gen_neon_narrow(int size, TCGv dest, TCGv_i64 src)
 {
     switch (size) {
@@ -4229,6 +4454,8 @@ static int disas_neon_data_insn(CPUState * env, DisasContext *s, uint32_t insn)
             pairwise = 0;
             break;
         }
+        if (!pairwise && !gen_neon_vec_3same(op, u, size, q, rd, rn, rm))
+            return 0;
         for (pass = 0; pass < (q ? 4 : 2); pass++) {
 
         if (pairwise) {
@@ -4543,6 +4770,11 @@ static int disas_neon_data_insn(CPUState * env, DisasContext *s, uint32_t insn)
                     abort();
                 }
 
+                if (op == 0 || (op == 5 && !u)) {
+                    /* VSHR, VSHL */
+                    gen_neon_vec_shift(u, size, q, rd, rm, shift);
+                    return 0;
+                }
                 for (pass = 0; pass < count; pass++) {
                     if (size == 3) {
                         neon_load_reg64(cpu_V0, rm + pass);
@@ -6450,15 +6682,19 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                                 abort();
                             }
                             gen_set_label(label);
+                            if (cpu_threads_enabled)
+                                gen_helper_exclusive_end(cpu_env);
                             gen_movl_reg_T0(s, rd);
                         }
                     } else {
                         /* SWP instruction */
                         rm = (insn) & 0xf;
 
-                        /* ??? This is not really atomic.  However we know
-                           we never have multiple CPUs running in parallel,
-                           so it is good enough.  */
+                        /* ??? This is only atomic with respect to other
+                           SWP and exclusive stores, and only when CPUs run
+                           in parallel; otherwise it is good enough.  */
+                        if (cpu_threads_enabled)
+                            gen_helper_exclusive_begin(cpu_env);
                         addr = load_reg(s, rn);
                         tmp = load_reg(s, rm);
                         if (insn & (1 << 22)) {
@@ -6469,11 +6705,12 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                             gen_st32(tmp, addr, IS_USER(s));
                         }
                         dead_tmp(addr);
+                        if (cpu_threads_enabled)
+                            gen_helper_exclusive_end(cpu_env);
                         store_reg(s, rd, tmp2);
                     }
                 }
             } else {
-                int address_offset;
                 int load;
                 /* Misc load/store */
                 rn = (insn >> 16) & 0xf;
@@ -6481,19 +6718,18 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                 addr = load_reg(s, rn);
                 if (insn & (1 << 24))
                     gen_add_datah_offset(s, insn, 0, addr);
-                address_offset = 0;
                 if (insn & (1 << 20)) {
                     /* load */
                     switch(sh) {
                     case 1:
-                        tmp = gen_ld16u(addr, IS_USER(s));
+                        tmp = gen_ld16u(addr, ldst_index(s, IS_USER(s)));
                         break;
                     case 2:
                         tmp = gen_ld8s(addr, IS_USER(s));
                         break;
                     default:
                     case 3:
-                        tmp = gen_ld16s(addr, IS_USER(s));
+                        tmp = gen_ld16s(addr, ldst_index(s, IS_USER(s)));
                         break;
                     }
                     load = 1;
@@ -6502,25 +6738,22 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                     if (sh & 1) {
                         /* store */
                         tmp = load_reg(s, rd);
-                        gen_st32(tmp, addr, IS_USER(s));
-                        tcg_gen_addi_i32(addr, addr, 4);
-                        tmp = load_reg(s, rd + 1);
-                        gen_st32(tmp, addr, IS_USER(s));
+                        tmp2 = load_reg(s, rd + 1);
+                        gen_strd(tmp, tmp2, addr, IS_USER(s));
                         load = 0;
                     } else {
                         /* load */
-                        tmp = gen_ld32(addr, IS_USER(s));
-                        store_reg(s, rd, tmp);
-                        tcg_gen_addi_i32(addr, addr, 4);
-                        tmp = gen_ld32(addr, IS_USER(s));
+                        tmp = new_tmp();
+                        tmp2 = new_tmp();
+                        gen_ldrd(tmp2, tmp, addr, IS_USER(s));
+                        store_reg(s, rd, tmp2);
                         rd++;
                         load = 1;
                     }
-                    address_offset = -4;
                 } else {
                     /* store */
                     tmp = load_reg(s, rd);
-                    gen_st16(tmp, addr, IS_USER(s));
+                    gen_st16(tmp, addr, ldst_index(s, IS_USER(s)));
                     load = 0;
                 }
                 /* Perform base writeback before the loaded value to
@@ -6528,11 +6761,9 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                    ldrd with base writeback is is undefined if the
                    destination and index registers overlap.  */
                 if (!(insn & (1 << 24))) {
-                    gen_add_datah_offset(s, insn, address_offset, addr);
+                    gen_add_datah_offset(s, insn, 0, addr);
                     store_reg(s, rn, addr);
                 } else if (insn & (1 << 21)) {
-                    if (address_offset)
-                        tcg_gen_addi_i32(addr, addr, address_offset);
                     store_reg(s, rn, addr);
                 } else {
                     dead_tmp(addr);
@@ -6810,7 +7041,7 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                 if (insn & (1 << 22)) {
                     tmp = gen_ld8u(tmp2, i);
                 } else {
-                    tmp = gen_ld32(tmp2, i);
+                    tmp = gen_ld32(tmp2, ldst_index(s, i));
                 }
             } else {
                 /* store */
@@ -6818,7 +7049,7 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                 if (insn & (1 << 22))
                     gen_st8(tmp, tmp2, i);
                 else
-                    gen_st32(tmp, tmp2, i);
+                    gen_st32(tmp, tmp2, ldst_index(s, i));
             }
             if (!(insn & (1 << 24))) {
                 gen_add_data_offset(s, insn, tmp2);
@@ -7171,24 +7402,22 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                 }
                 if (insn & (1 << 20)) {
                     /* ldrd */
-                    tmp = gen_ld32(addr, IS_USER(s));
+                    tmp = new_tmp();
+                    tmp2 = new_tmp();
+                    gen_ldrd(tmp, tmp2, addr, IS_USER(s));
                     store_reg(s, rs, tmp);
-                    tcg_gen_addi_i32(addr, addr, 4);
-                    tmp = gen_ld32(addr, IS_USER(s));
-                    store_reg(s, rd, tmp);
+                    store_reg(s, rd, tmp2);
                 } else {
                     /* strd */
                     tmp = load_reg(s, rs);
-                    gen_st32(tmp, addr, IS_USER(s));
-                    tcg_gen_addi_i32(addr, addr, 4);
-                    tmp = load_reg(s, rd);
-                    gen_st32(tmp, addr, IS_USER(s));
+                    tmp2 = load_reg(s, rd);
+                    gen_strd(tmp, tmp2, addr, IS_USER(s));
                 }
                 if (insn & (1 << 21)) {
                     /* Base writeback.  */
                     if (rn == 15)
                         goto illegal_op;
-                    tcg_gen_addi_i32(addr, addr, offset - 4);
+                    tcg_gen_addi_i32(addr, addr, offset);
                     store_reg(s, rn, addr);
                 } else {
                     dead_tmp(addr);
@@ -7209,6 +7438,8 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                     tmp = load_reg(s, rs);
                     gen_st32(tmp, cpu_T[1], IS_USER(s));
                     gen_set_label(label);
+                    if (cpu_threads_enabled)
+                        gen_helper_exclusive_end(cpu_env);
                     gen_movl_reg_T0(s, rd);
                 }
             } else if ((insn & (1 << 6)) == 0) {
@@ -7236,9 +7467,9 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                 store_reg(s, 15, tmp);
             } else {
                 /* Load/store exclusive byte/halfword/doubleword.  */
-                /* ??? These are not really atomic.  However we know
-                   we never have multiple CPUs running in parallel,
-                   so it is good enough.  */
+                /* ??? These are not really atomic.  With -vcpu-threads
+                   the exclusive lock is held from the test to the end of
+                   the store, which is good enough.  */
                 op = (insn >> 4) & 0x3;
                 /* Must use a global reg for the address because we have
                    a conditional branch in the store instruction.  */
@@ -7286,6 +7517,8 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                         goto illegal_op;
                     }
                     gen_set_label(label);
+                    if (cpu_threads_enabled)
+                        gen_helper_exclusive_end(cpu_env);
                     gen_movl_reg_T0(s, rm);
                 }
             }
@@ -8058,9 +8291,9 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                 switch (op) {
                 case 0: tmp = gen_ld8u(addr, user); break;
                 case 4: tmp = gen_ld8s(addr, user); break;
-                case 1: tmp = gen_ld16u(addr, user); break;
-                case 5: tmp = gen_ld16s(addr, user); break;
-                case 2: tmp = gen_ld32(addr, user); break;
+                case 1: tmp = gen_ld16u(addr, ldst_index(s, user)); break;
+                case 5: tmp = gen_ld16s(addr, ldst_index(s, user)); break;
+                case 2: tmp = gen_ld32(addr, ldst_index(s, user)); break;
                 default: goto illegal_op;
                 }
                 if (rs == 15) {
@@ -8076,8 +8309,8 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
             tmp = load_reg(s, rs);
             switch (op) {
             case 0: gen_st8(tmp, addr, user); break;
-            case 1: gen_st16(tmp, addr, user); break;
-            case 2: gen_st32(tmp, addr, user); break;
+            case 1: gen_st16(tmp, addr, ldst_index(s, user)); break;
+            case 2: gen_st32(tmp, addr, ldst_index(s, user)); break;
             default: goto illegal_op;
             }
         }
@@ -8381,10 +8614,10 @@ static void disas_thumb_insn(CPUState *env, DisasContext *s)
 
         switch (op) {
         case 0: /* str */
-            gen_st32(tmp, addr, IS_USER(s));
+            gen_st32(tmp, addr, ldst_index(s, IS_USER(s)));
             break;
         case 1: /* strh */
-            gen_st16(tmp, addr, IS_USER(s));
+            gen_st16(tmp, addr, ldst_index(s, IS_USER(s)));
             break;
         case 2: /* strb */
             gen_st8(tmp, addr, IS_USER(s));
@@ -8393,16 +8626,16 @@ static void disas_thumb_insn(CPUState *env, DisasContext *s)
             tmp = gen_ld8s(addr, IS_USER(s));
             break;
         case 4: /* ldr */
-            tmp = gen_ld32(addr, IS_USER(s));
+            tmp = gen_ld32(addr, ldst_index(s, IS_USER(s)));
             break;
         case 5: /* ldrh */
-            tmp = gen_ld16u(addr, IS_USER(s));
+            tmp = gen_ld16u(addr, ldst_index(s, IS_USER(s)));
             break;
         case 6: /* ldrb */
             tmp = gen_ld8u(addr, IS_USER(s));
             break;
         case 7: /* ldrsh */
-            tmp = gen_ld16s(addr, IS_USER(s));
+            tmp = gen_ld16s(addr, ldst_index(s, IS_USER(s)));
             break;
         }
         if (op >= 3) /* load */
@@ -8420,12 +8653,12 @@ static void disas_thumb_insn(CPUState *env, DisasContext *s)
 
         if (insn & (1 << 11)) {
             /* load */
-            tmp = gen_ld32(addr, IS_USER(s));
+            tmp = gen_ld32(addr, ldst_index(s, IS_USER(s)));
             store_reg(s, rd, tmp);
         } else {
             /* store */
             tmp = load_reg(s, rd);
-            gen_st32(tmp, addr, IS_USER(s));
+            gen_st32(tmp, addr, ldst_index(s, IS_USER(s)));
         }
         dead_tmp(addr);
         break;
@@ -8460,12 +8693,12 @@ static void disas_thumb_insn(CPUState *env, DisasContext *s)
 
         if (insn & (1 << 11)) {
             /* load */
-            tmp = gen_ld16u(addr, IS_USER(s));
+            tmp = gen_ld16u(addr, ldst_index(s, IS_USER(s)));
             store_reg(s, rd, tmp);
         } else {
             /* store */
             tmp = load_reg(s, rd);
-            gen_st16(tmp, addr, IS_USER(s));
+            gen_st16(tmp, addr, ldst_index(s, IS_USER(s)));
         }
         dead_tmp(addr);
         break;
@@ -8786,6 +9019,10 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     dc->thumb = env->thumb;
     dc->condexec_mask = (env->condexec_bits & 0xf) << 1;
     dc->condexec_cond = env->condexec_bits >> 4;
+    dc->trace = (tb->cflags & CF_TRACE) && !env->singlestep_enabled;
+    dc->trace_blocks = 0;
+    dc->jmp_slots = 0;
+    dc->unaligned = arm_unaligned_enabled(env);
 #if !defined(CONFIG_USER_ONLY)
     if (IS_M(env)) {
         dc->user = ((env->v7m.exception == 0) && (env->v7m.control & 1));
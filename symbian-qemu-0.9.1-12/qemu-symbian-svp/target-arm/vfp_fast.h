@@ -0,0 +1,128 @@
+/*
+ * ARM VFP arithmetic using the host FPU.
+ *
+ * With round to nearest, no flush to zero, no default NaN mode and no
+ * trap enables, IEEE single and double arithmetic on an SSE2 host gives
+ * the same results as softfloat, except for the sign and payload of
+ * generated NaNs.  The fast routines below do the operation on the host
+ * and return 0 when the result is a NaN so that the caller redoes it
+ * with softfloat.
+ *
+ * Exception flags are not computed per operation.  The host MXCSR flags
+ * are sticky, so they are cleared before the first fast operation and
+ * folded into the softfloat flags when the guest reads FPSCR (or when
+ * the CPU loop exits).  Both tininess detection (after rounding) and the
+ * conditions for the other flags match softfloat.
+ *
+ * This code is licenced under the GPL.
+ */
+#ifndef VFP_FAST_H
+#define VFP_FAST_H
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#define VFP_FAST_PATH 1
+
+/* FPSCR trap enables, which must be clear for the fast path.  The
+   rounding mode, flush to zero and default NaN mode are checked in the
+   float_status that softfloat uses.  */
+#define VFP_FPSCR_TRAPS (0x9f << 8)
+
+typedef union {
+    float32 f;
+    float s;
+} vfp_fast_s;
+
+typedef union {
+    float64 f;
+    double d;
+} vfp_fast_d;
+
+static inline int vfp_fast_is_nan_s(float32 a)
+{
+    return (float32_val(a) & 0x7fffffff) > 0x7f800000;
+}
+
+static inline int vfp_fast_is_nan_d(float64 a)
+{
+    return (float64_val(a) & LIT64(0x7fffffffffffffff))
+           > LIT64(0x7ff0000000000000);
+}
+
+static inline void vfp_fast_clear_flags(void)
+{
+    _mm_setcsr(_mm_getcsr() & ~0x3f);
+}
+
+/* Return the host exception flags raised since the last clear, in
+   softfloat form, and clear them.  */
+static inline int vfp_fast_read_flags(void)
+{
+    unsigned int csr = _mm_getcsr();
+    int flags = 0;
+
+    if (!(csr & 0x3d))
+        return 0;
+    if (csr & 0x01)
+        flags |= float_flag_invalid;
+    if (csr & 0x04)
+        flags |= float_flag_divbyzero;
+    if (csr & 0x08)
+        flags |= float_flag_overflow;
+    if (csr & 0x10)
+        flags |= float_flag_underflow;
+    if (csr & 0x20)
+        flags |= float_flag_inexact;
+    _mm_setcsr(csr & ~0x3f);
+    return flags;
+}
+
+#define VFP_FAST_BINOP(name, op) \
+static inline int vfp_fast_##name##s(float32 a, float32 b, float32 *res) \
+{ \
+    vfp_fast_s x, y; \
+    x.f = a; \
+    y.f = b; \
+    x.s = _mm_cvtss_f32(_mm_##op##_ss(_mm_set_ss(x.s), _mm_set_ss(y.s))); \
+    *res = x.f; \
+    return !vfp_fast_is_nan_s(x.f); \
+} \
+static inline int vfp_fast_##name##d(float64 a, float64 b, float64 *res) \
+{ \
+    vfp_fast_d x, y; \
+    x.f = a; \
+    y.f = b; \
+    x.d = _mm_cvtsd_f64(_mm_##op##_sd(_mm_set_sd(x.d), _mm_set_sd(y.d))); \
+    *res = x.f; \
+    return !vfp_fast_is_nan_d(x.f); \
+}
+VFP_FAST_BINOP(add, add)
+VFP_FAST_BINOP(sub, sub)
+VFP_FAST_BINOP(mul, mul)
+VFP_FAST_BINOP(div, div)
+#undef VFP_FAST_BINOP
+
+static inline int vfp_fast_sqrts(float32 a, float32 *res)
+{
+    vfp_fast_s x;
+
+    x.f = a;
+    x.s = _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(x.s)));
+    *res = x.f;
+    return !vfp_fast_is_nan_s(x.f);
+}
+
+static inline int vfp_fast_sqrtd(float64 a, float64 *res)
+{
+    vfp_fast_d x;
+
+    x.f = a;
+    x.d = _mm_cvtsd_f64(_mm_sqrt_sd(_mm_setzero_pd(), _mm_set_sd(x.d)));
+    *res = x.f;
+    return !vfp_fast_is_nan_d(x.f);
+}
+
+#endif /* __SSE2__ */
+
+#endif /* VFP_FAST_H */
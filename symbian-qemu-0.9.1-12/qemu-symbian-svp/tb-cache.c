@@ -0,0 +1,566 @@
+/*
+ *  Persistent translation block cache
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The generated code of a TB only depends on the guest code bytes, the
+   TB lookup key (pc, cs_base, flags, cflags) and the emulator binary.
+   Blocks are saved together with the list of references they make
+   outside of the code buffer (helpers, epilogue, TB pointer) so that
+   they can be copied to any address of the code buffer of a later run.
+   The guest bytes are hashed when a block is stored and checked again
+   before it is reused, so blocks whose guest code changed (new ROM
+   image, different process at the same address) are never executed.  */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "cpu.h"
+#include "exec-all.h"
+#include "qemu-common.h"
+#include "tcg.h"
+#include "tb-cache.h"
+
+//#define DEBUG_TB_CACHE
+
+#define TB_CACHE_MAGIC          0x43425451 /* "QTBC" */
+#define TB_CACHE_VERSION        1
+
+#define TB_CACHE_HASH_BITS      14
+#define TB_CACHE_HASH_SIZE      (1 << TB_CACHE_HASH_BITS)
+
+/* Maximum number of blocks kept for the same lookup key.  */
+#define TB_CACHE_MAX_VARIANTS   4
+
+typedef struct TBCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;
+    uint32_t nb_entries;
+    uint32_t reserved;
+    uint64_t data_size;
+} TBCacheHeader;
+
+/* Followed by 'nb_relocs' TCGExtReloc and 'code_size' bytes of host
+   code, padded to a multiple of 8 bytes.  */
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t guest_hash;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t code_size;
+    uint16_t size;
+    uint16_t icount;
+    uint16_t nb_relocs;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint16_t reserved[3];
+} TBCacheEntry;
+
+#define TB_CACHE_HIT    0x01 /* used in this run */
+#define TB_CACHE_STALE  0x02 /* guest code did not match */
+#define TB_CACHE_DEAD   0x04 /* replaced, dropped on save */
+
+typedef struct TBCacheNode {
+    TBCacheEntry *entry;
+    int state;
+    struct TBCacheNode *next;
+} TBCacheNode;
+
+int tb_cache_enabled;
+
+static char *tb_cache_filename;
+static uint64_t tb_cache_fingerprint;
+static TBCacheNode *tb_cache_hash[TB_CACHE_HASH_SIZE];
+static void *tb_cache_map;
+static size_t tb_cache_map_size;
+static int tb_cache_dirty;
+
+/* statistics */
+static int tb_cache_loaded;
+static int tb_cache_nb_entries;
+static int64_t tb_cache_lookups;
+static int64_t tb_cache_hits;
+static int64_t tb_cache_stale;
+static int64_t tb_cache_stored;
+static int64_t tb_cache_rejected;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+static uint64_t tb_cache_hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        h ^= *p++;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static inline unsigned int tb_cache_hash_func(target_ulong pc, int flags)
+{
+    return ((pc >> 2) ^ (pc >> (TB_CACHE_HASH_BITS + 2)) ^ flags)
+           & (TB_CACHE_HASH_SIZE - 1);
+}
+
+static inline size_t tb_cache_entry_size(const TBCacheEntry *e)
+{
+    return (sizeof(TBCacheEntry) + e->nb_relocs * sizeof(TCGExtReloc)
+            + e->code_size + 7) & ~7;
+}
+
+static inline TCGExtReloc *tb_cache_entry_relocs(TBCacheEntry *e)
+{
+    return (TCGExtReloc *)(e + 1);
+}
+
+static inline uint8_t *tb_cache_entry_code(TBCacheEntry *e)
+{
+    return (uint8_t *)(tb_cache_entry_relocs(e) + e->nb_relocs);
+}
+
+/* All the references to the emulator binary are saved relative to
+   this address.  */
+static inline tcg_target_long tb_cache_image_base(void)
+{
+    return (tcg_target_long)tb_cache_init;
+}
+
+/* Return a host pointer to the guest code at 'addr', or NULL if its
+   page is not present in the code TLB.  Unlike get_phys_addr_code,
+   this never raises a guest exception.  */
+static uint8_t *tb_cache_code_ptr(CPUState *env, target_ulong addr)
+{
+    int mmu_idx, page_index;
+
+    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    mmu_idx = cpu_mmu_index(env);
+    if (env->tlb_table[mmu_idx][page_index].addr_code !=
+        (addr & TARGET_PAGE_MASK))
+        return NULL;
+    return (uint8_t *)(long)(addr + env->tlb_table[mmu_idx][page_index].addend);
+}
+
+static int tb_cache_hash_code(CPUState *env, target_ulong pc, int size,
+                              uint64_t *hash)
+{
+    uint64_t h;
+    uint8_t *p;
+    int len;
+
+    h = FNV_OFFSET_BASIS;
+    while (size > 0) {
+        p = tb_cache_code_ptr(env, pc);
+        if (!p)
+            return -1;
+        len = TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK);
+        if (len > size)
+            len = size;
+        h = tb_cache_hash_bytes(h, p, len);
+        pc += len;
+        size -= len;
+    }
+    *hash = h;
+    return 0;
+}
+
+/* Breakpoints and single stepping change the generated code without
+   changing the TB key.  */
+static inline int tb_cache_usable(CPUState *env)
+{
+    return !env->singlestep_enabled && TAILQ_EMPTY(&env->breakpoints);
+}
+
+static inline int tb_cache_match(const TBCacheEntry *e,
+                                 const TranslationBlock *tb)
+{
+    return e->pc == tb->pc && e->cs_base == tb->cs_base &&
+           e->flags == (uint32_t)tb->flags && e->cflags == tb->cflags;
+}
+
+static void tb_cache_add(TBCacheEntry *e, int state)
+{
+    TBCacheNode *node, *node1;
+    unsigned int h;
+    int n;
+
+    h = tb_cache_hash_func(e->pc, e->flags);
+    node = qemu_mallocz(sizeof(*node));
+    node->entry = e;
+    node->state = state;
+    node->next = tb_cache_hash[h];
+    tb_cache_hash[h] = node;
+    tb_cache_nb_entries++;
+
+    /* drop the variants whose guest code is gone, and the oldest ones
+       if there are still too many */
+    n = 1;
+    for(node1 = node->next; node1; node1 = node1->next) {
+        TBCacheEntry *e1 = node1->entry;
+        if ((node1->state & TB_CACHE_DEAD) ||
+            e1->pc != e->pc || e1->cs_base != e->cs_base ||
+            e1->flags != e->flags || e1->cflags != e->cflags)
+            continue;
+        if ((node1->state & (TB_CACHE_STALE | TB_CACHE_HIT)) ==
+            TB_CACHE_STALE || ++n > TB_CACHE_MAX_VARIANTS) {
+            node1->state |= TB_CACHE_DEAD;
+            tb_cache_nb_entries--;
+        }
+    }
+}
+
+static uint64_t tb_cache_compute_fingerprint(void)
+{
+    uint64_t h;
+    int64_t v[6];
+#ifdef __linux__
+    struct stat st;
+#endif
+
+    h = FNV_OFFSET_BASIS;
+    /* the code is only valid for the binary that generated it */
+#ifdef __linux__
+    if (stat("/proc/self/exe", &st) == 0) {
+        h = tb_cache_hash_bytes(h, &st.st_size, sizeof(st.st_size));
+        h = tb_cache_hash_bytes(h, &st.st_mtime, sizeof(st.st_mtime));
+    } else
+#endif
+    {
+        h = tb_cache_hash_bytes(h, __DATE__ __TIME__,
+                                sizeof(__DATE__ __TIME__));
+    }
+    v[0] = TB_CACHE_VERSION;
+    v[1] = sizeof(CPUState);
+    v[2] = use_icount;
+    v[3] = (tcg_target_long)code_gen_prologue - tb_cache_image_base();
+    v[4] = (tcg_target_long)&tcg_ctx - tb_cache_image_base();
+    v[5] = 0;
+#if defined(TARGET_ARM)
+    /* the translator depends on the CPU features */
+    if (first_cpu)
+        v[5] = first_cpu->cp15.c0_cpuid;
+#endif
+    return tb_cache_hash_bytes(h, v, sizeof(v));
+}
+
+/* Check that an entry loaded from the file only refers to its own
+   code, so that a corrupt file cannot make tb_cache_lookup write
+   outside of the block.  */
+static int tb_cache_entry_valid(TBCacheEntry *e)
+{
+    TCGExtReloc *r;
+    int i, n;
+
+    if (e->code_size == 0 || e->code_size > code_gen_max_block_size() ||
+        e->nb_relocs > TCG_MAX_EXT_RELOCS)
+        return 0;
+    r = tb_cache_entry_relocs(e);
+    for(i = 0; i < e->nb_relocs; i++) {
+        n = tcg_ext_reloc_size(r[i].type);
+        if (n == 0 || (uint64_t)r[i].offset + n > e->code_size)
+            return 0;
+    }
+    for(i = 0; i < 2; i++) {
+        if (e->tb_next_offset[i] != 0xffff &&
+            e->tb_next_offset[i] > e->code_size)
+            return 0;
+        if (e->tb_jmp_offset[i] != 0xffff &&
+            e->tb_jmp_offset[i] + 4 > e->code_size)
+            return 0;
+    }
+    return 1;
+}
+
+static void tb_cache_load(const char *filename)
+{
+    TBCacheHeader *hdr;
+    TBCacheEntry *e;
+    uint8_t *p, *end;
+    struct stat st;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(TBCacheHeader)) {
+        close(fd);
+        return;
+    }
+    tb_cache_map_size = st.st_size;
+#ifndef _WIN32
+    tb_cache_map = mmap(NULL, tb_cache_map_size, PROT_READ, MAP_PRIVATE,
+                        fd, 0);
+    if (tb_cache_map == MAP_FAILED) {
+        tb_cache_map = NULL;
+        close(fd);
+        return;
+    }
+#else
+    tb_cache_map = qemu_malloc(tb_cache_map_size);
+    if (read(fd, tb_cache_map, tb_cache_map_size) != tb_cache_map_size) {
+        qemu_free(tb_cache_map);
+        tb_cache_map = NULL;
+        close(fd);
+        return;
+    }
+#endif
+    close(fd);
+
+    hdr = tb_cache_map;
+    if (hdr->magic != TB_CACHE_MAGIC || hdr->version != TB_CACHE_VERSION ||
+        hdr->data_size > tb_cache_map_size - sizeof(TBCacheHeader)) {
+        fprintf(stderr, "tb-cache: %s: invalid cache file, ignoring\n",
+                filename);
+        return;
+    }
+    if (hdr->fingerprint != tb_cache_fingerprint) {
+        fprintf(stderr, "tb-cache: %s: created by a different emulator "
+                "binary or configuration, ignoring\n", filename);
+        tb_cache_dirty = 1;
+        return;
+    }
+
+    /* check the whole file before using any of it */
+    p = (uint8_t *)(hdr + 1);
+    end = p + hdr->data_size;
+    while (p < end) {
+        e = (TBCacheEntry *)p;
+        if (end - p < sizeof(TBCacheEntry) ||
+            end - p < tb_cache_entry_size(e) || !tb_cache_entry_valid(e)) {
+            fprintf(stderr, "tb-cache: %s: corrupt cache file, ignoring\n",
+                    filename);
+            tb_cache_dirty = 1;
+            return;
+        }
+        p += tb_cache_entry_size(e);
+    }
+
+    p = (uint8_t *)(hdr + 1);
+    while (p < end) {
+        e = (TBCacheEntry *)p;
+        tb_cache_add(e, 0);
+        tb_cache_loaded++;
+        p += tb_cache_entry_size(e);
+    }
+#ifdef DEBUG_TB_CACHE
+    fprintf(stderr, "tb-cache: loaded %d blocks from %s\n",
+            tb_cache_loaded, filename);
+#endif
+}
+
+static void tb_cache_save(void)
+{
+    TBCacheHeader hdr;
+    TBCacheNode *node;
+    char *tmpname;
+    FILE *f;
+    size_t len;
+    int i;
+
+#ifdef DEBUG_TB_CACHE
+    tb_cache_dump_info(stderr, fprintf);
+#endif
+    if (!tb_cache_dirty)
+        return;
+
+    len = strlen(tb_cache_filename) + 5;
+    tmpname = qemu_malloc(len);
+    snprintf(tmpname, len, "%s.tmp", tb_cache_filename);
+    f = fopen(tmpname, "wb");
+    if (!f) {
+        fprintf(stderr, "tb-cache: could not create %s: %s\n",
+                tmpname, strerror(errno));
+        qemu_free(tmpname);
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TB_CACHE_MAGIC;
+    hdr.version = TB_CACHE_VERSION;
+    hdr.fingerprint = tb_cache_fingerprint;
+    fwrite(&hdr, 1, sizeof(hdr), f);
+    for(i = 0; i < TB_CACHE_HASH_SIZE; i++) {
+        for(node = tb_cache_hash[i]; node; node = node->next) {
+            if (node->state & TB_CACHE_DEAD)
+                continue;
+            len = tb_cache_entry_size(node->entry);
+            fwrite(node->entry, 1, len, f);
+            hdr.nb_entries++;
+            hdr.data_size += len;
+        }
+    }
+    fseek(f, 0, SEEK_SET);
+    fwrite(&hdr, 1, sizeof(hdr), f);
+    if (ferror(f) | fclose(f)) {
+        fprintf(stderr, "tb-cache: error writing %s\n", tmpname);
+        unlink(tmpname);
+    } else if (rename(tmpname, tb_cache_filename) < 0) {
+        fprintf(stderr, "tb-cache: could not rename %s: %s\n",
+                tmpname, strerror(errno));
+        unlink(tmpname);
+    }
+    qemu_free(tmpname);
+}
+
+/* Must be called once the CPUs have been created.  */
+void tb_cache_init(const char *filename)
+{
+#ifdef TCG_TARGET_HAS_ext_relocs
+    tb_cache_filename = qemu_strdup(filename);
+    tb_cache_fingerprint = tb_cache_compute_fingerprint();
+    tcg_ctx.ext_relocs = qemu_malloc(TCG_MAX_EXT_RELOCS *
+                                     sizeof(TCGExtReloc));
+    tb_cache_load(filename);
+    tb_cache_enabled = 1;
+    atexit(tb_cache_save);
+#else
+    fprintf(stderr, "tb-cache: not supported on this host, ignoring\n");
+#endif
+}
+
+/* Try to fill 'tb' and its host code from the cache.  Return non zero
+   on success.  */
+int tb_cache_lookup(CPUState *env, TranslationBlock *tb,
+                    int *gen_code_size_ptr)
+{
+    TBCacheNode *node;
+    TBCacheEntry *e;
+    uint64_t hash;
+
+    if (!tb_cache_usable(env))
+        return 0;
+    tb_cache_lookups++;
+    node = tb_cache_hash[tb_cache_hash_func(tb->pc, tb->flags)];
+    for(; node; node = node->next) {
+        e = node->entry;
+        if ((node->state & TB_CACHE_DEAD) || !tb_cache_match(e, tb))
+            continue;
+        if (tb_cache_hash_code(env, tb->pc, e->size, &hash) < 0)
+            continue;
+        if (hash != e->guest_hash) {
+            if (!(node->state & TB_CACHE_STALE))
+                tb_cache_stale++;
+            node->state |= TB_CACHE_STALE;
+            continue;
+        }
+        memcpy(tb->tc_ptr, tb_cache_entry_code(e), e->code_size);
+        if (tcg_apply_ext_relocs(tb->tc_ptr, tb_cache_entry_relocs(e),
+                                 e->nb_relocs, tb_cache_image_base(),
+                                 (tcg_target_long)tb) < 0) {
+            node->state |= TB_CACHE_DEAD;
+            tb_cache_nb_entries--;
+            tb_cache_dirty = 1;
+            continue;
+        }
+        tb->size = e->size;
+        tb->icount = e->icount;
+        tb->tb_next_offset[0] = e->tb_next_offset[0];
+        tb->tb_next_offset[1] = e->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+        tb->tb_jmp_offset[0] = e->tb_jmp_offset[0];
+        tb->tb_jmp_offset[1] = e->tb_jmp_offset[1];
+        tb->tb_jmp_offset[2] = 0xffff;
+        tb->tb_jmp_offset[3] = 0xffff;
+#endif
+        node->state |= TB_CACHE_HIT;
+        tb_cache_hits++;
+        *gen_code_size_ptr = e->code_size;
+        return 1;
+    }
+    return 0;
+}
+
+/* Record the block that was just generated by cpu_gen_code.  */
+void tb_cache_insert(CPUState *env, TranslationBlock *tb, int gen_code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheEntry *e, tmp;
+    TCGExtReloc *r;
+    uint64_t hash;
+    int i;
+
+    if (!tb_cache_usable(env))
+        return;
+    if (s->nb_ext_relocs < 0 || tb->size == 0 ||
+        tb_cache_hash_code(env, tb->pc, tb->size, &hash) < 0) {
+        tb_cache_rejected++;
+        return;
+    }
+
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.nb_relocs = s->nb_ext_relocs;
+    tmp.code_size = gen_code_size;
+    e = qemu_mallocz(tb_cache_entry_size(&tmp));
+    *e = tmp;
+    e->pc = tb->pc;
+    e->cs_base = tb->cs_base;
+    e->guest_hash = hash;
+    e->flags = tb->flags;
+    e->cflags = tb->cflags;
+    e->size = tb->size;
+    e->icount = tb->icount;
+    e->tb_next_offset[0] = tb->tb_next_offset[0];
+    e->tb_next_offset[1] = tb->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    e->tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    e->tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+#else
+    e->tb_jmp_offset[0] = 0xffff;
+    e->tb_jmp_offset[1] = 0xffff;
+#endif
+    r = tb_cache_entry_relocs(e);
+    memcpy(r, s->ext_relocs, e->nb_relocs * sizeof(TCGExtReloc));
+    for(i = 0; i < e->nb_relocs; i++) {
+        if (r[i].type == TCG_EXT_RELOC_TB)
+            r[i].value -= (tcg_target_long)tb;
+        else
+            r[i].value -= tb_cache_image_base();
+    }
+    memcpy(tb_cache_entry_code(e), tb->tc_ptr, gen_code_size);
+
+    tb_cache_add(e, TB_CACHE_HIT);
+    tb_cache_stored++;
+    tb_cache_dirty = 1;
+}
+
+void tb_cache_dump_info(FILE *f,
+                        int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    if (!tb_cache_enabled)
+        return;
+    cpu_fprintf(f, "\nPersistent TB cache (%s):\n", tb_cache_filename);
+    cpu_fprintf(f, "cached TB count     %d (%d loaded)\n",
+                tb_cache_nb_entries, tb_cache_loaded);
+    cpu_fprintf(f, "lookups             %" PRId64 " (hit rate %d%%)\n",
+                tb_cache_lookups,
+                tb_cache_lookups ?
+                (int)(tb_cache_hits * 100 / tb_cache_lookups) : 0);
+    cpu_fprintf(f, "stale TB count      %" PRId64 "\n", tb_cache_stale);
+    cpu_fprintf(f, "stored TB count     %" PRId64 " (%" PRId64 " rejected)\n",
+                tb_cache_stored, tb_cache_rejected);
+}
@@ -0,0 +1,17 @@
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+/* Persistent translation cache: host code for translated blocks is
+   kept in a file across runs, keyed by the guest code it was generated
+   from.  */
+
+extern int tb_cache_enabled;
+
+void tb_cache_init(const char *filename);
+int tb_cache_lookup(CPUState *env, TranslationBlock *tb,
+                    int *gen_code_size_ptr);
+void tb_cache_insert(CPUState *env, TranslationBlock *tb, int gen_code_size);
+void tb_cache_dump_info(FILE *f,
+                        int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
+
+#endif
@@ -151,6 +151,62 @@ int gen_new_label(void)
 
 #include "tcg-target.c"
 
+/* external reference processing (persistent TB cache) */
+
+void tcg_out_ext_reloc(TCGContext *s, uint8_t *code_ptr, int type,
+                       tcg_target_long value)
+{
+    TCGExtReloc *r;
+
+    if (!s->ext_relocs || s->nb_ext_relocs < 0)
+        return;
+    if (s->nb_ext_relocs >= TCG_MAX_EXT_RELOCS) {
+        /* too many references: the block will not be cached */
+        s->nb_ext_relocs = -1;
+        return;
+    }
+    r = &s->ext_relocs[s->nb_ext_relocs++];
+    r->offset = code_ptr - s->code_buf;
+    r->type = type;
+    r->value = value;
+}
+
+/* Return the number of code bytes patched by a reference of 'type', or
+   0 if the type is unknown.  */
+int tcg_ext_reloc_size(int type)
+{
+    switch(type) {
+    case TCG_EXT_RELOC_PC32:
+        return 4;
+    case TCG_EXT_RELOC_TB:
+        return sizeof(tcg_target_long);
+    default:
+        return 0;
+    }
+}
+
+/* Fix up the external references of a block copied to 'code_buf'.
+   PC32 targets are moved by 'image_delta', TB references are rebased
+   on 'tb_ptr'.  Return non zero if a reference cannot be encoded.  */
+int tcg_apply_ext_relocs(uint8_t *code_buf, const TCGExtReloc *relocs,
+                         int nb_relocs, tcg_target_long image_delta,
+                         tcg_target_long tb_ptr)
+{
+#ifdef TCG_TARGET_HAS_ext_relocs
+    int i;
+
+    for(i = 0; i < nb_relocs; i++) {
+        if (tcg_target_apply_ext_reloc(code_buf + relocs[i].offset,
+                                       relocs[i].type, relocs[i].value,
+                                       image_delta, tb_ptr))
+            return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 /* pool based memory allocation */
 void *tcg_malloc_internal(TCGContext *s, int size)
 {
@@ -1942,6 +1998,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+    s->nb_ext_relocs = 0;
 
     args = gen_opparam_buf;
     op_index = 0;
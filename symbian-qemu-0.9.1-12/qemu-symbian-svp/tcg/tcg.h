@@ -179,6 +179,16 @@ typedef int TCGv_i64;
 #define TCG_CALL_DUMMY_TCGV     MAKE_TCGV_I32(-1)
 #define TCG_CALL_DUMMY_ARG      ((TCGArg)(-1))
 
+/* ORed into the mem_index argument of the qemu_ld/st ops when the guest
+   only requires the access to be aligned to (1 << n) bytes instead of
+   its size.  Only generated for backends defining
+   TCG_TARGET_HAS_qemu_unaligned, which then handle such accesses inline
+   as long as they do not cross a page.  */
+#define TCG_MEM_ALIGN_SHIFT     8
+#define TCG_MEM_UNALIGNED(n)    (((n) + 1) << TCG_MEM_ALIGN_SHIFT)
+#define TCG_MEM_INDEX(mem_index) \
+    ((mem_index) & ((1 << TCG_MEM_ALIGN_SHIFT) - 1))
+
 typedef enum {
     TCG_COND_EQ,
     TCG_COND_NE,
@@ -224,6 +234,21 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+/* References from generated code to addresses outside the code
+   buffer.  They are only recorded when the persistent TB cache is
+   enabled, so that a block can be copied to another address (or
+   another process) and fixed up again.  */
+#define TCG_EXT_RELOC_PC32  0 /* pc relative 32 bit, target in the binary */
+#define TCG_EXT_RELOC_TB    1 /* absolute TranslationBlock pointer */
+
+#define TCG_MAX_EXT_RELOCS 256
+
+typedef struct TCGExtReloc {
+    uint32_t offset; /* from the start of the block */
+    uint32_t type;
+    int64_t value; /* absolute target, or offset from the TB pointer */
+} TCGExtReloc;
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -243,6 +268,10 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* external references (persistent TB cache), NULL if disabled */
+    TCGExtReloc *ext_relocs;
+    int nb_ext_relocs; /* -1 if the block cannot be relocated */
+
     /* liveness analysis */
     uint16_t *op_dead_iargs; /* for each operation, each bit tells if the
                                 corresponding input argument is dead */
@@ -317,6 +346,13 @@ void tcg_func_start(TCGContext *s);
 int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf);
 int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset);
 
+void tcg_out_ext_reloc(TCGContext *s, uint8_t *code_ptr, int type,
+                       tcg_target_long value);
+int tcg_ext_reloc_size(int type);
+int tcg_apply_ext_relocs(uint8_t *code_buf, const TCGExtReloc *relocs,
+                         int nb_relocs, tcg_target_long image_delta,
+                         tcg_target_long tb_ptr);
+
 void tcg_set_frame(TCGContext *s, int reg,
                    tcg_target_long start, tcg_target_long size);
 TCGv_i64 tcg_global_reg2_new_hack(TCGType type, int reg1, int reg2,
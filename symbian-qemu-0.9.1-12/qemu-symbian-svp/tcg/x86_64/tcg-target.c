@@ -104,6 +104,29 @@ static void patch_reloc(uint8_t *code_ptr, int type,
     }
 }
 
+/* Relocate an external reference of a block copied from another
+   code buffer.  See tcg_apply_ext_relocs.  */
+static int tcg_target_apply_ext_reloc(uint8_t *code_ptr, int type,
+                                      int64_t value,
+                                      tcg_target_long image_delta,
+                                      tcg_target_long tb_ptr)
+{
+    switch(type) {
+    case TCG_EXT_RELOC_PC32:
+        value += image_delta - ((tcg_target_long)code_ptr + 4);
+        if (value != (int32_t)value)
+            return -1;
+        *(uint32_t *)code_ptr = value;
+        break;
+    case TCG_EXT_RELOC_TB:
+        *(uint64_t *)code_ptr = tb_ptr + value;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
 /* maximum number of register used for input function arguments */
 static inline int tcg_target_get_call_iarg_regs_count(int flags)
 {
@@ -509,6 +532,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     int addr_reg, data_reg, r0, r1, mem_index, s_bits, bswap, rexw;
 #if defined(CONFIG_SOFTMMU)
     uint8_t *label1_ptr, *label2_ptr;
+    int align;
 #endif
 
     data_reg = *args++;
@@ -525,17 +549,32 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     rexw = P_REXW;
 #endif
 #if defined(CONFIG_SOFTMMU)
+    /* log2 of the alignment required by the guest */
+    align = s_bits;
+    if (mem_index >> TCG_MEM_ALIGN_SHIFT) {
+        align = (mem_index >> TCG_MEM_ALIGN_SHIFT) - 1;
+        mem_index = TCG_MEM_INDEX(mem_index);
+    }
+
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r1, addr_reg);
 
-    /* mov */
-    tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
+    if (align < s_bits) {
+        /* Compare the page of the last aligned unit of the access, so
+           that only accesses crossing a page miss the TLB check.  */
+        /* lea x(addr_reg), r0 */
+        tcg_out_modrm_offset(s, 0x8d | rexw, r0, addr_reg,
+                             (1 << s_bits) - (1 << align));
+    } else {
+        /* mov */
+        tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
+    }
  
     tcg_out_modrm(s, 0xc1 | rexw, 5, r1); /* shr $x, r1 */
     tcg_out8(s, TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS); 
     
     tcg_out_modrm(s, 0x81 | rexw, 4, r0); /* andl $x, r0 */
-    tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
+    tcg_out32(s, TARGET_PAGE_MASK | ((1 << align) - 1));
     
     tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
     tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
@@ -558,6 +597,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     /* XXX: move that code at the end of the TB */
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RSI, mem_index);
     tcg_out8(s, 0xe8);
+    tcg_out_ext_reloc(s, s->code_ptr, TCG_EXT_RELOC_PC32,
+                      (tcg_target_long)qemu_ld_helpers[s_bits]);
     tcg_out32(s, (tcg_target_long)qemu_ld_helpers[s_bits] - 
               (tcg_target_long)s->code_ptr - 4);
 
@@ -692,6 +733,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     int addr_reg, data_reg, r0, r1, mem_index, s_bits, bswap, rexw;
 #if defined(CONFIG_SOFTMMU)
     uint8_t *label1_ptr, *label2_ptr;
+    int align;
 #endif
 
     data_reg = *args++;
@@ -709,17 +751,32 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     rexw = P_REXW;
 #endif
 #if defined(CONFIG_SOFTMMU)
+    /* log2 of the alignment required by the guest */
+    align = s_bits;
+    if (mem_index >> TCG_MEM_ALIGN_SHIFT) {
+        align = (mem_index >> TCG_MEM_ALIGN_SHIFT) - 1;
+        mem_index = TCG_MEM_INDEX(mem_index);
+    }
+
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r1, addr_reg);
 
-    /* mov */
-    tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
+    if (align < s_bits) {
+        /* Compare the page of the last aligned unit of the access, so
+           that only accesses crossing a page miss the TLB check.  */
+        /* lea x(addr_reg), r0 */
+        tcg_out_modrm_offset(s, 0x8d | rexw, r0, addr_reg,
+                             (1 << s_bits) - (1 << align));
+    } else {
+        /* mov */
+        tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
+    }
  
     tcg_out_modrm(s, 0xc1 | rexw, 5, r1); /* shr $x, r1 */
     tcg_out8(s, TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS); 
     
     tcg_out_modrm(s, 0x81 | rexw, 4, r0); /* andl $x, r0 */
-    tcg_out32(s, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
+    tcg_out32(s, TARGET_PAGE_MASK | ((1 << align) - 1));
     
     tcg_out_modrm(s, 0x81, 4, r1); /* andl $x, r1 */
     tcg_out32(s, (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS);
@@ -760,6 +817,8 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, mem_index);
     tcg_out8(s, 0xe8);
+    tcg_out_ext_reloc(s, s->code_ptr, TCG_EXT_RELOC_PC32,
+                      (tcg_target_long)qemu_st_helpers[s_bits]);
     tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
               (tcg_target_long)s->code_ptr - 4);
 
@@ -837,18 +896,36 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
     
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_RAX, args[0]);
+        if (s->ext_relocs && args[0]) {
+            /* always use the 64 bit form so that the block can be
+               relocated */
+            tcg_out_opc(s, (0xb8 + (TCG_REG_RAX & 7)) | P_REXW, 0,
+                        TCG_REG_RAX, 0);
+            tcg_out_ext_reloc(s, s->code_ptr, TCG_EXT_RELOC_TB, args[0]);
+            tcg_out32(s, args[0]);
+            tcg_out32(s, args[0] >> 32);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_RAX, args[0]);
+        }
         tcg_out8(s, 0xe9); /* jmp tb_ret_addr */
+        tcg_out_ext_reloc(s, s->code_ptr, TCG_EXT_RELOC_PC32,
+                          (tcg_target_long)tb_ret_addr);
         tcg_out32(s, tb_ret_addr - s->code_ptr - 4);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* Align the displacement so that it can be patched while
+               another thread executes the code.  */
+            while (((tcg_target_long)s->code_ptr + 1) & 3)
+                tcg_out8(s, 0x90); /* nop */
             tcg_out8(s, 0xe9); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
         } else {
             /* indirect jump method */
+            if (s->ext_relocs)
+                s->nb_ext_relocs = -1;
             /* jmp Ev */
             tcg_out_modrm_offset(s, 0xff, 4, -1, 
                                  (tcg_target_long)(s->tb_next + 
@@ -859,6 +936,7 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out8(s, 0xe8);
+            tcg_out_ext_reloc(s, s->code_ptr, TCG_EXT_RELOC_PC32, args[0]);
             tcg_out32(s, args[0] - (tcg_target_long)s->code_ptr - 4);
         } else {
             tcg_out_modrm(s, 0xff, 2, args[0]);
@@ -867,6 +945,7 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
     case INDEX_op_jmp:
         if (const_args[0]) {
             tcg_out8(s, 0xe9);
+            tcg_out_ext_reloc(s, s->code_ptr, TCG_EXT_RELOC_PC32, args[0]);
             tcg_out32(s, args[0] - (tcg_target_long)s->code_ptr - 4);
         } else {
             tcg_out_modrm(s, 0xff, 4, args[0]);
@@ -0,0 +1,156 @@
+@ Load/store speed test for the softmmu memory access fast path.
+@ Runs bare metal on an ARMv6 core with semihosting:
+@   qemu-system-arm -M versatilepb -cpu arm1136 -nographic -semihosting \
+@       -kernel test-arm-memspeed
+@ and prints the time spent in each access pattern in centiseconds.
+.code	32
+.globl	_start
+
+.equ	LOOPS, 10000000
+.equ	SYS_WRITE0, 0x04
+.equ	SYS_CLOCK, 0x10
+.equ	SYS_EXIT, 0x18
+
+_start:
+ldr	sp, =stack_top
+@ Enable ARMv6 unaligned accesses (U bit) without alignment faults.
+mrc	p15, 0, r0, c1, c0, 0
+orr	r0, r0, #(1 << 22)
+bic	r0, r0, #(1 << 1)
+mcr	p15, 0, r0, c1, c0, 0
+ldr	r8, =buf
+
+ldr	r0, =aligned_test
+ldr	r1, =aligned_name
+bl	run
+ldr	r0, =unaligned_test
+ldr	r1, =unaligned_name
+bl	run
+ldr	r0, =halfword_test
+ldr	r1, =halfword_name
+bl	run
+ldr	r0, =doubleword_test
+ldr	r1, =doubleword_name
+bl	run
+ldr	r0, =crosspage_test
+ldr	r1, =crosspage_name
+bl	run
+
+mov	r0, #SYS_EXIT
+ldr	r1, =0x20026		@ ADP_Stopped_ApplicationExit
+swi	#0x123456
+
+@ Time the test loop at r0 and print the name at r1 with the result.
+run:
+stmfd	sp!, {r4-r7, lr}
+mov	r4, r0
+mov	r5, r1
+mov	r0, #SYS_CLOCK
+swi	#0x123456
+mov	r6, r0
+ldr	r7, =LOOPS
+blx	r4
+mov	r0, #SYS_CLOCK
+swi	#0x123456
+sub	r6, r0, r6
+mov	r0, #SYS_WRITE0
+mov	r1, r5
+swi	#0x123456
+mov	r0, r6
+bl	print_dec
+ldmfd	sp!, {r4-r7, pc}
+
+@ Print r0 in decimal followed by a newline.
+print_dec:
+ldr	r1, =numbuf_end
+mov	r2, #0
+strb	r2, [r1, #-1]!
+mov	r2, #'\n'
+strb	r2, [r1, #-1]!
+ldr	r12, =0xcccccccd
+1:
+umull	r2, r3, r0, r12
+mov	r3, r3, lsr #3		@ r3 = r0 / 10
+add	r2, r3, r3, lsl #2
+sub	r2, r0, r2, lsl #1	@ r2 = r0 % 10
+add	r2, r2, #'0'
+strb	r2, [r1, #-1]!
+movs	r0, r3
+bne	1b
+mov	r0, #SYS_WRITE0
+swi	#0x123456
+bx	lr
+
+@ The loops run r7 times on the page aligned buffer at r8.
+aligned_test:
+ldr	r0, [r8, #0]
+str	r0, [r8, #16]
+ldr	r1, [r8, #4]
+str	r1, [r8, #20]
+subs	r7, r7, #1
+bne	aligned_test
+bx	lr
+
+unaligned_test:
+ldr	r0, [r8, #1]
+str	r0, [r8, #17]
+ldr	r1, [r8, #6]
+str	r1, [r8, #23]
+subs	r7, r7, #1
+bne	unaligned_test
+bx	lr
+
+halfword_test:
+ldrh	r0, [r8, #1]
+strh	r0, [r8, #17]
+ldrh	r1, [r8, #7]
+strh	r1, [r8, #23]
+subs	r7, r7, #1
+bne	halfword_test
+bx	lr
+
+doubleword_test:
+ldrd	r0, r1, [r8, #4]
+strd	r0, r1, [r8, #20]
+ldrd	r2, r3, [r8, #12]
+strd	r2, r3, [r8, #28]
+subs	r7, r7, #1
+bne	doubleword_test
+bx	lr
+
+@ Accesses straddling a page boundary, always on the slow path.
+crosspage_test:
+add	r9, r8, #4096
+1:
+ldr	r0, [r9, #-2]
+str	r0, [r9, #-1]
+ldrd	r2, r3, [r9, #-4]
+strd	r2, r3, [r9, #-4]
+subs	r7, r7, #1
+bne	1b
+bx	lr
+
+aligned_name:
+.asciz	"aligned word:        "
+unaligned_name:
+.asciz	"unaligned word:      "
+halfword_name:
+.asciz	"unaligned halfword:  "
+doubleword_name:
+.asciz	"doubleword:          "
+crosspage_name:
+.asciz	"page crossing:       "
+.align	2
+
+.ltorg
+
+.bss
+.align	12
+buf:
+.space	8192
+numbuf:
+.space	16
+numbuf_end:
+.align	3
+.space	1024
+stack_top:
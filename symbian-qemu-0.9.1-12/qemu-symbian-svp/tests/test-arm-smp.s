@@ -0,0 +1,177 @@
+@ SMP scaling test for -vcpu-threads.
+@ Runs bare metal on the RealView ARM11 MPCore with semihosting:
+@   qemu-system-arm -M realview -cpu arm11mpcore -smp 4 -vcpu-threads \
+@       -nographic -semihosting -kernel test-arm-smp.bin
+@ The image is loaded raw, so that the board boot code parks the secondary
+@ CPUs until the primary releases them.  Every CPU runs the same amount of
+@ work, with an atomic increment of a shared counter after each chunk, and
+@ the primary prints the time taken for all of them in centiseconds.
+.code	32
+.globl	_start
+
+.equ	CHUNKS, 20000
+.equ	CHUNK_LOOPS, 5000
+.equ	SYS_WRITE0, 0x04
+.equ	SYS_CLOCK, 0x10
+.equ	SYS_EXIT, 0x18
+.equ	MPCORE_PRIV, 0x10100000
+.equ	SYS_FLAGSSET, 0x10000030
+
+_start:
+mrc	p15, 0, r0, c0, c0, 5	@ CPU ID
+and	r0, r0, #3
+ldr	sp, =stack_top
+sub	sp, sp, r0, lsl #10
+cmp	r0, #0
+bne	secondary
+
+ldr	r4, =MPCORE_PRIV
+ldr	r5, [r4, #4]		@ SCU configuration
+and	r5, r5, #3
+add	r5, r5, #1		@ number of CPUs
+@ Enable the interrupt controller, then release the secondary CPUs with a
+@ software interrupt to all the others.
+mov	r0, #1
+str	r0, [r4, #0x100]
+add	r1, r4, #0x1000
+str	r0, [r1]
+ldr	r1, =SYS_FLAGSSET
+mvn	r0, #0
+str	r0, [r1, #4]		@ FLAGSCLR
+ldr	r0, =_start
+str	r0, [r1]
+ldr	r1, =MPCORE_PRIV + 0x1f00
+mov	r0, #(2 << 24)
+str	r0, [r1]
+
+mov	r0, #SYS_CLOCK
+swi	#0x123456
+mov	r6, r0
+bl	work
+@ Sleep until all the CPUs are done.  Each one sends us an interrupt.
+ldr	r1, =done
+1:
+ldr	r0, [r1]
+cmp	r0, r5
+beq	2f
+wfi
+ldr	r0, [r4, #0x10c]
+str	r0, [r4, #0x110]
+b	1b
+2:
+mov	r0, #SYS_CLOCK
+swi	#0x123456
+sub	r6, r0, r6
+
+mov	r0, #SYS_WRITE0
+ldr	r1, =cpus_name
+swi	#0x123456
+mov	r0, r5
+bl	print_dec
+mov	r0, #SYS_WRITE0
+ldr	r1, =time_name
+swi	#0x123456
+mov	r0, r6
+bl	print_dec
+@ Check that no increment of the shared counter was lost.
+ldr	r0, =counter
+ldr	r0, [r0]
+ldr	r1, =CHUNKS
+mul	r2, r1, r5
+cmp	r0, r2
+ldreq	r1, =ok_msg
+ldrne	r1, =bad_msg
+mov	r0, #SYS_WRITE0
+swi	#0x123456
+
+mov	r0, #SYS_EXIT
+ldr	r1, =0x20026		@ ADP_Stopped_ApplicationExit
+swi	#0x123456
+
+secondary:
+@ Acknowledge the start interrupt, so that it does not stay pending.
+ldr	r4, =MPCORE_PRIV
+ldr	r0, [r4, #0x10c]
+str	r0, [r4, #0x110]
+bl	work
+add	r1, r4, #0x1000
+mov	r0, #(1 << 16)		@ interrupt CPU 0
+str	r0, [r1, #0xf00]
+2:
+wfi
+b	2b
+
+@ Run CHUNKS chunks of work, then count this CPU as done.
+work:
+ldr	r8, =counter
+ldr	r7, =CHUNKS
+1:
+ldr	r3, =CHUNK_LOOPS
+mov	r2, #1
+3:
+add	r2, r2, r2, lsl #3
+eor	r2, r2, r3
+subs	r3, r3, #1
+bne	3b
+4:
+ldrex	r0, [r8]
+add	r0, r0, #1
+strex	r1, r0, [r8]
+cmp	r1, #0
+bne	4b
+subs	r7, r7, #1
+bne	1b
+ldr	r8, =done
+5:
+ldrex	r0, [r8]
+add	r0, r0, #1
+strex	r1, r0, [r8]
+cmp	r1, #0
+bne	5b
+bx	lr
+
+@ Print r0 in decimal followed by a newline.
+print_dec:
+ldr	r1, =numbuf_end
+mov	r2, #0
+strb	r2, [r1, #-1]!
+mov	r2, #'\n'
+strb	r2, [r1, #-1]!
+ldr	r12, =0xcccccccd
+1:
+umull	r2, r3, r0, r12
+mov	r3, r3, lsr #3		@ r3 = r0 / 10
+add	r2, r3, r3, lsl #2
+sub	r2, r0, r2, lsl #1	@ r2 = r0 % 10
+add	r2, r2, #'0'
+strb	r2, [r1, #-1]!
+movs	r0, r3
+bne	1b
+mov	r0, #SYS_WRITE0
+swi	#0x123456
+bx	lr
+
+cpus_name:
+.asciz	"cpus:    "
+time_name:
+.asciz	"time:    "
+ok_msg:
+.asciz	"counter: ok\n"
+bad_msg:
+.asciz	"counter: lost updates\n"
+.align	2
+
+.ltorg
+
+.bss
+.align	5
+counter:
+.space	32
+done:
+.space	32
+numbuf:
+.space	16
+numbuf_end:
+.align	3
+.space	4096
+stack_top:
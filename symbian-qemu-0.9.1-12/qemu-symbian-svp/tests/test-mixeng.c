@@ -0,0 +1,257 @@
+/*
+ * Mixing engine SIMD cross-check and benchmark.
+ *
+ * Runs the signed 16 bit stereo conversion, clipping and resampling
+ * routines of audio/mixeng.c with the generic and with the SIMD code on
+ * the same random input, checks that the results are identical and
+ * prints the throughput of both.
+ *
+ * This code is licenced under the GPL.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "qemu-common.h"
+#include "audio.h"
+
+#define AUDIO_CAP "test-mixeng"
+#include "audio_int.h"
+
+#define SAMPLES 4099            /* not a multiple of the vector width */
+#define ROUNDS 2000
+
+struct mixeng_volume nominal_volume = {
+    0,
+#ifdef FLOAT_MIXENG
+    1.0,
+    1.0
+#else
+    1ULL << 32,
+    1ULL << 32
+#endif
+};
+
+void *audio_calloc (const char *funcname, int nmemb, size_t size)
+{
+    return calloc (nmemb, size);
+}
+
+void qemu_free (void *ptr)
+{
+    free (ptr);
+}
+
+void AUD_vlog (const char *cap, const char *fmt, va_list ap)
+{
+    fprintf (stderr, "%s: ", cap);
+    vfprintf (stderr, fmt, ap);
+}
+
+static int failures;
+
+static uint32_t rand_state = 0x2545f491;
+
+static uint32_t rand32 (void)
+{
+    /* xorshift32 */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static int64_t now_us (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void report (const char *name, int64_t us, long samples)
+{
+    printf ("  %-28s %8.1f Msamples/s\n", name,
+            us ? (double) samples / us : 0.0);
+}
+
+/* Mixed buffers, including values outside of the 16 bit range.  */
+static void rand_mix (struct st_sample *buf, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        int64_t l = (int32_t) rand32 ();
+        int64_t r = (int32_t) rand32 ();
+        switch (rand32 () & 7) {
+        case 0:
+            l *= (rand32 () & 0xff) + 1;
+            r = -r * ((rand32 () & 0xff) + 1);
+            break;
+        case 1:
+            l = 0x7f000000 - (rand32 () & 3);
+            r = -2147483648LL - (rand32 () & 3);
+            break;
+        }
+        buf[i].l = l;
+        buf[i].r = r;
+    }
+}
+
+static void compare (const char *what, struct st_sample *a,
+                     struct st_sample *b, int n)
+{
+    if (memcmp (a, b, n * sizeof (*a))) {
+        printf ("MISMATCH: %s\n", what);
+        failures++;
+    }
+}
+
+static void test_conv (const int16_t *pcm, struct st_sample *a,
+                       struct st_sample *b)
+{
+    int64_t t0, t1;
+    int i;
+
+    mixeng_init (0);
+    t0 = now_us ();
+    for (i = 0; i < ROUNDS; i++) {
+        mixeng_conv[1][1][0][1] (a, pcm, SAMPLES, &nominal_volume);
+    }
+    t0 = now_us () - t0;
+
+    if (!mixeng_init (1)) {
+        printf ("no SIMD routines on this host\n");
+        return;
+    }
+    t1 = now_us ();
+    for (i = 0; i < ROUNDS; i++) {
+        mixeng_conv[1][1][0][1] (b, pcm, SAMPLES, &nominal_volume);
+    }
+    t1 = now_us () - t1;
+
+    compare ("conv s16 stereo", a, b, SAMPLES);
+    printf ("conv s16 stereo:\n");
+    report ("generic", t0, (long) ROUNDS * SAMPLES);
+    report ("simd", t1, (long) ROUNDS * SAMPLES);
+}
+
+static void test_clip (struct st_sample *mix)
+{
+    static int16_t a[SAMPLES * 2], b[SAMPLES * 2];
+    int64_t t0, t1;
+    int i;
+
+    mixeng_init (0);
+    t0 = now_us ();
+    for (i = 0; i < ROUNDS; i++) {
+        mixeng_clip[1][1][0][1] (a, mix, SAMPLES);
+    }
+    t0 = now_us () - t0;
+
+    mixeng_init (1);
+    t1 = now_us ();
+    for (i = 0; i < ROUNDS; i++) {
+        mixeng_clip[1][1][0][1] (b, mix, SAMPLES);
+    }
+    t1 = now_us () - t1;
+
+    if (memcmp (a, b, sizeof (a))) {
+        printf ("MISMATCH: clip s16 stereo\n");
+        failures++;
+    }
+    printf ("clip s16 stereo:\n");
+    report ("generic", t0, (long) ROUNDS * SAMPLES);
+    report ("simd", t1, (long) ROUNDS * SAMPLES);
+}
+
+/* Feed the whole input through a fresh resampler in uneven chunks.  */
+static int64_t run_rate (int inrate, int outrate, int mix,
+                         struct st_sample *in, struct st_sample *out,
+                         int outsize)
+{
+    int64_t t = now_us ();
+    int round;
+
+    for (round = 0; round < ROUNDS / 4; round++) {
+        void *rate = st_rate_start (inrate, outrate);
+        int ipos = 0, opos = 0;
+
+        while (ipos < SAMPLES && opos < outsize) {
+            int isamp = SAMPLES - ipos, osamp = outsize - opos;
+
+            if (isamp > 1000) {
+                isamp = 1000;
+            }
+            if (mix) {
+                st_rate_flow_mix (rate, in + ipos, out + opos, &isamp, &osamp);
+            }
+            else {
+                st_rate_flow (rate, in + ipos, out + opos, &isamp, &osamp);
+            }
+            if (!isamp && !osamp) {
+                break;
+            }
+            ipos += isamp;
+            opos += osamp;
+        }
+        st_rate_stop (rate);
+    }
+    return now_us () - t;
+}
+
+static void test_rate (const char *name, int inrate, int outrate, int mix,
+                       struct st_sample *in)
+{
+    int outsize = (int64_t) SAMPLES * outrate / inrate + 16;
+    struct st_sample *a = calloc (outsize, sizeof (*a));
+    struct st_sample *b = calloc (outsize, sizeof (*b));
+    int64_t t0, t1;
+
+    mixeng_init (0);
+    t0 = run_rate (inrate, outrate, mix, in, a, outsize);
+    mixeng_init (1);
+    t1 = run_rate (inrate, outrate, mix, in, b, outsize);
+
+    compare (name, a, b, outsize);
+    printf ("%s:\n", name);
+    report ("generic", t0, (long) ROUNDS / 4 * SAMPLES);
+    report ("simd", t1, (long) ROUNDS / 4 * SAMPLES);
+    free (a);
+    free (b);
+}
+
+int main (int argc, char **argv)
+{
+    static int16_t pcm[SAMPLES * 2];
+    static struct st_sample a[SAMPLES], b[SAMPLES], mix[SAMPLES];
+    int i;
+
+    for (i = 0; i < SAMPLES * 2; i++) {
+        pcm[i] = rand32 ();
+    }
+    pcm[0] = -32768;
+    pcm[1] = 32767;
+
+    test_conv (pcm, a, b);
+    if (!mixeng_init (1)) {
+        return 0;
+    }
+
+    rand_mix (mix, SAMPLES);
+    test_clip (mix);
+
+    /* the interpolation keeps the input in the 32 bit range */
+    test_rate ("rate 44100 -> 48000", 44100, 48000, 0, a);
+    test_rate ("rate mix 22050 -> 44100", 22050, 44100, 1, a);
+    test_rate ("rate mix 44100 -> 44100", 44100, 44100, 1, mix);
+    test_rate ("rate 48000 -> 8000", 48000, 8000, 0, mix);
+
+    if (failures) {
+        printf ("%d mismatches\n", failures);
+        return 1;
+    }
+    printf ("all results identical\n");
+    return 0;
+}
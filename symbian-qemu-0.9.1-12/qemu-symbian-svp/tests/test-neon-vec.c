@@ -0,0 +1,304 @@
+/*
+ * NEON whole register helper conformance test.
+ *
+ * Runs the whole register helpers from target-arm/neon_helper.c on
+ * random inputs and checks the results against the per-pass helpers
+ * (or the equivalent TCG operation for the cases without a helper).
+ * Both D (8 byte) and Q (16 byte) operand sizes are tested, including
+ * the QC flag of the saturating operations.
+ *
+ * This code is licenced under the GPL.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "exec-all.h"
+#include "helpers.h"
+
+#define ITERATIONS 100000
+
+static CPUState cpu_env;
+static int failures;
+
+static uint32_t rand_state = 0x12345678;
+
+static uint32_t rand32(void)
+{
+    /* xorshift32 */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+/* Random register contents, biased towards the values that saturate.  */
+static void rand_reg(uint8_t *p)
+{
+    static const uint8_t special[] = { 0x00, 0x01, 0x7f, 0x80, 0x81, 0xff };
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        uint32_t r = rand32();
+        if ((r & 3) == 0)
+            p[i] = special[(r >> 2) % sizeof(special)];
+        else
+            p[i] = r >> 8;
+    }
+}
+
+static void report(const char *name, int oprsz, const uint8_t *n,
+                   const uint8_t *m, const uint8_t *got, const uint8_t *exp)
+{
+    int i;
+
+    if (failures++ >= 10)
+        return;
+    printf("%s (%d bytes) mismatch\n  n  ", name, oprsz);
+    for (i = 15; i >= 0; i--)
+        printf("%02x", n[i]);
+    printf("\n  m  ");
+    for (i = 15; i >= 0; i--)
+        printf("%02x", m[i]);
+    printf("\n  got ");
+    for (i = 15; i >= 0; i--)
+        printf("%02x", got[i]);
+    printf("\n  exp ");
+    for (i = 15; i >= 0; i--)
+        printf("%02x", exp[i]);
+    printf("\n");
+}
+
+/* Reference operations for the cases the translator does with TCG ops
+   instead of a helper.  */
+static uint32_t ref_and(uint32_t a, uint32_t b) { return a & b; }
+static uint32_t ref_bic(uint32_t a, uint32_t b) { return a & ~b; }
+static uint32_t ref_orr(uint32_t a, uint32_t b) { return a | b; }
+static uint32_t ref_orn(uint32_t a, uint32_t b) { return a | ~b; }
+static uint32_t ref_eor(uint32_t a, uint32_t b) { return a ^ b; }
+static uint32_t ref_add_u32(uint32_t a, uint32_t b) { return a + b; }
+static uint32_t ref_sub_u32(uint32_t a, uint32_t b) { return a - b; }
+static uint32_t ref_mul_u32(uint32_t a, uint32_t b) { return a * b; }
+
+typedef struct {
+    const char *name;
+    void (*vec)(void *, void *, void *, uint32_t);
+    uint32_t (*ref)(uint32_t, uint32_t);
+} VecOp;
+
+static const VecOp vec_ops[] = {
+    { "vand", helper_neon_vand, ref_and },
+    { "vbic", helper_neon_vbic, ref_bic },
+    { "vorr", helper_neon_vorr, ref_orr },
+    { "vorn", helper_neon_vorn, ref_orn },
+    { "veor", helper_neon_veor, ref_eor },
+    { "vadd.i8", helper_neon_vadd_u8, helper_neon_add_u8 },
+    { "vadd.i16", helper_neon_vadd_u16, helper_neon_add_u16 },
+    { "vadd.i32", helper_neon_vadd_u32, ref_add_u32 },
+    { "vsub.i8", helper_neon_vsub_u8, helper_neon_sub_u8 },
+    { "vsub.i16", helper_neon_vsub_u16, helper_neon_sub_u16 },
+    { "vsub.i32", helper_neon_vsub_u32, ref_sub_u32 },
+    { "vmul.i8", helper_neon_vmul_u8, helper_neon_mul_u8 },
+    { "vmul.i16", helper_neon_vmul_u16, helper_neon_mul_u16 },
+    { "vmul.i32", helper_neon_vmul_u32, ref_mul_u32 },
+};
+
+typedef struct {
+    const char *name;
+    uint32_t (*vec)(void *, void *, void *, uint32_t);
+    uint32_t (*ref)(CPUState *, uint32_t, uint32_t);
+} VecSatOp;
+
+static const VecSatOp vec_sat_ops[] = {
+    { "vqadd.u8", helper_neon_vqadd_u8, helper_neon_qadd_u8 },
+    { "vqadd.s8", helper_neon_vqadd_s8, helper_neon_qadd_s8 },
+    { "vqadd.u16", helper_neon_vqadd_u16, helper_neon_qadd_u16 },
+    { "vqadd.s16", helper_neon_vqadd_s16, helper_neon_qadd_s16 },
+    { "vqsub.u8", helper_neon_vqsub_u8, helper_neon_qsub_u8 },
+    { "vqsub.s8", helper_neon_vqsub_s8, helper_neon_qsub_s8 },
+    { "vqsub.u16", helper_neon_vqsub_u16, helper_neon_qsub_u16 },
+    { "vqsub.s16", helper_neon_vqsub_s16, helper_neon_qsub_s16 },
+};
+
+typedef struct {
+    const char *name;
+    void (*vec)(void *, void *, uint32_t, uint32_t);
+    int size;
+    int right;
+    uint32_t (*ref)(uint32_t, uint32_t);
+    uint64_t (*ref64)(uint64_t, uint64_t);
+} VecShiftOp;
+
+static const VecShiftOp vec_shift_ops[] = {
+    { "vshl.i8", helper_neon_vshl_u8, 0, 0, helper_neon_shl_u8, NULL },
+    { "vshl.i16", helper_neon_vshl_u16, 1, 0, helper_neon_shl_u16, NULL },
+    { "vshl.i32", helper_neon_vshl_u32, 2, 0, helper_neon_shl_u32, NULL },
+    { "vshl.i64", helper_neon_vshl_u64, 3, 0, NULL, helper_neon_shl_u64 },
+    { "vshr.u8", helper_neon_vshr_u8, 0, 1, helper_neon_shl_u8, NULL },
+    { "vshr.u16", helper_neon_vshr_u16, 1, 1, helper_neon_shl_u16, NULL },
+    { "vshr.u32", helper_neon_vshr_u32, 2, 1, helper_neon_shl_u32, NULL },
+    { "vshr.u64", helper_neon_vshr_u64, 3, 1, NULL, helper_neon_shl_u64 },
+    { "vshr.s8", helper_neon_vshr_s8, 0, 1, helper_neon_shl_s8, NULL },
+    { "vshr.s16", helper_neon_vshr_s16, 1, 1, helper_neon_shl_s16, NULL },
+    { "vshr.s32", helper_neon_vshr_s32, 2, 1, helper_neon_shl_s32, NULL },
+    { "vshr.s64", helper_neon_vshr_s64, 3, 1, NULL, helper_neon_shl_s64 },
+};
+
+static void test_vec_op(const VecOp *op, int oprsz)
+{
+    uint32_t n[4], m[4], d[4], exp[4];
+    int i, iter;
+
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        rand_reg((uint8_t *)n);
+        rand_reg((uint8_t *)m);
+        rand_reg((uint8_t *)d);
+        memcpy(exp, d, sizeof(exp));
+        for (i = 0; i < oprsz / 4; i++)
+            exp[i] = op->ref(n[i], m[i]);
+        op->vec(d, n, m, oprsz);
+        if (memcmp(d, exp, sizeof(d))) {
+            report(op->name, oprsz, (uint8_t *)n, (uint8_t *)m,
+                   (uint8_t *)d, (uint8_t *)exp);
+            return;
+        }
+    }
+}
+
+/* The bitwise select operations also read the destination.  */
+static void test_vec_select(int oprsz)
+{
+    static const struct {
+        const char *name;
+        void (*vec)(void *, void *, void *, uint32_t);
+    } ops[] = {
+        { "vbsl", helper_neon_vbsl },
+        { "vbit", helper_neon_vbit },
+        { "vbif", helper_neon_vbif },
+    };
+    uint32_t n[4], m[4], d[4], exp[4];
+    int i, k, iter;
+
+    for (k = 0; k < 3; k++) {
+        for (iter = 0; iter < ITERATIONS; iter++) {
+            rand_reg((uint8_t *)n);
+            rand_reg((uint8_t *)m);
+            rand_reg((uint8_t *)d);
+            memcpy(exp, d, sizeof(exp));
+            for (i = 0; i < oprsz / 4; i++) {
+                switch (k) {
+                case 0: exp[i] = (n[i] & d[i]) | (m[i] & ~d[i]); break;
+                case 1: exp[i] = (n[i] & m[i]) | (d[i] & ~m[i]); break;
+                case 2: exp[i] = (d[i] & m[i]) | (n[i] & ~m[i]); break;
+                }
+            }
+            ops[k].vec(d, n, m, oprsz);
+            if (memcmp(d, exp, sizeof(d))) {
+                report(ops[k].name, oprsz, (uint8_t *)n, (uint8_t *)m,
+                       (uint8_t *)d, (uint8_t *)exp);
+                break;
+            }
+        }
+    }
+}
+
+static void test_vec_sat_op(const VecSatOp *op, int oprsz)
+{
+    uint32_t n[4], m[4], d[4], exp[4];
+    uint32_t sat;
+    int i, iter;
+
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        rand_reg((uint8_t *)n);
+        rand_reg((uint8_t *)m);
+        rand_reg((uint8_t *)d);
+        memcpy(exp, d, sizeof(exp));
+        cpu_env.vfp.xregs[ARM_VFP_FPSCR] = 0;
+        for (i = 0; i < oprsz / 4; i++)
+            exp[i] = op->ref(&cpu_env, n[i], m[i]);
+        sat = op->vec(d, n, m, oprsz);
+        if (memcmp(d, exp, sizeof(d))) {
+            report(op->name, oprsz, (uint8_t *)n, (uint8_t *)m,
+                   (uint8_t *)d, (uint8_t *)exp);
+            return;
+        }
+        if ((sat != 0) != (cpu_env.vfp.xregs[ARM_VFP_FPSCR] != 0)) {
+            if (failures++ < 10)
+                printf("%s (%d bytes) QC mismatch: got %d\n",
+                       op->name, oprsz, sat != 0);
+            return;
+        }
+    }
+}
+
+static void test_vec_shift_op(const VecShiftOp *op, int oprsz)
+{
+    uint32_t m[4], d[4], exp[4];
+    uint64_t m64[2], d64[2], exp64[2];
+    uint32_t imm;
+    int esize, shift, i, iter;
+
+    esize = 8 << op->size;
+    for (iter = 0; iter < ITERATIONS; iter++) {
+        /* Left shifts by 0 .. esize - 1, right shifts by 1 .. esize.  */
+        shift = rand32() % esize + op->right;
+        if (op->size == 3) {
+            rand_reg((uint8_t *)m64);
+            rand_reg((uint8_t *)d64);
+            memcpy(exp64, d64, sizeof(exp64));
+            for (i = 0; i < oprsz / 8; i++)
+                exp64[i] = op->ref64(m64[i], op->right ? -shift : shift);
+            op->vec(d64, m64, shift, oprsz);
+            if (memcmp(d64, exp64, sizeof(d64))) {
+                report(op->name, oprsz, (uint8_t *)m64, (uint8_t *)m64,
+                       (uint8_t *)d64, (uint8_t *)exp64);
+                return;
+            }
+            continue;
+        }
+        /* The per-pass helpers take the count replicated in each lane,
+           negative for right shifts.  */
+        imm = op->right ? -shift : shift;
+        if (op->size == 0) {
+            imm &= 0xff;
+            imm |= imm << 8;
+            imm |= imm << 16;
+        } else if (op->size == 1) {
+            imm &= 0xffff;
+            imm |= imm << 16;
+        }
+        rand_reg((uint8_t *)m);
+        rand_reg((uint8_t *)d);
+        memcpy(exp, d, sizeof(exp));
+        for (i = 0; i < oprsz / 4; i++)
+            exp[i] = op->ref(m[i], imm);
+        op->vec(d, m, shift, oprsz);
+        if (memcmp(d, exp, sizeof(d))) {
+            report(op->name, oprsz, (uint8_t *)m, (uint8_t *)m,
+                   (uint8_t *)d, (uint8_t *)exp);
+            return;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i, oprsz;
+
+    for (oprsz = 8; oprsz <= 16; oprsz += 8) {
+        for (i = 0; i < sizeof(vec_ops) / sizeof(vec_ops[0]); i++)
+            test_vec_op(&vec_ops[i], oprsz);
+        test_vec_select(oprsz);
+        for (i = 0; i < sizeof(vec_sat_ops) / sizeof(vec_sat_ops[0]); i++)
+            test_vec_sat_op(&vec_sat_ops[i], oprsz);
+        for (i = 0; i < sizeof(vec_shift_ops) / sizeof(vec_shift_ops[0]); i++)
+            test_vec_shift_op(&vec_shift_ops[i], oprsz);
+    }
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("NEON whole register helpers OK\n");
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * RAM page compression round trip.
+ *
+ * Compresses and decompresses batches of pages with both codecs and
+ * several worker counts, and checks that the pages come back intact.
+ * Batches of one page are run between threaded batches, as the RAM
+ * stream does at the end of a pass.
+ *
+ * This code is licenced under the GPL.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "ram-compress.h"
+
+#define PAGE_SIZE 4096
+#define NB_PAGES 64
+
+static uint8_t pages[NB_PAGES][PAGE_SIZE];
+static uint8_t packed[NB_PAGES][PAGE_SIZE];
+static uint8_t unpacked[NB_PAGES][PAGE_SIZE];
+
+static int failures;
+
+static uint32_t rand_state = 0x2545f491;
+
+static uint32_t rand32(void)
+{
+    /* xorshift32 */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+/* Zero, repetitive and random pages.  */
+static void fill_pages(void)
+{
+    int i, j;
+
+    for (i = 0; i < NB_PAGES; i++) {
+        for (j = 0; j < PAGE_SIZE; j++) {
+            switch (i % 3) {
+            case 0:
+                pages[i][j] = 0;
+                break;
+            case 1:
+                pages[i][j] = "page contents "[j % 14] + (j >> 9);
+                break;
+            default:
+                pages[i][j] = rand32();
+                break;
+            }
+        }
+    }
+}
+
+static void round_trip(int method, int first, int nb)
+{
+    RamCompressJob jobs[NB_PAGES];
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        jobs[i].src = pages[first + i];
+        jobs[i].src_len = PAGE_SIZE;
+        jobs[i].dst = packed[first + i];
+        jobs[i].dst_len = PAGE_SIZE;
+    }
+    if (ram_compress_run(jobs, nb, method, 0) < 0) {
+        printf("FAILED: %s compression of %d pages\n",
+               ram_compress_name(method), nb);
+        failures++;
+        return;
+    }
+
+    for (i = 0; i < nb; i++) {
+        jobs[i].src = packed[first + i];
+        jobs[i].src_len = jobs[i].dst_len;
+        jobs[i].dst = unpacked[first + i];
+        jobs[i].dst_len = PAGE_SIZE;
+    }
+    if (ram_compress_run(jobs, nb, method, 1) < 0) {
+        printf("FAILED: %s decompression of %d pages\n",
+               ram_compress_name(method), nb);
+        failures++;
+        return;
+    }
+
+    if (memcmp(pages[first], unpacked[first], nb * PAGE_SIZE)) {
+        printf("MISMATCH: %s, %d pages\n", ram_compress_name(method), nb);
+        failures++;
+    }
+}
+
+static void timeout(int sig)
+{
+    printf("TIMEOUT: batch never completed\n");
+    fflush(stdout);
+    _exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const int methods[] = { RAM_COMPRESS_ZLIB, RAM_COMPRESS_FAST };
+    int threads, m;
+
+    signal(SIGALRM, timeout);
+    alarm(30);
+    fill_pages();
+
+    for (threads = 1; threads <= 4; threads++) {
+        ram_compress_set_threads(threads);
+        for (m = 0; m < 2; m++) {
+            /* single page batches bypass the workers */
+            round_trip(methods[m], 0, 2);
+            round_trip(methods[m], 2, 1);
+            round_trip(methods[m], 3, 2);
+            round_trip(methods[m], 0, NB_PAGES);
+            round_trip(methods[m], 5, 1);
+            round_trip(methods[m], 0, NB_PAGES);
+        }
+    }
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("all pages identical\n");
+    return 0;
+}
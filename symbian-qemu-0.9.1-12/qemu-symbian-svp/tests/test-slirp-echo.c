@@ -0,0 +1,429 @@
+/*
+ * slirp throughput benchmark
+ *
+ * Runs the slirp stack without a guest: a minimal TCP client plays the
+ * guest side of N parallel connections to 10.0.2.2, which slirp maps to
+ * an echo server on the host loopback.  Every byte goes guest -> slirp
+ * -> host socket -> echo -> slirp -> guest, so slirp can be profiled
+ * without a tap device or root.
+ *
+ * usage: test-slirp-echo [connections [megabytes per connection]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libslirp.h"
+
+#define MAX_CONN        256
+#define MSS             1460
+#define GUEST_WIN       65535
+#define RTO_US          200000
+
+#define TH_FIN  0x01
+#define TH_SYN  0x02
+#define TH_RST  0x04
+#define TH_PUSH 0x08
+#define TH_ACK  0x10
+
+static const uint8_t guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+static const uint8_t slirp_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x35, 0x02 };
+static const uint8_t guest_ip[4] = { 10, 0, 2, 15 };
+static const uint8_t host_ip[4] = { 10, 0, 2, 2 };
+
+enum { CONN_CLOSED, CONN_SYN_SENT, CONN_ESTABLISHED };
+
+typedef struct Conn {
+    int state;
+    uint16_t port;
+    uint32_t iss;
+    uint32_t snd_una, snd_nxt, snd_end;
+    uint32_t snd_wnd;
+    uint32_t irs, rcv_nxt;
+    int need_ack;
+    int64_t last_progress;
+} Conn;
+
+static Conn conns[MAX_CONN];
+static int nb_conns = 16;
+static uint32_t conn_bytes = 4 << 20;
+static uint16_t echo_port;
+static int arp_done;
+static uint64_t bytes_echoed;
+static uint8_t payload[MSS];
+
+static int64_t get_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* Echo server on the host side.  */
+
+static void *echo_client(void *opaque)
+{
+    int fd = (intptr_t)opaque;
+    char buf[65536];
+    ssize_t len, off, ret;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < len; off += ret) {
+            ret = write(fd, buf + off, len - off);
+            if (ret <= 0)
+                goto out;
+        }
+    }
+out:
+    close(fd);
+    return NULL;
+}
+
+static void *echo_server(void *opaque)
+{
+    int s = (intptr_t)opaque;
+    pthread_t thread;
+    int fd;
+
+    for (;;) {
+        fd = accept(s, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pthread_create(&thread, NULL, echo_client, (void *)(intptr_t)fd);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static void start_echo_server(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    pthread_t thread;
+    int s, one = 1;
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(s, MAX_CONN) < 0 ||
+        getsockname(s, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("echo server");
+        exit(1);
+    }
+    echo_port = ntohs(addr.sin_port);
+    pthread_create(&thread, NULL, echo_server, (void *)(intptr_t)s);
+}
+
+/* Guest side.  */
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *p, int len)
+{
+    while (len > 1) {
+        sum += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+    if (len)
+        sum += p[0] << 8;
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void send_arp(void)
+{
+    uint8_t buf[42];
+
+    memset(buf, 0xff, 6);
+    memcpy(buf + 6, guest_mac, 6);
+    put16(buf + 12, 0x0806);
+    put16(buf + 14, 1);
+    put16(buf + 16, 0x0800);
+    buf[18] = 6;
+    buf[19] = 4;
+    put16(buf + 20, 1);
+    memcpy(buf + 22, guest_mac, 6);
+    memcpy(buf + 28, guest_ip, 4);
+    memset(buf + 32, 0, 6);
+    memcpy(buf + 38, host_ip, 4);
+    slirp_input(buf, sizeof(buf));
+}
+
+static void send_tcp(Conn *c, uint32_t seq, int flags,
+                     const uint8_t *data, int len)
+{
+    uint8_t buf[14 + 20 + 24 + MSS];
+    uint8_t *ip = buf + 14, *th = ip + 20;
+    int hlen = (flags & TH_SYN) ? 24 : 20;
+    uint32_t sum;
+
+    memcpy(buf, slirp_mac, 6);
+    memcpy(buf + 6, guest_mac, 6);
+    put16(buf + 12, 0x0800);
+
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put16(ip + 2, 20 + hlen + len);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    memcpy(ip + 12, guest_ip, 4);
+    memcpy(ip + 16, host_ip, 4);
+    put16(ip + 10, csum_fold(csum_add(0, ip, 20)));
+
+    memset(th, 0, hlen);
+    put16(th, c->port);
+    put16(th + 2, echo_port);
+    put32(th + 4, seq);
+    put32(th + 8, (flags & TH_ACK) ? c->rcv_nxt : 0);
+    th[12] = (hlen / 4) << 4;
+    th[13] = flags;
+    put16(th + 14, GUEST_WIN);
+    if (flags & TH_SYN) {
+        th[20] = 2;
+        th[21] = 4;
+        put16(th + 22, MSS);
+    }
+    if (len)
+        memcpy(th + hlen, data, len);
+    sum = csum_add(0, ip + 12, 8);
+    sum += IPPROTO_TCP + hlen + len;
+    sum = csum_add(sum, th, hlen + len);
+    put16(th + 16, csum_fold(sum));
+
+    slirp_input(buf, 14 + 20 + hlen + len);
+}
+
+static Conn *find_conn(uint16_t port)
+{
+    int i;
+
+    for (i = 0; i < nb_conns; i++) {
+        if (conns[i].port == port)
+            return &conns[i];
+    }
+    return NULL;
+}
+
+/* Called by slirp for every frame it sends to the guest.  Only updates
+   the connection state; replies are sent from the main loop.  */
+void slirp_output(const uint8_t *pkt, int pkt_len)
+{
+    const uint8_t *ip, *th;
+    uint32_t seq, ack;
+    int flags, hlen, len;
+    Conn *c;
+
+    if (pkt_len < 14 || get16(pkt + 12) != 0x0800) {
+        if (pkt_len >= 42 && get16(pkt + 12) == 0x0806 &&
+            get16(pkt + 20) == 2)
+            arp_done = 1;
+        return;
+    }
+    ip = pkt + 14;
+    if (ip[9] != IPPROTO_TCP)
+        return;
+    th = ip + (ip[0] & 0xf) * 4;
+    hlen = (th[12] >> 4) * 4;
+    len = get16(ip + 2) - (th - ip) - hlen;
+    c = find_conn(get16(th + 2));
+    if (!c)
+        return;
+    seq = get32(th + 4);
+    ack = get32(th + 8);
+    flags = th[13];
+
+    if (flags & TH_RST) {
+        fprintf(stderr, "connection %d reset\n", (int)(c - conns));
+        exit(1);
+    }
+    if (c->state == CONN_SYN_SENT) {
+        if ((flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK) &&
+            ack == c->iss + 1) {
+            c->irs = seq;
+            c->rcv_nxt = seq + 1;
+            c->snd_una = c->snd_nxt = ack;
+            c->snd_end = ack + conn_bytes;
+            c->state = CONN_ESTABLISHED;
+            c->need_ack = 1;
+            c->last_progress = get_us();
+        }
+        c->snd_wnd = get16(th + 14);
+        return;
+    }
+
+    if ((flags & TH_ACK) && (int32_t)(ack - c->snd_una) > 0 &&
+        (int32_t)(ack - c->snd_nxt) <= 0) {
+        c->snd_una = ack;
+        c->last_progress = get_us();
+    }
+    c->snd_wnd = get16(th + 14);
+    if (len > 0) {
+        if (seq == c->rcv_nxt) {
+            c->rcv_nxt += len;
+            bytes_echoed += len;
+        }
+        c->need_ack = 1;
+    }
+}
+
+int slirp_can_output(void)
+{
+    return 1;
+}
+
+void term_vprintf(const char *fmt, va_list ap)
+{
+    vfprintf(stderr, fmt, ap);
+}
+
+/* Send what the window allows, acknowledge what was received.  */
+static void guest_run(Conn *c, int64_t now)
+{
+    uint32_t limit;
+    int len;
+
+    if (c->state == CONN_SYN_SENT) {
+        if (now - c->last_progress > RTO_US) {
+            send_tcp(c, c->iss, TH_SYN, NULL, 0);
+            c->last_progress = now;
+        }
+        return;
+    }
+    if (c->state != CONN_ESTABLISHED)
+        return;
+
+    if (c->snd_nxt != c->snd_una && now - c->last_progress > RTO_US) {
+        c->snd_nxt = c->snd_una;
+        c->last_progress = now;
+    }
+    limit = c->snd_una + c->snd_wnd;
+    if ((int32_t)(c->snd_end - limit) < 0)
+        limit = c->snd_end;
+    while ((int32_t)(limit - c->snd_nxt) > 0) {
+        len = limit - c->snd_nxt;
+        if (len > MSS)
+            len = MSS;
+        send_tcp(c, c->snd_nxt, TH_ACK | TH_PUSH, payload, len);
+        c->snd_nxt += len;
+        c->need_ack = 0;
+    }
+    if (c->need_ack) {
+        send_tcp(c, c->snd_nxt, TH_ACK, NULL, 0);
+        c->need_ack = 0;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t total;
+    int64_t start, now;
+    struct timeval tv;
+    fd_set rfds, wfds, xfds;
+    int i, nfds;
+
+    if (argc > 1)
+        nb_conns = atoi(argv[1]);
+    if (argc > 2)
+        conn_bytes = atoi(argv[2]) << 20;
+    if (nb_conns < 1 || nb_conns > MAX_CONN || conn_bytes == 0) {
+        fprintf(stderr,
+                "usage: %s [connections [megabytes per connection]]\n",
+                argv[0]);
+        return 1;
+    }
+    total = (uint64_t)nb_conns * conn_bytes;
+    for (i = 0; i < MSS; i++)
+        payload[i] = i;
+
+    start_echo_server();
+    slirp_init();
+    send_arp();
+    if (!arp_done) {
+        fprintf(stderr, "no ARP reply from slirp\n");
+        return 1;
+    }
+
+    start = get_us();
+    for (i = 0; i < nb_conns; i++) {
+        conns[i].port = 20000 + i;
+        conns[i].iss = 1000 * (i + 1);
+        conns[i].state = CONN_SYN_SENT;
+        conns[i].last_progress = start;
+        send_tcp(&conns[i], conns[i].iss, TH_SYN, NULL, 0);
+    }
+
+    while (bytes_echoed < total) {
+        nfds = -1;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_ZERO(&xfds);
+        slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 1000;
+        if (select(nfds + 1, &rfds, &wfds, &xfds, &tv) < 0) {
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
+            FD_ZERO(&xfds);
+        }
+        slirp_select_poll(&rfds, &wfds, &xfds);
+
+        now = get_us();
+        for (i = 0; i < nb_conns; i++)
+            guest_run(&conns[i], now);
+        if (now - start > 120 * 1000000LL) {
+            fprintf(stderr, "timeout, %llu of %llu bytes echoed\n",
+                    (unsigned long long)bytes_echoed,
+                    (unsigned long long)total);
+            return 1;
+        }
+    }
+
+    now = get_us();
+    printf("%d connections, %llu bytes echoed in %.3f s: %.1f MB/s\n",
+           nb_conns, (unsigned long long)total, (now - start) / 1e6,
+           total / (double)(now - start));
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * VFP host FPU fast path cross-check.
+ *
+ * Runs the fast path from target-arm/vfp_fast.h and softfloat on the
+ * same randomized operands, the way the VFP helpers do, and checks that
+ * both the results and the accumulated exception flags are identical.
+ *
+ * This code is licenced under the GPL.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "vfp_fast.h"
+
+#define ITERATIONS 1000000
+
+#ifdef VFP_FAST_PATH
+
+static int failures;
+
+static uint32_t rand_state = 0x2545f491;
+
+static uint32_t rand32(void)
+{
+    /* xorshift32 */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+/* Random operands, biased towards zeros, infinities, NaNs, denormals and
+   values that overflow or underflow when combined.  */
+static float32 rand_s(void)
+{
+    static const uint32_t special[] = {
+        0x00000000, 0x80000000, 0x7f800000, 0xff800000, /* zero, inf */
+        0x7fc00000, 0x7f800001, 0xffc12345, 0xff812345, /* NaN */
+        0x00000001, 0x007fffff, 0x80400000, /* denormal */
+        0x00800000, 0x80800000, 0x7f7fffff, 0xff7fffff, /* min, max */
+        0x3f800000, 0xbf800000, 0x3f800001, 0x4b000000,
+    };
+    uint32_t r = rand32();
+
+    switch (r & 7) {
+    case 0:
+        return make_float32(special[(r >> 3) % (sizeof(special) / 4)]);
+    case 1:
+        /* small exponents, to produce denormal results */
+        return make_float32((rand32() & 0x80ffffff) | ((r >> 3) & 0x0f) << 23);
+    case 2:
+        /* exponents close to the top */
+        return make_float32((rand32() & 0x80ffffff) | (0xf0 + ((r >> 3) & 0xf)) << 23);
+    case 3:
+        /* around 1.0 */
+        return make_float32((rand32() & 0x80ffffff) | (0x7c + ((r >> 3) & 7)) << 23);
+    default:
+        return make_float32(rand32());
+    }
+}
+
+static float64 rand_d(void)
+{
+    static const uint64_t special[] = {
+        0, LIT64(0x8000000000000000),
+        LIT64(0x7ff0000000000000), LIT64(0xfff0000000000000),
+        LIT64(0x7ff8000000000000), LIT64(0x7ff0000000000001),
+        LIT64(0xfff8000000012345), LIT64(0x0000000000000001),
+        LIT64(0x000fffffffffffff), LIT64(0x0010000000000000),
+        LIT64(0x7fefffffffffffff), LIT64(0x3ff0000000000000),
+        LIT64(0xbff0000000000001),
+    };
+    uint32_t r = rand32();
+    uint64_t v = ((uint64_t)rand32() << 32) | rand32();
+
+    switch (r & 7) {
+    case 0:
+        return make_float64(special[(r >> 3) % (sizeof(special) / 8)]);
+    case 1:
+        return make_float64((v & LIT64(0x800fffffffffffff))
+                            | (uint64_t)((r >> 3) & 0x3f) << 52);
+    case 2:
+        return make_float64((v & LIT64(0x800fffffffffffff))
+                            | (uint64_t)(0x7c0 + ((r >> 3) & 0x3f)) << 52);
+    case 3:
+        return make_float64((v & LIT64(0x800fffffffffffff))
+                            | (uint64_t)(0x3fc + ((r >> 3) & 7)) << 52);
+    default:
+        return make_float64(v);
+    }
+}
+
+static void check(const char *name, uint64_t a, uint64_t b,
+                  uint64_t got, int got_flags, uint64_t exp, int exp_flags)
+{
+    if (got == exp && got_flags == exp_flags)
+        return;
+    if (failures++ < 20)
+        printf("%s %016llx %016llx: got %016llx flags %02x, "
+               "expected %016llx flags %02x\n", name,
+               (unsigned long long)a, (unsigned long long)b,
+               (unsigned long long)got, got_flags,
+               (unsigned long long)exp, exp_flags);
+}
+
+/* Same sequence as the helpers: fast path with host flags, softfloat
+   when the fast path declines.  */
+#define TEST_BINOP(name) \
+static void test_##name(void) \
+{ \
+    float_status ref, fb; \
+    float32 a, b, r, e; \
+    float64 c, d, rd, ed; \
+    int flags, i; \
+    for (i = 0; i < ITERATIONS; i++) { \
+        a = rand_s(); \
+        b = rand_s(); \
+        memset(&ref, 0, sizeof(ref)); \
+        memset(&fb, 0, sizeof(fb)); \
+        e = float32_##name(a, b, &ref); \
+        vfp_fast_clear_flags(); \
+        if (!vfp_fast_##name##s(a, b, &r)) \
+            r = float32_##name(a, b, &fb); \
+        flags = vfp_fast_read_flags() | get_float_exception_flags(&fb); \
+        check(#name "s", float32_val(a), float32_val(b), float32_val(r), \
+              flags, float32_val(e), get_float_exception_flags(&ref)); \
+        c = rand_d(); \
+        d = rand_d(); \
+        memset(&ref, 0, sizeof(ref)); \
+        memset(&fb, 0, sizeof(fb)); \
+        ed = float64_##name(c, d, &ref); \
+        vfp_fast_clear_flags(); \
+        if (!vfp_fast_##name##d(c, d, &rd)) \
+            rd = float64_##name(c, d, &fb); \
+        flags = vfp_fast_read_flags() | get_float_exception_flags(&fb); \
+        check(#name "d", float64_val(c), float64_val(d), float64_val(rd), \
+              flags, float64_val(ed), get_float_exception_flags(&ref)); \
+    } \
+}
+TEST_BINOP(add)
+TEST_BINOP(sub)
+TEST_BINOP(mul)
+TEST_BINOP(div)
+
+static void test_sqrt(void)
+{
+    float_status ref, fb;
+    float32 a, r, e;
+    float64 c, rd, ed;
+    int flags, i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        a = rand_s();
+        memset(&ref, 0, sizeof(ref));
+        memset(&fb, 0, sizeof(fb));
+        e = float32_sqrt(a, &ref);
+        vfp_fast_clear_flags();
+        if (!vfp_fast_sqrts(a, &r))
+            r = float32_sqrt(a, &fb);
+        flags = vfp_fast_read_flags() | get_float_exception_flags(&fb);
+        check("sqrts", float32_val(a), 0, float32_val(r), flags,
+              float32_val(e), get_float_exception_flags(&ref));
+        c = rand_d();
+        memset(&ref, 0, sizeof(ref));
+        memset(&fb, 0, sizeof(fb));
+        ed = float64_sqrt(c, &ref);
+        vfp_fast_clear_flags();
+        if (!vfp_fast_sqrtd(c, &rd))
+            rd = float64_sqrt(c, &fb);
+        flags = vfp_fast_read_flags() | get_float_exception_flags(&fb);
+        check("sqrtd", float64_val(c), 0, float64_val(rd), flags,
+              float64_val(ed), get_float_exception_flags(&ref));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    test_add();
+    test_sub();
+    test_mul();
+    test_div();
+    test_sqrt();
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("VFP fast path matches softfloat\n");
+    return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+    printf("VFP fast path not available on this host\n");
+    return 0;
+}
+
+#endif
@@ -95,6 +95,15 @@
 #include <linux/ppdev.h>
 #include <linux/parport.h>
 #endif
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef CONFIG_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#ifdef CONFIG_TIMERFD
+#include <sys/timerfd.h>
+#endif
 #ifdef __sun__
 #include <sys/stat.h>
 #include <sys/ethernet.h>
@@ -149,6 +158,11 @@
 #include "disas.h"
 
 #include "exec-all.h"
+#include "tb-cache.h"
+#include "snapshot-store.h"
+#include "ram-compress.h"
+#include "cpu-threads.h"
+#include "replay.h"
 
 //#define DEBUG_UNUSED_IOPORT
 //#define DEBUG_IOPORT
@@ -784,6 +798,11 @@ static int64_t get_clock(void)
 }
 #endif
 
+int64_t qemu_get_host_clock(void)
+{
+    return get_clock();
+}
+
 /* Return the virtual CPU time, based on the instruction counter.  */
 static int64_t cpu_get_icount(void)
 {
@@ -909,8 +928,30 @@ static void qemu_rearm_alarm_timer(struct qemu_alarm_timer *t)
 #define MIN_TIMER_REARM_US 250
 
 static struct qemu_alarm_timer *alarm_timer;
+
+/* While every CPU is halted, host alarms may be late by up to this many
+   microseconds, so that timers which expire close together share one
+   wakeup.  */
+static int64_t timer_slack_us;
+
+/* Host alarms delivered, for "info alarm".  */
+static uint64_t alarm_wakeups;
+static int64_t alarm_start_time;
 #ifndef _WIN32
+/* Wakes up the main loop.  An eventfd when the host has one, in which
+   case both ends are the same descriptor, otherwise a pipe.  */
 static int alarm_timer_rfd, alarm_timer_wfd;
+
+static void alarm_timer_notify(void)
+{
+#ifdef CONFIG_EVENTFD
+    static const uint64_t val = 1;
+#else
+    static const char val = 0;
+#endif
+
+    write(alarm_timer_wfd, &val, sizeof(val));
+}
 #endif
 
 #ifdef _WIN32
@@ -942,6 +983,12 @@ static void hpet_stop_timer(struct qemu_alarm_timer *t);
 static int rtc_start_timer(struct qemu_alarm_timer *t);
 static void rtc_stop_timer(struct qemu_alarm_timer *t);
 
+#ifdef CONFIG_TIMERFD
+static int timerfd_start_timer(struct qemu_alarm_timer *t);
+static void timerfd_stop_timer(struct qemu_alarm_timer *t);
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t);
+#endif
+
 #endif /* __linux__ */
 
 #endif /* _WIN32 */
@@ -1014,6 +1061,11 @@ static void init_icount_adjust(void)
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
 #ifdef __linux__
+#ifdef CONFIG_TIMERFD
+    /* Only with an I/O thread, which is always waiting for it.  */
+    {"timerfd", ALARM_FLAG_DYNTICKS, timerfd_start_timer,
+     timerfd_stop_timer, timerfd_rearm_timer, NULL},
+#endif
     {"dynticks", ALARM_FLAG_DYNTICKS, dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer, NULL},
     /* HPET - if available - is preferred */
@@ -1274,6 +1326,21 @@ static void timer_save(QEMUFile *f, void *opaque)
     qemu_put_be64(f, cpu_clock_offset);
 }
 
+static void icount_save(QEMUFile *f, void *opaque)
+{
+    qemu_put_be64(f, qemu_icount);
+    qemu_put_be64(f, qemu_icount_bias);
+}
+
+static int icount_load(QEMUFile *f, void *opaque, int version_id)
+{
+    if (version_id != 1)
+        return -EINVAL;
+    qemu_icount = qemu_get_be64(f);
+    qemu_icount_bias = qemu_get_be64(f);
+    return 0;
+}
+
 static int timer_load(QEMUFile *f, void *opaque, int version_id)
 {
     if (version_id != 1 && version_id != 2)
@@ -1325,6 +1392,7 @@ static void host_alarm_handler(int host_signum)
         last_clock = ti;
     }
 #endif
+    alarm_wakeups++;
     if (alarm_has_dynticks(alarm_timer) ||
         (!use_icount &&
             qemu_timer_expired(active_timers[QEMU_TIMER_VIRTUAL],
@@ -1337,11 +1405,14 @@ static void host_alarm_handler(int host_signum)
         struct qemu_alarm_win32 *data = ((struct qemu_alarm_timer*)dwUser)->priv;
         SetEvent(data->host_alarm);
 #else
-        static const char byte = 0;
-        write(alarm_timer_wfd, &byte, sizeof(byte));
+        alarm_timer_notify();
 #endif
         alarm_timer->flags |= ALARM_FLAG_EXPIRED;
 
+        /* Record/replay needs the CPU to leave guest code at the same
+           instruction on every run: it only stops on icount deadlines.  */
+        if (replay_mode != REPLAY_NONE)
+            return;
         if (env) {
             /* stop the currently executing cpu because a timer occured */
             cpu_interrupt(env, CPU_INTERRUPT_EXIT);
@@ -1356,6 +1427,16 @@ static void host_alarm_handler(int host_signum)
     }
 }
 
+/* Wake the main loop from a CPU thread, so that it handles a request or
+   a bottom half without waiting for the next timer.  */
+void qemu_notify_event(void)
+{
+#ifndef _WIN32
+    if (cpu_threads_enabled)
+        alarm_timer_notify();
+#endif
+}
+
 static int64_t qemu_next_deadline(void)
 {
     int64_t delta;
@@ -1374,7 +1455,36 @@ static int64_t qemu_next_deadline(void)
     return delta;
 }
 
+/* Nonzero if no CPU can run until an interrupt arrives.  */
+static int qemu_cpus_idle(void)
+{
+    CPUState *env;
+
+    if (!vm_running)
+        return 1;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->halted)
+            return 0;
+    }
+    return 1;
+}
+
 #if defined(__linux__) || defined(_WIN32)
+/* Move an alarm DELTA_US from now to the next multiple of the slack
+   that is not more than the slack away.  The boundaries are the same
+   for every process on the host, so idle emulators wake up together.  */
+static int64_t qemu_alarm_slack(int64_t delta_us)
+{
+    int64_t now, when;
+
+    if (!timer_slack_us || !qemu_cpus_idle())
+        return delta_us;
+    now = get_clock() / 1000;
+    when = now + delta_us + timer_slack_us;
+    when -= when % timer_slack_us;
+    return when - now;
+}
+
 static uint64_t qemu_next_deadline_dyntick(void)
 {
     int64_t delta;
@@ -1395,7 +1505,7 @@ static uint64_t qemu_next_deadline_dyntick(void)
     if (delta < MIN_TIMER_REARM_US)
         delta = MIN_TIMER_REARM_US;
 
-    return delta;
+    return qemu_alarm_slack(delta);
 }
 #endif
 
@@ -1558,33 +1668,44 @@ static void dynticks_stop_timer(struct qemu_alarm_timer *t)
     timer_delete(host_timer);
 }
 
-static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
+/* TIMEOUT holds the time left on a one-shot host timer.  Replace it
+   with the next deadline and return 1 if the host timer must be set,
+   or return 0 if it already expires early enough.  */
+static int dynticks_next_timeout(struct itimerspec *timeout)
 {
-    timer_t host_timer = (timer_t)(long)t->priv;
-    struct itimerspec timeout;
     int64_t nearest_delta_us = INT64_MAX;
     int64_t current_us;
 
     if (!active_timers[QEMU_TIMER_REALTIME] &&
                 !active_timers[QEMU_TIMER_VIRTUAL])
-        return;
+        return 0;
 
     nearest_delta_us = qemu_next_deadline_dyntick();
 
     /* check whether a timer is already running */
+    current_us = timeout->it_value.tv_sec * 1000000 + timeout->it_value.tv_nsec/1000;
+    if (current_us && current_us <= nearest_delta_us)
+        return 0;
+
+    timeout->it_interval.tv_sec = 0;
+    timeout->it_interval.tv_nsec = 0; /* 0 for one-shot timer */
+    timeout->it_value.tv_sec =  nearest_delta_us / 1000000;
+    timeout->it_value.tv_nsec = (nearest_delta_us % 1000000) * 1000;
+    return 1;
+}
+
+static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
+{
+    timer_t host_timer = (timer_t)(long)t->priv;
+    struct itimerspec timeout;
+
     if (timer_gettime(host_timer, &timeout)) {
         perror("gettime");
         fprintf(stderr, "Internal timer error: aborting\n");
         exit(1);
     }
-    current_us = timeout.it_value.tv_sec * 1000000 + timeout.it_value.tv_nsec/1000;
-    if (current_us && current_us <= nearest_delta_us)
+    if (!dynticks_next_timeout(&timeout))
         return;
-
-    timeout.it_interval.tv_sec = 0;
-    timeout.it_interval.tv_nsec = 0; /* 0 for one-shot timer */
-    timeout.it_value.tv_sec =  nearest_delta_us / 1000000;
-    timeout.it_value.tv_nsec = (nearest_delta_us % 1000000) * 1000;
     if (timer_settime(host_timer, 0 /* RELATIVE */, &timeout, NULL)) {
         perror("settime");
         fprintf(stderr, "Internal timer error: aborting\n");
@@ -1592,6 +1713,65 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     }
 }
 
+#ifdef CONFIG_TIMERFD
+/* A timerfd wakes up the main loop without a signal.  Nothing would
+   interrupt a CPU executing in the main thread, so this needs CPU
+   threads.  Expired timers run in the main loop, which rearms the
+   alarm afterwards.  */
+static void timerfd_alarm_read(void *opaque)
+{
+    struct qemu_alarm_timer *t = opaque;
+    uint64_t expirations;
+
+    if (read((long)t->priv, &expirations, sizeof(expirations)) > 0) {
+        alarm_wakeups++;
+        t->flags |= ALARM_FLAG_EXPIRED;
+    }
+}
+
+static int timerfd_start_timer(struct qemu_alarm_timer *t)
+{
+    int fd;
+
+    if (!cpu_threads_enabled)
+        return -1;
+    fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (fd < 0)
+        return -1;
+    fcntl_setfl(fd, O_NONBLOCK);
+    t->priv = (void *)(long)fd;
+    qemu_set_fd_handler(fd, timerfd_alarm_read, NULL, t);
+    return 0;
+}
+
+static void timerfd_stop_timer(struct qemu_alarm_timer *t)
+{
+    int fd = (long)t->priv;
+
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    close(fd);
+}
+
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t)
+{
+    int fd = (long)t->priv;
+    struct itimerspec timeout;
+
+    if (timerfd_gettime(fd, &timeout)) {
+        perror("timerfd_gettime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+    if (!dynticks_next_timeout(&timeout))
+        return;
+    if (timerfd_settime(fd, 0, &timeout, NULL)) {
+        perror("timerfd_settime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+}
+#endif
+
 #endif /* defined(__linux__) */
 
 static int unix_start_timer(struct qemu_alarm_timer *t)
@@ -1745,9 +1925,15 @@ static int init_timer_alarm(void)
 #ifndef _WIN32
     int fds[2];
 
-    err = pipe(fds);
-    if (err == -1)
-        return -errno;
+#ifdef CONFIG_EVENTFD
+    fds[0] = fds[1] = eventfd(0, 0);
+    if (fds[0] < 0)
+#endif
+    {
+        err = pipe(fds);
+        if (err == -1)
+            return -errno;
+    }
 
     err = fcntl_setfl(fds[0], O_NONBLOCK);
     if (err < 0)
@@ -1780,13 +1966,15 @@ static int init_timer_alarm(void)
 #endif
 
     alarm_timer = t;
+    alarm_start_time = get_clock();
 
     return 0;
 
 fail:
 #ifndef _WIN32
     close(fds[0]);
-    close(fds[1]);
+    if (fds[1] != fds[0])
+        close(fds[1]);
 #endif
     return err;
 }
@@ -1797,6 +1985,24 @@ static void quit_timers(void)
     alarm_timer = NULL;
 }
 
+#ifndef _WIN32
+/* Host timers are not inherited by fork(), give the child its own alarm
+   timer and notify pipe.  */
+static void fork_timers(void)
+{
+    qemu_set_fd_handler2(alarm_timer_rfd, NULL, NULL, NULL, NULL);
+    alarm_timer->stop(alarm_timer);
+    close(alarm_timer_rfd);
+    if (alarm_timer_wfd != alarm_timer_rfd)
+        close(alarm_timer_wfd);
+    if (init_timer_alarm() < 0) {
+        fprintf(stderr, "could not initialize alarm timer\n");
+        exit(1);
+    }
+    qemu_rearm_alarm_timer(alarm_timer);
+}
+#endif
+
 /***********************************************************/
 /* host time/date access */
 void qemu_get_timedate(struct tm *tm, int offset)
@@ -1805,6 +2011,8 @@ void qemu_get_timedate(struct tm *tm, int offset)
     struct tm *ret;
 
     time(&ti);
+    if (replay_mode != REPLAY_NONE)
+        ti = replay_host_value(ti);
     ti += offset;
     if (rtc_date_offset == -1) {
         if (rtc_utc)
@@ -2216,12 +2424,16 @@ static int drive_init(struct drive_opt *arg, int snapshot,
     int max_devs;
     int index;
     int cache;
+    int native_aio = 0;
+    int64_t metadata_cache = 0;
+    int queues = 0;
     int bdrv_flags;
     char *str = arg->opt;
     static const char * const params[] = { "bus", "unit", "if", "index",
                                            "cyls", "heads", "secs", "trans",
                                            "media", "snapshot", "file",
-                                           "cache", "format", NULL };
+                                           "cache", "format", "metadata_cache",
+                                           "aio", "queues", NULL };
 
     if (check_params(buf, sizeof(buf), params, str) < 0) {
          fprintf(stderr, "qemu: unknown parameter '%s' in '%s'\n",
@@ -2389,6 +2601,53 @@ static int drive_init(struct drive_opt *arg, int snapshot,
         }
     }
 
+    if (get_param_value(buf, sizeof(buf), "aio", str)) {
+        if (!strcmp(buf, "threads"))
+            native_aio = 0;
+        else if (!strcmp(buf, "native"))
+            native_aio = 1;
+        else {
+           fprintf(stderr, "qemu: invalid aio option\n");
+           return -1;
+        }
+#ifndef CONFIG_LINUX_AIO
+        if (native_aio) {
+           fprintf(stderr, "qemu: native aio is not supported by this host\n");
+           return -1;
+        }
+#endif
+    }
+
+    if (get_param_value(buf, sizeof(buf), "queues", str)) {
+        if (type != IF_VIRTIO) {
+            fprintf(stderr, "qemu: '%s' queues is only supported "
+                            "by virtio drives\n", str);
+            return -1;
+        }
+        queues = strtol(buf, NULL, 0);
+        if (queues < 1) {
+            fprintf(stderr, "qemu: '%s' invalid number of queues\n", str);
+            return -1;
+        }
+    }
+
+    if (get_param_value(buf, sizeof(buf), "metadata_cache", str)) {
+        char *end;
+
+        metadata_cache = strtoll(buf, &end, 0);
+        if (*end == 'M' || *end == 'm') {
+            metadata_cache <<= 20;
+            end++;
+        } else if (*end == 'K' || *end == 'k') {
+            metadata_cache <<= 10;
+            end++;
+        }
+        if (*end != '\0' || metadata_cache <= 0) {
+            fprintf(stderr, "qemu: invalid metadata_cache size '%s'\n", buf);
+            return -1;
+        }
+    }
+
     if (get_param_value(buf, sizeof(buf), "format", str)) {
        if (strcmp(buf, "?") == 0) {
             fprintf(stderr, "qemu: Supported formats:");
@@ -2467,6 +2726,8 @@ static int drive_init(struct drive_opt *arg, int snapshot,
         snprintf(buf, sizeof(buf), "%s%s%i",
                  devname, mediastr, unit_id);
     bdrv = bdrv_new(buf);
+    if (metadata_cache)
+        bdrv_set_metadata_cache(bdrv, metadata_cache);
     drives_table[nb_drives].bdrv = bdrv;
     drives_table[nb_drives].type = type;
     drives_table[nb_drives].bus = bus_id;
@@ -2496,7 +2757,10 @@ static int drive_init(struct drive_opt *arg, int snapshot,
         break;
     case IF_PFLASH:
     case IF_MTD:
+        break;
     case IF_VIRTIO:
+        if (queues)
+            bdrv_set_queues_hint(bdrv, queues);
         break;
     }
     if (!file[0])
@@ -2512,6 +2776,8 @@ static int drive_init(struct drive_opt *arg, int snapshot,
         bdrv_flags |= BDRV_O_CACHE_WB;
     else if (cache == 3) /* not specified */
         bdrv_flags |= BDRV_O_CACHE_DEF;
+    if (native_aio)
+        bdrv_flags |= BDRV_O_NATIVE_AIO;
     if (bdrv_open2(bdrv, file, bdrv_flags, drv) < 0 || qemu_key_check(bdrv, file)) {
         fprintf(stderr, "qemu: could not open disk image %s\n",
                         file);
@@ -2774,7 +3040,38 @@ static void dumb_display_init(DisplayState *ds)
 /***********************************************************/
 /* I/O handling */
 
-#define MAX_IO_HANDLERS 64
+/* Time spent in a main loop handler, shown by "info iohandlers".  */
+typedef struct IOHandlerStats {
+    uint64_t count;
+    int64_t time;
+    int64_t max_time;
+} IOHandlerStats;
+
+static IOHandlerStats io_wait_stats;
+static IOHandlerStats io_timer_stats;
+#if defined(CONFIG_SLIRP)
+static IOHandlerStats io_slirp_stats;
+#endif
+
+static void io_stats_add(IOHandlerStats *st, int64_t start)
+{
+    int64_t t = get_clock() - start;
+
+    st->count++;
+    st->time += t;
+    if (t > st->max_time)
+        st->max_time = t;
+}
+
+/* Main loop iterations, descriptors found ready, and the time from the
+   end of the wait to the end of the iteration.  */
+static struct {
+    uint64_t iterations;
+    uint64_t events;
+    int max_events;
+    int64_t latency;
+    int64_t max_latency;
+} main_loop_stats;
 
 typedef struct IOHandlerRecord {
     int fd;
@@ -2783,12 +3080,102 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_write;
     int deleted;
     void *opaque;
-    /* temporary data */
-    struct pollfd *ufd;
+    IOHandlerStats read_stats;
+    IOHandlerStats write_stats;
+    /* EPOLLIN/EPOLLOUT mask registered with epoll.  */
+    int events;
     struct IOHandlerRecord *next;
 } IOHandlerRecord;
 
 static IOHandlerRecord *first_io_handler;
+static int io_handlers_deleted;
+
+#ifdef CONFIG_EPOLL
+/* On Linux, descriptors stay registered with epoll between iterations
+   and are only updated when their handlers change, or when a
+   fd_read_poll handler changes its mind.  The main loop then only
+   visits the descriptors that are ready.  Set to -1 to use select().  */
+#define IO_EPOLL_EVENTS 64
+
+static int io_epoll_fd = -1;
+static int no_epoll;
+
+static int io_handler_events(IOHandlerRecord *ioh, int poll)
+{
+    int events = 0;
+
+    if (ioh->deleted)
+        return 0;
+    if (ioh->fd_read &&
+        (!ioh->fd_read_poll || (poll && ioh->fd_read_poll(ioh->opaque))))
+        events |= EPOLLIN;
+    if (ioh->fd_write)
+        events |= EPOLLOUT;
+    return events;
+}
+
+static void io_epoll_disable(void)
+{
+    IOHandlerRecord *ioh;
+
+    close(io_epoll_fd);
+    io_epoll_fd = -1;
+    /* Handlers registered while epoll was in use may have fds that
+       select() cannot take: io_select_fill() skips them.  */
+    for (ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+        if (!ioh->deleted && ioh->fd >= FD_SETSIZE)
+            fprintf(stderr, "qemu: fd %d is too large for select(), "
+                    "its handler is disabled\n", ioh->fd);
+    }
+}
+
+static void io_epoll_set(IOHandlerRecord *ioh, int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (io_epoll_fd < 0 || events == ioh->events)
+        return;
+    if (!ioh->events)
+        op = EPOLL_CTL_ADD;
+    else if (!events)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ioh;
+    ioh->events = events;
+    /* The descriptor may already be closed when its handler goes.  */
+    if (epoll_ctl(io_epoll_fd, op, ioh->fd, &ev) < 0 &&
+        op != EPOLL_CTL_DEL) {
+        /* epoll refuses regular files, which select() reports as
+           always ready.  Go back to select() for everything.  */
+        io_epoll_disable();
+    }
+}
+
+/* Create the epoll instance and register the existing handlers.  Also
+   used by a forked child, which must not share its parent's instance.  */
+static void io_epoll_init(void)
+{
+    IOHandlerRecord *ioh;
+
+    if (io_epoll_fd >= 0)
+        close(io_epoll_fd);
+    io_epoll_fd = -1;
+    if (no_epoll)
+        return;
+    io_epoll_fd = epoll_create(IO_EPOLL_EVENTS);
+    if (io_epoll_fd < 0)
+        return;
+    fcntl(io_epoll_fd, F_SETFD, FD_CLOEXEC);
+    for (ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+        ioh->events = 0;
+        io_epoll_set(ioh, io_handler_events(ioh, 0));
+    }
+}
+#endif
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -2808,11 +3195,24 @@ int qemu_set_fd_handler2(int fd,
                 break;
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+                io_handlers_deleted = 1;
+#ifdef CONFIG_EPOLL
+                io_epoll_set(ioh, 0);
+#endif
                 break;
             }
             pioh = &ioh->next;
         }
     } else {
+#ifndef _WIN32
+#ifdef CONFIG_EPOLL
+        if (io_epoll_fd < 0)
+#endif
+        if (fd >= FD_SETSIZE) {
+            fprintf(stderr, "qemu: fd %d is too large for select()\n", fd);
+            return -1;
+        }
+#endif
         for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
             if (ioh->fd == fd)
                 goto found;
@@ -2829,6 +3229,11 @@ int qemu_set_fd_handler2(int fd,
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+#ifdef CONFIG_EPOLL
+        /* Read handlers with a fd_read_poll callback are added by the
+           main loop when they can receive.  */
+        io_epoll_set(ioh, io_handler_events(ioh, 0));
+#endif
     }
     return 0;
 }
@@ -3021,6 +3426,14 @@ static void ram_decompress_close(RamDecompressState *s)
 #define RAM_SAVE_FLAG_MEM_SIZE	0x04
 #define RAM_SAVE_FLAG_PAGE	0x08
 #define RAM_SAVE_FLAG_EOS	0x10
+#define RAM_SAVE_FLAG_MAPPED	0x20
+#define RAM_SAVE_FLAG_STORE	0x40
+#define RAM_SAVE_FLAG_BATCH	0x80
+#define RAM_SAVE_FLAG_POSTCOPY	0x100
+
+/* Alignment of the raw RAM image in snapshot files.  A multiple of the
+   host page size, so that restore can map it.  */
+#define RAM_MAP_ALIGN	0x10000
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -3036,39 +3449,176 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     return 1;
 }
 
-static int ram_save_block(QEMUFile *f)
+/* Pages of a compressed batch.  */
+#define RAM_BATCH_PAGES	256
+
+typedef struct RamStreamStats {
+    int method;
+    int64_t pages;
+    int64_t dup_pages;
+    int64_t raw_bytes;
+    int64_t stream_bytes;
+    int64_t time;
+} RamStreamStats;
+
+static int ram_compress_method = RAM_COMPRESS_NONE;
+static RamStreamStats ram_save_stats;
+static RamStreamStats ram_load_stats;
+static ram_addr_t ram_save_addr;
+static int ram_postcopy_outgoing;
+static int ram_postcopy_pending;
+static uint8_t *ram_batch_buf;
+static RamCompressJob ram_batch_jobs[RAM_BATCH_PAGES];
+static ram_addr_t ram_batch_addr[RAM_BATCH_PAGES];
+
+/* Return the address of the next dirty page and clear its dirty bit, or
+   -1 if none is left.  */
+static ram_addr_t ram_next_dirty(void)
 {
-    static ram_addr_t current_addr = 0;
-    ram_addr_t saved_addr = current_addr;
-    ram_addr_t addr = 0;
-    int found = 0;
+    ram_addr_t addr;
 
-    while (addr < phys_ram_size) {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t ch;
+    for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
+        ram_addr_t current_addr = ram_save_addr;
 
+        ram_save_addr = (ram_save_addr + TARGET_PAGE_SIZE) % phys_ram_size;
+        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
             cpu_physical_memory_reset_dirty(current_addr,
                                             current_addr + TARGET_PAGE_SIZE,
                                             MIGRATION_DIRTY_FLAG);
+            return current_addr;
+        }
+    }
+    return -1;
+}
 
-            ch = *host_ram_addr(current_addr);
+/* Write a page filled with a single byte as a COMPRESS record.  Return 0
+   if the page has other contents.  */
+static int ram_save_dup_page(QEMUFile *f, ram_addr_t addr)
+{
+    uint8_t *p = host_ram_addr(addr);
 
-            if (is_dup_page(host_ram_addr(current_addr), ch)) {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, ch);
-            } else {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, host_ram_addr(current_addr), TARGET_PAGE_SIZE);
-            }
+    if (!is_dup_page(p, *p))
+        return 0;
+    qemu_put_be64(f, addr | RAM_SAVE_FLAG_COMPRESS);
+    qemu_put_byte(f, *p);
+    ram_save_stats.pages++;
+    ram_save_stats.dup_pages++;
+    ram_save_stats.stream_bytes += 9;
+    return 1;
+}
 
-            found = 1;
-            break;
-        }
-        addr += TARGET_PAGE_SIZE;
-        current_addr = (saved_addr + addr) % phys_ram_size;
+static void ram_save_page(QEMUFile *f, ram_addr_t addr)
+{
+    if (!ram_save_dup_page(f, addr)) {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, host_ram_addr(addr), TARGET_PAGE_SIZE);
+        ram_save_stats.pages++;
+        ram_save_stats.stream_bytes += 8 + TARGET_PAGE_SIZE;
+    }
+}
+
+static int ram_save_block(QEMUFile *f)
+{
+    ram_addr_t current_addr;
+
+    current_addr = ram_next_dirty();
+    if (current_addr == -1)
+        return 0;
+
+    ram_save_page(f, current_addr);
+
+    return 1;
+}
+
+/* Send up to RAM_BATCH_PAGES dirty pages as one BATCH record, compressed
+   on the worker threads:
+
+     be64 flags, byte method, be32 count,
+     count * (be64 address, be32 length), compressed pages
+
+   A length of TARGET_PAGE_SIZE means the page is stored uncompressed.
+   Pages filled with a single byte are still sent as COMPRESS records.
+   Return the number of pages sent.  */
+static int ram_save_batch(QEMUFile *f)
+{
+    ram_addr_t addr;
+    int i, n, sent;
+
+    if (!ram_batch_buf)
+        ram_batch_buf = qemu_malloc(RAM_BATCH_PAGES * TARGET_PAGE_SIZE);
+
+    n = 0;
+    sent = 0;
+    while (n < RAM_BATCH_PAGES && (addr = ram_next_dirty()) != -1) {
+        sent++;
+        if (ram_save_dup_page(f, addr))
+            continue;
+        ram_batch_addr[n] = addr;
+        ram_batch_jobs[n].src = host_ram_addr(addr);
+        ram_batch_jobs[n].src_len = TARGET_PAGE_SIZE;
+        ram_batch_jobs[n].dst = ram_batch_buf + n * TARGET_PAGE_SIZE;
+        ram_batch_jobs[n].dst_len = TARGET_PAGE_SIZE;
+        n++;
+    }
+    if (n == 0)
+        return sent;
+
+    ram_compress_run(ram_batch_jobs, n, ram_compress_method, 0);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_BATCH);
+    qemu_put_byte(f, ram_compress_method);
+    qemu_put_be32(f, n);
+    for (i = 0; i < n; i++) {
+        qemu_put_be64(f, ram_batch_addr[i]);
+        qemu_put_be32(f, ram_batch_jobs[i].dst_len);
+    }
+    ram_save_stats.stream_bytes += 13 + 12 * n;
+    for (i = 0; i < n; i++) {
+        qemu_put_buffer(f, ram_batch_jobs[i].dst, ram_batch_jobs[i].dst_len);
+        ram_save_stats.stream_bytes += ram_batch_jobs[i].dst_len;
+    }
+    ram_save_stats.pages += n;
+
+    return sent;
+}
+
+static int ram_load_batch(QEMUFile *f)
+{
+    int i, n, method, len;
+    uint8_t *p;
+
+    if (!ram_batch_buf)
+        ram_batch_buf = qemu_malloc(RAM_BATCH_PAGES * TARGET_PAGE_SIZE);
+
+    method = qemu_get_byte(f);
+    n = qemu_get_be32(f);
+    if (n <= 0 || n > RAM_BATCH_PAGES)
+        return -EINVAL;
+    for (i = 0; i < n; i++) {
+        ram_batch_addr[i] = qemu_get_be64(f);
+        len = qemu_get_be32(f);
+        if (ram_batch_addr[i] >= phys_ram_size ||
+            (ram_batch_addr[i] & ~TARGET_PAGE_MASK) ||
+            len <= 0 || len > TARGET_PAGE_SIZE)
+            return -EINVAL;
+        ram_batch_jobs[i].src_len = len;
+    }
+    p = ram_batch_buf;
+    for (i = 0; i < n; i++) {
+        len = ram_batch_jobs[i].src_len;
+        if (qemu_get_buffer(f, p, len) != len)
+            return -EIO;
+        ram_batch_jobs[i].src = p;
+        ram_batch_jobs[i].dst = host_ram_addr(ram_batch_addr[i]);
+        ram_batch_jobs[i].dst_len = TARGET_PAGE_SIZE;
+        p += len;
+        ram_load_stats.stream_bytes += len;
     }
+    ram_load_stats.method = method;
+    ram_load_stats.pages += n;
+    ram_load_stats.stream_bytes += 13 + 12 * n;
 
-    return found;
+    return ram_compress_run(ram_batch_jobs, n, method, 1);
 }
 
 static ram_addr_t ram_save_threshold = 10;
@@ -3086,42 +3636,122 @@ static ram_addr_t ram_save_remaining(void)
     return count;
 }
 
-static int ram_save_live(QEMUFile *f, int stage, void *opaque)
+/* Write all of RAM as a raw image at the next aligned file offset.  */
+static void ram_save_mapped(QEMUFile *f)
 {
+    int64_t offset;
     ram_addr_t addr;
 
-    if (stage == 1) {
-        /* Make sure all dirty bits are set */
-        for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
-            if (!cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-                cpu_physical_memory_set_dirty(addr);
-        }
-        
-        /* Enable dirty memory tracking */
-        cpu_physical_memory_set_dirty_tracking(1);
-
-        qemu_put_be64(f, phys_ram_size | RAM_SAVE_FLAG_MEM_SIZE);
-    }
+    offset = (qemu_ftell(f) + 16 + RAM_MAP_ALIGN - 1) & ~(RAM_MAP_ALIGN - 1);
+    qemu_put_be64(f, RAM_SAVE_FLAG_MAPPED);
+    qemu_put_be64(f, offset);
+    qemu_fseek(f, offset, SEEK_SET);
+    for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE)
+        qemu_put_buffer(f, host_ram_addr(addr), TARGET_PAGE_SIZE);
+}
 
-    while (!qemu_file_rate_limit(f)) {
-        int ret;
+static int ram_load_mapped(QEMUFile *f)
+{
+    int64_t offset;
+    ram_addr_t addr;
+    int fd;
 
-        ret = ram_save_block(f);
-        if (ret == 0) /* no more blocks */
-            break;
+    offset = qemu_get_be64(f);
+    fd = qemu_file_fd(f);
+    if (fd < 0 || qemu_ram_map_file(fd, offset) < 0) {
+        qemu_fseek(f, offset, SEEK_SET);
+        for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE)
+            qemu_get_buffer(f, host_ram_addr(addr), TARGET_PAGE_SIZE);
     }
+    qemu_fseek(f, offset + phys_ram_size, SEEK_SET);
+
+    if (qemu_file_has_error(f))
+        return -EIO;
+
+    return 0;
+}
+
+static int ram_save_live(QEMUFile *f, int stage, void *opaque)
+{
+    ram_addr_t addr;
+    int64_t start;
+    int ret;
+
+    if (snapshot_store_saving) {
+        /* Incremental snapshot: pages go to the snapshot store and the
+           file only records which store map to restore.  */
+        if (stage == 1) {
+            qemu_put_be64(f, phys_ram_size | RAM_SAVE_FLAG_MEM_SIZE);
+            qemu_put_be64(f, RAM_SAVE_FLAG_STORE);
+            if (snapshot_store_save_ram(f) < 0)
+                qemu_file_set_error(f);
+        }
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 1;
+    }
+
+    if (qemu_file_fd(f) >= 0 && ram_compress_method == RAM_COMPRESS_NONE) {
+        /* Snapshot file: the VM is stopped, so save RAM in one go in a
+           form that can be mapped on restore.  */
+        if (stage == 1) {
+            qemu_put_be64(f, phys_ram_size | RAM_SAVE_FLAG_MEM_SIZE);
+            ram_save_mapped(f);
+        }
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 1;
+    }
+
+    start = get_clock();
+    if (stage == 1) {
+        memset(&ram_save_stats, 0, sizeof(ram_save_stats));
+        ram_save_stats.method = ram_compress_method;
+
+        /* Make sure all dirty bits are set */
+        for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
+            if (!cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
+                cpu_physical_memory_set_dirty(addr);
+        }
+        
+        /* Enable dirty memory tracking */
+        cpu_physical_memory_set_dirty_tracking(1);
+
+        qemu_put_be64(f, phys_ram_size | RAM_SAVE_FLAG_MEM_SIZE);
+        ram_save_stats.stream_bytes += 8;
+    }
+
+    /* With post-copy, all pages are left to ram_postcopy_save once the
+       device state has been sent.  */
+    while (!ram_postcopy_outgoing && !qemu_file_rate_limit(f)) {
+        if (ram_compress_method != RAM_COMPRESS_NONE)
+            ret = ram_save_batch(f);
+        else
+            ret = ram_save_block(f);
+        if (ret == 0) /* no more blocks */
+            break;
+    }
+
+    /* try transferring iterative blocks of memory */
 
-    /* try transferring iterative blocks of memory */
-
     if (stage == 3) {
         cpu_physical_memory_set_dirty_tracking(0);
 
-        /* flush all remaining blocks regardless of rate limiting */
-        while (ram_save_block(f) != 0);
+        if (ram_postcopy_outgoing) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+            ram_save_stats.stream_bytes += 8;
+        } else if (ram_compress_method != RAM_COMPRESS_NONE) {
+            /* flush all remaining blocks regardless of rate limiting */
+            while (ram_save_batch(f) != 0);
+        } else {
+            while (ram_save_block(f) != 0);
+        }
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    ram_save_stats.stream_bytes += 8;
+    ram_save_stats.time += get_clock() - start;
 
+    if (stage == 2 && ram_postcopy_outgoing)
+        return 1;
     return (stage == 2) && (ram_save_remaining() < ram_save_threshold);
 }
 
@@ -3157,8 +3787,14 @@ static int ram_load_dead(QEMUFile *f, void *opaque)
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
+    int64_t start;
     int flags;
 
+    /* Guest RAM no longer matches the last store snapshot, unless this
+       is one.  */
+    if (version_id < 3)
+        snapshot_store_forget();
+
     if (version_id == 1)
         return ram_load_v1(f, opaque);
 
@@ -3168,9 +3804,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         return ram_load_dead(f, opaque);
     }
 
-    if (version_id != 3)
+    if (version_id < 3 || version_id > 6)
         return -EINVAL;
 
+    start = get_clock();
     do {
         addr = qemu_get_be64(f);
 
@@ -3180,23 +3817,317 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
             if (addr != phys_ram_size)
                 return -EINVAL;
+            memset(&ram_load_stats, 0, sizeof(ram_load_stats));
+            ram_load_stats.stream_bytes = 8;
+            ram_postcopy_pending = 0;
+        }
+
+        if (flags & (RAM_SAVE_FLAG_FULL | RAM_SAVE_FLAG_MAPPED |
+                     RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
+                     RAM_SAVE_FLAG_BATCH | RAM_SAVE_FLAG_POSTCOPY))
+            snapshot_store_forget();
+
+        if (flags & RAM_SAVE_FLAG_POSTCOPY)
+            ram_postcopy_pending = 1;
+
+        if (flags & RAM_SAVE_FLAG_BATCH) {
+            if (ram_load_batch(f) < 0)
+                return -EINVAL;
+        }
+
+        if (flags & RAM_SAVE_FLAG_STORE) {
+            if (snapshot_store_load_ram(f) < 0)
+                return -EINVAL;
         }
 
         if (flags & RAM_SAVE_FLAG_FULL) {
             if (ram_load_dead(f, opaque) < 0)
                 return -EINVAL;
         }
+
+        if (flags & RAM_SAVE_FLAG_MAPPED) {
+            if (ram_load_mapped(f) < 0)
+                return -EINVAL;
+        }
         
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             uint8_t ch = qemu_get_byte(f);
             memset(host_ram_addr(addr), ch, TARGET_PAGE_SIZE);
-        } else if (flags & RAM_SAVE_FLAG_PAGE)
+            ram_load_stats.pages++;
+            ram_load_stats.dup_pages++;
+            ram_load_stats.stream_bytes += 9;
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
             qemu_get_buffer(f, host_ram_addr(addr), TARGET_PAGE_SIZE);
+            ram_load_stats.pages++;
+            ram_load_stats.stream_bytes += 8 + TARGET_PAGE_SIZE;
+        }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
+    ram_load_stats.stream_bytes += 8;
+    ram_load_stats.time += get_clock() - start;
+
+    return 0;
+}
+
+static void ram_print_stats(const char *name, RamStreamStats *s)
+{
+    int64_t raw, ms, ratio, rate;
+
+    if (s->pages == 0) {
+        term_printf("last %s: none\n", name);
+        return;
+    }
+    raw = s->pages * TARGET_PAGE_SIZE;
+    ms = s->time / 1000000;
+    ratio = s->stream_bytes ? raw * 10 / s->stream_bytes : 0;
+    rate = s->time ? raw * 1000 / s->time : 0;
+    term_printf("last %s: %s, %" PRId64 " pages (%" PRId64 " single byte), "
+                "%" PRId64 " KB -> %" PRId64 " KB, ratio %" PRId64 ".%" PRId64
+                ", %" PRId64 " ms, %" PRId64 " MB/s\n",
+                name, ram_compress_name(s->method), s->pages, s->dup_pages,
+                raw >> 10, s->stream_bytes >> 10, ratio / 10, ratio % 10,
+                ms, rate);
+}
+
+void do_info_compression(void)
+{
+    term_printf("method: %s, %d threads\n",
+                ram_compress_name(ram_compress_method),
+                ram_compress_get_threads());
+    ram_print_stats("save", &ram_save_stats);
+    ram_print_stats("load", &ram_load_stats);
+}
+
+/***********************************************************/
+/* post-copy migration */
+
+/* The source stops the guest, sends the device state followed by a
+   POSTCOPY record, then sends the pages as PAGE and COMPRESS records
+   terminated by EOS.  The destination starts as soon as the device state
+   is loaded.  Pages it has not received yet are marked in
+   phys_ram_postcopy; touching one sends its address (be64) back to the
+   source, which sends it ahead of the remaining pages, and waits for it.  */
+
+typedef struct RamPostcopyStats {
+    int incoming;
+    int64_t start;
+    int64_t time;
+    int64_t requested;
+    int64_t pushed;
+    int64_t fault_time;
+    int64_t fault_max;
+    ram_addr_t missing;
+} RamPostcopyStats;
+
+static RamPostcopyStats ram_postcopy_stats;
+static QEMUFile *ram_postcopy_file;
+static int ram_postcopy_fd = -1;
+static ram_addr_t ram_postcopy_wanted = -1;
+static QEMUBH *ram_postcopy_bh;
+
+void ram_postcopy_set_outgoing(int enable)
+{
+    ram_postcopy_outgoing = enable;
+    if (enable) {
+        memset(&ram_postcopy_stats, 0, sizeof(ram_postcopy_stats));
+        ram_postcopy_stats.start = get_clock();
+    }
+}
+
+/* Send page ADDR now if it has not been sent yet.  */
+void ram_postcopy_request(QEMUFile *f, uint64_t addr)
+{
+    addr &= TARGET_PAGE_MASK;
+    if (addr >= phys_ram_size ||
+        !cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
+        return;
+    cpu_physical_memory_reset_dirty(addr, addr + TARGET_PAGE_SIZE,
+                                    MIGRATION_DIRTY_FLAG);
+    ram_save_page(f, addr);
+    qemu_fflush(f);
+    ram_postcopy_stats.requested++;
+}
+
+/* Send the pages that were not requested while the rate limit allows.
+   Return 1 when all of RAM has been sent.  */
+int ram_postcopy_save(QEMUFile *f)
+{
+    ram_addr_t addr;
+
+    while (!qemu_file_rate_limit(f)) {
+        addr = ram_next_dirty();
+        if (addr == -1) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            ram_postcopy_stats.time = get_clock() - ram_postcopy_stats.start;
+            return 1;
+        }
+        ram_save_page(f, addr);
+        ram_postcopy_stats.pushed++;
+    }
     return 0;
 }
 
+static void ram_postcopy_finish(void)
+{
+    qemu_set_fd_handler(ram_postcopy_fd, NULL, NULL, NULL);
+    qemu_fclose(ram_postcopy_file);
+    closesocket(ram_postcopy_fd);
+    ram_postcopy_file = NULL;
+    ram_postcopy_fd = -1;
+    qemu_free(phys_ram_postcopy);
+    phys_ram_postcopy = NULL;
+    ram_postcopy_stats.time = get_clock() - ram_postcopy_stats.start;
+}
+
+/* Read one page record from the source.  Return 0 at the end of the
+   stream.  The guest cannot run without its memory, so a transfer error
+   is fatal.  */
+static int ram_postcopy_load_page(void)
+{
+    QEMUFile *f = ram_postcopy_file;
+    static uint8_t discard[TARGET_PAGE_SIZE];
+    ram_addr_t addr;
+    uint8_t *p;
+    int flags;
+
+    addr = qemu_get_be64(f);
+    flags = addr & ~TARGET_PAGE_MASK;
+    addr &= TARGET_PAGE_MASK;
+
+    if (flags & RAM_SAVE_FLAG_EOS) {
+        if (ram_postcopy_stats.missing != 0)
+            goto fail;
+        ram_postcopy_finish();
+        return 0;
+    }
+    if (addr >= phys_ram_size ||
+        !(flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)))
+        goto fail;
+
+    /* A page already received must not overwrite what the guest has
+       written to it since.  */
+    if (phys_ram_postcopy[addr >> TARGET_PAGE_BITS])
+        p = host_ram_addr(addr);
+    else
+        p = discard;
+    if (flags & RAM_SAVE_FLAG_COMPRESS)
+        memset(p, qemu_get_byte(f), TARGET_PAGE_SIZE);
+    else
+        qemu_get_buffer(f, p, TARGET_PAGE_SIZE);
+    if (qemu_file_has_error(f))
+        goto fail;
+
+    if (p != discard) {
+        phys_ram_postcopy[addr >> TARGET_PAGE_BITS] = 0;
+        cpu_physical_memory_set_dirty(addr);
+        ram_postcopy_stats.missing--;
+        if (addr == ram_postcopy_wanted)
+            ram_postcopy_stats.requested++;
+        else
+            ram_postcopy_stats.pushed++;
+    }
+    return 1;
+
+fail:
+    fprintf(stderr, "post-copy migration failed with %ld pages missing\n",
+            (long)ram_postcopy_stats.missing);
+    exit(1);
+}
+
+static void ram_postcopy_read(void *opaque)
+{
+    do {
+        if (ram_postcopy_load_page() == 0)
+            return;
+    } while (qemu_file_pending(ram_postcopy_file));
+}
+
+void ram_postcopy_fetch(ram_addr_t addr)
+{
+    uint64_t req = cpu_to_be64(addr);
+    int64_t t;
+    int len, locked;
+
+    locked = cpu_threads_lock();
+    t = get_clock();
+    do {
+        len = send(ram_postcopy_fd, (const void *)&req, sizeof(req), 0);
+    } while (len == -1 && socket_error() == EINTR);
+
+    ram_postcopy_wanted = addr;
+    while (phys_ram_postcopy && phys_ram_postcopy[addr >> TARGET_PAGE_BITS])
+        ram_postcopy_load_page();
+    ram_postcopy_wanted = -1;
+
+    t = get_clock() - t;
+    ram_postcopy_stats.fault_time += t;
+    if (t > ram_postcopy_stats.fault_max)
+        ram_postcopy_stats.fault_max = t;
+
+    /* Records read along with the page are not seen by select.  */
+    if (ram_postcopy_file && qemu_file_pending(ram_postcopy_file))
+        qemu_bh_schedule(ram_postcopy_bh);
+    cpu_threads_unlock(locked);
+}
+
+/* Called once the device state of an incoming migration is loaded.  If
+   the source uses post-copy, take over F and FD to receive the pages and
+   return 1.  */
+int ram_postcopy_incoming_start(QEMUFile *f, int fd)
+{
+    CPUState *env;
+
+    if (!ram_postcopy_pending)
+        return 0;
+    ram_postcopy_pending = 0;
+
+    memset(&ram_postcopy_stats, 0, sizeof(ram_postcopy_stats));
+    ram_postcopy_stats.incoming = 1;
+    ram_postcopy_stats.start = get_clock();
+    ram_postcopy_stats.missing = phys_ram_size >> TARGET_PAGE_BITS;
+
+    ram_postcopy_file = f;
+    ram_postcopy_fd = fd;
+    if (!ram_postcopy_bh)
+        ram_postcopy_bh = qemu_bh_new(ram_postcopy_read, NULL);
+    phys_ram_postcopy = qemu_malloc(phys_ram_size >> TARGET_PAGE_BITS);
+    memset(phys_ram_postcopy, 1, phys_ram_size >> TARGET_PAGE_BITS);
+
+    /* Make every access go through the TLB fill path again.  */
+    for (env = first_cpu; env != NULL; env = env->next_cpu)
+        tlb_flush(env, 1);
+    tb_flush(first_cpu);
+
+    qemu_set_fd_handler(fd, ram_postcopy_read, NULL, NULL);
+    if (qemu_file_pending(f))
+        qemu_bh_schedule(ram_postcopy_bh);
+    return 1;
+}
+
+void ram_postcopy_info(void)
+{
+    RamPostcopyStats *s = &ram_postcopy_stats;
+    int64_t time;
+
+    if (s->start == 0)
+        return;
+    if (!s->incoming) {
+        term_printf("post-copy pages: %" PRId64 " sent on request, "
+                    "%" PRId64 " pushed\n", s->requested, s->pushed);
+        return;
+    }
+    time = phys_ram_postcopy ? get_clock() - s->start : s->time;
+    term_printf("incoming post-copy: %s, %" PRId64 " ms, %ld pages missing\n",
+                phys_ram_postcopy ? "active" : "completed", time / 1000000,
+                (long)s->missing);
+    term_printf("pages: %" PRId64 " fetched on demand, %" PRId64
+                " received in background\n", s->requested, s->pushed);
+    term_printf("fault wait: %" PRId64 " ms total, average %" PRId64
+                " us, max %" PRId64 " us\n", s->fault_time / 1000000,
+                s->requested ? s->fault_time / s->requested / 1000 : 0,
+                s->fault_max / 1000);
+}
+
 void qemu_service_io(void)
 {
     CPUState *env = cpu_single_env;
@@ -3219,6 +4150,7 @@ struct QEMUBH {
     int scheduled;
     int idle;
     int deleted;
+    IOHandlerStats stats;
     QEMUBH *next;
 };
 
@@ -3240,6 +4172,7 @@ QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
 int qemu_bh_poll(void)
 {
     QEMUBH *bh, **bhp;
+    int64_t t;
     int ret;
 
     ret = 0;
@@ -3249,7 +4182,9 @@ int qemu_bh_poll(void)
             if (!bh->idle)
                 ret = 1;
             bh->idle = 0;
+            t = get_clock();
             bh->cb(bh->opaque);
+            io_stats_add(&bh->stats, t);
         }
     }
 
@@ -3285,6 +4220,7 @@ void qemu_bh_schedule(QEMUBH *bh)
     /* stop the currently executing CPU to execute the BH ASAP */
     if (env) {
         cpu_interrupt(env, CPU_INTERRUPT_EXIT);
+        qemu_notify_event();
     }
 }
 
@@ -3353,8 +4289,18 @@ static QEMUMachine *find_machine(const char *name)
 /***********************************************************/
 /* main execution loop */
 
+static QEMUTimer *gui_timer;
+
 static void gui_update(void *opaque)
 {
+    if (replay_mode != REPLAY_NONE) {
+        /* Display updates raise guest interrupts: refresh on virtual
+           time, so that they happen at the same instruction on replay.  */
+        gui_notify_update_tick(qemu_get_clock(vm_clock) / 1000000);
+        qemu_mod_timer(gui_timer, qemu_get_clock(vm_clock) +
+                       GUI_REFRESH_INTERVAL * 1000000LL);
+        return;
+    }
     gui_notify_update_tick(qemu_get_clock(rt_clock));
     /*
     DisplayState *ds = opaque;
@@ -3428,6 +4374,7 @@ void vm_start(void)
         vm_running = 1;
         vm_state_notify(1);
         qemu_rearm_alarm_timer(alarm_timer);
+        resume_all_vcpus();
     }
 }
 
@@ -3436,6 +4383,7 @@ void vm_stop(int reason)
     if (vm_running) {
         cpu_disable_ticks();
         vm_running = 0;
+        pause_all_vcpus();
         if (reason != 0) {
             if (vm_stop_cb) {
                 vm_stop_cb(vm_stop_opaque, reason);
@@ -3457,6 +4405,7 @@ void qemu_snapshot_request(const char *filename)
     snapshot_requested = qemu_strdup(filename);
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    qemu_notify_event();
 }
 
 void qemu_snapshot_request_restore(const char *filename)
@@ -3468,6 +4417,7 @@ void qemu_snapshot_request_restore(const char *filename)
     snapshot_requested = qemu_strdup(filename);
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    qemu_notify_event();
 }
 
 int qemu_snapshot_requested(void)
@@ -3475,6 +4425,192 @@ int qemu_snapshot_requested(void)
     return snapshot_requested != NULL;
 }
 
+#ifndef _WIN32
+/***********************************************************/
+/* fork server */
+
+/* With -fork-server PATH, clients connect to the unix socket PATH and
+   send one request per connection:
+
+     freeze     stop the VM and reply "ok".  Children are forked from
+                this state, so the parent never runs the guest again.
+     fork       fork a child that runs the VM.  The connection becomes
+                the stdin and stdout of the child, so a serial port or
+                monitor on stdio talks to the client.  The child first
+                writes "pid N".
+
+   Children share guest RAM with the parent copy-on-write, so a guest
+   booted once can run any number of tests from the same state.  Other
+   host resources, such as disk image files, are shared as well.  */
+
+typedef struct ForkServerClient {
+    int fd;
+    int len;
+    char buf[64];
+    struct ForkServerClient *next;
+} ForkServerClient;
+
+static int fork_server_fd = -1;
+static ForkServerClient *fork_server_clients;
+static int fork_server_forks;
+
+static void fork_server_close(ForkServerClient *c)
+{
+    ForkServerClient **pc;
+
+    for (pc = &fork_server_clients; *pc != c; pc = &(*pc)->next);
+    *pc = c->next;
+    qemu_set_fd_handler2(c->fd, NULL, NULL, NULL, NULL);
+    close(c->fd);
+    qemu_free(c);
+}
+
+static void fork_server_reply(ForkServerClient *c, const char *fmt, ...)
+{
+    char buf[64];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    write(c->fd, buf, strlen(buf));
+}
+
+static void fork_server_child(ForkServerClient *c)
+{
+    int fd = c->fd;
+
+    /* Drop the server and the other clients, keeping the socket of the
+       request as the console.  */
+#ifdef CONFIG_EPOLL
+    /* The epoll instance is shared with the server.  */
+    io_epoll_init();
+#endif
+    qemu_set_fd_handler2(fork_server_fd, NULL, NULL, NULL, NULL);
+    close(fork_server_fd);
+    fork_server_fd = -1;
+    while (fork_server_clients) {
+        ForkServerClient *o = fork_server_clients;
+
+        if (o == c) {
+            fork_server_clients = o->next;
+            qemu_set_fd_handler2(fd, NULL, NULL, NULL, NULL);
+            qemu_free(o);
+        } else {
+            fork_server_close(o);
+        }
+    }
+
+    dup2(fd, 0);
+    dup2(fd, 1);
+    close(fd);
+    fork_timers();
+    printf("pid %d\n", (int)getpid());
+    fflush(stdout);
+    vm_start();
+}
+
+static void fork_server_fork(ForkServerClient *c)
+{
+    pid_t pid;
+
+    /* Reap the children that have exited.  */
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+
+    /* The children must not inherit, and write again, the buffered
+       output of the server.  */
+    qemu_aio_flush();
+    qemu_chr_flush_all();
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        fork_server_child(c);
+        return;
+    }
+    if (pid < 0)
+        fork_server_reply(c, "error %s\n", strerror(errno));
+    else
+        fork_server_forks++;
+    fork_server_close(c);
+}
+
+static void fork_server_read(void *opaque)
+{
+    ForkServerClient *c = opaque;
+    char *eol;
+    int len;
+
+    len = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (len < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (len <= 0) {
+        fork_server_close(c);
+        return;
+    }
+    c->len += len;
+    c->buf[c->len] = '\0';
+    eol = strchr(c->buf, '\n');
+    if (!eol) {
+        if (c->len == sizeof(c->buf) - 1)
+            fork_server_close(c);
+        return;
+    }
+    *eol = '\0';
+    if (eol > c->buf && eol[-1] == '\r')
+        eol[-1] = '\0';
+
+    if (!strcmp(c->buf, "freeze")) {
+        vm_stop(0);
+        fork_server_reply(c, "ok\n");
+        fork_server_close(c);
+    } else if (!strcmp(c->buf, "fork")) {
+        fork_server_fork(c);
+    } else {
+        fork_server_reply(c, "error unknown request\n");
+        fork_server_close(c);
+    }
+}
+
+static void fork_server_accept(void *opaque)
+{
+    ForkServerClient *c;
+    int fd;
+
+    fd = accept(fork_server_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    c = qemu_mallocz(sizeof(ForkServerClient));
+    c->fd = fd;
+    c->next = fork_server_clients;
+    fork_server_clients = c;
+    qemu_set_fd_handler2(fd, NULL, fork_server_read, NULL, c);
+}
+
+static int fork_server_start(const char *path)
+{
+    char buf[128];
+
+    fork_server_fd = unix_listen(path, buf, sizeof(buf));
+    if (fork_server_fd < 0)
+        return -1;
+    listen(fork_server_fd, 16);
+    qemu_set_fd_handler2(fork_server_fd, NULL, fork_server_accept, NULL,
+                         NULL);
+    return 0;
+}
+
+void do_info_forkserver(void)
+{
+    if (fork_server_fd < 0) {
+        term_printf("fork server not running\n");
+        return;
+    }
+    term_printf("fork server: %s, %d children forked\n",
+                vm_running ? "running" : "frozen", fork_server_forks);
+}
+#endif
+
 /* reset/shutdown handler */
 
 typedef struct QEMUResetEntry {
@@ -3527,10 +4663,17 @@ void qemu_system_reset(void)
 {
     QEMUResetEntry *re;
 
+    snapshot_store_forget();
+
+    /* CPU threads must not run while their state is reset.  */
+    if (vm_running)
+        pause_all_vcpus();
     /* reset all devices */
     for(re = first_reset_entry; re != NULL; re = re->next) {
         re->func(re->opaque);
     }
+    if (vm_running)
+        resume_all_vcpus();
 }
 
 void qemu_system_reset_request(void)
@@ -3542,6 +4685,7 @@ void qemu_system_reset_request(void)
     }
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    qemu_notify_event();
 }
 
 void qemu_system_shutdown_request(void)
@@ -3549,6 +4693,7 @@ void qemu_system_shutdown_request(void)
     shutdown_requested = 1;
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    qemu_notify_event();
 }
 
 void qemu_system_powerdown_request(void)
@@ -3556,6 +4701,7 @@ void qemu_system_powerdown_request(void)
     powerdown_requested = 1;
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    qemu_notify_event();
 }
 
 #ifdef _WIN32
@@ -3608,13 +4754,132 @@ static void host_main_loop_wait(int *timeout)
 }
 #endif
 
-void main_loop_wait(int timeout)
+/* Add the descriptors of the I/O handlers to the select() sets.  */
+static void io_select_fill(int *pnfds, fd_set *rfds, fd_set *wfds)
+{
+    IOHandlerRecord *ioh;
+
+    for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+        if (ioh->deleted)
+            continue;
+#ifndef _WIN32
+        if (ioh->fd >= FD_SETSIZE)
+            continue;
+#endif
+        if (ioh->fd_read &&
+            (!ioh->fd_read_poll ||
+             ioh->fd_read_poll(ioh->opaque) != 0)) {
+            FD_SET(ioh->fd, rfds);
+            if (ioh->fd > *pnfds)
+                *pnfds = ioh->fd;
+        }
+        if (ioh->fd_write) {
+            FD_SET(ioh->fd, wfds);
+            if (ioh->fd > *pnfds)
+                *pnfds = ioh->fd;
+        }
+    }
+}
+
+static int io_select_dispatch(fd_set *rfds, fd_set *wfds)
+{
+    IOHandlerRecord *ioh;
+    int64_t t;
+    int n = 0;
+
+    for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+#ifndef _WIN32
+        if (ioh->fd >= FD_SETSIZE)
+            continue;
+#endif
+        if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, rfds)) {
+            t = get_clock();
+            ioh->fd_read(ioh->opaque);
+            io_stats_add(&ioh->read_stats, t);
+            n++;
+        }
+        if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, wfds)) {
+            t = get_clock();
+            ioh->fd_write(ioh->opaque);
+            io_stats_add(&ioh->write_stats, t);
+            n++;
+        }
+    }
+    return n;
+}
+
+#ifdef CONFIG_EPOLL
+/* Only the handlers with a fd_read_poll callback can change their
+   interest between iterations.  */
+static void io_epoll_prepare(void)
+{
+    IOHandlerRecord *ioh;
+
+    for(ioh = first_io_handler; ioh != NULL && io_epoll_fd >= 0;
+        ioh = ioh->next) {
+        if (ioh->fd_read_poll)
+            io_epoll_set(ioh, io_handler_events(ioh, 1));
+    }
+}
+
+static int io_epoll_dispatch(struct epoll_event *events, int n)
 {
     IOHandlerRecord *ioh;
+    int64_t t;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        ioh = events[i].data.ptr;
+        /* Errors and hang-ups are passed on to the handlers, which find
+           out when they read or write, as with select().  */
+        if (!ioh->deleted && (ioh->events & EPOLLIN) &&
+            (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            t = get_clock();
+            ioh->fd_read(ioh->opaque);
+            io_stats_add(&ioh->read_stats, t);
+        }
+        if (!ioh->deleted && (ioh->events & EPOLLOUT) &&
+            (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+            t = get_clock();
+            ioh->fd_write(ioh->opaque);
+            io_stats_add(&ioh->write_stats, t);
+        }
+    }
+    return n;
+}
+#endif
+
+/* Free the handlers removed while dispatching.  */
+static void io_handlers_cleanup(void)
+{
+    IOHandlerRecord **pioh, *ioh;
+
+    if (!io_handlers_deleted)
+        return;
+    io_handlers_deleted = 0;
+    pioh = &first_io_handler;
+    while (*pioh) {
+        ioh = *pioh;
+        if (ioh->deleted) {
+            *pioh = ioh->next;
+            qemu_free(ioh);
+        } else
+            pioh = &ioh->next;
+    }
+}
+
+void main_loop_wait(int timeout)
+{
     fd_set rfds, wfds, xfds;
-    int ret, nfds;
+    int ret, nfds, nevents;
     struct timeval tv;
+    int64_t t, woken;
+#ifdef CONFIG_EPOLL
+    struct epoll_event events[IO_EPOLL_EVENTS];
+    int epoll_fd;
+#endif
 
+    replay_checkpoint(REPLAY_PHASE_ENTER);
     qemu_bh_update_timeout(&timeout);
 
     host_main_loop_wait(&timeout);
@@ -3625,22 +4890,13 @@ void main_loop_wait(int timeout)
     FD_ZERO(&rfds);
     FD_ZERO(&wfds);
     FD_ZERO(&xfds);
-    for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
-        if (ioh->deleted)
-            continue;
-        if (ioh->fd_read &&
-            (!ioh->fd_read_poll ||
-             ioh->fd_read_poll(ioh->opaque) != 0)) {
-            FD_SET(ioh->fd, &rfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
-        }
-        if (ioh->fd_write) {
-            FD_SET(ioh->fd, &wfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
-        }
-    }
+#ifdef CONFIG_EPOLL
+    io_epoll_prepare();
+    epoll_fd = io_epoll_fd;
+    if (epoll_fd < 0)
+#endif
+        io_select_fill(&nfds, &rfds, &wfds);
+    replay_checkpoint(REPLAY_PHASE_POLLED);
 
     tv.tv_sec = timeout / 1000;
     tv.tv_usec = (timeout % 1000) * 1000;
@@ -3649,31 +4905,47 @@ void main_loop_wait(int timeout)
     if (slirp_is_inited()) {
         slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
     }
+#endif
+#ifdef CONFIG_VCPU_THREADS
+    /* Let the CPU threads run device emulation while we sleep.  */
+    if (cpu_threads_enabled)
+        qemu_mutex_unlock_iothread();
+#endif
+    t = get_clock();
+#ifdef CONFIG_EPOLL
+    if (epoll_fd >= 0 && nfds < 0) {
+        ret = epoll_wait(epoll_fd, events, IO_EPOLL_EVENTS, timeout);
+    } else if (epoll_fd >= 0) {
+        /* slirp still wants fd sets: wait for the epoll descriptor to
+           become readable together with its sockets.  */
+        FD_SET(epoll_fd, &rfds);
+        if (epoll_fd > nfds)
+            nfds = epoll_fd;
+        ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    } else
 #endif
     ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
-    if (ret > 0) {
-        IOHandlerRecord **pioh;
-
-        for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
-            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, &rfds)) {
-                ioh->fd_read(ioh->opaque);
-            }
-            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, &wfds)) {
-                ioh->fd_write(ioh->opaque);
-            }
-        }
-
-	/* remove deleted IO handlers */
-	pioh = &first_io_handler;
-	while (*pioh) {
-            ioh = *pioh;
-            if (ioh->deleted) {
-                *pioh = ioh->next;
-                qemu_free(ioh);
-            } else
-                pioh = &ioh->next;
-        }
-    }
+    woken = get_clock();
+    io_stats_add(&io_wait_stats, t);
+#ifdef CONFIG_VCPU_THREADS
+    if (cpu_threads_enabled)
+        qemu_mutex_lock_iothread();
+#endif
+    nevents = 0;
+#ifdef CONFIG_EPOLL
+    if (epoll_fd >= 0) {
+        int n = ret;
+
+        if (nfds >= 0)
+            n = ret > 0 && FD_ISSET(epoll_fd, &rfds) ?
+                epoll_wait(epoll_fd, events, IO_EPOLL_EVENTS, 0) : 0;
+        if (n > 0)
+            nevents = io_epoll_dispatch(events, n);
+    } else
+#endif
+    if (ret > 0)
+        nevents = io_select_dispatch(&rfds, &wfds);
+    io_handlers_cleanup();
 #if defined(CONFIG_SLIRP)
     if (slirp_is_inited()) {
         if (ret < 0) {
@@ -3681,10 +4953,14 @@ void main_loop_wait(int timeout)
             FD_ZERO(&wfds);
             FD_ZERO(&xfds);
         }
+        t = get_clock();
         slirp_select_poll(&rfds, &wfds, &xfds);
+        io_stats_add(&io_slirp_stats, t);
     }
 #endif
+    replay_checkpoint(REPLAY_PHASE_IO);
 
+    t = get_clock();
     /* vm time timers */
     if (vm_running && likely(!(cur_cpu->singlestep_enabled & SSTEP_NOTIMER)))
         qemu_run_timers(&active_timers[QEMU_TIMER_VIRTUAL],
@@ -3693,11 +4969,141 @@ void main_loop_wait(int timeout)
     /* real time timers */
     qemu_run_timers(&active_timers[QEMU_TIMER_REALTIME],
                     qemu_get_clock(rt_clock));
+    io_stats_add(&io_timer_stats, t);
+    replay_checkpoint(REPLAY_PHASE_TIMERS);
+
+    /* Set the host alarm for the timers that are left.  */
+    if (alarm_timer->flags & ALARM_FLAG_EXPIRED) {
+        alarm_timer->flags &= ~ALARM_FLAG_EXPIRED;
+        qemu_rearm_alarm_timer(alarm_timer);
+    }
 
     /* Check bottom-halves last in case any of the earlier events triggered
        them.  */
     qemu_bh_poll();
+    replay_checkpoint(REPLAY_PHASE_BH);
 
+    t = get_clock() - woken;
+    main_loop_stats.iterations++;
+    main_loop_stats.events += nevents;
+    if (nevents > main_loop_stats.max_events)
+        main_loop_stats.max_events = nevents;
+    main_loop_stats.latency += t;
+    if (t > main_loop_stats.max_latency)
+        main_loop_stats.max_latency = t;
+}
+
+static void io_stats_print(const char *name, const char *target,
+                           IOHandlerStats *st)
+{
+    term_printf("%-16s %10" PRIu64 " %10" PRId64 " %8" PRId64 "  %s\n",
+                name, st->count, st->time / 1000000, st->max_time / 1000,
+                target);
+}
+
+void do_info_iohandlers(void)
+{
+    IOHandlerRecord *ioh;
+    QEMUBH *bh;
+    char name[32];
+    char target[64];
+    const char *mode;
+#ifdef __linux__
+    int len;
+#endif
+
+    switch (cpu_threads_enabled) {
+    case CPU_THREADS_PER_CPU:
+        mode = "on, one thread per CPU";
+        break;
+    case CPU_THREADS_SINGLE:
+        mode = "on, one thread for all CPUs";
+        break;
+    default:
+        mode = "off";
+        break;
+    }
+    term_printf("I/O thread: %s\n", mode);
+#ifdef CONFIG_EPOLL
+    mode = io_epoll_fd >= 0 ? "epoll" : "select";
+#else
+    mode = "select";
+#endif
+    term_printf("main loop: %s, %" PRIu64 " iterations, %" PRIu64
+                " fd events (max %d at once)\n", mode,
+                main_loop_stats.iterations, main_loop_stats.events,
+                main_loop_stats.max_events);
+    if (main_loop_stats.iterations)
+        term_printf("dispatch latency: avg %" PRId64 " us, max %" PRId64
+                    " us\n",
+                    main_loop_stats.latency / main_loop_stats.iterations / 1000,
+                    main_loop_stats.max_latency / 1000);
+    term_printf("%-16s %10s %10s %8s\n", "handler", "calls", "total ms",
+                "max us");
+    io_stats_print("wait", "", &io_wait_stats);
+    io_stats_print("timers", "", &io_timer_stats);
+#if defined(CONFIG_SLIRP)
+    io_stats_print("slirp", "", &io_slirp_stats);
+#endif
+    for (ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+        if (ioh->deleted)
+            continue;
+        target[0] = '\0';
+#ifdef __linux__
+        snprintf(name, sizeof(name), "/proc/self/fd/%d", ioh->fd);
+        len = readlink(name, target, sizeof(target) - 1);
+        if (len >= 0)
+            target[len] = '\0';
+#endif
+        if (ioh->fd_read) {
+            snprintf(name, sizeof(name), "fd %d read", ioh->fd);
+            io_stats_print(name, target, &ioh->read_stats);
+        }
+        if (ioh->fd_write) {
+            snprintf(name, sizeof(name), "fd %d write", ioh->fd);
+            io_stats_print(name, target, &ioh->write_stats);
+        }
+    }
+    for (bh = first_bh; bh != NULL; bh = bh->next) {
+        if (bh->deleted || !bh->stats.count)
+            continue;
+        snprintf(name, sizeof(name), "bh %p", bh->cb);
+        io_stats_print(name, "", &bh->stats);
+    }
+}
+
+static void alarm_rate_print(const char *name, uint64_t count,
+                             uint64_t last_count, int64_t now,
+                             int64_t last_time)
+{
+    term_printf("%-18s %10" PRIu64 " %10.1f %10.1f\n", name, count,
+                count * 1e9 / (now - alarm_start_time),
+                (count - last_count) * 1e9 / (now - last_time));
+}
+
+void do_info_alarm(void)
+{
+    static uint64_t last_wakeups, last_iterations;
+    static int64_t last_time;
+    int64_t now = get_clock();
+
+    if (!last_time)
+        last_time = alarm_start_time;
+    term_printf("alarm timer: %s\n", alarm_timer->name);
+    if (timer_slack_us)
+        term_printf("timer slack: %" PRId64 " us while idle\n",
+                    timer_slack_us);
+    term_printf("CPUs: %s\n", qemu_cpus_idle() ? "idle" : "running");
+    if (now == last_time)
+        return;
+    term_printf("%-18s %10s %10s %10s\n", "wakeups", "total", "avg/s",
+                "last/s");
+    alarm_rate_print("alarm", alarm_wakeups, last_wakeups, now, last_time);
+    alarm_rate_print("main loop", main_loop_stats.iterations,
+                     last_iterations, now, last_time);
+    last_wakeups = alarm_wakeups;
+    last_iterations = main_loop_stats.iterations;
+    last_time = now;
 }
 
 static int main_loop(void)
@@ -3709,10 +5115,23 @@ static int main_loop(void)
     CPUState *env;
 
     cur_cpu = first_cpu;
-    next_cpu = cur_cpu->next_cpu ?: first_cpu;
+    if (!cpu_threads_enabled)
+        next_cpu = cur_cpu->next_cpu ?: first_cpu;
     for(;;) {
         if (vm_running) {
 
+#ifdef CONFIG_VCPU_THREADS
+            if (cpu_threads_enabled) {
+                /* The CPU threads run the guest; only look for a CPU
+                   that stopped at a breakpoint.  */
+                env = cpu_threads_debug_cpu();
+                ret = env ? EXCP_DEBUG : EXCP_HALTED;
+                if (env)
+                    cur_cpu = env;
+                else
+                    env = cur_cpu;
+            } else
+#endif
             for(;;) {
                 /* get next cpu */
                 env = next_cpu;
@@ -3728,6 +5147,8 @@ static int main_loop(void)
                     count = qemu_next_deadline();
                     count = (count + (1 << icount_time_shift) - 1)
                             >> icount_time_shift;
+                    if (replay_mode != REPLAY_NONE)
+                        count = replay_icount_budget(count);
                     qemu_icount += count;
                     decr = (count > 0xffff) ? 0xffff : count;
                     count -= decr;
@@ -3829,9 +5250,12 @@ static int main_loop(void)
                         delta += add;
                         add = (add + (1 << icount_time_shift) - 1)
                               >> icount_time_shift;
+                        if (replay_mode != REPLAY_NONE)
+                            add = replay_icount_budget(add);
                         qemu_icount += add;
                         timeout = delta / 1000000;
-                        if (timeout < 0)
+                        /* Inputs come from the log: no need to wait.  */
+                        if (timeout < 0 || replay_mode == REPLAY_PLAY)
                             timeout = 0;
                     }
                 } else {
@@ -3853,8 +5277,14 @@ static int main_loop(void)
         main_loop_wait(timeout);
 #ifdef CONFIG_PROFILER
         dev_time += profile_getclock() - ti;
+#endif
+#ifdef CONFIG_VCPU_THREADS
+        /* Share the CPU thread between the CPUs.  */
+        if (cpu_threads_enabled == CPU_THREADS_SINGLE)
+            cpu_threads_rotate();
 #endif
     }
+    pause_all_vcpus();
     cpu_disable_ticks();
     return ret;
 }
@@ -3881,6 +5311,8 @@ static void help(int exitcode)
 	   "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
            "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
            "       [,cache=writethrough|writeback|none][,format=f]\n"
+           "       [,metadata_cache=size][,aio=threads|native]\n"
+           "       [,queues=n]\n"
 	   "                use 'file' as a drive image\n"
            "-mtdblock file  use 'file' as on-board Flash memory image\n"
            "-sd file        use 'file' as SecureDigital card image\n"
@@ -4015,6 +5447,8 @@ static void help(int exitcode)
 	   "-vnc display    start a VNC server on display\n"
 #ifndef _WIN32
 	   "-daemonize      daemonize QEMU after initializing\n"
+           "-fork-server path\n"
+           "                fork copies of the VM on requests to the unix socket 'path'\n"
 #endif
 	   "-option-rom rom load a file, rom, into the option ROM space\n"
 #ifdef TARGET_SPARC
@@ -4025,6 +5459,26 @@ static void help(int exitcode)
            "-startdate      select initial date of the clock\n"
            "-icount [N|auto]\n"
            "                Enable virtual instruction counter with 2^N clock ticks per instruction\n"
+           "-tb-cache file  keep translated code for the guest in 'file' across runs\n"
+           "-tb-trace n     retranslate blocks executed 'n' times as hot traces\n"
+           "-ram-compress method[,threads=n]\n"
+           "                compress RAM in snapshots and migration with 'zlib' or 'fast'\n"
+           "                using 'n' threads\n"
+#if defined(CONFIG_VCPU_THREADS) && defined(TARGET_ARM)
+           "-vcpu-threads   run each emulated CPU in its own host thread\n"
+           "-io-thread      run the emulated CPUs in a thread separate from I/O\n"
+#endif
+#ifdef CONFIG_EPOLL
+           "-no-epoll       use select() instead of epoll in the main loop\n"
+#endif
+           "-timer-slack us let host alarms be up to 'us' microseconds late\n"
+           "                while the CPUs are idle, to save wakeups\n"
+           "-record file[,snapshot=secs]\n"
+           "                record the inputs of the run in 'file', with a snapshot\n"
+           "                every 'secs' seconds of virtual time\n"
+           "-replay file[,seek=icount]\n"
+           "                replay the inputs recorded in 'file', stopping at\n"
+           "                instruction 'icount'\n"
            "\n"
            "During emulation, the following keys are useful:\n"
            "ctrl-alt-f      toggle full screen\n"
@@ -4129,6 +5583,7 @@ enum {
     QEMU_OPTION_no_shutdown,
     QEMU_OPTION_show_cursor,
     QEMU_OPTION_daemonize,
+    QEMU_OPTION_fork_server,
     QEMU_OPTION_option_rom,
     QEMU_OPTION_semihosting,
     QEMU_OPTION_name,
@@ -4137,6 +5592,15 @@ enum {
     QEMU_OPTION_clock,
     QEMU_OPTION_startdate,
     QEMU_OPTION_tb_size,
+    QEMU_OPTION_tb_cache,
+    QEMU_OPTION_tb_trace,
+    QEMU_OPTION_ram_compress,
+    QEMU_OPTION_vcpu_threads,
+    QEMU_OPTION_io_thread,
+    QEMU_OPTION_no_epoll,
+    QEMU_OPTION_timer_slack,
+    QEMU_OPTION_record,
+    QEMU_OPTION_replay,
     QEMU_OPTION_icount,
     QEMU_OPTION_uuid,
     QEMU_OPTION_incoming,
@@ -4244,6 +5708,9 @@ static const QEMUOption qemu_options[] = {
     { "no-shutdown", 0, QEMU_OPTION_no_shutdown },
     { "show-cursor", 0, QEMU_OPTION_show_cursor },
     { "daemonize", 0, QEMU_OPTION_daemonize },
+#ifndef _WIN32
+    { "fork-server", HAS_ARG, QEMU_OPTION_fork_server },
+#endif
     { "option-rom", HAS_ARG, QEMU_OPTION_option_rom },
 #if defined(TARGET_ARM) || defined(TARGET_M68K) || defined(TARGET_PPC)
     { "semihosting", 0, QEMU_OPTION_semihosting },
@@ -4258,6 +5725,19 @@ static const QEMUOption qemu_options[] = {
     { "clock", HAS_ARG, QEMU_OPTION_clock },
     { "startdate", HAS_ARG, QEMU_OPTION_startdate },
     { "tb-size", HAS_ARG, QEMU_OPTION_tb_size },
+    { "tb-cache", HAS_ARG, QEMU_OPTION_tb_cache },
+    { "tb-trace", HAS_ARG, QEMU_OPTION_tb_trace },
+    { "ram-compress", HAS_ARG, QEMU_OPTION_ram_compress },
+#if defined(CONFIG_VCPU_THREADS) && defined(TARGET_ARM)
+    { "vcpu-threads", 0, QEMU_OPTION_vcpu_threads },
+    { "io-thread", 0, QEMU_OPTION_io_thread },
+#endif
+#ifdef CONFIG_EPOLL
+    { "no-epoll", 0, QEMU_OPTION_no_epoll },
+#endif
+    { "timer-slack", HAS_ARG, QEMU_OPTION_timer_slack },
+    { "record", HAS_ARG, QEMU_OPTION_record },
+    { "replay", HAS_ARG, QEMU_OPTION_replay },
     { "icount", HAS_ARG, QEMU_OPTION_icount },
     { "incoming", HAS_ARG, QEMU_OPTION_incoming },
     { NULL },
@@ -4611,9 +6091,15 @@ int main(int argc, char **argv, char **envp)
     int usb_devices_index;
     int fds[2];
     int tb_size;
+    const char *tb_cache_file = NULL;
     const char *pid_file = NULL;
     int autostart;
     const char *incoming = NULL;
+    const char *replay_arg = NULL;
+    int replay_arg_mode = REPLAY_NONE;
+#ifndef _WIN32
+    const char *fork_server = NULL;
+#endif
 
     qemu_cache_utils_init(envp);
 
@@ -5157,6 +6643,11 @@ int main(int argc, char **argv, char **envp)
 	    case QEMU_OPTION_daemonize:
 		daemonize = 1;
 		break;
+#ifndef _WIN32
+            case QEMU_OPTION_fork_server:
+                fork_server = optarg;
+                break;
+#endif
 	    case QEMU_OPTION_option_rom:
 		if (nb_option_roms >= MAX_OPTION_ROMS) {
 		    fprintf(stderr, "Too many option ROMs\n");
@@ -5232,6 +6723,62 @@ int main(int argc, char **argv, char **envp)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_tb_cache:
+                tb_cache_file = optarg;
+                break;
+            case QEMU_OPTION_tb_trace:
+                tb_trace_threshold = strtol(optarg, NULL, 0);
+                if (tb_trace_threshold < 0)
+                    tb_trace_threshold = 0;
+                break;
+            case QEMU_OPTION_ram_compress:
+                {
+                    char buf[32];
+                    const char *p;
+
+                    p = get_opt_value(buf, sizeof(buf), optarg);
+                    ram_compress_method = ram_compress_find(buf);
+                    if (ram_compress_method < 0) {
+                        fprintf(stderr, "Unknown compression method '%s'\n",
+                                buf);
+                        exit(1);
+                    }
+                    if (*p == ',' &&
+                        get_param_value(buf, sizeof(buf), "threads", p + 1))
+                        ram_compress_set_threads(strtol(buf, NULL, 0));
+                }
+                break;
+#if defined(CONFIG_VCPU_THREADS) && defined(TARGET_ARM)
+            case QEMU_OPTION_vcpu_threads:
+                if (!cpu_threads_enabled)
+                    cpu_threads_init(CPU_THREADS_PER_CPU);
+                cpu_threads_enabled = CPU_THREADS_PER_CPU;
+                break;
+            case QEMU_OPTION_io_thread:
+                if (!cpu_threads_enabled)
+                    cpu_threads_init(CPU_THREADS_SINGLE);
+                break;
+#endif
+#ifdef CONFIG_EPOLL
+            case QEMU_OPTION_no_epoll:
+                no_epoll = 1;
+                break;
+#endif
+            case QEMU_OPTION_timer_slack:
+                timer_slack_us = strtol(optarg, NULL, 0);
+                if (timer_slack_us < 0) {
+                    fprintf(stderr, "Invalid timer slack %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_record:
+                replay_arg_mode = REPLAY_RECORD;
+                replay_arg = optarg;
+                break;
+            case QEMU_OPTION_replay:
+                replay_arg_mode = REPLAY_PLAY;
+                replay_arg = optarg;
+                break;
             case QEMU_OPTION_icount:
                 use_icount = 1;
                 if (strcmp(optarg, "auto") == 0) {
@@ -5256,6 +6803,43 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 #endif
+    if (cpu_threads_enabled && use_icount) {
+        fprintf(stderr, "CPU threads can not be used with -icount\n");
+        exit(1);
+    }
+#ifndef _WIN32
+    if (cpu_threads_enabled && fork_server) {
+        fprintf(stderr, "CPU threads can not be used with -fork-server\n");
+        exit(1);
+    }
+#endif
+    if (replay_arg) {
+        if (cpu_threads_enabled) {
+            fprintf(stderr, "CPU threads can not be used with -record or "
+                    "-replay\n");
+            exit(1);
+        }
+#ifndef _WIN32
+        if (fork_server) {
+            fprintf(stderr, "-fork-server can not be used with -record or "
+                    "-replay\n");
+            exit(1);
+        }
+#endif
+        if (use_icount && icount_time_shift < 0) {
+            fprintf(stderr, "-record and -replay need a fixed -icount\n");
+            exit(1);
+        }
+        if (!use_icount) {
+            use_icount = 1;
+            icount_time_shift = 3;
+        }
+        if (replay_start(replay_arg_mode, replay_arg, &icount_time_shift) < 0)
+            exit(1);
+        /* Complete disk requests in bottom halves rather than from the
+           host AIO threads.  */
+        bdrv_set_sync_aio();
+    }
 
     if (!machine) {
         printf("No board specified. Use -M file.dtb\n");
@@ -5360,6 +6944,9 @@ int main(int argc, char **argv, char **envp)
     }
     setvbuf(stdout, NULL, _IOLBF, 0);
 
+#ifdef CONFIG_EPOLL
+    io_epoll_init();
+#endif
     init_timers();
     if (init_timer_alarm() < 0) {
         fprintf(stderr, "could not initialize alarm timer\n");
@@ -5484,7 +7071,9 @@ int main(int argc, char **argv, char **envp)
 	    exit(1);
 
     register_savevm("timer", 0, 2, timer_save, timer_load, NULL);
-    register_savevm_live("ram", 0, 3, ram_save_live, NULL, ram_load, NULL);
+    if (use_icount)
+        register_savevm("icount", 0, 1, icount_save, icount_load, NULL);
+    register_savevm_live("ram", 0, 6, ram_save_live, NULL, ram_load, NULL);
 
 #if 0
     TODO: DFG!
@@ -5599,6 +7188,9 @@ int main(int argc, char **argv, char **envp)
 
     gui_notify_console_select(0);
 
+    if (tb_cache_file)
+        tb_cache_init(tb_cache_file);
+
     /* Set KVM's vcpu state to qemu's initial CPUState. */
     if (kvm_enabled()) {
         int ret;
@@ -5621,9 +7213,11 @@ int main(int argc, char **argv, char **envp)
     }
 
     if (gui_needs_timer()) {
-        struct QEMUTimer *gui_timer = qemu_new_timer(rt_clock, gui_update, NULL);
+        QEMUClock *clock = replay_mode != REPLAY_NONE ? vm_clock : rt_clock;
+
+        gui_timer = qemu_new_timer(clock, gui_update, NULL);
         gui_set_timer(gui_timer);
-        qemu_mod_timer(gui_timer, qemu_get_clock(rt_clock));
+        qemu_mod_timer(gui_timer, qemu_get_clock(clock));
     }
 
 #ifdef CONFIG_GDBSTUB
@@ -5646,6 +7240,19 @@ int main(int argc, char **argv, char **envp)
         qemu_start_incoming_migration(incoming);
     }
 
+#ifndef _WIN32
+    if (fork_server && fork_server_start(fork_server) < 0) {
+        fprintf(stderr, "qemu: could not start fork server on '%s'\n",
+                fork_server);
+        exit(1);
+    }
+#endif
+
+#ifdef CONFIG_VCPU_THREADS
+    if (cpu_threads_enabled && cpu_threads_start() < 0)
+        exit(1);
+#endif
+
     {
         /* XXX: simplify init */
         read_passwords();
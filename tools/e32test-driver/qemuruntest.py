@@ -26,6 +26,9 @@
 # QemuTestRunner collects  output into LineTimeInfo objects. These record the time at which each line was received. The time can be used as a crude
 # measure of how long a test took to execute.
 # The raw data gathered from running the tests can be retrieved using GetResults. This returns a list of LineTimeInfo objects.
+# ForkServer boots a ROM once in a QEMU started with -fork-server and freezes it when the boot is complete. ForkedTestRunner
+# then runs each test in a copy-on-write copy of the booted emulator forked from that state, so tests do not pay for the boot
+# and run in parallel. The forked emulators use their connection to the fork server socket as serial console. Unix only.
 
 import sys
 mswindows = (sys.platform == "win32")
@@ -51,7 +54,9 @@ from stat import *
 
 import watchdog
 
-__all__ = ["QemuTestRunner"]
+import socket
+
+__all__ = ["QemuTestRunner", "ForkServer", "ForkedTestRunner"]
 
 class LineTimeInfo(object):
     def __init__(self, line, atime):
@@ -197,3 +202,136 @@ class PseudoRunner(QemuTestRunner):
 
     def GetReportFileName(self):
         return "Runtest-Summary.txt"
+
+class ForkServer(object):
+    def __init__(self, qemupath, cpu, rompath, board = 'syborg', readyPattern = None, socketPath = None, displayp = False):
+        """Create new ForkServer instance."""
+        self.qemupath = qemupath
+        self.board = board
+        self.cpu = cpu
+        self.rompath = rompath
+        self.displayp = displayp
+        if socketPath == None:
+            socketPath = "%s-%d.sock" % (rompath, os.getpid())
+        self.socketPath = socketPath
+        self.cmd = [qemupath, "-M", board, "-cpu", cpu, "-kernel", rompath, "-nographic", "-fork-server", socketPath]
+        if readyPattern == None:
+            readyPattern = r'^\s*[A-Za-z]:\\.*>'
+        self.readyPattern = re.compile(readyPattern)
+        self.popen = None
+        self.bootTime = None
+        self.watchdog = watchdog.WatchDog(900, lambda : self.Stop())
+
+    def Start(self):
+        """Boot the ROM and freeze the emulator once the ready pattern is seen. Returns True if it was."""
+        self.timeStarted = time.gmtime()
+        start = time.time()
+        if self.displayp:
+            print >> sys.stdout, " ".join(self.cmd)
+        p = Popen(self.cmd, stdin=PIPE, stdout=PIPE)
+        self.popen = p
+        ready = False
+        self.watchdog.Start()
+        try:
+            while p.poll() == None and not ready:
+                line = p.stdout.readline()
+                self.watchdog.Reset()
+                if self.displayp:
+                    print >> sys.stdout, line
+                ready = re.search(self.readyPattern, line) != None
+        finally:
+            self.watchdog.Stop()
+        if not ready:
+            return False
+        f = self.Request("freeze")
+        reply = f.readline().strip()
+        f.close()
+        if reply != "ok":
+            return False
+        self.bootTime = time.time() - start
+        return True
+
+    def Request(self, request):
+        """Send a request to the fork server and return the connection as a file."""
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(self.socketPath)
+        s.sendall(request + "\n")
+        f = s.makefile('r+b', 0)
+        s.close()
+        return f
+
+    def Fork(self):
+        """Return the console and the pid of a new emulator forked from the booted state."""
+        f = self.Request("fork")
+        reply = f.readline().split()
+        if len(reply) != 2 or reply[0] != "pid":
+            f.close()
+            return (None, None)
+        return (f, int(reply[1]))
+
+    def Stop(self):
+        if self.popen != None and self.popen.poll() == None:
+            os.kill(self.popen.pid, signal.SIGKILL)
+            self.popen.wait()
+        if os.path.exists(self.socketPath):
+            os.unlink(self.socketPath)
+
+    def GetBootTime(self):
+        return self.bootTime
+
+class ForkedTestRunner(object):
+    def __init__(self, server, command, endPattern = 'RUNTESTS: Test', timeout = 900, displayp = False):
+        """Create new ForkedTestRunner instance, running 'command' on the console of a forked emulator."""
+        self.server = server
+        self.command = command
+        self.endPattern = re.compile(endPattern)
+        self.timeout = timeout
+        self.displayp = displayp
+        self.lineTimeInfo = []
+        self.wallTime = None
+        self.finished = False
+
+    def Run(self):
+        self.lineTimeInfo = []
+        self.finished = False
+        start = time.time()
+        (console, pid) = self.server.Fork()
+        if console == None:
+            self.wallTime = time.time() - start
+            return False
+        dog = watchdog.WatchDog(self.timeout, lambda : self.KillSim(pid))
+        dog.Start()
+        try:
+            console.write(self.command + "\r\n")
+            while not self.finished:
+                line = console.readline()
+                if not line:
+                    break
+                if self.displayp:
+                    print >> sys.stdout, line
+                self.lineTimeInfo.append(LineTimeInfo(line, time.time() - start))
+                self.finished = re.search(self.endPattern, line) != None
+        finally:
+            dog.Stop()
+            self.wallTime = time.time() - start
+            self.KillSim(pid)
+            console.close()
+        return self.finished
+
+    def KillSim(self, pid):
+        try:
+            os.kill(pid, signal.SIGKILL)
+        except OSError:
+            pass
+
+    def GetResults(self):
+        return self.lineTimeInfo
+
+    def GetCommand(self):
+        return self.command
+
+    def GetWallTime(self):
+        return self.wallTime
+
+    def Finishedp(self):
+        return self.finished
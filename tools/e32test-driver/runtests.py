@@ -17,14 +17,20 @@
 
 # Provides 'ui' for running RTests on target and generating a report of the results.
 # Uses qemuruntest to run the tests and rtestreport to generate the results.
+# With --fork-tests the ROM is booted once in a QEMU fork server and each test command listed in the given file is run
+# in its own emulator forked from the booted state, --jobs at a time. The report gives the wall time of each test.
 
 import glob
+import re
 import sys
 import os.path
+import threading
+import time
 
 from optparse import OptionParser
 
 import qemuruntest
+import rtest
 import rtestreport
 
 def ParseOptions():
@@ -37,9 +43,91 @@ def ParseOptions():
     optParser.add_option("-q", "--qemu", action="store", type="string", dest="qemupath", default="qemu-system-arm.exe")
     optParser.add_option("-r", "--rom", action="store", type="string", default="syborg.e32test.a8.urel.elf")
     optParser.add_option("-s", "--summary", action="store", type="string")
+    optParser.add_option("-f", "--fork-tests", action="store", type="string", dest="forkTests")
+    optParser.add_option("-j", "--jobs", action="store", type="int", default=4)
+    optParser.add_option("--ready", action="store", type="string")
+    optParser.add_option("--test-end", action="store", type="string", dest="testEnd", default="RUNTESTS: Test")
 
     return optParser.parse_args()
 
+def ForkedTestResult(runner):
+    if not runner.Finishedp():
+        return 'Did not complete'
+    line = runner.GetResults()[-1].GetLine()
+    if re.search(rtest.failedRTestPattern, line) != None:
+        return 'Failed'
+    if re.search(rtest.erroredRTestPattern, line) != None:
+        return 'Errored'
+    return 'Passed'
+
+def ForkedTestName(runner):
+    results = runner.GetResults()
+    if len(results) > 0:
+        m = re.search(rtest.nameRTestPattern, results[-1].GetLine())
+        if m != None:
+            return m.group(1)
+    return runner.GetCommand()
+
+def RunForkedTests(options, qemupath, rompath):
+    commands = []
+    for line in open(options.forkTests):
+        line = line.strip()
+        if line and not line.startswith('#'):
+            commands.append(line)
+
+    server = qemuruntest.ForkServer(qemupath, options.cpu, rompath, board = options.board, readyPattern = options.ready, displayp = options.displayp)
+    try:
+        if not server.Start():
+            print >> sys.stderr, "ERROR: ROM image %s did not reach the ready state" % (rompath)
+            return 1
+
+        runners = []
+        for command in commands:
+            runners.append(qemuruntest.ForkedTestRunner(server, command, endPattern = options.testEnd, displayp = options.displayp))
+
+        pending = list(runners)
+        lock = threading.Lock()
+        def Worker():
+            while True:
+                lock.acquire()
+                if len(pending) == 0:
+                    lock.release()
+                    return
+                runner = pending.pop(0)
+                lock.release()
+                runner.Run()
+
+        start = time.time()
+        workers = []
+        for i in range(max(options.jobs, 1)):
+            worker = threading.Thread(target = Worker)
+            worker.start()
+            workers.append(worker)
+        for worker in workers:
+            worker.join()
+        elapsed = time.time() - start
+    finally:
+        server.Stop()
+
+    if options.summary:
+        reportFile = open(options.summary, 'w')
+    else:
+        reportFile = sys.stdout
+    print >> reportFile, "ROM image: %s" % (rompath)
+    print >> reportFile, "Boot time: %.2f seconds" % (server.GetBootTime())
+    print >> reportFile, "Ran %d tests in %.2f seconds with %d jobs\n" % (len(runners), elapsed, max(options.jobs, 1))
+    passed = 0
+    for runner in runners:
+        result = ForkedTestResult(runner)
+        if result == 'Passed':
+            passed += 1
+        print >> reportFile, "%s : %s : %.2f seconds" % (ForkedTestName(runner), result, runner.GetWallTime())
+    print >> reportFile, "\n%d of %d tests passed" % (passed, len(runners))
+    if reportFile != sys.stdout:
+        reportFile.close()
+
+    return 0
+
 def main():
     errors = False
     (options, args) = ParseOptions()
@@ -65,6 +153,9 @@ def main():
         if errors:
             sys.exit(1)
 
+        if options.forkTests:
+            return RunForkedTests(options, qemupath, rompath)
+
         output = options.output
         if output == None:
             output = rompath